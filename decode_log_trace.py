@@ -0,0 +1,157 @@
+#!python -u
+
+import sys
+import struct
+import re
+
+# See LOG_TRACE_BUFFER and LOG_TRACE_RECORD in src/xen/log.c
+
+BUFFER_MAGIC = 0x4352544c  # 'CRTL'
+BUFFER_HEADER = struct.Struct('<IIIIIIQ')
+RECORD = struct.Struct('<QQIIHHI8Q')
+
+LEVEL_NAMES = {
+    1 << 0: 'ERROR',
+    1 << 1: 'WARNING',
+    1 << 2: 'TRACE',
+    1 << 3: 'INFO',
+    0x80000000: 'CRITICAL'
+}
+
+class Image:
+    def __init__(self, base, path):
+        self.base = base
+        self.data = open(path, 'rb').read()
+        self.sections = []
+
+        pe = struct.unpack_from('<I', self.data, 0x3c)[0]
+        if self.data[pe:pe + 4] != b'PE\0\0':
+            raise ValueError('%s: not a PE image' % path)
+
+        count, = struct.unpack_from('<H', self.data, pe + 6)
+        optional, = struct.unpack_from('<H', self.data, pe + 20)
+        table = pe + 24 + optional
+
+        self.size = 0
+        for index in range(count):
+            (vsize, vaddr, rawsize, rawptr) = struct.unpack_from(
+                '<IIII', self.data, table + (index * 40) + 8)
+            self.sections.append((vaddr, max(vsize, rawsize), rawptr, rawsize))
+            self.size = max(self.size, vaddr + max(vsize, rawsize))
+
+    def string(self, address):
+        rva = address - self.base
+        if rva < 0 or rva >= self.size:
+            return None
+
+        for (vaddr, vsize, rawptr, rawsize) in self.sections:
+            if rva >= vaddr and rva < vaddr + min(vsize, rawsize):
+                offset = rawptr + rva - vaddr
+                end = self.data.index(b'\0', offset)
+                return self.data[offset:end].decode('ascii', 'replace')
+
+        return None
+
+SPECIFIER = re.compile(r'%(-?)(0?)([0-9]*)(l*)(w*)([cpduoxXsZ%]?)')
+
+def format(text, arguments, pointer_size):
+    arguments = list(arguments)
+
+    def convert(match):
+        (left, zero, width, long, wide, conversion) = match.groups()
+
+        if conversion == '%' or conversion == '':
+            return conversion
+
+        value = arguments.pop(0) if len(arguments) != 0 else 0
+
+        if conversion == 'c':
+            return chr(value & 0xffff)
+
+        if conversion == 'p':
+            zero = '0'
+            width = str(pointer_size * 2)
+            long = 'll' if pointer_size == 8 else ''
+
+        bits = 64 if len(long) == 2 else 32
+        value &= (1 << bits) - 1
+
+        if conversion == 'd' and value & (1 << (bits - 1)):
+            value -= 1 << bits
+
+        code = {'d': 'd', 'u': 'd', 'o': 'o', 'x': 'x',
+                'X': 'X', 'p': 'X'}[conversion]
+
+        return ('{:' + ('<' if left else '>') +
+                ('0' if zero and not left else '') +
+                width + code + '}').format(value)
+
+    return SPECIFIER.sub(convert, text)
+
+def decode(path, images, pointer_size):
+    data = open(path, 'rb').read()
+
+    (magic, buffer_cpu, count, dropped, producer, consumer, _) = \
+        BUFFER_HEADER.unpack_from(data, 0)
+    if magic != BUFFER_MAGIC:
+        raise ValueError('%s: bad magic %08x' % (path, magic))
+
+    records = []
+    for index in range(count):
+        offset = BUFFER_HEADER.size + (index * RECORD.size)
+        if offset + RECORD.size > len(data):
+            break
+
+        fields = RECORD.unpack_from(data, offset)
+        (address, timestamp, level, sequence, cpu, argc, _) = fields[:7]
+        if address == 0:
+            continue
+
+        # Sequence numbers wrap so order them relative to the producer
+        records.append(((sequence - producer) & 0xffffffff,
+                        timestamp, level, cpu, address, fields[7:7 + argc]))
+
+    print('CPU %u: %u RECORDS (PRODUCER %u CONSUMER %u DROPPED %u)' %
+          (buffer_cpu, len(records), producer, consumer, dropped))
+
+    for (_, timestamp, level, cpu, address, arguments) in sorted(records):
+        text = None
+        for image in images:
+            text = image.string(address)
+            if text is not None:
+                break
+
+        if text is None:
+            text = 'FORMAT @ %016x: %s\n' % (address,
+                                             ' '.join('%x' % a for a in arguments))
+        else:
+            text = format(text, arguments, pointer_size)
+
+        sys.stdout.write('[%u:%016x] %s: %s' %
+                         (cpu, timestamp, LEVEL_NAMES.get(level, '%08x' % level), text))
+        if not text.endswith('\n'):
+            sys.stdout.write('\n')
+
+def usage():
+    print('usage: decode_log_trace.py [-32] <image>@<base> ... <buffer> ...')
+    sys.exit(1)
+
+if __name__ == '__main__':
+    pointer_size = 8
+    images = []
+    buffers = []
+
+    for arg in sys.argv[1:]:
+        if arg == '-32':
+            pointer_size = 4
+        elif '@' in arg:
+            (path, base) = arg.rsplit('@', 1)
+            images.append(Image(int(base, 16), path))
+        else:
+            buffers.append(arg)
+
+    if len(buffers) == 0:
+        usage()
+
+    for path in buffers:
+        decode(path, images, pointer_size)
@@ -62,10 +62,16 @@ typedef VOID
     );
 
 /*! \typedef XENBUS_BALLOON_ADJUST
-    \brief Adjust the balloon to the target \a Size
+    \brief Move the balloon one step towards the target \a Size
 
     \param Interface The interface header
     \param Size The target size of the balloon in pages
+    \return STATUS_PENDING if the target has not yet been reached and
+    the caller should call again after yielding
+
+    The size of each step adapts to the observed balloon rate and
+    to the available memory in the guest. Progress towards the target
+    is published in xenstore as a percentage in memory/balloon-progress.
 */  
 typedef NTSTATUS
 (*XENBUS_BALLOON_ADJUST)(
@@ -83,6 +89,34 @@ typedef ULONGLONG
     IN  PINTERFACE  Interface
     );
 
+/*! \typedef XENBUS_BALLOON_REPORT
+    \brief Hand free guest memory back to the hypervisor
+
+    \param Interface The interface header
+    \return STATUS_NOT_SUPPORTED if free page reporting is not enabled
+
+    This should be called periodically while the balloon is not
+    being adjusted. If it is time for another reporting pass and the
+    guest has plenty of free memory then a chunk of it is released to
+    the hypervisor. If the guest is running low on memory then some
+    previously reported memory is reclaimed instead.
+    Reported memory does not count towards the size of the balloon.
+*/
+typedef NTSTATUS
+(*XENBUS_BALLOON_REPORT)(
+    IN  PINTERFACE  Interface
+    );
+
+/*! \typedef XENBUS_BALLOON_RECLAIM
+    \brief Reclaim all memory handed back by XENBUS_BALLOON_REPORT
+
+    \param Interface The interface header
+*/
+typedef NTSTATUS
+(*XENBUS_BALLOON_RECLAIM)(
+    IN  PINTERFACE  Interface
+    );
+
 // {D92AA810-BECB-4BD5-A3DA-BD03C135A297}
 DEFINE_GUID(GUID_XENBUS_BALLOON_INTERFACE, 
 0xd92aa810, 0xbecb, 0x4bd5, 0xa3, 0xda, 0xbd, 0x3, 0xc1, 0x35, 0xa2, 0x97);
@@ -99,7 +133,21 @@ struct _XENBUS_BALLOON_INTERFACE_V1 {
     XENBUS_BALLOON_GET_SIZE     BalloonGetSize;
 };
 
-typedef struct _XENBUS_BALLOON_INTERFACE_V1 XENBUS_BALLOON_INTERFACE, *PXENBUS_BALLOON_INTERFACE;
+/*! \struct _XENBUS_BALLOON_INTERFACE_V2
+    \brief BALLOON interface version 2
+    \ingroup interfaces
+*/
+struct _XENBUS_BALLOON_INTERFACE_V2 {
+    INTERFACE                   Interface;
+    XENBUS_BALLOON_ACQUIRE      BalloonAcquire;
+    XENBUS_BALLOON_RELEASE      BalloonRelease;
+    XENBUS_BALLOON_ADJUST       BalloonAdjust;
+    XENBUS_BALLOON_GET_SIZE     BalloonGetSize;
+    XENBUS_BALLOON_REPORT       BalloonReport;
+    XENBUS_BALLOON_RECLAIM      BalloonReclaim;
+};
+
+typedef struct _XENBUS_BALLOON_INTERFACE_V2 XENBUS_BALLOON_INTERFACE, *PXENBUS_BALLOON_INTERFACE;
 
 /*! \def XENBUS_BALLOON
     \brief Macro at assist in method invocation
@@ -110,7 +158,7 @@ typedef struct _XENBUS_BALLOON_INTERFACE_V1 XENBUS_BALLOON_INTERFACE, *PXENBUS_B
 #endif  // _WINDLL
 
 #define XENBUS_BALLOON_INTERFACE_VERSION_MIN    1
-#define XENBUS_BALLOON_INTERFACE_VERSION_MAX    1
+#define XENBUS_BALLOON_INTERFACE_VERSION_MAX    2
 
 #endif  // _XENBUS_BALLOON_INTERFACE_H
 
@@ -140,6 +140,75 @@ typedef VOID
     IN  PXENBUS_DEBUG_CALLBACK  Callback OPTIONAL
     );
 
+/*! \typedef XENBUS_DEBUG_STATISTIC
+    \brief Statistic handle
+*/
+typedef struct _XENBUS_DEBUG_STATISTIC  XENBUS_DEBUG_STATISTIC, *PXENBUS_DEBUG_STATISTIC;
+
+/*! \enum _XENBUS_DEBUG_STATISTIC_TYPE
+    \brief Statistic type
+*/
+typedef enum _XENBUS_DEBUG_STATISTIC_TYPE {
+    XENBUS_DEBUG_STATISTIC_TYPE_INVALID = 0,
+    /*! Samples are arbitrary values */
+    XENBUS_DEBUG_STATISTIC_TYPE_VALUE,
+    /*! Samples are intervals measured by KeQueryPerformanceCounter() */
+    XENBUS_DEBUG_STATISTIC_TYPE_TIME,
+    /*! Samples are intervals in TSC cycles (i.e. differences between
+        values returned by __rdtsc()). This is much cheaper to measure
+        in interrupt and DPC paths, but an interval that spans CPUs is
+        only meaningful if their TSCs are in sync. */
+    XENBUS_DEBUG_STATISTIC_TYPE_CYCLES
+} XENBUS_DEBUG_STATISTIC_TYPE, *PXENBUS_DEBUG_STATISTIC_TYPE;
+
+/*! \typedef XENBUS_DEBUG_STATISTIC_CREATE
+    \brief Create a statistic
+
+    \param Interface The interface header
+    \param Name The name of the statistic
+    \param Type The type of samples that will be recorded
+    \param Statistic A pointer to a statistic handle to be initialized
+
+    Statistics are diagnostic only so, should creation fail, \a Statistic
+    is set to NULL and the NULL handle may still be passed to
+    \a XENBUS_DEBUG_STATISTIC_RECORD and \a XENBUS_DEBUG_STATISTIC_DESTROY.
+*/
+typedef NTSTATUS
+(*XENBUS_DEBUG_STATISTIC_CREATE)(
+    IN  PINTERFACE                  Interface,
+    IN  const CHAR                  *Name,
+    IN  XENBUS_DEBUG_STATISTIC_TYPE Type,
+    OUT PXENBUS_DEBUG_STATISTIC     *Statistic
+    );
+
+/*! \typedef XENBUS_DEBUG_STATISTIC_RECORD
+    \brief Record a sample
+
+    \param Interface The interface header
+    \param Statistic The statistic handle
+    \param Value The sample value
+
+    This method takes no locks and may be invoked at any IRQL
+*/
+typedef VOID
+(*XENBUS_DEBUG_STATISTIC_RECORD)(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_DEBUG_STATISTIC Statistic OPTIONAL,
+    IN  ULONGLONG               Value
+    );
+
+/*! \typedef XENBUS_DEBUG_STATISTIC_DESTROY
+    \brief Destroy a statistic
+
+    \param Interface The interface header
+    \param Statistic The statistic handle
+*/
+typedef VOID
+(*XENBUS_DEBUG_STATISTIC_DESTROY)(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_DEBUG_STATISTIC Statistic OPTIONAL
+    );
+
 // {0DF600AE-6B20-4227-BF94-03DA9A26A114}
 DEFINE_GUID(GUID_XENBUS_DEBUG_INTERFACE, 
 0xdf600ae, 0x6b20, 0x4227, 0xbf, 0x94, 0x3, 0xda, 0x9a, 0x26, 0xa1, 0x14);
@@ -158,7 +227,24 @@ struct _XENBUS_DEBUG_INTERFACE_V1 {
     XENBUS_DEBUG_DEREGISTER DebugDeregister;
 };
 
-typedef struct _XENBUS_DEBUG_INTERFACE_V1 XENBUS_DEBUG_INTERFACE, *PXENBUS_DEBUG_INTERFACE;
+/*! \struct _XENBUS_DEBUG_INTERFACE_V2
+    \brief DEBUG interface version 2
+    \ingroup interfaces
+*/
+struct _XENBUS_DEBUG_INTERFACE_V2 {
+    INTERFACE                       Interface;
+    XENBUS_DEBUG_ACQUIRE            DebugAcquire;
+    XENBUS_DEBUG_RELEASE            DebugRelease;
+    XENBUS_DEBUG_REGISTER           DebugRegister;
+    XENBUS_DEBUG_PRINTF             DebugPrintf;
+    XENBUS_DEBUG_TRIGGER            DebugTrigger;
+    XENBUS_DEBUG_DEREGISTER         DebugDeregister;
+    XENBUS_DEBUG_STATISTIC_CREATE   DebugStatisticCreate;
+    XENBUS_DEBUG_STATISTIC_RECORD   DebugStatisticRecord;
+    XENBUS_DEBUG_STATISTIC_DESTROY  DebugStatisticDestroy;
+};
+
+typedef struct _XENBUS_DEBUG_INTERFACE_V2 XENBUS_DEBUG_INTERFACE, *PXENBUS_DEBUG_INTERFACE;
 
 /*! \def XENBUS_DEBUG
     \brief Macro at assist in method invocation
@@ -169,7 +255,38 @@ typedef struct _XENBUS_DEBUG_INTERFACE_V1 XENBUS_DEBUG_INTERFACE, *PXENBUS_DEBUG
 #endif  // _WINDLL
 
 #define XENBUS_DEBUG_INTERFACE_VERSION_MIN  1
-#define XENBUS_DEBUG_INTERFACE_VERSION_MAX  1
+#define XENBUS_DEBUG_INTERFACE_VERSION_MAX  2
+
+/*! \def XENBUS_DEBUG_STATISTIC_BUCKET_COUNT
+    \brief Number of log2 buckets in a statistic histogram
+
+    Bucket 0 counts samples of value 0 and bucket N (N > 0) counts
+    samples in the range [2^(N-1), 2^N). The last bucket also counts
+    all larger samples.
+*/
+#define XENBUS_DEBUG_STATISTIC_BUCKET_COUNT 40
+
+/*! \struct _XENBUS_DEBUG_STATISTIC_SNAPSHOT
+    \brief Statistic snapshot
+
+    A snapshot of each statistic is periodically written as a REG_BINARY
+    value, named after the statistic, in the volatile 'Statistics' subkey
+    of the XENBUS service key.
+*/
+struct _XENBUS_DEBUG_STATISTIC_SNAPSHOT {
+    /*! The XENBUS_DEBUG_STATISTIC_TYPE */
+    ULONG       Type;
+    ULONG       Reserved;
+    /*! Ticks per second for XENBUS_DEBUG_STATISTIC_TYPE_TIME or
+        XENBUS_DEBUG_STATISTIC_TYPE_CYCLES, zero otherwise */
+    ULONGLONG   Frequency;
+    ULONGLONG   Count;
+    ULONGLONG   Sum;
+    ULONGLONG   Maximum;
+    ULONGLONG   Bucket[XENBUS_DEBUG_STATISTIC_BUCKET_COUNT];
+};
+
+typedef struct _XENBUS_DEBUG_STATISTIC_SNAPSHOT XENBUS_DEBUG_STATISTIC_SNAPSHOT, *PXENBUS_DEBUG_STATISTIC_SNAPSHOT;
 
 #endif  // _XENBUS_DEBUG_INTERFACE_H
 
@@ -229,6 +229,48 @@ typedef NTSTATUS
     IN  PHYSICAL_ADDRESS        Address
     );
 
+/*! \typedef XENBUS_GNTTAB_MAP_FOREIGN_PAGES_CACHED
+    \brief Map foreign memory pages into the system address space,
+    re-using a mapping retained from a previous call if possible
+
+    \param Interface The interface header
+    \param Domain The domid of the foreign domain that granted the pages
+    \param NumberPages Number of pages to map
+    \param References Array of grant reference numbers shared by the foreign domain
+    \param ReadOnly If TRUE, pages are mapped with read-only access
+    \param Address The physical address that the foreign pages are mapped under
+
+    The mapping must be released using XENBUS_GNTTAB_UNMAP_FOREIGN_PAGES
+    but, unlike a mapping made by XENBUS_GNTTAB_MAP_FOREIGN_PAGES, it may
+    be retained after that and handed out again to a subsequent call with
+    the same Domain, References and ReadOnly. Hence the foreign domain
+    must not expect to be able to revoke the grants until the mapping has
+    been flushed using XENBUS_GNTTAB_FLUSH_FOREIGN_PAGES.
+*/
+typedef NTSTATUS
+(*XENBUS_GNTTAB_MAP_FOREIGN_PAGES_CACHED)(
+    IN  PINTERFACE              Interface,
+    IN  USHORT                  Domain,
+    IN  ULONG                   NumberPages,
+    IN  PULONG                  References,
+    IN  BOOLEAN                 ReadOnly,
+    OUT PHYSICAL_ADDRESS        *Address
+    );
+
+/*! \typedef XENBUS_GNTTAB_FLUSH_FOREIGN_PAGES
+    \brief Unmap any retained mappings of pages granted by a foreign domain
+
+    \param Interface The interface header
+    \param Domain The domid of the foreign domain that granted the pages
+
+    Mappings that are still in use are unmapped when they are released.
+*/
+typedef VOID
+(*XENBUS_GNTTAB_FLUSH_FOREIGN_PAGES)(
+    IN  PINTERFACE              Interface,
+    IN  USHORT                  Domain
+    );
+
 // {763679C5-E5C2-4A6D-8B88-6BB02EC42D8E}
 DEFINE_GUID(GUID_XENBUS_GNTTAB_INTERFACE, 
 0x763679c5, 0xe5c2, 0x4a6d, 0x8b, 0x88, 0x6b, 0xb0, 0x2e, 0xc4, 0x2d, 0x8e);
@@ -301,7 +343,27 @@ struct _XENBUS_GNTTAB_INTERFACE_V4 {
     XENBUS_GNTTAB_UNMAP_FOREIGN_PAGES   GnttabUnmapForeignPages;
 };
 
-typedef struct _XENBUS_GNTTAB_INTERFACE_V4 XENBUS_GNTTAB_INTERFACE, *PXENBUS_GNTTAB_INTERFACE;
+/*! \struct _XENBUS_GNTTAB_INTERFACE_V5
+    \brief GNTTAB interface version 5
+    \ingroup interfaces
+*/
+struct _XENBUS_GNTTAB_INTERFACE_V5 {
+    INTERFACE                               Interface;
+    XENBUS_GNTTAB_ACQUIRE                   GnttabAcquire;
+    XENBUS_GNTTAB_RELEASE                   GnttabRelease;
+    XENBUS_GNTTAB_CREATE_CACHE              GnttabCreateCache;
+    XENBUS_GNTTAB_PERMIT_FOREIGN_ACCESS     GnttabPermitForeignAccess;
+    XENBUS_GNTTAB_REVOKE_FOREIGN_ACCESS     GnttabRevokeForeignAccess;
+    XENBUS_GNTTAB_GET_REFERENCE             GnttabGetReference;
+    XENBUS_GNTTAB_QUERY_REFERENCE           GnttabQueryReference;
+    XENBUS_GNTTAB_DESTROY_CACHE             GnttabDestroyCache;
+    XENBUS_GNTTAB_MAP_FOREIGN_PAGES         GnttabMapForeignPages;
+    XENBUS_GNTTAB_UNMAP_FOREIGN_PAGES       GnttabUnmapForeignPages;
+    XENBUS_GNTTAB_MAP_FOREIGN_PAGES_CACHED  GnttabMapForeignPagesCached;
+    XENBUS_GNTTAB_FLUSH_FOREIGN_PAGES       GnttabFlushForeignPages;
+};
+
+typedef struct _XENBUS_GNTTAB_INTERFACE_V5 XENBUS_GNTTAB_INTERFACE, *PXENBUS_GNTTAB_INTERFACE;
 
 /*! \def XENBUS_GNTTAB
     \brief Macro at assist in method invocation
@@ -312,7 +374,7 @@ typedef struct _XENBUS_GNTTAB_INTERFACE_V4 XENBUS_GNTTAB_INTERFACE, *PXENBUS_GNT
 #endif  // _WINDLL
 
 #define XENBUS_GNTTAB_INTERFACE_VERSION_MIN 1
-#define XENBUS_GNTTAB_INTERFACE_VERSION_MAX 4
+#define XENBUS_GNTTAB_INTERFACE_VERSION_MAX 5
 
 #endif  // _XENBUS_GNTTAB_INTERFACE_H
 
@@ -143,6 +143,29 @@ typedef VOID
     IN  PXENBUS_RANGE_SET   RangeSet
     );
 
+/*! \typedef XENBUS_RANGE_SET_TAKE
+    \brief Take items from the start of the lowest range in a range-set
+    \param Interface The interface header
+    \param RangeSet The range-set handle
+    \param Count The maximum number of items required
+    \param Start A pointer to a value which will be set to the base of
+    the items taken
+    \param Taken A pointer to a value which will be set to the number of
+    items taken (which will be between 1 and Count)
+
+    Unlike XENBUS_RANGE_SET_POP this does not fail if no range is large
+    enough to satisfy the whole request. Successive calls return items
+    in ascending order.
+*/  
+typedef NTSTATUS
+(*XENBUS_RANGE_SET_TAKE)(
+    IN  PINTERFACE          Interface,
+    IN  PXENBUS_RANGE_SET   RangeSet,
+    IN  ULONGLONG           Count,
+    OUT PLONGLONG           Start,
+    OUT PULONGLONG          Taken
+    );
+
 // {EE7E78A2-6847-48C5-B123-BB012F0EABF4}
 DEFINE_GUID(GUID_XENBUS_RANGE_SET_INTERFACE, 
 0xee7e78a2, 0x6847, 0x48c5, 0xb1, 0x23, 0xbb, 0x1, 0x2f, 0xe, 0xab, 0xf4);
@@ -162,7 +185,23 @@ struct _XENBUS_RANGE_SET_INTERFACE_V1 {
     XENBUS_RANGE_SET_DESTROY    RangeSetDestroy;
 };
 
-typedef struct _XENBUS_RANGE_SET_INTERFACE_V1 XENBUS_RANGE_SET_INTERFACE, *PXENBUS_RANGE_SET_INTERFACE;
+/*! \struct _XENBUS_RANGE_SET_INTERFACE_V2
+    \brief RANGE_SET interface version 2
+    \ingroup interfaces
+*/
+struct _XENBUS_RANGE_SET_INTERFACE_V2 {
+    INTERFACE                   Interface;
+    XENBUS_RANGE_SET_ACQUIRE    RangeSetAcquire;
+    XENBUS_RANGE_SET_RELEASE    RangeSetRelease;
+    XENBUS_RANGE_SET_CREATE     RangeSetCreate;
+    XENBUS_RANGE_SET_PUT        RangeSetPut;
+    XENBUS_RANGE_SET_POP        RangeSetPop;
+    XENBUS_RANGE_SET_GET        RangeSetGet;
+    XENBUS_RANGE_SET_DESTROY    RangeSetDestroy;
+    XENBUS_RANGE_SET_TAKE       RangeSetTake;
+};
+
+typedef struct _XENBUS_RANGE_SET_INTERFACE_V2 XENBUS_RANGE_SET_INTERFACE, *PXENBUS_RANGE_SET_INTERFACE;
 
 /*! \def XENBUS_RANGE_SET
     \brief Macro at assist in method invocation
@@ -173,7 +212,7 @@ typedef struct _XENBUS_RANGE_SET_INTERFACE_V1 XENBUS_RANGE_SET_INTERFACE, *PXENB
 #endif  // _WINDLL
 
 #define XENBUS_RANGE_SET_INTERFACE_VERSION_MIN 1
-#define XENBUS_RANGE_SET_INTERFACE_VERSION_MAX 1
+#define XENBUS_RANGE_SET_INTERFACE_VERSION_MAX 2
 
 #endif  // _XENBUS_RANGE_SET_INTERFACE_H
 
@@ -44,20 +44,27 @@
 // U  - XENBUS_UNPLUG_INTERFACE
 // CO - XENBUS_CONSOLE_INTERFACE
 // EM - XENFILT_EMULATED_INTERFACE
+// T  - XENBUS_TIMER_INTERFACE
 
-//                    REVISION   S  SI   E   D  ST   R   C   G   U  CO  EM
-#define DEFINE_REVISION_TABLE                                                \
-    DEFINE_REVISION(0x08000009,  1,  2,  4,  1,  1,  1,  1,  1,  1,  0,  1), \
-    DEFINE_REVISION(0x0800000A,  1,  2,  5,  1,  1,  1,  1,  1,  1,  0,  1), \
-    DEFINE_REVISION(0x0800000B,  1,  2,  5,  1,  2,  1,  1,  2,  1,  0,  1), \
-    DEFINE_REVISION(0x09000000,  1,  2,  5,  1,  2,  1,  1,  2,  1,  0,  1), \
-    DEFINE_REVISION(0x09000001,  1,  2,  6,  1,  2,  1,  1,  2,  1,  1,  1), \
-    DEFINE_REVISION(0x09000002,  1,  2,  7,  1,  2,  1,  1,  2,  1,  1,  1), \
-    DEFINE_REVISION(0x09000003,  1,  2,  8,  1,  2,  1,  1,  2,  1,  1,  1), \
-    DEFINE_REVISION(0x09000004,  1,  2,  8,  1,  2,  1,  1,  3,  1,  1,  1), \
-    DEFINE_REVISION(0x09000005,  1,  2,  8,  1,  2,  1,  2,  4,  1,  1,  1), \
-    DEFINE_REVISION(0x09000006,  1,  3,  8,  1,  2,  1,  2,  4,  1,  1,  1), \
-    DEFINE_REVISION(0x09000007,  1,  3,  8,  1,  2,  1,  2,  4,  1,  1,  2), \
-    DEFINE_REVISION(0x09000008,  1,  3,  9,  1,  2,  1,  2,  4,  1,  1,  2)
+//                    REVISION   S  SI   E   D  ST   R   C   G   U  CO  EM   T
+#define DEFINE_REVISION_TABLE                                                    \
+    DEFINE_REVISION(0x08000009,  1,  2,  4,  1,  1,  1,  1,  1,  1,  0,  1,  0), \
+    DEFINE_REVISION(0x0800000A,  1,  2,  5,  1,  1,  1,  1,  1,  1,  0,  1,  0), \
+    DEFINE_REVISION(0x0800000B,  1,  2,  5,  1,  2,  1,  1,  2,  1,  0,  1,  0), \
+    DEFINE_REVISION(0x09000000,  1,  2,  5,  1,  2,  1,  1,  2,  1,  0,  1,  0), \
+    DEFINE_REVISION(0x09000001,  1,  2,  6,  1,  2,  1,  1,  2,  1,  1,  1,  0), \
+    DEFINE_REVISION(0x09000002,  1,  2,  7,  1,  2,  1,  1,  2,  1,  1,  1,  0), \
+    DEFINE_REVISION(0x09000003,  1,  2,  8,  1,  2,  1,  1,  2,  1,  1,  1,  0), \
+    DEFINE_REVISION(0x09000004,  1,  2,  8,  1,  2,  1,  1,  3,  1,  1,  1,  0), \
+    DEFINE_REVISION(0x09000005,  1,  2,  8,  1,  2,  1,  2,  4,  1,  1,  1,  0), \
+    DEFINE_REVISION(0x09000006,  1,  3,  8,  1,  2,  1,  2,  4,  1,  1,  1,  0), \
+    DEFINE_REVISION(0x09000007,  1,  3,  8,  1,  2,  1,  2,  4,  1,  1,  2,  0), \
+    DEFINE_REVISION(0x09000008,  1,  3,  9,  1,  2,  1,  2,  4,  1,  1,  2,  0), \
+    DEFINE_REVISION(0x09000009,  1,  3,  9,  2,  2,  1,  2,  4,  1,  1,  2,  0), \
+    DEFINE_REVISION(0x0900000A,  1,  3,  9,  2,  2,  2,  2,  4,  1,  1,  2,  0), \
+    DEFINE_REVISION(0x0900000B,  1,  4,  9,  2,  2,  2,  2,  4,  1,  1,  2,  0), \
+    DEFINE_REVISION(0x0900000C,  1,  5,  9,  2,  2,  2,  2,  4,  1,  1,  2,  0), \
+    DEFINE_REVISION(0x0900000D,  1,  5,  9,  2,  2,  2,  2,  4,  1,  1,  2,  1), \
+    DEFINE_REVISION(0x0900000E,  1,  5,  9,  2,  2,  2,  2,  5,  1,  1,  2,  1)
 
 #endif  // _REVISION_H
@@ -132,6 +132,45 @@ typedef VOID
     OUT PBOOLEAN        Local
     );
 
+/*! \typedef XENBUS_SHARED_INFO_IS_PROCESSOR_ENABLED
+    \brief Determine whether events can be delivered to a processor
+
+    \param Interface The interface header
+    \param Index The system-wide index of the processor
+    \return TRUE if the vCPU backing the processor has a vcpu_info
+
+    A vCPU beyond the first XEN_LEGACY_MAX_VCPUS only has a vcpu_info
+    if one could be registered for it, so an event channel should not
+    be bound to its processor unless this method returns TRUE.
+*/
+typedef BOOLEAN
+(*XENBUS_SHARED_INFO_IS_PROCESSOR_ENABLED)(
+    IN  PINTERFACE  Interface,
+    IN  ULONG       Index
+    );
+
+/*! \typedef XENBUS_SHARED_INFO_GET_SYSTEM_TIME
+    \brief Retrieve the hypervisor system time from the pvclock of the
+    current vCPU
+
+    \param Interface The interface header
+    \return The time in nanoseconds
+
+    Values read on one processor do not go backwards while the domain
+    runs on a given host, but they restart from the new host's system
+    time after a migration so they should only be used to measure
+    intervals. Unless the host has a stable TSC, values read on
+    different processors may be slightly skewed. A processor without a
+    vcpu_info (see \a XENBUS_SHARED_INFO_IS_PROCESSOR_ENABLED) has no
+    pvclock and gets the interrupt time instead, which is not
+    comparable with hypervisor system time. This method may be called
+    at any IRQL.
+*/
+typedef LONGLONG
+(*XENBUS_SHARED_INFO_GET_SYSTEM_TIME)(
+    IN  PINTERFACE  Interface
+    );
+
 // {7E73C34F-1640-4649-A8F3-263BC930A004}
 DEFINE_GUID(GUID_XENBUS_SHARED_INFO_INTERFACE, 
 0x7e73c34f, 0x1640, 0x4649, 0xa8, 0xf3, 0x26, 0x3b, 0xc9, 0x30, 0xa0, 0x4);
@@ -168,7 +207,42 @@ struct _XENBUS_SHARED_INFO_INTERFACE_V3 {
     XENBUS_SHARED_INFO_GET_TIME         SharedInfoGetTime;
 };
 
-typedef struct _XENBUS_SHARED_INFO_INTERFACE_V3 XENBUS_SHARED_INFO_INTERFACE, *PXENBUS_SHARED_INFO_INTERFACE;
+/*! \struct _XENBUS_SHARED_INFO_INTERFACE_V4
+    \brief SHARED_INFO interface version 4
+    \ingroup interfaces
+*/
+struct _XENBUS_SHARED_INFO_INTERFACE_V4 {
+    INTERFACE                               Interface;
+    XENBUS_SHARED_INFO_ACQUIRE              SharedInfoAcquire;
+    XENBUS_SHARED_INFO_RELEASE              SharedInfoRelease;
+    XENBUS_SHARED_INFO_UPCALL_PENDING       SharedInfoUpcallPending;
+    XENBUS_SHARED_INFO_EVTCHN_POLL          SharedInfoEvtchnPoll;
+    XENBUS_SHARED_INFO_EVTCHN_ACK           SharedInfoEvtchnAck;
+    XENBUS_SHARED_INFO_EVTCHN_MASK          SharedInfoEvtchnMask;
+    XENBUS_SHARED_INFO_EVTCHN_UNMASK        SharedInfoEvtchnUnmask;
+    XENBUS_SHARED_INFO_GET_TIME             SharedInfoGetTime;
+    XENBUS_SHARED_INFO_IS_PROCESSOR_ENABLED SharedInfoIsProcessorEnabled;
+};
+
+/*! \struct _XENBUS_SHARED_INFO_INTERFACE_V5
+    \brief SHARED_INFO interface version 5
+    \ingroup interfaces
+*/
+struct _XENBUS_SHARED_INFO_INTERFACE_V5 {
+    INTERFACE                               Interface;
+    XENBUS_SHARED_INFO_ACQUIRE              SharedInfoAcquire;
+    XENBUS_SHARED_INFO_RELEASE              SharedInfoRelease;
+    XENBUS_SHARED_INFO_UPCALL_PENDING       SharedInfoUpcallPending;
+    XENBUS_SHARED_INFO_EVTCHN_POLL          SharedInfoEvtchnPoll;
+    XENBUS_SHARED_INFO_EVTCHN_ACK           SharedInfoEvtchnAck;
+    XENBUS_SHARED_INFO_EVTCHN_MASK          SharedInfoEvtchnMask;
+    XENBUS_SHARED_INFO_EVTCHN_UNMASK        SharedInfoEvtchnUnmask;
+    XENBUS_SHARED_INFO_GET_TIME             SharedInfoGetTime;
+    XENBUS_SHARED_INFO_IS_PROCESSOR_ENABLED SharedInfoIsProcessorEnabled;
+    XENBUS_SHARED_INFO_GET_SYSTEM_TIME      SharedInfoGetSystemTime;
+};
+
+typedef struct _XENBUS_SHARED_INFO_INTERFACE_V5 XENBUS_SHARED_INFO_INTERFACE, *PXENBUS_SHARED_INFO_INTERFACE;
 
 /*! \def XENBUS_SHARED_INFO
     \brief Macro at assist in method invocation
@@ -179,6 +253,6 @@ typedef struct _XENBUS_SHARED_INFO_INTERFACE_V3 XENBUS_SHARED_INFO_INTERFACE, *P
 #endif  // _WINDLL
 
 #define XENBUS_SHARED_INFO_INTERFACE_VERSION_MIN    2
-#define XENBUS_SHARED_INFO_INTERFACE_VERSION_MAX    3
+#define XENBUS_SHARED_INFO_INTERFACE_VERSION_MAX    5
 
 #endif  // _XENBUS_SHARED_INFO_H
@@ -0,0 +1,179 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*! \file timer_interface.h
+    \brief XENBUS TIMER Interface
+
+    This interface provides access to high resolution one-shot timers
+    driven by the hypervisor
+*/
+
+#ifndef _XENBUS_TIMER_INTERFACE_H
+#define _XENBUS_TIMER_INTERFACE_H
+
+#ifndef _WINDLL
+
+/*! \typedef XENBUS_TIMER
+    \brief Timer handle
+*/
+typedef struct _XENBUS_TIMER    XENBUS_TIMER, *PXENBUS_TIMER;
+
+/*! \typedef XENBUS_TIMER_ACQUIRE
+    \brief Acquire a reference to the TIMER interface
+
+    \param Interface The interface header
+*/
+typedef NTSTATUS
+(*XENBUS_TIMER_ACQUIRE)(
+    IN  PINTERFACE  Interface
+    );
+
+/*! \typedef XENBUS_TIMER_RELEASE
+    \brief Release a reference to the TIMER interface
+
+    \param Interface The interface header
+*/
+typedef VOID
+(*XENBUS_TIMER_RELEASE)(
+    IN  PINTERFACE  Interface
+    );
+
+/*! \typedef XENBUS_TIMER_FUNCTION
+    \brief Timer expiry callback
+
+    \param Argument Context passed to \a XENBUS_TIMER_CREATE
+
+    The callback is invoked at DISPATCH_LEVEL on the CPU the timer
+    was created for. The timer may be set again from within the
+    callback.
+*/
+typedef VOID
+(*XENBUS_TIMER_FUNCTION)(
+    IN  PVOID   Argument
+    );
+
+/*! \typedef XENBUS_TIMER_CREATE
+    \brief Create a timer
+
+    \param Interface The interface header
+    \param Cpu The index of the CPU on which the timer will expire
+    \param Function The callback to invoke on expiry
+    \param Argument The context argument to pass to \a Function
+    \param Timer A pointer to a timer handle to be initialized
+*/
+typedef NTSTATUS
+(*XENBUS_TIMER_CREATE)(
+    IN  PINTERFACE              Interface,
+    IN  ULONG                   Cpu,
+    IN  XENBUS_TIMER_FUNCTION   Function,
+    IN  PVOID                   Argument,
+    OUT PXENBUS_TIMER           *Timer
+    );
+
+/*! \typedef XENBUS_TIMER_SET
+    \brief Arm (or re-arm) a timer
+
+    \param Interface The interface header
+    \param Timer The timer handle
+    \param Delay The time, in nanoseconds, until the timer should expire
+    \return TRUE if the timer was already pending
+
+    Timers that are pending across a suspend/resume may expire later
+    than requested, but never earlier.
+*/
+typedef BOOLEAN
+(*XENBUS_TIMER_SET)(
+    IN  PINTERFACE      Interface,
+    IN  PXENBUS_TIMER   Timer,
+    IN  ULONGLONG       Delay
+    );
+
+/*! \typedef XENBUS_TIMER_CANCEL
+    \brief Cancel a pending timer
+
+    \param Interface The interface header
+    \param Timer The timer handle
+    \return TRUE if the timer was pending
+*/
+typedef BOOLEAN
+(*XENBUS_TIMER_CANCEL)(
+    IN  PINTERFACE      Interface,
+    IN  PXENBUS_TIMER   Timer
+    );
+
+/*! \typedef XENBUS_TIMER_DESTROY
+    \brief Destroy a timer
+
+    \param Interface The interface header
+    \param Timer The timer handle
+
+    The timer is cancelled if it is pending. This method must be
+    called at PASSIVE_LEVEL and will not return until any callback
+    already in progress has completed.
+*/
+typedef VOID
+(*XENBUS_TIMER_DESTROY)(
+    IN  PINTERFACE      Interface,
+    IN  PXENBUS_TIMER   Timer
+    );
+
+// {87b3ea39-5d3e-41b3-aa7b-d8ed27279b05}
+DEFINE_GUID(GUID_XENBUS_TIMER_INTERFACE,
+0x87b3ea39, 0x5d3e, 0x41b3, 0xaa, 0x7b, 0xd8, 0xed, 0x27, 0x27, 0x9b, 0x05);
+
+/*! \struct _XENBUS_TIMER_INTERFACE_V1
+    \brief TIMER interface version 1
+    \ingroup interfaces
+*/
+struct _XENBUS_TIMER_INTERFACE_V1 {
+    INTERFACE               Interface;
+    XENBUS_TIMER_ACQUIRE    TimerAcquire;
+    XENBUS_TIMER_RELEASE    TimerRelease;
+    XENBUS_TIMER_CREATE     TimerCreate;
+    XENBUS_TIMER_SET        TimerSet;
+    XENBUS_TIMER_CANCEL     TimerCancel;
+    XENBUS_TIMER_DESTROY    TimerDestroy;
+};
+
+typedef struct _XENBUS_TIMER_INTERFACE_V1 XENBUS_TIMER_INTERFACE, *PXENBUS_TIMER_INTERFACE;
+
+/*! \def XENBUS_TIMER
+    \brief Macro at assist in method invocation
+*/
+#define XENBUS_TIMER(_Method, _Interface, ...)    \
+    (_Interface)->Timer ## _Method((PINTERFACE)(_Interface), __VA_ARGS__)
+
+#endif  // _WINDLL
+
+#define XENBUS_TIMER_INTERFACE_VERSION_MIN  1
+#define XENBUS_TIMER_INTERFACE_VERSION_MAX  1
+
+#endif  // _XENBUS_TIMER_INTERFACE_H
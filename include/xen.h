@@ -83,6 +83,69 @@ HypercallPopulate(
     VOID
     );
 
+// A batch of hypercalls is issued using a single __HYPERVISOR_multicall
+// (and hence a single VM exit). The result of each queued hypercall is
+// available from HypercallBatchResult() once the batch has been flushed.
+// Arguments are passed by value so any buffers referenced by them must
+// remain valid until the flush completes.
+
+#define HYPERCALL_BATCH_MAXIMUM_ENTRIES 16
+
+typedef struct _HYPERCALL_BATCH {
+    ULONG               Count;
+    BOOLEAN             Flushed;
+    multicall_entry_t   Entry[HYPERCALL_BATCH_MAXIMUM_ENTRIES];
+} HYPERCALL_BATCH, *PHYPERCALL_BATCH;
+
+XEN_API
+VOID
+HypercallBatchInitialize(
+    OUT PHYPERCALL_BATCH    Batch
+    );
+
+__checkReturn
+XEN_API
+NTSTATUS
+HypercallBatchQueue(
+    IN  PHYPERCALL_BATCH    Batch,
+    IN  ULONG               Ordinal,
+    IN  ULONG               Count,
+    ...
+    );
+
+#define HYPERCALL_BATCH_QUEUE(_Batch, _Name, _Count, ...) \
+        HypercallBatchQueue((_Batch), __HYPERVISOR_##_Name, (_Count), __VA_ARGS__)
+
+__checkReturn
+XEN_API
+NTSTATUS
+HypercallBatchFlush(
+    IN  PHYPERCALL_BATCH    Batch
+    );
+
+XEN_API
+LONG_PTR
+HypercallBatchResult(
+    IN  PHYPERCALL_BATCH    Batch,
+    IN  ULONG               Index
+    );
+
+// Count is the number of VM exits made for the ordinal and Cycles the
+// cumulative TSC cycles spent in them. Batched is the number of calls
+// made on behalf of a __HYPERVISOR_multicall (which are accounted to
+// that ordinal). The counts are kept per CPU and summed on query.
+
+#define HYPERCALL_MAXIMUM_ORDINAL   64
+
+XEN_API
+VOID
+HypercallQueryStatistics(
+    IN  ULONG       Ordinal,
+    OUT PULONGLONG  Count,
+    OUT PULONGLONG  Batched,
+    OUT PULONGLONG  Cycles
+    );
+
 // HVM
 
 __checkReturn
@@ -127,6 +190,16 @@ MemoryAddToPhysmap(
     IN  ULONG_PTR   Offset
     );
 
+__checkReturn
+XEN_API
+NTSTATUS
+MemoryAddToPhysmapRange(
+    IN  PFN_NUMBER  Pfn,
+    IN  ULONG       Space,
+    IN  ULONG_PTR   Offset,
+    IN  ULONG       Count
+    );
+
 #define PAGE_ORDER_4K   0
 #define PAGE_ORDER_2M   9
 
@@ -495,4 +568,21 @@ VcpuSetPeriodicTimer(
     IN  PLARGE_INTEGER  Period
     );
 
+__checkReturn
+XEN_API
+NTSTATUS
+VcpuSetSingleshotTimer(
+    IN  unsigned int    vcpu_id,
+    IN  ULONGLONG       Timeout
+    );
+
+__checkReturn
+XEN_API
+NTSTATUS
+VcpuRegisterVcpuInfo(
+    IN  unsigned int    vcpu_id,
+    IN  PFN_NUMBER      Pfn,
+    IN  ULONG           Offset
+    );
+
 #endif  // _XEN_H
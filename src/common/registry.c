@@ -1215,6 +1215,32 @@ fail1:
     return status;
 }
 
+NTSTATUS
+RegistryQueryKeyLastWriteTime(
+    IN  HANDLE                  Key,
+    OUT PLARGE_INTEGER          LastWriteTime
+    )
+{
+    KEY_CACHED_INFORMATION      Information;
+    ULONG                       Size;
+    NTSTATUS                    status;
+
+    status = ZwQueryKey(Key,
+                        KeyCachedInformation,
+                        &Information,
+                        sizeof (Information),
+                        &Size);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    *LastWriteTime = Information.LastWriteTime;
+
+    return STATUS_SUCCESS;
+
+fail1:
+    return status;
+}
+
 NTSTATUS
 RegistryQuerySystemStartOption(
     IN  PCHAR                       Prefix,
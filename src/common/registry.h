@@ -171,6 +171,12 @@ RegistryQueryKeyName(
     OUT PANSI_STRING        *Array
     );
 
+extern NTSTATUS
+RegistryQueryKeyLastWriteTime(
+    IN  HANDLE          Key,
+    OUT PLARGE_INTEGER  LastWriteTime
+    );
+
 extern NTSTATUS
 RegistryQuerySystemStartOption(
     IN  PCHAR           Name,
@@ -42,6 +42,8 @@
 
 #define MAXIMUM_HYPERCALL_PAGE_COUNT 2
 
+#define HYPERCALL_TAG   'PYH'
+
 #pragma code_seg("hypercall")
 __declspec(allocate("hypercall"))
 static UCHAR        __Section[(MAXIMUM_HYPERCALL_PAGE_COUNT + 1) * PAGE_SIZE];
@@ -58,6 +60,67 @@ typedef HYPERCALL_GATE  *PHYPERCALL_GATE;
 PHYPERCALL_GATE     Hypercall;
 ULONG               HypercallMsr;
 
+typedef struct _HYPERCALL_STATISTICS {
+    LONG64  Count;
+    LONG64  Batched;
+    LONG64  Cycles;
+} HYPERCALL_STATISTICS, *PHYPERCALL_STATISTICS;
+
+// Each CPU accounts into its own block, padded to a whole number of
+// cache lines, so that hypercalls made on different CPUs never touch
+// the same line. The blocks are only summed when queried.
+
+typedef union _HYPERCALL_PROCESSOR {
+    HYPERCALL_STATISTICS    Statistics[HYPERCALL_MAXIMUM_ORDINAL];
+    UCHAR                   Pad[P2ROUNDUP(sizeof (HYPERCALL_STATISTICS) *
+                                          HYPERCALL_MAXIMUM_ORDINAL,
+                                          SYSTEM_CACHE_ALIGNMENT_SIZE)];
+} HYPERCALL_PROCESSOR, *PHYPERCALL_PROCESSOR;
+
+C_ASSERT((sizeof (HYPERCALL_PROCESSOR) % SYSTEM_CACHE_ALIGNMENT_SIZE) == 0);
+
+static PVOID                HypercallProcessorBuffer;
+static PHYPERCALL_PROCESSOR HypercallProcessor;
+static ULONG                HypercallProcessorCount;
+
+static FORCEINLINE PVOID
+__HypercallAllocate(
+    IN  ULONG   Length
+    )
+{
+    return __AllocatePoolWithTag(NonPagedPool, Length, HYPERCALL_TAG);
+}
+
+static FORCEINLINE VOID
+__HypercallFree(
+    IN  PVOID   Buffer
+    )
+{
+    __FreePoolWithTag(Buffer, HYPERCALL_TAG);
+}
+
+static FORCEINLINE PHYPERCALL_STATISTICS
+__HypercallStatistics(
+    IN  ULONG               Ordinal
+    )
+{
+    PHYPERCALL_PROCESSOR    Processor;
+    ULONG                   Cpu;
+
+    if (Ordinal >= HYPERCALL_MAXIMUM_ORDINAL)
+        return NULL;
+
+    Processor = HypercallProcessor;
+    if (Processor == NULL)
+        return NULL;
+
+    Cpu = KeGetCurrentProcessorNumberEx(NULL);
+    if (Cpu >= HypercallProcessorCount)
+        return NULL;
+
+    return &Processor[Cpu].Statistics[Ordinal];
+}
+
 XEN_API
 VOID
 HypercallPopulate(
@@ -132,11 +195,41 @@ HypercallInitialize(
     HypercallMsr = EBX;
 
     HypercallPopulate();
+
+    // Statistics are best effort: hypercalls are simply not accounted
+    // if the per-CPU blocks cannot be allocated
+    HypercallProcessorCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    HypercallProcessorBuffer = __HypercallAllocate(sizeof (HYPERCALL_PROCESSOR) *
+                                                   HypercallProcessorCount +
+                                                   SYSTEM_CACHE_ALIGNMENT_SIZE);
+    if (HypercallProcessorBuffer == NULL) {
+        HypercallProcessorCount = 0;
+        return;
+    }
+
+    HypercallProcessor = (PVOID)P2ROUNDUP((ULONG_PTR)HypercallProcessorBuffer,
+                                          SYSTEM_CACHE_ALIGNMENT_SIZE);
 }
 
 extern uintptr_t __stdcall hypercall2(uint32_t ord, uintptr_t arg1, uintptr_t arg2);
 extern uintptr_t __stdcall hypercall3(uint32_t ord, uintptr_t arg1, uintptr_t arg2, uintptr_t arg3);
 
+static FORCEINLINE VOID
+__HypercallAccount(
+    IN  ULONG       Ordinal,
+    IN  ULONG64     Cycles
+    )
+{
+    PHYPERCALL_STATISTICS   Statistics;
+
+    Statistics = __HypercallStatistics(Ordinal);
+    if (Statistics == NULL)
+        return;
+
+    (VOID) InterlockedIncrement64(&Statistics->Count);
+    (VOID) InterlockedExchangeAdd64(&Statistics->Cycles, (LONG64)Cycles);
+}
+
 LONG_PTR
 __Hypercall(
     ULONG       Ordinal,
@@ -146,10 +239,13 @@ __Hypercall(
 {
     va_list     Arguments;
     ULONG_PTR   Value;
+    ULONG64     Start;
 
     if (!HypercallPageInitialized)
         return -ENOSYS;
 
+    Start = __rdtsc();
+
     va_start(Arguments, Count);
     switch (Count) {
     case 2: {
@@ -175,9 +271,138 @@ __Hypercall(
     }
     va_end(Arguments);
 
+    __HypercallAccount(Ordinal, __rdtsc() - Start);
+
     return Value;
 }
 
+XEN_API
+VOID
+HypercallBatchInitialize(
+    OUT PHYPERCALL_BATCH    Batch
+    )
+{
+    RtlZeroMemory(Batch, sizeof (HYPERCALL_BATCH));
+}
+
+__checkReturn
+XEN_API
+NTSTATUS
+HypercallBatchQueue(
+    IN  PHYPERCALL_BATCH    Batch,
+    IN  ULONG               Ordinal,
+    IN  ULONG               Count,
+    ...
+    )
+{
+    multicall_entry_t       *Entry;
+    va_list                 Arguments;
+    ULONG                   Index;
+
+    ASSERT(!Batch->Flushed);
+    ASSERT3U(Count, <=, ARRAYSIZE(Entry->args));
+
+    // The caller is expected to flush and re-initialize a full batch
+    if (Batch->Count == HYPERCALL_BATCH_MAXIMUM_ENTRIES)
+        return STATUS_BUFFER_OVERFLOW;
+
+    Entry = &Batch->Entry[Batch->Count];
+    RtlZeroMemory(Entry, sizeof (multicall_entry_t));
+
+    Entry->op = Ordinal;
+
+    va_start(Arguments, Count);
+    for (Index = 0; Index < Count; Index++)
+        Entry->args[Index] = va_arg(Arguments, ULONG_PTR);
+    va_end(Arguments);
+
+    Batch->Count++;
+
+    return STATUS_SUCCESS;
+}
+
+__checkReturn
+XEN_API
+NTSTATUS
+HypercallBatchFlush(
+    IN  PHYPERCALL_BATCH    Batch
+    )
+{
+    ULONG                   Index;
+    LONG_PTR                rc;
+    NTSTATUS                status;
+
+    ASSERT(!Batch->Flushed);
+    Batch->Flushed = TRUE;
+
+    if (Batch->Count == 0)
+        return STATUS_SUCCESS;
+
+    rc = HYPERCALL(LONG_PTR, multicall, 2, &Batch->Entry[0], (ULONG_PTR)Batch->Count);
+
+    if (rc < 0) {
+        ERRNO_TO_STATUS(-rc, status);
+        goto fail1;
+    }
+
+    for (Index = 0; Index < Batch->Count; Index++) {
+        ULONG                   Ordinal = (ULONG)Batch->Entry[Index].op;
+        PHYPERCALL_STATISTICS   Statistics;
+
+        Statistics = __HypercallStatistics(Ordinal);
+        if (Statistics != NULL)
+            (VOID) InterlockedIncrement64(&Statistics->Batched);
+    }
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+XEN_API
+LONG_PTR
+HypercallBatchResult(
+    IN  PHYPERCALL_BATCH    Batch,
+    IN  ULONG               Index
+    )
+{
+    ASSERT(Batch->Flushed);
+    ASSERT3U(Index, <, Batch->Count);
+
+    return (LONG_PTR)Batch->Entry[Index].result;
+}
+
+XEN_API
+VOID
+HypercallQueryStatistics(
+    IN  ULONG       Ordinal,
+    OUT PULONGLONG  Count,
+    OUT PULONGLONG  Batched,
+    OUT PULONGLONG  Cycles
+    )
+{
+    ULONG                   Cpu;
+
+    *Count = *Batched = *Cycles = 0;
+
+    if (Ordinal >= HYPERCALL_MAXIMUM_ORDINAL ||
+        HypercallProcessor == NULL)
+        return;
+
+    for (Cpu = 0; Cpu < HypercallProcessorCount; Cpu++) {
+        PHYPERCALL_STATISTICS   Statistics;
+
+        Statistics = &HypercallProcessor[Cpu].Statistics[Ordinal];
+
+        *Count += (ULONGLONG)Statistics->Count;
+        *Batched += (ULONGLONG)Statistics->Batched;
+        *Cycles += (ULONGLONG)Statistics->Cycles;
+    }
+}
+
 VOID
 HypercallTeardown(
     VOID
@@ -185,6 +410,14 @@ HypercallTeardown(
 {
     ULONG   Index;
 
+    if (HypercallProcessorBuffer != NULL) {
+        HypercallProcessor = NULL;
+        HypercallProcessorCount = 0;
+
+        __HypercallFree(HypercallProcessorBuffer);
+        HypercallProcessorBuffer = NULL;
+    }
+
     Hypercall = NULL;
 
     for (Index = 0; Index < MAXIMUM_HYPERCALL_PAGE_COUNT; Index++)
@@ -40,9 +40,12 @@
 #include "log.h"
 #include "assert.h"
 #include "high.h"
+#include "util.h"
 
 #define LOG_BUFFER_SIZE 256
 
+#define LOG_TAG 'GOL'
+
 typedef struct _LOG_SLOT {
     LOG_LEVEL   Level;
     CHAR        Buffer[LOG_BUFFER_SIZE];
@@ -58,14 +61,54 @@ struct _LOG_DISPOSITION {
 #define LOG_NR_SLOTS 32
 #define LOG_NR_DISPOSITIONS 8
 
+// The layout of the trace buffer and record structures is decoded
+// offline by decode_log_trace.py so any change here must be
+// reflected there.
+
+#define LOG_TRACE_MAXIMUM_ARGUMENTS 8
+
+typedef struct _LOG_TRACE_RECORD {
+    ULONGLONG   Format;
+    ULONGLONG   Timestamp;
+    ULONG       Level;
+    ULONG       Sequence;
+    USHORT      Cpu;
+    USHORT      Count;
+    ULONG       Reserved;
+    ULONGLONG   Argument[LOG_TRACE_MAXIMUM_ARGUMENTS];
+} LOG_TRACE_RECORD, *PLOG_TRACE_RECORD;
+
+C_ASSERT(sizeof (LOG_TRACE_RECORD) == 96);
+
+#define LOG_TRACE_BUFFER_MAGIC  'CRTL'
+
+#define LOG_TRACE_NR_RECORDS    128
+
+typedef struct _LOG_TRACE_BUFFER {
+    ULONG               Magic;
+    ULONG               Cpu;
+    ULONG               RecordCount;
+    ULONG               Dropped;
+    volatile ULONG      Producer;
+    volatile ULONG      Consumer;
+    ULONGLONG           Reserved;
+    LOG_TRACE_RECORD    Record[LOG_TRACE_NR_RECORDS];
+} LOG_TRACE_BUFFER, *PLOG_TRACE_BUFFER;
+
+C_ASSERT(FIELD_OFFSET(LOG_TRACE_BUFFER, Record) == 32);
+C_ASSERT((LOG_TRACE_NR_RECORDS & (LOG_TRACE_NR_RECORDS - 1)) == 0);
+
 typedef struct _LOG_CONTEXT {
-    LONG            References;
-    BOOLEAN         Enabled;
-    LOG_SLOT        Slot[LOG_NR_SLOTS];
-    ULONG           Pending;
-    LOG_DISPOSITION Disposition[LOG_NR_DISPOSITIONS];
-    HIGH_LOCK       Lock;
-    KDPC            Dpc;
+    LONG                References;
+    BOOLEAN             Enabled;
+    LOG_SLOT            Slot[LOG_NR_SLOTS];
+    ULONG               Pending;
+    LOG_DISPOSITION     Disposition[LOG_NR_DISPOSITIONS];
+    LOG_LEVEL           Mask;
+    HIGH_LOCK           Lock;
+    KDPC                Dpc;
+    PLOG_TRACE_BUFFER   *TraceBuffer;
+    ULONG               TraceBufferCount;
 } LOG_CONTEXT, *PLOG_CONTEXT;
 
 static LOG_CONTEXT  LogContext;
@@ -128,26 +171,47 @@ LogFormatNumber(
     IN  BOOLEAN     UpperCase
     )
 {
-    ULONGLONG       Next = Value / Base;
+    CHAR            Digit[22]; // Enough for 8 bytes in octal
+    ULONG           Length;
+
+    Length = 0;
+    do {
+        ULONGLONG   Next = Value / Base;
+        UCHAR       Remainder = (UCHAR)(Value - (Next * Base));
 
-    if (Next != 0)
-        Buffer = LogFormatNumber(Buffer, Next, Base, UpperCase);
+        if (Remainder < 10)
+            Digit[Length++] = '0' + Remainder;
+        else
+            Digit[Length++] = ((UpperCase) ? 'A' : 'a') + (Remainder - 10);
 
-    Value %= Base;
+        Value = Next;
+    } while (Value != 0);
 
-    if (Value < 10)
-        *Buffer++ = '0' + (CHAR)Value;
-    else
-        *Buffer++ = ((UpperCase) ? 'A' : 'a') + (CHAR)(Value - 10);
+    while (Length != 0)
+        *Buffer++ = Digit[--Length];
 
     *Buffer = '\0';
 
     return Buffer;
 }
 
+// Arguments are either taken from a va_list (when formatting at the
+// call site) or from the array captured in a LOG_TRACE_RECORD (when
+// formatting is deferred to drain time).
+
+typedef struct _LOG_ARGUMENTS {
+    va_list         List;
+    const ULONGLONG *Array;
+} LOG_ARGUMENTS, *PLOG_ARGUMENTS;
+
+#define LOG_ARGUMENT(_Arguments, _Type)                 \
+        (((_Arguments)->Array != NULL) ?                \
+         (_Type)*(_Arguments)->Array++ :                \
+         va_arg((_Arguments)->List, _Type))
+
 #define LOG_FORMAT_NUMBER(_Arguments, _Type, _Character, _Buffer)                               \
         do {                                                                                    \
-            U ## _Type  _Value = va_arg((_Arguments), U ## _Type);                              \
+            U ## _Type  _Value = LOG_ARGUMENT((_Arguments), U ## _Type);                        \
             BOOLEAN     _UpperCase = FALSE;                                                     \
             UCHAR       _Base = 0;                                                              \
             ULONG       _Index = 0;                                                             \
@@ -182,10 +246,10 @@ LogFormatNumber(
 
 static VOID
 LogWriteSlot(
-    IN  PLOG_SLOT   Slot,
-    IN  LONG        Count,
-    IN  const CHAR  *Format,
-    IN  va_list     Arguments
+    IN      PLOG_SLOT       Slot,
+    IN      LONG            Count,
+    IN      const CHAR      *Format,
+    IN OUT  PLOG_ARGUMENTS  Arguments
     )
 {
     CHAR            Character;
@@ -245,13 +309,13 @@ LogWriteSlot(
         case 'c': {
             if (Wide) {
                 WCHAR   Value;
-                Value = va_arg(Arguments, WCHAR);
+                Value = LOG_ARGUMENT(Arguments, WCHAR);
 
                 __LogPut(Slot, (CHAR)Value);
             } else { 
                 CHAR    Value;
 
-                Value = va_arg(Arguments, CHAR);
+                Value = LOG_ARGUMENT(Arguments, CHAR);
 
                 __LogPut(Slot, Value);
             }
@@ -297,10 +361,13 @@ LogWriteSlot(
         }
         case 's': {
             if (Wide) {
-                PWCHAR  Value = va_arg(Arguments, PWCHAR);
+                PWCHAR  Value;
                 ULONG   Length;
                 ULONG   Index;
 
+                ASSERT3P(Arguments->Array, ==, NULL);
+                Value = va_arg(Arguments->List, PWCHAR);
+
                 if (Value == NULL)
                     Value = L"(null)";
 
@@ -323,10 +390,13 @@ LogWriteSlot(
                     }
                 }
             } else {
-                PCHAR   Value = va_arg(Arguments, PCHAR);
+                PCHAR   Value;
                 ULONG   Length;
                 ULONG   Index;
 
+                ASSERT3P(Arguments->Array, ==, NULL);
+                Value = va_arg(Arguments->List, PCHAR);
+
                 if (Value == NULL)
                     Value = "(null)";
 
@@ -354,11 +424,14 @@ LogWriteSlot(
         }
         case 'Z': {
             if (Wide) {
-                PUNICODE_STRING Value = va_arg(Arguments, PUNICODE_STRING);
+                PUNICODE_STRING Value;
                 PWCHAR          Buffer;
                 ULONG           Length;
                 ULONG           Index;
 
+                ASSERT3P(Arguments->Array, ==, NULL);
+                Value = va_arg(Arguments->List, PUNICODE_STRING);
+
                 if (Value == NULL) {
                     Buffer = L"(null)";
                     Length = sizeof ("(null)") - 1;
@@ -384,11 +457,14 @@ LogWriteSlot(
                     }
                 }
             } else {
-                PANSI_STRING Value = va_arg(Arguments, PANSI_STRING);
+                PANSI_STRING Value;
                 PCHAR        Buffer;
                 ULONG        Length;
                 ULONG        Index;
 
+                ASSERT3P(Arguments->Array, ==, NULL);
+                Value = va_arg(Arguments->List, PANSI_STRING);
+
                 if (Value == NULL) {
                     Buffer = "(null)";
                     Length = sizeof ("(null)") - 1;
@@ -439,8 +515,17 @@ LogCchVPrintf(
 {
     PLOG_CONTEXT    Context = &LogContext;
     PLOG_SLOT       Slot;
+    LOG_ARGUMENTS   SlotArguments;
     KIRQL           Irql;
 
+    // There is no point in formatting a message that no disposition
+    // is going to consume.
+    if ((Level & Context->Mask) == 0)
+        return;
+
+    SlotArguments.List = Arguments;
+    SlotArguments.Array = NULL;
+
     AcquireHighLock(&Context->Lock, &Irql);
 
     if (Context->Pending == ARRAYSIZE(Context->Slot))
@@ -452,7 +537,7 @@ LogCchVPrintf(
     LogWriteSlot(Slot,
                  __min(Count, LOG_BUFFER_SIZE),
                  Format,
-                 Arguments);
+                 &SlotArguments);
 
     LogFlush(Context);
 
@@ -501,6 +586,280 @@ LogPrintf(
     va_end(Arguments);
 }
 
+// Walk the format specifiers in the same way as LogWriteSlot() but,
+// rather than formatting, simply copy the raw argument values. Strings
+// cannot be captured since there is no guarantee that they will still
+// be valid at drain time.
+static BOOLEAN
+LogTraceCapture(
+    IN  PLOG_TRACE_RECORD   Record,
+    IN  const CHAR          *Format,
+    IN  va_list             Arguments
+    )
+{
+    CHAR                    Character;
+    ULONG                   Count;
+
+    Count = 0;
+    while ((Character = *Format++) != '\0') {
+        UCHAR   Long = 0;
+        BOOLEAN Wide = FALSE;
+
+        if (Character != '%')
+            continue;
+
+        Character = *Format++;
+        if (Character == '-')
+            Character = *Format++;
+
+        while (isdigit((unsigned char)Character))
+            Character = *Format++;
+
+        while (Character == 'l') {
+            Long++;
+            Character = *Format++;
+        }
+
+        while (Character == 'w') {
+            Wide = TRUE;
+            Character = *Format++;
+        }
+
+        switch (Character) {
+        case 'c':
+        case 'p':
+        case 'd':
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+            if (Count == LOG_TRACE_MAXIMUM_ARGUMENTS)
+                return FALSE;
+
+            // Character arguments are promoted to int
+            if (Character == 'c')
+                Record->Argument[Count++] = (Wide) ?
+                                            (WCHAR)va_arg(Arguments, int) :
+                                            (UCHAR)va_arg(Arguments, int);
+            else if (Character == 'p')
+                Record->Argument[Count++] = va_arg(Arguments, ULONG_PTR);
+            else if (Long == 2)
+                Record->Argument[Count++] = va_arg(Arguments, ULONGLONG);
+            else
+                Record->Argument[Count++] = va_arg(Arguments, ULONG);
+
+            break;
+
+        case 's':
+        case 'Z':
+        case '\0':
+            return FALSE;
+
+        default:
+            break;
+        }
+    }
+
+    Record->Count = (USHORT)Count;
+    return TRUE;
+}
+
+VOID
+LogDeferredVPrintf(
+    IN  LOG_LEVEL       Level,
+    IN  const CHAR      *Format,
+    IN  va_list         Arguments
+    )
+{
+    PLOG_CONTEXT        Context = &LogContext;
+    PLOG_TRACE_BUFFER   Buffer;
+    PLOG_TRACE_RECORD   Record;
+    va_list             Capture;
+    BOOLEAN             Captured;
+    ULONG               Cpu;
+    ULONG               Producer;
+    KIRQL               Irql;
+
+    if ((Level & Context->Mask) == 0)
+        return;
+
+    KeRaiseIrql(HIGH_LEVEL, &Irql);
+
+    Cpu = KeGetCurrentProcessorNumberEx(NULL);
+
+    Buffer = (Cpu < Context->TraceBufferCount) ?
+             Context->TraceBuffer[Cpu] :
+             NULL;
+    if (Buffer == NULL)
+        goto format;
+
+    Producer = Buffer->Producer;
+    if (Producer - Buffer->Consumer == Buffer->RecordCount) {
+        (VOID) InterlockedIncrement((PLONG)&Buffer->Dropped);
+        goto done;
+    }
+
+    Record = &Buffer->Record[Producer & (Buffer->RecordCount - 1)];
+
+    // Capture from a copy so that Arguments can still be used to format
+    // the message if it cannot be captured
+    va_copy(Capture, Arguments);
+    Captured = LogTraceCapture(Record, Format, Capture);
+    va_end(Capture);
+
+    if (!Captured)
+        goto format;
+
+    Record->Format = (ULONG_PTR)Format;
+    Record->Timestamp = __rdtsc();
+    Record->Level = Level;
+    Record->Sequence = Producer;
+    Record->Cpu = (USHORT)Cpu;
+
+    KeMemoryBarrier();
+
+    Buffer->Producer = Producer + 1;
+
+    KeMemoryBarrier();
+
+    // Kick the DPC when the buffer goes non-empty, so that a lone record
+    // is not left sitting in the buffer, and again once it is half full
+    // so that we don't start dropping records. LogTraceDrainBuffer()
+    // re-checks the producer after publishing the consumer so a record
+    // added while a drain is in progress is not missed.
+    if (Producer == Buffer->Consumer ||
+        Producer + 1 - Buffer->Consumer >= Buffer->RecordCount / 2)
+        KeInsertQueueDpc(&Context->Dpc, NULL, NULL);
+
+done:
+    KeLowerIrql(Irql);
+    return;
+
+format:
+    KeLowerIrql(Irql);
+
+    LogCchVPrintf(Level, LOG_BUFFER_SIZE, Format, Arguments);
+}
+
+VOID
+LogDeferredPrintf(
+    IN  LOG_LEVEL   Level,
+    IN  const CHAR  *Format,
+    ...
+    )
+{
+    va_list         Arguments;
+
+    va_start(Arguments, Format);
+    LogDeferredVPrintf(Level, Format, Arguments);
+    va_end(Arguments);
+}
+
+static BOOLEAN
+LogTraceDrainBuffer(
+    IN  PLOG_CONTEXT        Context,
+    IN  PLOG_TRACE_BUFFER   Buffer
+    )
+{
+    ULONG                   Producer;
+    ULONG                   Consumer;
+    ULONG                   Dropped;
+
+    Producer = Buffer->Producer;
+    KeMemoryBarrier();
+
+    for (Consumer = Buffer->Consumer;
+         Consumer != Producer;
+         Consumer++) {
+        PLOG_TRACE_RECORD   Record;
+        PLOG_SLOT           Slot;
+        LOG_ARGUMENTS       SlotArguments;
+        ULONGLONG           Prefix[2];
+
+        Record = &Buffer->Record[Consumer & (Buffer->RecordCount - 1)];
+
+        if (Context->Pending == ARRAYSIZE(Context->Slot))
+            LogFlush(Context);
+
+        Slot = &Context->Slot[Context->Pending++];
+        Slot->Level = Record->Level;
+
+        Prefix[0] = Record->Cpu;
+        Prefix[1] = Record->Timestamp;
+
+        RtlZeroMemory(&SlotArguments, sizeof (LOG_ARGUMENTS));
+        SlotArguments.Array = Prefix;
+
+        LogWriteSlot(Slot,
+                     LOG_BUFFER_SIZE,
+                     "[%u:%016llx] ",
+                     &SlotArguments);
+
+        SlotArguments.Array = Record->Argument;
+
+        LogWriteSlot(Slot,
+                     LOG_BUFFER_SIZE - Slot->Offset,
+                     (const CHAR *)(ULONG_PTR)Record->Format,
+                     &SlotArguments);
+    }
+
+    KeMemoryBarrier();
+    Buffer->Consumer = Consumer;
+
+    KeMemoryBarrier();
+    Producer = Buffer->Producer;
+
+    Dropped = InterlockedExchange((PLONG)&Buffer->Dropped, 0);
+    if (Dropped != 0) {
+        PLOG_SLOT           Slot;
+        LOG_ARGUMENTS       SlotArguments;
+        ULONGLONG           Argument[2];
+
+        if (Context->Pending == ARRAYSIZE(Context->Slot))
+            LogFlush(Context);
+
+        Slot = &Context->Slot[Context->Pending++];
+        Slot->Level = LOG_LEVEL_WARNING;
+
+        Argument[0] = Buffer->Cpu;
+        Argument[1] = Dropped;
+
+        RtlZeroMemory(&SlotArguments, sizeof (LOG_ARGUMENTS));
+        SlotArguments.Array = Argument;
+
+        LogWriteSlot(Slot,
+                     LOG_BUFFER_SIZE,
+                     "XEN|LOG: CPU %u: DROPPED %u TRACE RECORDS\n",
+                     &SlotArguments);
+    }
+
+    // Tell the caller if records arrived while we were draining
+    return (Producer != Consumer) ? TRUE : FALSE;
+}
+
+static BOOLEAN
+LogTraceDrain(
+    IN  PLOG_CONTEXT    Context
+    )
+{
+    ULONG               Index;
+    BOOLEAN             More;
+
+    More = FALSE;
+
+    for (Index = 0; Index < Context->TraceBufferCount; Index++) {
+        PLOG_TRACE_BUFFER   Buffer = Context->TraceBuffer[Index];
+
+        if (Buffer == NULL)
+            continue;
+
+        if (LogTraceDrainBuffer(Context, Buffer))
+            More = TRUE;
+    }
+
+    return More;
+}
+
 typedef VOID
 (*DBG_PRINT_CALLBACK)(
     PANSI_STRING    Ansi,
@@ -523,16 +882,20 @@ LogDpc(
     )
 {
     PLOG_CONTEXT    Context = &LogContext;
+    BOOLEAN         More;
     KIRQL           Irql;
 
     UNREFERENCED_PARAMETER(_Context);
-    UNREFERENCED_PARAMETER(Dpc);
     UNREFERENCED_PARAMETER(Argument1);
     UNREFERENCED_PARAMETER(Argument2);
 
     AcquireHighLock(&Context->Lock, &Irql);
+    More = LogTraceDrain(Context);
     LogFlush(Context);
     ReleaseHighLock(&Context->Lock, Irql);
+
+    if (More)
+        KeInsertQueueDpc(Dpc, NULL, NULL);
 }
 
 static VOID
@@ -579,6 +942,29 @@ LogDebugPrint(
     KeInsertQueueDpc(&Context->Dpc, NULL, NULL);
 }
 
+static VOID
+LogTraceBufferDestroy(
+    IN  PLOG_CONTEXT    Context
+    )
+{
+    ULONG               Count;
+    ULONG               Index;
+
+    if (Context->TraceBuffer == NULL)
+        return;
+
+    Count = Context->TraceBufferCount;
+
+    Context->TraceBufferCount = 0;
+    KeMemoryBarrier();
+
+    for (Index = 0; Index < Count; Index++)
+        __FreePoolWithTag(Context->TraceBuffer[Index], LOG_TAG);
+
+    __FreePoolWithTag(Context->TraceBuffer, LOG_TAG);
+    Context->TraceBuffer = NULL;
+}
+
 VOID
 LogTeardown(
     VOID
@@ -591,6 +977,23 @@ LogTeardown(
         Context->Enabled = FALSE;
     }
 
+    // Format anything still in the trace buffers while the format
+    // strings are still mapped
+    if (Context->TraceBuffer != NULL) {
+        KIRQL   Irql;
+
+        KeFlushQueuedDpcs();
+
+        AcquireHighLock(&Context->Lock, &Irql);
+        (VOID) LogTraceDrain(Context);
+        LogFlush(Context);
+        ReleaseHighLock(&Context->Lock, Irql);
+    }
+
+    LogTraceBufferDestroy(Context);
+
+    Context->Mask = LOG_LEVEL_NONE;
+
     RtlZeroMemory(&Context->Dpc, sizeof (KDPC));
     RtlZeroMemory(&Context->Lock, sizeof (HIGH_LOCK));
 
@@ -632,6 +1035,9 @@ LogAddDisposition(
         }
     }
 
+    if (NT_SUCCESS(status))
+        Context->Mask |= Mask;
+
     if (!NT_SUCCESS(status))
         goto fail1;
 
@@ -664,11 +1070,13 @@ LogRemoveDisposition(
 
     AcquireHighLock(&Context->Lock, &Irql);
 
+    Context->Mask = LOG_LEVEL_NONE;
+
     for (Index = 0; Index < LOG_NR_DISPOSITIONS; Index++) {
-        if (&Context->Disposition[Index] != Disposition)
-            continue;
+        if (&Context->Disposition[Index] == Disposition)
+            RtlZeroMemory(&Context->Disposition[Index], sizeof (LOG_DISPOSITION));
 
-        RtlZeroMemory(&Context->Disposition[Index], sizeof (LOG_DISPOSITION));
+        Context->Mask |= Context->Disposition[Index].Mask;
     }
 
     ReleaseHighLock(&Context->Lock, Irql);
@@ -704,6 +1112,97 @@ done:
     return Enable;
 }
 
+static FORCEINLINE BOOLEAN
+__LogTraceBufferEnable(
+    VOID
+    )
+{
+    CHAR            Key[] = "XEN:TRACE_BUFFER=";
+    PANSI_STRING    Option;
+    PCHAR           Value;
+    BOOLEAN         Enable;
+    NTSTATUS        status;
+
+    Enable = TRUE;
+
+    status = RegistryQuerySystemStartOption(Key, &Option);
+    if (!NT_SUCCESS(status))
+        goto done;
+
+    Value = Option->Buffer + sizeof (Key) - 1;
+
+    if (strcmp(Value, "OFF") == 0)
+        Enable = FALSE;
+    else if (strcmp(Value, "ON") != 0)
+        Warning("UNRECOGNIZED VALUE OF %s: %s\n", Key, Value);
+
+    RegistryFreeSzValue(Option);
+
+done:
+    return Enable;
+}
+
+static NTSTATUS
+LogTraceBufferCreate(
+    IN  PLOG_CONTEXT    Context
+    )
+{
+    ULONG               Count;
+    ULONG               Index;
+    NTSTATUS            status;
+
+    Count = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    Context->TraceBuffer = __AllocatePoolWithTag(NonPagedPool,
+                                                 sizeof (PLOG_TRACE_BUFFER) * Count,
+                                                 LOG_TAG);
+
+    status = STATUS_NO_MEMORY;
+    if (Context->TraceBuffer == NULL)
+        goto fail1;
+
+    for (Index = 0; Index < Count; Index++) {
+        PLOG_TRACE_BUFFER   Buffer;
+
+        Buffer = __AllocatePoolWithTag(NonPagedPool,
+                                       sizeof (LOG_TRACE_BUFFER),
+                                       LOG_TAG);
+
+        status = STATUS_NO_MEMORY;
+        if (Buffer == NULL)
+            goto fail2;
+
+        Buffer->Magic = LOG_TRACE_BUFFER_MAGIC;
+        Buffer->Cpu = Index;
+        Buffer->RecordCount = LOG_TRACE_NR_RECORDS;
+
+        Context->TraceBuffer[Index] = Buffer;
+    }
+
+    KeMemoryBarrier();
+
+    Context->TraceBufferCount = Count;
+
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+    while (Index != 0) {
+        --Index;
+
+        __FreePoolWithTag(Context->TraceBuffer[Index], LOG_TAG);
+    }
+
+    __FreePoolWithTag(Context->TraceBuffer, LOG_TAG);
+    Context->TraceBuffer = NULL;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
 XEN_API
 VOID
 LogResume(
@@ -805,6 +1304,11 @@ LogInitialize(
 
     KeInitializeDpc(&Context->Dpc, LogDpc, NULL);
 
+    // Failure to create the trace buffers is not fatal; deferred
+    // messages will simply be formatted at the call site.
+    if (__LogTraceBufferEnable())
+        (VOID) LogTraceBufferCreate(Context);
+
     if (__LogDbgPrintCallbackEnable()) {
         status = DbgSetDebugPrintCallback(LogDebugPrint, TRUE);
 
@@ -44,4 +44,27 @@ LogTeardown(
     VOID
     );
 
+// Deferred messages are captured in binary form into a per-CPU buffer
+// and only formatted when the buffer is drained. Only numeric and
+// character conversions are captured; a message with string arguments
+// is formatted immediately.
+// NOTE: Only the format string pointer is captured, so these are not
+//       exported; a format string in another image could be gone by the
+//       time the record is drained. Anything left in the buffers is
+//       drained by LogTeardown().
+
+extern VOID
+LogDeferredVPrintf(
+    IN  LOG_LEVEL   Level,
+    IN  const CHAR  *Format,
+    IN  va_list     Arguments
+    );
+
+extern VOID
+LogDeferredPrintf(
+    IN  LOG_LEVEL   Level,
+    IN  const CHAR  *Format,
+    ...
+    );
+
 #endif  // _XEN_LOG_H
@@ -80,6 +80,89 @@ fail1:
     return status;
 }
 
+__checkReturn
+XEN_API
+NTSTATUS
+MemoryAddToPhysmapRange(
+    IN  PFN_NUMBER              Pfn,
+    IN  ULONG                   Space,
+    IN  ULONG_PTR               Offset,
+    IN  ULONG                   Count
+    )
+{
+    struct xen_add_to_physmap   op[HYPERCALL_BATCH_MAXIMUM_ENTRIES];
+    HYPERCALL_BATCH             Batch;
+    ULONG                       Done;
+    NTSTATUS                    status;
+
+    Done = 0;
+    while (Done < Count) {
+        ULONG   Index;
+        ULONG   Batched;
+
+        HypercallBatchInitialize(&Batch);
+
+        Batched = __min(Count - Done, HYPERCALL_BATCH_MAXIMUM_ENTRIES);
+
+        for (Index = 0; Index < Batched; Index++) {
+            op[Index].domid = DOMID_SELF;
+            op[Index].space = Space;
+            op[Index].idx = Offset + Done + Index;
+            op[Index].gpfn = (xen_pfn_t)(Pfn + Done + Index);
+
+            status = HYPERCALL_BATCH_QUEUE(&Batch,
+                                           memory_op,
+                                           2,
+                                           (ULONG_PTR)XENMEM_add_to_physmap,
+                                           (ULONG_PTR)&op[Index]);
+            ASSERT(NT_SUCCESS(status));
+        }
+
+        status = HypercallBatchFlush(&Batch);
+        if (status == STATUS_NOT_IMPLEMENTED) {
+            Warning("multicall not implemented\n");
+            break;
+        }
+
+        if (!NT_SUCCESS(status))
+            goto fail1;
+
+        for (Index = 0; Index < Batched; Index++) {
+            LONG_PTR    rc = HypercallBatchResult(&Batch, Index);
+
+            if (rc < 0) {
+                ERRNO_TO_STATUS(-rc, status);
+                goto fail2;
+            }
+        }
+
+        Done += Batched;
+    }
+
+    // If the batch could not be issued then add the remaining frames
+    // one at a time
+    while (Done < Count) {
+        status = MemoryAddToPhysmap(Pfn + Done, Space, Offset + Done);
+        if (!NT_SUCCESS(status))
+            goto fail3;
+
+        Done++;
+    }
+
+    return STATUS_SUCCESS;
+
+fail3:
+    Error("fail3\n");
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
 __checkReturn
 XEN_API
 ULONG
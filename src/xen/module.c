@@ -35,7 +35,7 @@
 #include <ntstrsafe.h>
 #include <aux_klib.h>
 
-#include "high.h"
+#include "mutex.h"
 #include "module.h"
 #include "dbg_print.h"
 #include "assert.h"
@@ -50,11 +50,46 @@ typedef struct _MODULE {
     CHAR        Name[AUX_KLIB_MODULE_PATH_LEN];
 } MODULE, *PMODULE;
 
+// The list is only used to maintain the set of modules. Lookups are
+// done by binary search of an immutable sorted index, which is rebuilt
+// whenever the list changes and published by swapping a pointer.
+
+typedef struct _MODULE_INDEX_ENTRY {
+    ULONG_PTR   Start;
+    ULONG_PTR   End;
+    PCHAR       Name;
+} MODULE_INDEX_ENTRY, *PMODULE_INDEX_ENTRY;
+
+typedef struct _MODULE_INDEX {
+    ULONG               Count;
+    MODULE_INDEX_ENTRY  Entry[1];
+} MODULE_INDEX, *PMODULE_INDEX;
+
+// A reader increments the count for its CPU (at DISPATCH_LEVEL or above
+// so it cannot migrate) before picking up the index pointer, so once a
+// new index has been published a writer need only see each count drop
+// to zero once before the old index can be freed.
+//
+// The array is pool allocated so its base is not cache aligned, but
+// padding each count out to a full cache line is enough to keep any
+// two counts off the same line.
+
+#define MODULE_READER_STRIDE    SYSTEM_CACHE_ALIGNMENT_SIZE
+
+typedef struct _MODULE_READER {
+    volatile LONG   Count;
+    UCHAR           Pad[MODULE_READER_STRIDE - sizeof (LONG)];
+} MODULE_READER, *PMODULE_READER;
+
 typedef struct _MODULE_CONTEXT {
-    LONG        References;
-    LIST_ENTRY  List;
-    PLIST_ENTRY Cursor;
-    HIGH_LOCK   Lock;
+    LONG                    References;
+    LIST_ENTRY              List;
+    PLIST_ENTRY             Cursor;
+    ULONG                   Count;
+    MUTEX                   Mutex;
+    PMODULE_INDEX volatile  Index;
+    PMODULE_READER          Reader;
+    ULONG                   ReaderCount;
 } MODULE_CONTEXT, *PMODULE_CONTEXT;
 
 static MODULE_CONTEXT   ModuleContext;
@@ -111,6 +146,54 @@ ModuleSearchBackwards(
     }
 }
 
+static PMODULE_INDEX
+ModuleAllocateIndex(
+    IN  ULONG   Count
+    )
+{
+    return __ModuleAllocate(FIELD_OFFSET(MODULE_INDEX, Entry) +
+                            (__max(Count, 1) * sizeof (MODULE_INDEX_ENTRY)));
+}
+
+static VOID
+ModulePublishIndex(
+    IN  PMODULE_CONTEXT Context,
+    IN  PMODULE_INDEX   New
+    )
+{
+    PMODULE_INDEX       Old;
+    PLIST_ENTRY         ListEntry;
+    ULONG               Cpu;
+
+    New->Count = 0;
+
+    for (ListEntry = Context->List.Flink;
+         ListEntry != &Context->List;
+         ListEntry = ListEntry->Flink) {
+        PMODULE             Module;
+        PMODULE_INDEX_ENTRY Entry;
+
+        Module = CONTAINING_RECORD(ListEntry, MODULE, ListEntry);
+
+        Entry = &New->Entry[New->Count++];
+        Entry->Start = Module->Start;
+        Entry->End = Module->End;
+        Entry->Name = Module->Name;
+    }
+    ASSERT3U(New->Count, ==, Context->Count);
+
+    Old = InterlockedExchangePointer((PVOID *)&Context->Index, New);
+
+    // Wait for any reader that may have picked up the old index
+    for (Cpu = 0; Cpu < Context->ReaderCount; Cpu++) {
+        while (Context->Reader[Cpu].Count != 0)
+            _mm_pause();
+    }
+
+    if (Old != NULL)
+        __ModuleFree(Old);
+}
+
 static NTSTATUS
 ModuleAdd(
     IN  PMODULE_CONTEXT Context,
@@ -140,7 +223,7 @@ ModuleAdd(
     PMODULE             New;
     ULONG               Index;
     PMODULE             Module;
-    KIRQL               Irql;
+    PMODULE_INDEX       ModuleIndex;
     LIST_ENTRY          List;
     BOOLEAN             After;
     NTSTATUS            status;
@@ -163,7 +246,14 @@ ModuleAdd(
 
     InitializeListHead(&List);
 
-    AcquireHighLock(&Context->Lock, &Irql);
+    AcquireMutex(&Context->Mutex);
+
+    // Overlapping modules are only ever removed so this is large enough
+    ModuleIndex = ModuleAllocateIndex(Context->Count + 1);
+
+    status = STATUS_NO_MEMORY;
+    if (ModuleIndex == NULL)
+        goto fail2;
 
 again:
     After = TRUE;
@@ -190,6 +280,7 @@ again:
 
             RemoveEntryList(Context->Cursor);
             InsertTailList(&List, &Module->ListEntry);
+            --Context->Count;
 
             Context->Cursor = Cursor;
             goto again;
@@ -209,6 +300,7 @@ again:
 
             RemoveEntryList(Context->Cursor);
             InsertTailList(&List, &Module->ListEntry);
+            --Context->Count;
 
             Context->Cursor = Cursor;
             goto again;
@@ -222,6 +314,7 @@ again:
 
         RemoveEntryList(Context->Cursor);
         InsertTailList(&List, &Module->ListEntry);
+        --Context->Count;
 
         Context->Cursor = Cursor;
         goto again;
@@ -234,8 +327,12 @@ done:
         INSERT_BEFORE(Context->Cursor, &New->ListEntry);
 
     Context->Cursor = &New->ListEntry;
+    Context->Count++;
 
-    ReleaseHighLock(&Context->Lock, Irql);
+    // Once this returns no reader can be referencing a removed module
+    ModulePublishIndex(Context, ModuleIndex);
+
+    ReleaseMutex(&Context->Mutex);
 
     while (!IsListEmpty(&List)) {
         PLIST_ENTRY     ListEntry;
@@ -249,6 +346,13 @@ done:
 
     return STATUS_SUCCESS;
 
+fail2:
+    Error("fail2\n");
+
+    ReleaseMutex(&Context->Mutex);
+
+    __ModuleFree(New);
+
 fail1:
     Error("fail1 (%08x)\n", status);
 
@@ -330,30 +434,73 @@ ModuleLookup(
     )
 {
     PMODULE_CONTEXT Context = &ModuleContext;
-    PLIST_ENTRY     ListEntry;
+    PMODULE_INDEX   Index;
+    PMODULE_READER  Reader;
+    ULONG           Cpu;
     KIRQL           Irql;
+    LONG            Low;
+    LONG            High;
 
     *Name = NULL;
     *Offset = 0;
 
-    AcquireHighLock(&Context->Lock, &Irql);
+    // This may be called at any IRQL (including from a bugcheck
+    // callback) so only raise if necessary
+    KeRaiseIrql(__max(KeGetCurrentIrql(), DISPATCH_LEVEL), &Irql);
 
-    for (ListEntry = Context->List.Flink;
-         ListEntry != &Context->List;
-         ListEntry = ListEntry->Flink) {
-        PMODULE Module;
+    Cpu = KeGetCurrentProcessorNumberEx(NULL);
+    if (Cpu >= Context->ReaderCount)
+        goto done;
 
-        Module = CONTAINING_RECORD(ListEntry, MODULE, ListEntry);
+    Reader = &Context->Reader[Cpu];
+    (VOID) InterlockedIncrement(&Reader->Count);
 
-        if (Address >= Module->Start &&
-            Address <= Module->End) {
-            *Name = Module->Name;
-            *Offset = Address - Module->Start;
+    Index = Context->Index;
+    if (Index == NULL)
+        goto release;
+
+    Low = 0;
+    High = (LONG)Index->Count - 1;
+
+    while (Low <= High) {
+        LONG                Mid = Low + ((High - Low) / 2);
+        PMODULE_INDEX_ENTRY Entry = &Index->Entry[Mid];
+
+        if (Address < Entry->Start) {
+            High = Mid - 1;
+        } else if (Address > Entry->End) {
+            Low = Mid + 1;
+        } else {
+            *Name = Entry->Name;
+            *Offset = Address - Entry->Start;
             break;
         }
     }
 
-    ReleaseHighLock(&Context->Lock, Irql);
+release:
+    (VOID) InterlockedDecrement(&Reader->Count);
+
+done:
+    KeLowerIrql(Irql);
+}
+
+static VOID
+ModuleDestroyIndex(
+    IN  PMODULE_CONTEXT Context
+    )
+{
+    PMODULE_INDEX       Index;
+    ULONG               Cpu;
+
+    Index = InterlockedExchangePointer((PVOID *)&Context->Index, NULL);
+
+    for (Cpu = 0; Cpu < Context->ReaderCount; Cpu++) {
+        while (Context->Reader[Cpu].Count != 0)
+            _mm_pause();
+    }
+
+    if (Index != NULL)
+        __ModuleFree(Index);
 }
 
 VOID
@@ -365,7 +512,10 @@ ModuleTeardown(
 
     (VOID) PsRemoveLoadImageNotifyRoutine(ModuleLoad);
 
+    ModuleDestroyIndex(Context);
+
     Context->Cursor = NULL;
+    Context->Count = 0;
 
     while (!IsListEmpty(&Context->List)) {
         PLIST_ENTRY ListEntry;
@@ -380,7 +530,11 @@ ModuleTeardown(
 
     RtlZeroMemory(&Context->List, sizeof (LIST_ENTRY));
 
-    RtlZeroMemory(&Context->Lock, sizeof (HIGH_LOCK));
+    __ModuleFree(Context->Reader);
+    Context->Reader = NULL;
+    Context->ReaderCount = 0;
+
+    RtlZeroMemory(&Context->Mutex, sizeof (MUTEX));
 
     (VOID) InterlockedDecrement(&Context->References);
 
@@ -405,7 +559,15 @@ ModuleInitialize(
     if (References != 1)
         goto fail1;
 
-    InitializeHighLock(&Context->Lock);
+    InitializeMutex(&Context->Mutex);
+
+    Context->ReaderCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    Context->Reader = __ModuleAllocate(sizeof (MODULE_READER) *
+                                       Context->ReaderCount);
+
+    status = STATUS_NO_MEMORY;
+    if (Context->Reader == NULL)
+        goto fail2;
 
     (VOID) AuxKlibInitialize();
 
@@ -413,11 +575,11 @@ ModuleInitialize(
                                            sizeof (AUX_MODULE_EXTENDED_INFO),
                                            NULL);
     if (!NT_SUCCESS(status))
-        goto fail2;
+        goto fail3;
 
     status = STATUS_UNSUCCESSFUL;
     if (BufferSize == 0)
-        goto fail3;
+        goto fail4;
 
 again:
     Count = BufferSize / sizeof (AUX_MODULE_EXTENDED_INFO);
@@ -425,14 +587,14 @@ again:
 
     status = STATUS_NO_MEMORY;
     if (QueryInfo == NULL)
-        goto fail4;
+        goto fail5;
 
     status = AuxKlibQueryModuleInformation(&BufferSize,
                                            sizeof (AUX_MODULE_EXTENDED_INFO),
                                            QueryInfo);
     if (!NT_SUCCESS(status)) {
         if (status != STATUS_BUFFER_TOO_SMALL)
-            goto fail5;
+            goto fail6;
 
         __ModuleFree(QueryInfo);
         goto again;
@@ -452,22 +614,27 @@ again:
                            (ULONG_PTR)QueryInfo[Index].BasicInfo.ImageBase,
                            (ULONG_PTR)QueryInfo[Index].ImageSize);
         if (!NT_SUCCESS(status))
-            goto fail6;
+            goto fail7;
     }
 
     status = PsSetLoadImageNotifyRoutine(ModuleLoad);
     if (!NT_SUCCESS(status))
-        goto fail7;
+        goto fail8;
 
     __ModuleFree(QueryInfo);
 
     return STATUS_SUCCESS;
 
+fail8:
+    Error("fail8\n");
+
 fail7:
     Error("fail7\n");
 
-fail6:
-    Error("fail6\n");
+    ModuleDestroyIndex(Context);
+
+    Context->Cursor = NULL;
+    Context->Count = 0;
 
     while (!IsListEmpty(&Context->List)) {
         PLIST_ENTRY ListEntry;
@@ -482,20 +649,30 @@ fail6:
 
     RtlZeroMemory(&Context->List, sizeof (LIST_ENTRY));
 
-fail5:
-    Error("fail5\n");
+fail6:
+    Error("fail6\n");
 
     __ModuleFree(QueryInfo);
 
+fail5:
+    Error("fail5\n");
+
 fail4:
     Error("fail4\n");
 
 fail3:
     Error("fail3\n");
 
+    __ModuleFree(Context->Reader);
+    Context->Reader = NULL;
+
 fail2:
     Error("fail2\n");
 
+    Context->ReaderCount = 0;
+
+    RtlZeroMemory(&Context->Mutex, sizeof (MUTEX));
+
 fail1:
     Error("fail1 (%08x)\n", status);
 
@@ -80,3 +80,65 @@ fail1:
 
     return status;
 }
+
+__checkReturn
+XEN_API
+NTSTATUS
+VcpuSetSingleshotTimer(
+    IN  unsigned int                    vcpu_id,
+    IN  ULONGLONG                       Timeout
+    )
+{
+    struct vcpu_set_singleshot_timer    op;
+    LONG_PTR                            rc;
+    NTSTATUS                            status;
+
+    op.timeout_abs_ns = Timeout;
+    op.flags = 0;
+
+    rc = VcpuOp(VCPUOP_set_singleshot_timer, vcpu_id, &op);
+
+    if (rc < 0) {
+        ERRNO_TO_STATUS(-rc, status);
+        goto fail1;
+    }
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+__checkReturn
+XEN_API
+NTSTATUS
+VcpuRegisterVcpuInfo(
+    IN  unsigned int                vcpu_id,
+    IN  PFN_NUMBER                  Pfn,
+    IN  ULONG                       Offset
+    )
+{
+    struct vcpu_register_vcpu_info  op;
+    LONG_PTR                        rc;
+    NTSTATUS                        status;
+
+    op.mfn = Pfn;
+    op.offset = Offset;
+    op.rsvd = 0;
+
+    rc = VcpuOp(VCPUOP_register_vcpu_info, vcpu_id, &op);
+
+    if (rc < 0) {
+        ERRNO_TO_STATUS(-rc, status);
+        goto fail1;
+    }
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
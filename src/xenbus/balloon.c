@@ -36,6 +36,8 @@
 #include "mutex.h"
 #include "balloon.h"
 #include "range_set.h"
+#include "thread.h"
+#include "registry.h"
 #include "dbg_print.h"
 #include "assert.h"
 #include "util.h"
@@ -45,23 +47,99 @@
 
 #define XENBUS_BALLOON_PFN_ARRAY_SIZE  (MAX_PAGES_PER_MDL)
 
+#define XENBUS_BALLOON_PAGES_PER_EXTENT     (1u << PAGE_ORDER_2M)
+#define XENBUS_BALLOON_EXTENT_ARRAY_SIZE    (XENBUS_BALLOON_PFN_ARRAY_SIZE / XENBUS_BALLOON_PAGES_PER_EXTENT)
+
+typedef struct _XENBUS_BALLOON_ORDER_STATISTICS {
+    ULONGLONG   Decreased;
+    ULONGLONG   Populated;
+    ULONGLONG   Failed;
+} XENBUS_BALLOON_ORDER_STATISTICS, *PXENBUS_BALLOON_ORDER_STATISTICS;
+
 typedef struct _XENBUS_BALLOON_FIST {
     BOOLEAN Inflation;
     BOOLEAN Deflation;
 } XENBUS_BALLOON_FIST, *PXENBUS_BALLOON_FIST;
 
+#define XENBUS_BALLOON_MAXIMUM_WORKER_COUNT 8
+
+// Pages are verified in windows of this many pages so that we never
+// need a large system VA mapping
+#define XENBUS_BALLOON_CHECK_WINDOW_SIZE    64
+
+typedef struct _XENBUS_BALLOON_CHECK_WINDOW {
+    MDL         Mdl;
+    PFN_NUMBER  PfnArray[XENBUS_BALLOON_CHECK_WINDOW_SIZE];
+} XENBUS_BALLOON_CHECK_WINDOW, *PXENBUS_BALLOON_CHECK_WINDOW;
+
+typedef enum _XENBUS_BALLOON_CHECK_POLICY {
+    XENBUS_BALLOON_CHECK_OFF = 0,
+    XENBUS_BALLOON_CHECK_FULL,
+    XENBUS_BALLOON_CHECK_SAMPLE
+} XENBUS_BALLOON_CHECK_POLICY, *PXENBUS_BALLOON_CHECK_POLICY;
+
+typedef struct _XENBUS_BALLOON_WORKER {
+    PXENBUS_BALLOON_CONTEXT         Context;
+    ULONG                           Index;
+    USHORT                          Node;
+    PXENBUS_THREAD                  Thread;
+    KEVENT                          Done;
+    BOOLEAN                         Inflate;
+    BOOLEAN                         Background;
+    ULONGLONG                       Requested;
+    ULONGLONG                       Count;
+    NTSTATUS                        Status;
+    ULONGLONG                       Rate;
+    MDL                             Mdl;
+    PFN_NUMBER                      PfnArray[XENBUS_BALLOON_PFN_ARRAY_SIZE];
+    PFN_NUMBER                      ExtentArray[XENBUS_BALLOON_EXTENT_ARRAY_SIZE];
+    XENBUS_BALLOON_ORDER_STATISTICS Order4K;
+    XENBUS_BALLOON_ORDER_STATISTICS Order2M;
+    XENBUS_BALLOON_CHECK_WINDOW     Window;
+    ULONG                           Seed;
+    ULONGLONG                       Checked;
+} XENBUS_BALLOON_WORKER, *PXENBUS_BALLOON_WORKER;
+
+// Free page reporting: pages which Windows has free are periodically
+// handed back to Xen. They are tracked separately from the balloon
+// target and reclaimed again when memory pressure rises.
+typedef struct _XENBUS_BALLOON_REPORT {
+    BOOLEAN         Enabled;
+    ULONG           Period;
+    ULONGLONG       Chunk;
+    LARGE_INTEGER   Last;
+    ULONGLONG       Size;
+    ULONGLONG       Passes;
+    ULONGLONG       Reported;
+    ULONGLONG       Reclaimed;
+} XENBUS_BALLOON_REPORT, *PXENBUS_BALLOON_REPORT;
+
 struct _XENBUS_BALLOON_CONTEXT {
     PXENBUS_FDO                 Fdo;
     KSPIN_LOCK                  Lock;
     LONG                        References;
     PKEVENT                     LowMemoryEvent;
     HANDLE                      LowMemoryHandle;
+    PKEVENT                     HighMemoryEvent;
+    HANDLE                      HighMemoryHandle;
     ULONGLONG                   Size;
-    MDL                         Mdl;
-    PFN_NUMBER                  PfnArray[XENBUS_BALLOON_PFN_ARRAY_SIZE];
+    ULONGLONG                   Rate;
+    ULONGLONG                   Step;
+    ULONGLONG                   Origin;
+    ULONGLONG                   Target;
+    PXENBUS_BALLOON_WORKER      *Worker;
+    ULONG                       WorkerCount;
+    XENBUS_BALLOON_REPORT       Report;
+    XENBUS_BALLOON_CHECK_POLICY CheckPolicy;
+    ULONG                       CheckStride;
     XENBUS_RANGE_SET_INTERFACE  RangeSetInterface;
     PXENBUS_RANGE_SET           RangeSet;
     XENBUS_STORE_INTERFACE      StoreInterface;
+    XENBUS_DEBUG_INTERFACE      DebugInterface;
+    PXENBUS_DEBUG_CALLBACK      DebugCallback;
+    PXENBUS_DEBUG_STATISTIC     InflateStatistic;
+    PXENBUS_DEBUG_STATISTIC     DeflateStatistic;
+    PXENBUS_DEBUG_STATISTIC     CheckStatistic;
     XENBUS_BALLOON_FIST         FIST;
 };
 
@@ -171,7 +249,7 @@ BalloonCreateHeap(
 
 static VOID
 BalloonSort(
-    IN  PXENBUS_BALLOON_CONTEXT Context,
+    IN  PXENBUS_BALLOON_WORKER  Worker,
     IN  ULONG                   Count
     )
 {
@@ -179,7 +257,7 @@ BalloonSort(
     ULONG                       Unsorted;
     ULONG                       Index;
 
-    PfnArray = Context->PfnArray;
+    PfnArray = Worker->PfnArray;
 
     // Heap sort to keep stack usage down
     BalloonCreateHeap(PfnArray, Count);
@@ -193,28 +271,115 @@ BalloonSort(
         ASSERT3U(PfnArray[Index], <, PfnArray[Index + 1]);
 }
 
+// Return the number of consecutive PFNs in the array starting at Index
+static FORCEINLINE ULONG
+__BalloonRunLength(
+    IN  PXENBUS_BALLOON_WORKER  Worker,
+    IN  ULONG                   Index,
+    IN  ULONG                   Count
+    )
+{
+    PPFN_NUMBER                 PfnArray = Worker->PfnArray;
+    ULONG                       Length;
+
+    ASSERT3U(Index, <, Count);
+
+    Length = 1;
+    while (Index + Length < Count &&
+           PfnArray[Index + Length] == PfnArray[Index] + Length)
+        Length++;
+
+    return Length;
+}
+
+// Move any naturally aligned run of XENBUS_BALLOON_PAGES_PER_EXTENT
+// PFNs in the (sorted) PFN array to the front of the array, recording
+// the first PFN of each run in the extent array.
+static ULONG
+BalloonGatherExtents(
+    IN  PXENBUS_BALLOON_WORKER  Worker,
+    IN  ULONG                   Count
+    )
+{
+    PPFN_NUMBER                 PfnArray = Worker->PfnArray;
+    ULONG                       Front;
+    ULONG                       Index;
+    ULONG                       Extents;
+
+    Front = 0;
+    Index = 0;
+    Extents = 0;
+
+    while (Index + XENBUS_BALLOON_PAGES_PER_EXTENT <= Count) {
+        PFN_NUMBER  Pfn = PfnArray[Index];
+        ULONG       Offset;
+
+        // The array is sorted and free of duplicates so, if the last
+        // PFN is where it should be, the run is contiguous
+        if ((Pfn & (XENBUS_BALLOON_PAGES_PER_EXTENT - 1)) != 0 ||
+            PfnArray[Index + XENBUS_BALLOON_PAGES_PER_EXTENT - 1] !=
+            Pfn + XENBUS_BALLOON_PAGES_PER_EXTENT - 1) {
+            Index++;
+            continue;
+        }
+
+        RtlMoveMemory(&PfnArray[Front + XENBUS_BALLOON_PAGES_PER_EXTENT],
+                      &PfnArray[Front],
+                      (Index - Front) * sizeof (PFN_NUMBER));
+
+        for (Offset = 0; Offset < XENBUS_BALLOON_PAGES_PER_EXTENT; Offset++)
+            PfnArray[Front + Offset] = Pfn + Offset;
+
+        ASSERT3U(Extents, <, XENBUS_BALLOON_EXTENT_ARRAY_SIZE);
+        Worker->ExtentArray[Extents++] = Pfn;
+
+        Front += XENBUS_BALLOON_PAGES_PER_EXTENT;
+        Index += XENBUS_BALLOON_PAGES_PER_EXTENT;
+    }
+
+    return Extents;
+}
+
 static PMDL
 BalloonAllocatePagesForMdl(
-    IN  ULONG       Count
+    IN  USHORT      Node,
+    IN  ULONG       Count,
+    IN  BOOLEAN     Contiguous
     )
 {
     LARGE_INTEGER   LowAddress;
     LARGE_INTEGER   HighAddress;
     LARGE_INTEGER   SkipBytes;
     SIZE_T          TotalBytes;
+    ULONG           Flags;
     PMDL            Mdl;
 
     LowAddress.QuadPart = 0ull;
     HighAddress.QuadPart = ~0ull;
-    SkipBytes.QuadPart = 0ull;
     TotalBytes = (SIZE_T)Count << PAGE_SHIFT;
-    
-    Mdl = MmAllocatePagesForMdlEx(LowAddress,
-                                  HighAddress,
-                                  SkipBytes,
-                                  TotalBytes,
-                                  MmCached,
-                                  MM_DONT_ZERO_ALLOCATION);
+    Flags = MM_DONT_ZERO_ALLOCATION;
+
+    if (Contiguous) {
+        // Ask for physically contiguous chunks of a superpage each. The
+        // chunks are checked for alignment before they are released as
+        // superpages so it does not matter if we get something else.
+        ASSERT3U(Count & (XENBUS_BALLOON_PAGES_PER_EXTENT - 1), ==, 0);
+
+        SkipBytes.QuadPart = (LONGLONG)XENBUS_BALLOON_PAGES_PER_EXTENT << PAGE_SHIFT;
+        Flags |= MM_ALLOCATE_REQUIRE_CONTIGUOUS_CHUNKS;
+    } else {
+        SkipBytes.QuadPart = 0ull;
+    }
+
+    // The node is only a preference; Windows falls back to other nodes
+    // if the local one cannot satisfy the allocation.
+    Mdl = MmAllocateNodePagesForMdlEx(LowAddress,
+                                      HighAddress,
+                                      SkipBytes,
+                                      TotalBytes,
+                                      MmCached,
+                                      Node,
+                                      Flags);
     if (Mdl == NULL)
         goto done;
 
@@ -229,24 +394,39 @@ done:
     return Mdl;
 }
 
-static VOID
-BalloonFreePagesFromMdl(
-    IN  PMDL        Mdl,
-    IN  BOOLEAN     Check
+// Sanity check:
+//
+// Make sure that things written to the pages in the window really do
+// stick. If a page is still ballooned out at the hypervisor level
+// then writes will be discarded and reads will give back all 1s.
+static ULONG
+BalloonCheckWindow(
+    IN  PXENBUS_BALLOON_WORKER  Worker,
+    IN  ULONG                   Count
     )
 {
-    volatile UCHAR  *Mapping;
-    ULONG           Index;
+    PMDL                        Mdl;
+    volatile UCHAR              *Mapping;
+    ULONG                       Index;
 
-    if (!Check)
-        goto done;
+    ASSERT(Count != 0);
+    ASSERT3U(Count, <=, XENBUS_BALLOON_CHECK_WINDOW_SIZE);
+
+    Mdl = &Worker->Window.Mdl;
+
+#pragma warning(push)
+#pragma warning(disable:28145)  // The opaque MDL structure should not be modified by a driver
+
+    Mdl->Next = NULL;
+    Mdl->Size = (SHORT)(sizeof(MDL) + (sizeof(PFN_NUMBER) * Count));
+    Mdl->MdlFlags = MDL_PAGES_LOCKED;
+    Mdl->Process = NULL;
+    Mdl->MappedSystemVa = NULL;
+    Mdl->StartVa = NULL;
+    Mdl->ByteCount = Count << PAGE_SHIFT;
+    Mdl->ByteOffset = 0;
 
-    // Sanity check:
-    //
-    // Make sure that things written to the page really do stick. 
-    // If the page is still ballooned out at the hypervisor level
-    // then writes will be discarded and reads will give back
-    // all 1s.
+#pragma warning(pop)
 
     Mapping = MmMapLockedPagesSpecifyCache(Mdl,
                                            KernelMode,
@@ -254,39 +434,138 @@ BalloonFreePagesFromMdl(
                                            NULL,
                                            FALSE,
                                            LowPagePriority);
-    if (Mapping == NULL)
+    if (Mapping == NULL) {
         // Windows couldn't map the memory. That's kind of sad, but not
         // really an error: it might be that we're very low on kernel
         // virtual address space.
+        Count = 0;
         goto done;
+    }
 
     // Write and read the first byte in each page to make sure it's backed
     // by RAM.
-    ASSERT((Mdl->ByteCount & (PAGE_SIZE - 1)) == 0);
-
-    for (Index = 0; Index < (Mdl->ByteCount >> PAGE_SHIFT); Index++) {
+    for (Index = 0; Index < Count; Index++) {
         UCHAR   Byte;
 
-        ASSERT3U(Index << PAGE_SHIFT, <, Mdl->ByteCount);
-        Mapping[Index << PAGE_SHIFT] = (UCHAR)Index;
+        Mapping[Index << PAGE_SHIFT] = (UCHAR)Worker->Window.PfnArray[Index];
 
         KeMemoryBarrier();
         Byte = Mapping[Index << PAGE_SHIFT];
 
-        ASSERT3U(Byte, ==, (UCHAR)Index);
+        ASSERT3U(Byte, ==, (UCHAR)Worker->Window.PfnArray[Index]);
     }
 
     MmUnmapLockedPages((PVOID)Mapping, Mdl);
 
+done:
+    RtlZeroMemory(&Worker->Window, sizeof (XENBUS_BALLOON_CHECK_WINDOW));
+
+    return Count;
+}
+
+static VOID
+BalloonFreePagesFromMdl(
+    IN  PXENBUS_BALLOON_WORKER  Worker,
+    IN  PMDL                    Mdl,
+    IN  BOOLEAN                 Check
+    )
+{
+    PXENBUS_BALLOON_CONTEXT     Context = Worker->Context;
+    PPFN_NUMBER                 PfnArray;
+    LARGE_INTEGER               Start;
+    LARGE_INTEGER               End;
+    ULONG                       Pages;
+    ULONG                       Stride;
+    ULONG                       Index;
+    ULONG                       Count;
+    ULONG                       Checked;
+
+    if (!Check || Context->CheckPolicy == XENBUS_BALLOON_CHECK_OFF)
+        goto done;
+
+    ASSERT((Mdl->ByteCount & (PAGE_SIZE - 1)) == 0);
+
+    Start = KeQueryPerformanceCounter(NULL);
+
+    PfnArray = MmGetMdlPfnArray(Mdl);
+    Pages = Mdl->ByteCount >> PAGE_SHIFT;
+
+    // When sampling, one page chosen at random is checked in every
+    // group of CheckStride pages
+    Stride = (Context->CheckPolicy == XENBUS_BALLOON_CHECK_SAMPLE) ?
+             Context->CheckStride :
+             1;
+    ASSERT(Stride != 0);
+
+    Count = 0;
+    Checked = 0;
+
+    for (Index = 0; Index < Pages; Index += Stride) {
+        ULONG   Offset;
+
+        Offset = (Stride > 1) ?
+                 RtlRandomEx(&Worker->Seed) % __min(Stride, Pages - Index) :
+                 0;
+
+        Worker->Window.PfnArray[Count++] = PfnArray[Index + Offset];
+
+        if (Count == XENBUS_BALLOON_CHECK_WINDOW_SIZE) {
+            Checked += BalloonCheckWindow(Worker, Count);
+            Count = 0;
+        }
+    }
+
+    if (Count != 0)
+        Checked += BalloonCheckWindow(Worker, Count);
+
+    End = KeQueryPerformanceCounter(NULL);
+
+    Worker->Checked += Checked;
+
+    XENBUS_DEBUG(StatisticRecord,
+                 &Context->DebugInterface,
+                 Context->CheckStatistic,
+                 End.QuadPart - Start.QuadPart);
+
 done:
     MmFreePagesFromMdl(Mdl);
 }
 
+static ULONG
+BalloonCopyPagesFromMdl(
+    IN  PXENBUS_BALLOON_WORKER  Worker,
+    IN  ULONG                   Index,
+    IN  PMDL                    Mdl OPTIONAL
+    )
+{
+    PPFN_NUMBER                 PfnArray;
+    ULONG                       Count;
+
+    if (Mdl == NULL)
+        return 0;
+
+    ASSERT(Mdl->ByteOffset == 0);
+    ASSERT((Mdl->ByteCount & (PAGE_SIZE - 1)) == 0);
+    ASSERT(Mdl->MdlFlags & MDL_PAGES_LOCKED);
+
+    Count = Mdl->ByteCount >> PAGE_SHIFT;
+    ASSERT3U(Index + Count, <=, XENBUS_BALLOON_PFN_ARRAY_SIZE);
+
+    PfnArray = MmGetMdlPfnArray(Mdl);
+    RtlCopyMemory(&Worker->PfnArray[Index],
+                  PfnArray,
+                  Count * sizeof (PFN_NUMBER));
+
+    ExFreePool(Mdl);
+
+    return Count;
+}
+
 #define XENBUS_BALLOON_MIN_PAGES_PER_S 1000ull
 
 static ULONG
 BalloonAllocatePfnArray(
-    IN      PXENBUS_BALLOON_CONTEXT Context,
+    IN      PXENBUS_BALLOON_WORKER  Worker,
     IN      ULONG                   Requested,
     IN OUT  PBOOLEAN                Slow
     )
@@ -295,35 +574,36 @@ BalloonAllocatePfnArray(
     LARGE_INTEGER                   End;
     ULONGLONG                       TimeDelta;
     ULONGLONG                       Rate;
-    PMDL                            Mdl;
-    PPFN_NUMBER                     PfnArray;
+    ULONG                           Superpages;
     ULONG                           Count;
 
     ASSERT(Requested != 0);
     ASSERT3U(Requested, <=, XENBUS_BALLOON_PFN_ARRAY_SIZE);
-    ASSERT(IsZeroMemory(Context->PfnArray, Requested * sizeof (PFN_NUMBER)));
+    ASSERT(IsZeroMemory(Worker->PfnArray, Requested * sizeof (PFN_NUMBER)));
 
     KeQuerySystemTime(&Start);
     Count = 0;
 
-    Mdl = BalloonAllocatePagesForMdl(Requested);
-    if (Mdl == NULL)
-        goto done;
-
-    ASSERT(Mdl->ByteOffset == 0);
-    ASSERT((Mdl->ByteCount & (PAGE_SIZE - 1)) == 0);
-    ASSERT(Mdl->MdlFlags & MDL_PAGES_LOCKED);
-
-    Count = Mdl->ByteCount >> PAGE_SHIFT;
-
-    PfnArray = MmGetMdlPfnArray(Mdl);
-    RtlCopyMemory(Context->PfnArray, PfnArray, Count * sizeof (PFN_NUMBER));
-
-    BalloonSort(Context, Count);
+    // Try for as many whole superpages as possible first and then
+    // fall back to 4K pages for the remainder.
+    Superpages = Requested & ~(XENBUS_BALLOON_PAGES_PER_EXTENT - 1);
+    if (Superpages != 0)
+        Count += BalloonCopyPagesFromMdl(Worker,
+                                         Count,
+                                         BalloonAllocatePagesForMdl(Worker->Node,
+                                                                    Superpages,
+                                                                    TRUE));
+
+    if (Count < Requested)
+        Count += BalloonCopyPagesFromMdl(Worker,
+                                         Count,
+                                         BalloonAllocatePagesForMdl(Worker->Node,
+                                                                    Requested - Count,
+                                                                    FALSE));
+
+    if (Count != 0)
+        BalloonSort(Worker, Count);
 
-    ExFreePool(Mdl);
-
-done:
     KeQuerySystemTime(&End);
     TimeDelta = __max(((End.QuadPart - Start.QuadPart) / 10000ull), 1);
 
@@ -336,21 +616,51 @@ done:
 
 static ULONG
 BalloonPopulatePhysmap(
-    IN  ULONG       Requested,
-    IN  PPFN_NUMBER PfnArray
+    IN  PXENBUS_BALLOON_WORKER  Worker,
+    IN  ULONG                   Requested
     )
 {
-    LARGE_INTEGER   Start;
-    LARGE_INTEGER   End;
-    ULONGLONG       TimeDelta;
-    ULONGLONG       Rate;
-    ULONG           Count;
+    LARGE_INTEGER               Start;
+    LARGE_INTEGER               End;
+    ULONGLONG                   TimeDelta;
+    ULONGLONG                   Rate;
+    ULONG                       Extents;
+    ULONG                       Count;
 
     ASSERT(Requested != 0);
 
     KeQuerySystemTime(&Start);
 
-    Count = MemoryPopulatePhysmap(PAGE_ORDER_4K, Requested, PfnArray);
+    // Superpage extents are gathered at the front of the array so,
+    // whatever happens, the populated PFNs remain a prefix of it.
+    Extents = BalloonGatherExtents(Worker, Requested);
+    Count = 0;
+
+    if (Extents != 0) {
+        ULONG   Populated;
+
+        Populated = MemoryPopulatePhysmap(PAGE_ORDER_2M,
+                                          Extents,
+                                          Worker->ExtentArray);
+
+        Worker->Order2M.Populated += Populated;
+        Worker->Order2M.Failed += Extents - Populated;
+
+        Count = Populated * XENBUS_BALLOON_PAGES_PER_EXTENT;
+    }
+
+    if (Count < Requested) {
+        ULONG   Populated;
+
+        Populated = MemoryPopulatePhysmap(PAGE_ORDER_4K,
+                                          Requested - Count,
+                                          &Worker->PfnArray[Count]);
+
+        Worker->Order4K.Populated += Populated;
+        Worker->Order4K.Failed += Requested - Count - Populated;
+
+        Count += Populated;
+    }
 
     KeQuerySystemTime(&End);
     TimeDelta = __max(((End.QuadPart - Start.QuadPart) / 10000ull), 1);
@@ -363,53 +673,74 @@ BalloonPopulatePhysmap(
 
 static ULONG
 BalloonPopulatePfnArray(
-    IN      PXENBUS_BALLOON_CONTEXT Context,
+    IN      PXENBUS_BALLOON_WORKER  Worker,
     IN      ULONG                   Requested
     )
 {
+    PXENBUS_BALLOON_CONTEXT         Context = Worker->Context;
     LARGE_INTEGER                   Start;
     LARGE_INTEGER                   End;
     ULONGLONG                       TimeDelta;
     ULONGLONG                       Rate;
+    BOOLEAN                         Sorted;
     ULONG                           Index;
     ULONG                           Count;
 
     ASSERT(Requested != 0);
     ASSERT3U(Requested, <=, XENBUS_BALLOON_PFN_ARRAY_SIZE);
-    ASSERT(IsZeroMemory(Context->PfnArray, Requested * sizeof (PFN_NUMBER)));
+    ASSERT(IsZeroMemory(Worker->PfnArray, Requested * sizeof (PFN_NUMBER)));
 
     KeQuerySystemTime(&Start);
 
-    for (Index = 0; Index < Requested; Index++) {
+    // Items are taken in ascending order, but another worker may put
+    // back lower PFNs between our takes if it fails to populate them.
+    // BalloonGatherExtents() relies on the array being sorted.
+    Sorted = TRUE;
+    Index = 0;
+    while (Index < Requested) {
         LONGLONG    Pfn;
+        ULONGLONG   Taken;
         NTSTATUS    status;
 
-        status = XENBUS_RANGE_SET(Pop,
+        status = XENBUS_RANGE_SET(Take,
                                   &Context->RangeSetInterface,
                                   Context->RangeSet,
-                                  1,
-                                  &Pfn);
+                                  Requested - Index,
+                                  &Pfn,
+                                  &Taken);
         ASSERT(NT_SUCCESS(status));
+        if (!NT_SUCCESS(status))
+            break;
 
-        Context->PfnArray[Index] = (PFN_NUMBER)Pfn;
+        if (Index != 0 && (PFN_NUMBER)Pfn < Worker->PfnArray[Index - 1])
+            Sorted = FALSE;
+
+        while (Taken-- != 0)
+            Worker->PfnArray[Index++] = (PFN_NUMBER)Pfn++;
     }
+    Requested = Index;
 
-    Count = BalloonPopulatePhysmap(Requested, Context->PfnArray);
+    if (!Sorted)
+        BalloonSort(Worker, Requested);
+
+    Count = (Requested != 0) ? BalloonPopulatePhysmap(Worker, Requested) : 0;
 
     Index = Count;
     while (Index < Requested) {
+        ULONG       Length;
         NTSTATUS    status;
 
+        Length = __BalloonRunLength(Worker, Index, Requested);
+
         status = XENBUS_RANGE_SET(Put,
                                   &Context->RangeSetInterface,
                                   Context->RangeSet,
-                                  (LONGLONG)Context->PfnArray[Index],
-                                  1);
-
+                                  (LONGLONG)Worker->PfnArray[Index],
+                                  Length);
         ASSERT(NT_SUCCESS(status));
 
-        Context->PfnArray[Index] = 0;
-        Index++;
+        RtlZeroMemory(&Worker->PfnArray[Index], Length * sizeof (PFN_NUMBER));
+        Index += Length;
     }
 
     KeQuerySystemTime(&End);
@@ -417,27 +748,63 @@ BalloonPopulatePfnArray(
 
     Rate = (ULONGLONG)(Count * 1000) / TimeDelta;
 
+    if (Count != 0)
+        XENBUS_DEBUG(StatisticRecord,
+                     &Context->DebugInterface,
+                     Context->DeflateStatistic,
+                     Rate);
+
     Info("%u page(s) at %llu pages/s\n", Count, Rate);
     return Count;
 }
 
 static ULONG
 BalloonDecreaseReservation(
-    IN  ULONG       Requested,
-    IN  PPFN_NUMBER PfnArray
+    IN  PXENBUS_BALLOON_WORKER  Worker,
+    IN  ULONG                   Requested
     )
 {
-    LARGE_INTEGER   Start;
-    LARGE_INTEGER   End;
-    ULONGLONG       TimeDelta;
-    ULONGLONG       Rate;
-    ULONG           Count;
+    LARGE_INTEGER               Start;
+    LARGE_INTEGER               End;
+    ULONGLONG                   TimeDelta;
+    ULONGLONG                   Rate;
+    ULONG                       Extents;
+    ULONG                       Count;
 
     ASSERT(Requested != 0);
 
     KeQuerySystemTime(&Start);
 
-    Count = MemoryDecreaseReservation(PAGE_ORDER_4K, Requested, PfnArray);
+    // Superpage extents are gathered at the front of the array so,
+    // whatever happens, the released PFNs remain a prefix of it.
+    Extents = BalloonGatherExtents(Worker, Requested);
+    Count = 0;
+
+    if (Extents != 0) {
+        ULONG   Decreased;
+
+        Decreased = MemoryDecreaseReservation(PAGE_ORDER_2M,
+                                              Extents,
+                                              Worker->ExtentArray);
+
+        Worker->Order2M.Decreased += Decreased;
+        Worker->Order2M.Failed += Extents - Decreased;
+
+        Count = Decreased * XENBUS_BALLOON_PAGES_PER_EXTENT;
+    }
+
+    if (Count < Requested) {
+        ULONG   Decreased;
+
+        Decreased = MemoryDecreaseReservation(PAGE_ORDER_4K,
+                                              Requested - Count,
+                                              &Worker->PfnArray[Count]);
+
+        Worker->Order4K.Decreased += Decreased;
+        Worker->Order4K.Failed += Requested - Count - Decreased;
+
+        Count += Decreased;
+    }
 
     KeQuerySystemTime(&End);
     TimeDelta = __max(((End.QuadPart - Start.QuadPart) / 10000ull), 1);
@@ -450,10 +817,11 @@ BalloonDecreaseReservation(
 
 static ULONG
 BalloonReleasePfnArray(
-    IN      PXENBUS_BALLOON_CONTEXT Context,
+    IN      PXENBUS_BALLOON_WORKER  Worker,
     IN      ULONG                   Requested
     )
 {
+    PXENBUS_BALLOON_CONTEXT         Context = Worker->Context;
     LARGE_INTEGER                   Start;
     LARGE_INTEGER                   End;
     ULONGLONG                       TimeDelta;
@@ -471,50 +839,64 @@ BalloonReleasePfnArray(
 
     Index = 0;
     while (Index < Requested) {
+        ULONG       Length;
         NTSTATUS    status;
 
+        Length = __BalloonRunLength(Worker, Index, Requested);
+
         status = XENBUS_RANGE_SET(Put,
                                   &Context->RangeSetInterface,
                                   Context->RangeSet,
-                                  (LONGLONG)Context->PfnArray[Index],
-                                  1);
+                                  (LONGLONG)Worker->PfnArray[Index],
+                                  Length);
         if (!NT_SUCCESS(status))
             break;
 
-        Index++;
+        Index += Length;
     }
     Requested = Index;
 
-    Count = BalloonDecreaseReservation(Requested, Context->PfnArray);
+    Count = (Requested != 0) ? BalloonDecreaseReservation(Worker, Requested) : 0;
 
-    RtlZeroMemory(Context->PfnArray, Count * sizeof (PFN_NUMBER));
-
-    for (Index = Count; Index < Requested; Index++) {
+    for (Index = Count; Index < Requested; ) {
+        ULONG       Length;
         NTSTATUS    status;
 
+        Length = __BalloonRunLength(Worker, Index, Requested);
+
         status = XENBUS_RANGE_SET(Get,
                                   &Context->RangeSetInterface,
                                   Context->RangeSet,
-                                  (LONGLONG)Context->PfnArray[Index],
-                                  1);
+                                  (LONGLONG)Worker->PfnArray[Index],
+                                  Length);
         ASSERT(NT_SUCCESS(status));
+
+        Index += Length;
     }
 
+    RtlZeroMemory(Worker->PfnArray, Count * sizeof (PFN_NUMBER));
+
 done:
-    ASSERT(IsZeroMemory(Context->PfnArray, Count * sizeof (PFN_NUMBER)));
+    ASSERT(IsZeroMemory(Worker->PfnArray, Count * sizeof (PFN_NUMBER)));
 
     KeQuerySystemTime(&End);
     TimeDelta = __max(((End.QuadPart - Start.QuadPart) / 10000ull), 1);
 
     Rate = (ULONGLONG)(Count * 1000) / TimeDelta;
 
+    if (Count != 0)
+        XENBUS_DEBUG(StatisticRecord,
+                     &Context->DebugInterface,
+                     Context->InflateStatistic,
+                     Rate);
+
     Info("%u page(s) at %llu pages/s\n", Count, Rate);
     return Count;
 }
 
 static ULONG
 BalloonFreePfnArray(
-    IN      PXENBUS_BALLOON_CONTEXT Context,
+    IN      PXENBUS_BALLOON_WORKER  Worker,
     IN      ULONG                   Requested,
     IN      BOOLEAN                 Check
     )
@@ -535,12 +917,12 @@ BalloonFreePfnArray(
     if (Requested == 0)
         goto done;
 
-    ASSERT(IsZeroMemory(&Context->Mdl, sizeof (MDL)));
+    ASSERT(IsZeroMemory(&Worker->Mdl, sizeof (MDL)));
 
     for (Index = 0; Index < Requested; Index++)
-        ASSERT(Context->PfnArray[Index] != 0);
+        ASSERT(Worker->PfnArray[Index] != 0);
 
-    Mdl = &Context->Mdl;
+    Mdl = &Worker->Mdl;
 
 #pragma warning(push)
 #pragma warning(disable:28145)  // The opaque MDL structure should not be modified by a driver
@@ -556,15 +938,15 @@ BalloonFreePfnArray(
 
 #pragma warning(pop)
 
-    BalloonFreePagesFromMdl(Mdl, Check);
+    BalloonFreePagesFromMdl(Worker, Mdl, Check);
     Count = Requested;
 
-    RtlZeroMemory(&Context->Mdl, sizeof (MDL));
+    RtlZeroMemory(&Worker->Mdl, sizeof (MDL));
 
-    RtlZeroMemory(Context->PfnArray, Count * sizeof (PFN_NUMBER));
+    RtlZeroMemory(Worker->PfnArray, Count * sizeof (PFN_NUMBER));
 
 done:
-    ASSERT(IsZeroMemory(Context->PfnArray, Requested * sizeof (PFN_NUMBER)));
+    ASSERT(IsZeroMemory(Worker->PfnArray, Requested * sizeof (PFN_NUMBER)));
 
     KeQuerySystemTime(&End);
     TimeDelta = __max(((End.QuadPart - Start.QuadPart) / 10000ull), 1);
@@ -594,25 +976,33 @@ BalloonLowMemory(
     return (status == STATUS_SUCCESS) ? TRUE : FALSE;
 }
 
-static NTSTATUS
-BalloonDeflate(
-    IN  PXENBUS_BALLOON_CONTEXT Context,
-    IN  ULONGLONG               Requested
+static BOOLEAN
+BalloonHighMemory(
+    IN  PXENBUS_BALLOON_CONTEXT Context
     )
 {
-    LARGE_INTEGER               Start;
-    LARGE_INTEGER               End;
-    ULONGLONG                   Count;
-    ULONGLONG                   TimeDelta;
+    LARGE_INTEGER               Timeout;
     NTSTATUS                    status;
 
-    status = STATUS_UNSUCCESSFUL;
-    if (Context->FIST.Deflation)
-        goto done;
+    Timeout.QuadPart = 0;
 
-    Info("====> %llu page(s)\n", Requested);
+    status = KeWaitForSingleObject(Context->HighMemoryEvent,
+                                   Executive,
+                                   KernelMode,
+                                   FALSE,
+                                   &Timeout);
 
-    KeQuerySystemTime(&Start);
+    return (status == STATUS_SUCCESS) ? TRUE : FALSE;
+}
+
+static NTSTATUS
+BalloonWorkerDeflate(
+    IN  PXENBUS_BALLOON_WORKER  Worker
+    )
+{
+    ULONGLONG                   Requested = Worker->Requested;
+    ULONGLONG                   Count;
+    NTSTATUS                    status;
 
     Count = 0;
     status = STATUS_SUCCESS;
@@ -622,51 +1012,30 @@ BalloonDeflate(
         ULONG   Populated;
         ULONG   Freed;
 
-        Populated = BalloonPopulatePfnArray(Context, ThisTime);
+        Populated = BalloonPopulatePfnArray(Worker, ThisTime);
         if (Populated < ThisTime)
             status = STATUS_RETRY;
 
-        Freed = BalloonFreePfnArray(Context, Populated, TRUE);
+        Freed = BalloonFreePfnArray(Worker, Populated, TRUE);
         ASSERT(Freed == Populated);
 
         Count += Freed;
     }
 
-    KeQuerySystemTime(&End);
-
-    TimeDelta = (End.QuadPart - Start.QuadPart) / 10000ull;
-
-    Info("<==== %llu page(s) in %llums\n", Count, TimeDelta);
-    Context->Size -= Count;
+    Worker->Count = Count;
 
-done:
     return status;
 }
 
 static NTSTATUS
-BalloonInflate(
-    IN  PXENBUS_BALLOON_CONTEXT Context,
-    IN  ULONGLONG               Requested
+BalloonWorkerInflate(
+    IN  PXENBUS_BALLOON_WORKER  Worker
     )
 {
-    LARGE_INTEGER               Start;
-    LARGE_INTEGER               End;
+    ULONGLONG                   Requested = Worker->Requested;
     ULONGLONG                   Count;
-    ULONGLONG                   TimeDelta;
     NTSTATUS                    status;
 
-    status = STATUS_UNSUCCESSFUL;
-    if (Context->FIST.Inflation)
-        goto done;
-
-    status = STATUS_NO_MEMORY;
-    if (BalloonLowMemory(Context))
-        goto done;
-
-    Info("====> %llu page(s)\n", Requested);
-
-    KeQuerySystemTime(&Start);
-
     Count = 0;
     status = STATUS_SUCCESS;
 
@@ -676,20 +1045,20 @@ BalloonInflate(
         BOOLEAN Slow;
         ULONG   Released;
 
-        Allocated = BalloonAllocatePfnArray(Context, ThisTime, &Slow);
+        Allocated = BalloonAllocatePfnArray(Worker, ThisTime, &Slow);
         if (Allocated < ThisTime || Slow)
             status = STATUS_RETRY;
 
-        Released = BalloonReleasePfnArray(Context, Allocated);
+        Released = BalloonReleasePfnArray(Worker, Allocated);
 
         if (Released < Allocated) {
             ULONG   Freed;
 
-            RtlMoveMemory(&(Context->PfnArray[0]),
-                          &(Context->PfnArray[Released]),
+            RtlMoveMemory(&(Worker->PfnArray[0]),
+                          &(Worker->PfnArray[Released]),
                           (Allocated - Released) * sizeof (PFN_NUMBER));
 
-            Freed = BalloonFreePfnArray(Context, Allocated - Released, FALSE);
+            Freed = BalloonFreePfnArray(Worker, Allocated - Released, FALSE);
             ASSERT3U(Freed, ==, Allocated - Released);
         }
 
@@ -699,37 +1068,259 @@ BalloonInflate(
         Count += Released;
     }
 
-    KeQuerySystemTime(&End);
-
-    TimeDelta = (End.QuadPart - Start.QuadPart) / 10000ull;
-
-    Info("<==== %llu page(s) in %llums\n", Count, TimeDelta);
-    Context->Size += Count;
+    Worker->Count = Count;
 
-done:
     return status;
 }
 
-static VOID
-BalloonGetFISTEntries(
-    IN  PXENBUS_BALLOON_CONTEXT Context
+static NTSTATUS
+BalloonWorker(
+    IN  PXENBUS_THREAD      Self,
+    IN  PVOID               Context
     )
 {
-    PCHAR                       Buffer;
-    NTSTATUS                    status;
+    PXENBUS_BALLOON_WORKER  Worker = Context;
+    GROUP_AFFINITY          Affinity;
+    KPRIORITY               Priority;
+    PKEVENT                 Event;
 
-    status = XENBUS_STORE(Read,
-                          &Context->StoreInterface,
-                          NULL,
-                          "FIST/balloon",
-                          "inflation",
-                          &Buffer);
-    if (!NT_SUCCESS(status)) {
-        Context->FIST.Inflation = FALSE;
-    } else {
-        Context->FIST.Inflation = (BOOLEAN)strtol(Buffer, NULL, 2);
+    Trace("====> (%u)\n", Worker->Index);
 
-        XENBUS_STORE(Free,
+    // Run on the node we allocate from so that the PFN array and the
+    // pages we touch stay local
+    KeQueryNodeActiveAffinity(Worker->Node, &Affinity, NULL);
+    if (Affinity.Mask != 0)
+        KeSetSystemGroupAffinityThread(&Affinity, NULL);
+
+    Priority = KeQueryPriorityThread(KeGetCurrentThread());
+
+    Event = ThreadGetEvent(Self);
+
+    for (;;) {
+        LARGE_INTEGER   Start;
+        LARGE_INTEGER   End;
+        ULONGLONG       TimeDelta;
+
+        (VOID) KeWaitForSingleObject(Event,
+                                     Executive,
+                                     KernelMode,
+                                     FALSE,
+                                     NULL);
+        KeClearEvent(Event);
+
+        if (ThreadIsAlerted(Self))
+            break;
+
+        // Background work (i.e. free page reporting) should not get in
+        // the way of anything else
+        (VOID) KeSetPriorityThread(KeGetCurrentThread(),
+                                   (Worker->Background) ?
+                                   LOW_PRIORITY + 1 :
+                                   Priority);
+
+        KeQuerySystemTime(&Start);
+
+        Worker->Status = (Worker->Inflate) ?
+                         BalloonWorkerInflate(Worker) :
+                         BalloonWorkerDeflate(Worker);
+
+        KeQuerySystemTime(&End);
+        TimeDelta = __max(((End.QuadPart - Start.QuadPart) / 10000ull), 1);
+
+        Worker->Rate = (Worker->Count * 1000) / TimeDelta;
+
+        KeSetEvent(&Worker->Done, IO_NO_INCREMENT, FALSE);
+    }
+
+    Trace("<==== (%u)\n", Worker->Index);
+
+    return STATUS_SUCCESS;
+}
+
+// Split a request across the per-node workers in whole PFN arrays, so
+// small adjustments are not spread thinly across nodes. Only the last
+// worker used may be handed a partial array.
+static NTSTATUS
+BalloonDispatch(
+    IN  PXENBUS_BALLOON_CONTEXT Context,
+    IN  BOOLEAN                 Inflate,
+    IN  BOOLEAN                 Background,
+    IN  ULONGLONG               Requested,
+    OUT PULONGLONG              Count
+    )
+{
+    LARGE_INTEGER               Start;
+    LARGE_INTEGER               End;
+    ULONGLONG                   TimeDelta;
+    ULONGLONG                   Arrays;
+    ULONGLONG                   Share;
+    ULONGLONG                   Remaining;
+    ULONG                       Remainder;
+    ULONG                       Workers;
+    ULONG                       Index;
+    NTSTATUS                    status;
+
+    ASSERT(Requested != 0);
+
+    Arrays = (Requested + XENBUS_BALLOON_PFN_ARRAY_SIZE - 1) /
+             XENBUS_BALLOON_PFN_ARRAY_SIZE;
+
+    Workers = (ULONG)__min(Context->WorkerCount, Arrays);
+    ASSERT(Workers != 0);
+
+    Share = Arrays / Workers;
+    Remainder = (ULONG)(Arrays % Workers);
+
+    KeQuerySystemTime(&Start);
+
+    Remaining = Requested;
+    for (Index = 0; Index < Workers; Index++) {
+        PXENBUS_BALLOON_WORKER  Worker = Context->Worker[Index];
+        ULONGLONG               ThisWorker;
+
+        ThisWorker = (Share + ((Index < Remainder) ? 1 : 0)) *
+                     XENBUS_BALLOON_PFN_ARRAY_SIZE;
+
+        Worker->Inflate = Inflate;
+        Worker->Background = Background;
+        Worker->Requested = __min(ThisWorker, Remaining);
+        Remaining -= Worker->Requested;
+        Worker->Count = 0;
+        Worker->Status = STATUS_SUCCESS;
+
+        ThreadWake(Worker->Thread);
+    }
+    ASSERT3U(Remaining, ==, 0);
+
+    *Count = 0;
+    status = STATUS_SUCCESS;
+
+    for (Index = 0; Index < Workers; Index++) {
+        PXENBUS_BALLOON_WORKER  Worker = Context->Worker[Index];
+
+        (VOID) KeWaitForSingleObject(&Worker->Done,
+                                     Executive,
+                                     KernelMode,
+                                     FALSE,
+                                     NULL);
+
+        Info("worker %u (node %u): %llu/%llu page(s) at %llu pages/s\n",
+             Worker->Index,
+             Worker->Node,
+             Worker->Count,
+             Worker->Requested,
+             Worker->Rate);
+
+        *Count += Worker->Count;
+
+        if (!NT_SUCCESS(Worker->Status))
+            status = Worker->Status;
+    }
+
+    KeQuerySystemTime(&End);
+    TimeDelta = __max(((End.QuadPart - Start.QuadPart) / 10000ull), 1);
+
+    Context->Rate = (*Count * 1000) / TimeDelta;
+
+    return status;
+}
+
+static NTSTATUS
+BalloonDeflate(
+    IN  PXENBUS_BALLOON_CONTEXT Context,
+    IN  ULONGLONG               Requested
+    )
+{
+    LARGE_INTEGER               Start;
+    LARGE_INTEGER               End;
+    ULONGLONG                   Count;
+    ULONGLONG                   TimeDelta;
+    NTSTATUS                    status;
+
+    status = STATUS_UNSUCCESSFUL;
+    if (Context->FIST.Deflation)
+        goto done;
+
+    Info("====> %llu page(s)\n", Requested);
+
+    KeQuerySystemTime(&Start);
+
+    status = BalloonDispatch(Context, FALSE, FALSE, Requested, &Count);
+
+    KeQuerySystemTime(&End);
+
+    TimeDelta = (End.QuadPart - Start.QuadPart) / 10000ull;
+
+    Info("<==== %llu page(s) in %llums (%llu pages/s)\n",
+         Count,
+         TimeDelta,
+         Context->Rate);
+    Context->Size -= Count;
+
+done:
+    return status;
+}
+
+static NTSTATUS
+BalloonInflate(
+    IN  PXENBUS_BALLOON_CONTEXT Context,
+    IN  ULONGLONG               Requested
+    )
+{
+    LARGE_INTEGER               Start;
+    LARGE_INTEGER               End;
+    ULONGLONG                   Count;
+    ULONGLONG                   TimeDelta;
+    NTSTATUS                    status;
+
+    status = STATUS_UNSUCCESSFUL;
+    if (Context->FIST.Inflation)
+        goto done;
+
+    status = STATUS_NO_MEMORY;
+    if (BalloonLowMemory(Context))
+        goto done;
+
+    Info("====> %llu page(s)\n", Requested);
+
+    KeQuerySystemTime(&Start);
+
+    status = BalloonDispatch(Context, TRUE, FALSE, Requested, &Count);
+
+    KeQuerySystemTime(&End);
+
+    TimeDelta = (End.QuadPart - Start.QuadPart) / 10000ull;
+
+    Info("<==== %llu page(s) in %llums (%llu pages/s)\n",
+         Count,
+         TimeDelta,
+         Context->Rate);
+    Context->Size += Count;
+
+done:
+    return status;
+}
+
+static VOID
+BalloonGetFISTEntries(
+    IN  PXENBUS_BALLOON_CONTEXT Context
+    )
+{
+    PCHAR                       Buffer;
+    NTSTATUS                    status;
+
+    status = XENBUS_STORE(Read,
+                          &Context->StoreInterface,
+                          NULL,
+                          "FIST/balloon",
+                          "inflation",
+                          &Buffer);
+    if (!NT_SUCCESS(status)) {
+        Context->FIST.Inflation = FALSE;
+    } else {
+        Context->FIST.Inflation = (BOOLEAN)strtol(Buffer, NULL, 2);
+
+        XENBUS_STORE(Free,
                      &Context->StoreInterface,
                      Buffer);
     }
@@ -771,6 +1362,8 @@ __BalloonStatus(
         return " [RETRY]";
     case STATUS_NO_MEMORY:
         return " [LOW_MEM]";
+    case STATUS_PENDING:
+        return " [PENDING]";
     default:
         break;
     }
@@ -778,6 +1371,74 @@ __BalloonStatus(
     return " [UNKNOWN]";
 }
 
+#define XENBUS_BALLOON_MINIMUM_STEP         ((ULONGLONG)XENBUS_BALLOON_PFN_ARRAY_SIZE)
+#define XENBUS_BALLOON_MAXIMUM_STEP         (1ull << 18)    // 1G
+#define XENBUS_BALLOON_STEP_PERIOD_MS       1000ull
+
+// Work out how far to move the balloon in the next step. The step is
+// limited to what the last step's rate suggests can be done in roughly
+// XENBUS_BALLOON_STEP_PERIOD_MS and, when inflating, only grows while
+// Windows reports plenty of available memory. Otherwise it backs off.
+static ULONGLONG
+BalloonGetStep(
+    IN  PXENBUS_BALLOON_CONTEXT Context,
+    IN  BOOLEAN                 Inflate
+    )
+{
+    ULONGLONG                   Limit;
+    ULONGLONG                   Step;
+
+    Limit = XENBUS_BALLOON_MAXIMUM_STEP;
+    if (Context->Rate != 0)
+        Limit = __min(Limit,
+                      __max((Context->Rate * XENBUS_BALLOON_STEP_PERIOD_MS) / 1000ull,
+                            XENBUS_BALLOON_MINIMUM_STEP));
+
+    Step = Context->Step;
+    if (Step == 0)
+        Step = XENBUS_BALLOON_MINIMUM_STEP;
+    else if (!Inflate || BalloonHighMemory(Context))
+        Step *= 2;
+    else
+        Step /= 2;
+
+    Step = __max(Step, XENBUS_BALLOON_MINIMUM_STEP);
+    Step = __min(Step, Limit);
+
+    Context->Step = Step;
+    return Step;
+}
+
+static VOID
+BalloonPublishProgress(
+    IN  PXENBUS_BALLOON_CONTEXT Context
+    )
+{
+    ULONGLONG                   Total;
+    ULONGLONG                   Done;
+    ULONG                       Progress;
+
+    Total = (Context->Target > Context->Origin) ?
+            Context->Target - Context->Origin :
+            Context->Origin - Context->Target;
+
+    Done = (Context->Size > Context->Origin) ?
+           Context->Size - Context->Origin :
+           Context->Origin - Context->Size;
+
+    Progress = (Total != 0) ?
+               (ULONG)((__min(Done, Total) * 100) / Total) :
+               100;
+
+    (VOID) XENBUS_STORE(Printf,
+                        &Context->StoreInterface,
+                        NULL,
+                        "memory",
+                        "balloon-progress",
+                        "%u",
+                        Progress);
+}
+
 NTSTATUS
 BalloonAdjust(
     IN  PINTERFACE          Interface,
@@ -785,23 +1446,38 @@ BalloonAdjust(
     )
 {
     PXENBUS_BALLOON_CONTEXT Context = Interface->Context;
+    ULONGLONG               Step;
     NTSTATUS                status;
 
     ASSERT3U(KeGetCurrentIrql(), <, DISPATCH_LEVEL);
 
-    Info("====> (%llu page(s))\n", Context->Size);
+    Info("====> (%llu page(s) -> %llu page(s))\n", Context->Size, Size);
+
+    if (Size != Context->Target) {
+        Context->Origin = Context->Size;
+        Context->Target = Size;
+    }
 
     status = STATUS_SUCCESS;
 
     BalloonGetFISTEntries(Context);
 
-    while (Context->Size != Size && NT_SUCCESS(status)) {
-        if (Size > Context->Size)
-            status = BalloonInflate(Context, Size - Context->Size);
-        else if (Size < Context->Size)
-            status = BalloonDeflate(Context, Context->Size - Size);
+    if (Size > Context->Size) {
+        Step = BalloonGetStep(Context, TRUE);
+        status = BalloonInflate(Context, __min(Size - Context->Size, Step));
+    } else if (Size < Context->Size) {
+        Step = BalloonGetStep(Context, FALSE);
+        status = BalloonDeflate(Context, __min(Context->Size - Size, Step));
     }
 
+    if (status == STATUS_RETRY || status == STATUS_NO_MEMORY)
+        Context->Step = XENBUS_BALLOON_MINIMUM_STEP;
+
+    BalloonPublishProgress(Context);
+
+    if (NT_SUCCESS(status) && Context->Size != Size)
+        status = STATUS_PENDING;
+
     Info("<==== (%llu page(s))%s\n",
          Context->Size,
          __BalloonStatus(status));
@@ -819,6 +1495,150 @@ BalloonGetSize(
     return Context->Size;
 }
 
+static NTSTATUS
+BalloonReclaimPages(
+    IN  PXENBUS_BALLOON_CONTEXT Context,
+    IN  ULONGLONG               Requested
+    )
+{
+    ULONGLONG                   Count;
+    NTSTATUS                    status;
+
+    ASSERT3U(Requested, <=, Context->Report.Size);
+
+    status = BalloonDispatch(Context, FALSE, FALSE, Requested, &Count);
+
+    Context->Report.Size -= Count;
+    Context->Report.Reclaimed += Count;
+
+    Info("%llu page(s) (%llu remaining)\n", Count, Context->Report.Size);
+
+    return status;
+}
+
+NTSTATUS
+BalloonReport(
+    IN  PINTERFACE          Interface
+    )
+{
+    PXENBUS_BALLOON_CONTEXT Context = Interface->Context;
+    PXENBUS_BALLOON_REPORT  Report = &Context->Report;
+    LARGE_INTEGER           Now;
+    ULONGLONG               Count;
+
+    ASSERT3U(KeGetCurrentIrql(), <, DISPATCH_LEVEL);
+
+    if (!Report->Enabled)
+        return STATUS_NOT_SUPPORTED;
+
+    // Give reported pages back to Windows as soon as it starts to
+    // run short
+    if (BalloonLowMemory(Context)) {
+        if (Report->Size != 0)
+            (VOID) BalloonReclaimPages(Context,
+                                       __min(Report->Size,
+                                             XENBUS_BALLOON_MAXIMUM_STEP));
+
+        return STATUS_SUCCESS;
+    }
+
+    KeQuerySystemTime(&Now);
+
+    if ((ULONGLONG)(Now.QuadPart - Report->Last.QuadPart) <
+        (ULONGLONG)Report->Period * 10000000ull)
+        return STATUS_SUCCESS;
+
+    Report->Last = Now;
+
+    // Only report while Windows considers there to be plenty of
+    // free memory
+    if (!BalloonHighMemory(Context))
+        return STATUS_SUCCESS;
+
+    (VOID) BalloonDispatch(Context, TRUE, TRUE, Report->Chunk, &Count);
+
+    Report->Size += Count;
+    Report->Reported += Count;
+    Report->Passes++;
+
+    Info("%llu page(s) (%llu reported)\n", Count, Report->Size);
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS
+BalloonReclaim(
+    IN  PINTERFACE          Interface
+    )
+{
+    PXENBUS_BALLOON_CONTEXT Context = Interface->Context;
+    NTSTATUS                status;
+
+    ASSERT3U(KeGetCurrentIrql(), <, DISPATCH_LEVEL);
+
+    status = STATUS_SUCCESS;
+
+    while (Context->Report.Size != 0 && NT_SUCCESS(status))
+        status = BalloonReclaimPages(Context, Context->Report.Size);
+
+    return status;
+}
+
+static VOID
+BalloonDebugCallback(
+    IN  PVOID               Argument,
+    IN  BOOLEAN             Crashing
+    )
+{
+    PXENBUS_BALLOON_CONTEXT Context = Argument;
+    ULONG                   Index;
+
+    UNREFERENCED_PARAMETER(Crashing);
+
+    XENBUS_DEBUG(Printf,
+                 &Context->DebugInterface,
+                 "Size = %llu page(s) Rate = %llu pages/s\n",
+                 Context->Size,
+                 Context->Rate);
+
+    if (Context->Report.Enabled)
+        XENBUS_DEBUG(Printf,
+                     &Context->DebugInterface,
+                     "Report: Size = %llu page(s) Passes = %llu Reported = %llu Reclaimed = %llu\n",
+                     Context->Report.Size,
+                     Context->Report.Passes,
+                     Context->Report.Reported,
+                     Context->Report.Reclaimed);
+
+    for (Index = 0; Index < Context->WorkerCount; Index++) {
+        PXENBUS_BALLOON_WORKER  Worker = Context->Worker[Index];
+
+        XENBUS_DEBUG(Printf,
+                     &Context->DebugInterface,
+                     "[%u]: Node = %u Rate = %llu pages/s Checked = %llu page(s)\n",
+                     Worker->Index,
+                     Worker->Node,
+                     Worker->Rate,
+                     Worker->Checked);
+
+        XENBUS_DEBUG(Printf,
+                     &Context->DebugInterface,
+                     "[%u]: 4K: Decreased = %llu Populated = %llu Failed = %llu\n",
+                     Worker->Index,
+                     Worker->Order4K.Decreased,
+                     Worker->Order4K.Populated,
+                     Worker->Order4K.Failed);
+
+        XENBUS_DEBUG(Printf,
+                     &Context->DebugInterface,
+                     "[%u]: 2M: Decreased = %llu Populated = %llu Failed = %llu\n",
+                     Worker->Index,
+                     Worker->Order2M.Decreased,
+                     Worker->Order2M.Populated,
+                     Worker->Order2M.Failed);
+    }
+}
+
 static NTSTATUS
 BalloonAcquire(
     IN  PINTERFACE          Interface
@@ -850,6 +1670,37 @@ BalloonAcquire(
     if (!NT_SUCCESS(status))
         goto fail3;
 
+    status = XENBUS_DEBUG(Acquire, &Context->DebugInterface);
+    if (!NT_SUCCESS(status))
+        goto fail4;
+
+    status = XENBUS_DEBUG(Register,
+                          &Context->DebugInterface,
+                          __MODULE__ "|BALLOON",
+                          BalloonDebugCallback,
+                          Context,
+                          &Context->DebugCallback);
+    if (!NT_SUCCESS(status))
+        goto fail5;
+
+    (VOID) XENBUS_DEBUG(StatisticCreate,
+                        &Context->DebugInterface,
+                        "BALLOON|INFLATE_RATE",
+                        XENBUS_DEBUG_STATISTIC_TYPE_VALUE,
+                        &Context->InflateStatistic);
+
+    (VOID) XENBUS_DEBUG(StatisticCreate,
+                        &Context->DebugInterface,
+                        "BALLOON|DEFLATE_RATE",
+                        XENBUS_DEBUG_STATISTIC_TYPE_VALUE,
+                        &Context->DeflateStatistic);
+
+    (VOID) XENBUS_DEBUG(StatisticCreate,
+                        &Context->DebugInterface,
+                        "BALLOON|CHECK",
+                        XENBUS_DEBUG_STATISTIC_TYPE_TIME,
+                        &Context->CheckStatistic);
+
     Trace("<====\n");
 
 done:
@@ -857,6 +1708,16 @@ done:
 
     return STATUS_SUCCESS;
 
+fail5:
+    Error("fail5\n");
+
+    XENBUS_DEBUG(Release, &Context->DebugInterface);
+
+fail4:
+    Error("fail4\n");
+
+    XENBUS_STORE(Release, &Context->StoreInterface);
+
 fail3:
     Error("fail3\n");
 
@@ -887,6 +1748,7 @@ BalloonRelease(
 {
     PXENBUS_BALLOON_CONTEXT Context = Interface->Context;
     KIRQL                   Irql;
+    ULONG                   Index;
 
     KeAcquireSpinLock(&Context->Lock, &Irql);
 
@@ -898,8 +1760,53 @@ BalloonRelease(
     if (Context->Size != 0)
         BUG("STILL INFLATED");
 
+    if (Context->Report.Size != 0)
+        BUG("STILL REPORTED");
+
+    Context->Report.Last.QuadPart = 0;
+    Context->Report.Passes = 0;
+    Context->Report.Reported = 0;
+    Context->Report.Reclaimed = 0;
+
     RtlZeroMemory(&Context->FIST, sizeof (XENBUS_BALLOON_FIST));
 
+    for (Index = 0; Index < Context->WorkerCount; Index++) {
+        PXENBUS_BALLOON_WORKER  Worker = Context->Worker[Index];
+
+        RtlZeroMemory(&Worker->Order2M, sizeof (XENBUS_BALLOON_ORDER_STATISTICS));
+        RtlZeroMemory(&Worker->Order4K, sizeof (XENBUS_BALLOON_ORDER_STATISTICS));
+        RtlZeroMemory(Worker->ExtentArray, sizeof (Worker->ExtentArray));
+        Worker->Rate = 0;
+        Worker->Checked = 0;
+    }
+
+    Context->Rate = 0;
+    Context->Step = 0;
+    Context->Origin = 0;
+    Context->Target = 0;
+
+    XENBUS_DEBUG(StatisticDestroy,
+                 &Context->DebugInterface,
+                 Context->CheckStatistic);
+    Context->CheckStatistic = NULL;
+
+    XENBUS_DEBUG(StatisticDestroy,
+                 &Context->DebugInterface,
+                 Context->DeflateStatistic);
+    Context->DeflateStatistic = NULL;
+
+    XENBUS_DEBUG(StatisticDestroy,
+                 &Context->DebugInterface,
+                 Context->InflateStatistic);
+    Context->InflateStatistic = NULL;
+
+    XENBUS_DEBUG(Deregister,
+                 &Context->DebugInterface,
+                 Context->DebugCallback);
+    Context->DebugCallback = NULL;
+
+    XENBUS_DEBUG(Release, &Context->DebugInterface);
+
     XENBUS_STORE(Release, &Context->StoreInterface);
 
     XENBUS_RANGE_SET(Destroy,
@@ -915,6 +1822,32 @@ done:
     KeReleaseSpinLock(&Context->Lock, Irql);
 }
 
+static VOID
+BalloonWorkerDestroy(
+    IN  PXENBUS_BALLOON_WORKER  Worker
+    )
+{
+    ThreadAlert(Worker->Thread);
+    ThreadJoin(Worker->Thread);
+    Worker->Thread = NULL;
+
+    Worker->Inflate = FALSE;
+    Worker->Background = FALSE;
+    Worker->Requested = 0;
+    Worker->Count = 0;
+    Worker->Status = STATUS_SUCCESS;
+
+    RtlZeroMemory(&Worker->Done, sizeof (KEVENT));
+
+    Worker->Seed = 0;
+    Worker->Node = 0;
+    Worker->Index = 0;
+    Worker->Context = NULL;
+
+    ASSERT(IsZeroMemory(Worker, sizeof (XENBUS_BALLOON_WORKER)));
+    __BalloonFree(Worker);
+}
+
 static struct _XENBUS_BALLOON_INTERFACE_V1 BalloonInterfaceVersion1 = {
     { sizeof (struct _XENBUS_BALLOON_INTERFACE_V1), 1, NULL, NULL, NULL },
     BalloonAcquire,
@@ -922,6 +1855,107 @@ static struct _XENBUS_BALLOON_INTERFACE_V1 BalloonInterfaceVersion1 = {
     BalloonAdjust,
     BalloonGetSize
 };
+
+static struct _XENBUS_BALLOON_INTERFACE_V2 BalloonInterfaceVersion2 = {
+    { sizeof (struct _XENBUS_BALLOON_INTERFACE_V2), 2, NULL, NULL, NULL },
+    BalloonAcquire,
+    BalloonRelease,
+    BalloonAdjust,
+    BalloonGetSize,
+    BalloonReport,
+    BalloonReclaim
+};
+
+#define XENBUS_BALLOON_DEFAULT_CHECK_STRIDE 64
+
+static VOID
+BalloonGetCheckOption(
+    IN  PXENBUS_BALLOON_CONTEXT Context
+    )
+{
+    CHAR                        Key[] = "XEN:BALLOON_CHECK=";
+    PANSI_STRING                Option;
+    PCHAR                       Value;
+    NTSTATUS                    status;
+
+    // Default to checking every page, as we always have
+    Context->CheckPolicy = XENBUS_BALLOON_CHECK_FULL;
+    Context->CheckStride = 1;
+
+    status = RegistryQuerySystemStartOption(Key, &Option);
+    if (!NT_SUCCESS(status))
+        return;
+
+    Value = Option->Buffer + sizeof (Key) - 1;
+
+    if (strcmp(Value, "OFF") == 0) {
+        Context->CheckPolicy = XENBUS_BALLOON_CHECK_OFF;
+    } else if (strncmp(Value, "SAMPLE", sizeof ("SAMPLE") - 1) == 0) {
+        ULONG   Stride;
+
+        Value += sizeof ("SAMPLE") - 1;
+        Stride = (*Value == ':') ?
+                 strtoul(Value + 1, NULL, 0) :
+                 XENBUS_BALLOON_DEFAULT_CHECK_STRIDE;
+
+        if (Stride > 1) {
+            Context->CheckPolicy = XENBUS_BALLOON_CHECK_SAMPLE;
+            Context->CheckStride = Stride;
+        }
+    } else if (strcmp(Value, "FULL") != 0) {
+        Warning("UNRECOGNIZED VALUE OF %s: %s\n", Key, Value);
+    }
+
+    RegistryFreeSzValue(Option);
+
+    Info("policy %u stride %u\n",
+         Context->CheckPolicy,
+         Context->CheckStride);
+}
+
+#define XENBUS_BALLOON_REPORT_CHUNK_MIN (1ull << 14)    // 64M
+
+static VOID
+BalloonGetReportOption(
+    IN  PXENBUS_BALLOON_CONTEXT Context
+    )
+{
+    CHAR                        Key[] = "XEN:BALLOON_REPORTING=";
+    PANSI_STRING                Option;
+    PCHAR                       Value;
+    NTSTATUS                    status;
+
+    status = RegistryQuerySystemStartOption(Key, &Option);
+    if (!NT_SUCCESS(status))
+        return;
+
+    Value = Option->Buffer + sizeof (Key) - 1;
+
+    // Higher levels of aggressiveness report more often and in
+    // bigger chunks
+    if (strcmp(Value, "LOW") == 0) {
+        Context->Report.Period = 60;
+        Context->Report.Chunk = XENBUS_BALLOON_REPORT_CHUNK_MIN;
+    } else if (strcmp(Value, "MEDIUM") == 0) {
+        Context->Report.Period = 30;
+        Context->Report.Chunk = XENBUS_BALLOON_REPORT_CHUNK_MIN << 2;
+    } else if (strcmp(Value, "HIGH") == 0) {
+        Context->Report.Period = 10;
+        Context->Report.Chunk = XENBUS_BALLOON_REPORT_CHUNK_MIN << 4;
+    } else if (strcmp(Value, "OFF") != 0) {
+        Warning("UNRECOGNIZED VALUE OF %s: %s\n", Key, Value);
+    }
+
+    Context->Report.Enabled = (Context->Report.Period != 0) ? TRUE : FALSE;
+
+    RegistryFreeSzValue(Option);
+
+    if (Context->Report.Enabled)
+        Info("%s (every %us, %llu page(s))\n",
+             Value,
+             Context->Report.Period,
+             Context->Report.Chunk);
+}
                      
 NTSTATUS
 BalloonInitialize(
@@ -930,6 +1964,10 @@ BalloonInitialize(
     )
 {
     UNICODE_STRING              Unicode;
+    PXENBUS_BALLOON_WORKER      Worker;
+    ULONG                       Highest;
+    ULONG                       Node;
+    ULONG                       Index;
     NTSTATUS                    status;
 
     Trace("====>\n");
@@ -952,6 +1990,12 @@ BalloonInitialize(
                                sizeof ((*Context)->StoreInterface));
     ASSERT(NT_SUCCESS(status));
 
+    status = DebugGetInterface(FdoGetDebugContext(Fdo),
+                               XENBUS_DEBUG_INTERFACE_VERSION_MAX,
+                               (PINTERFACE)&(*Context)->DebugInterface,
+                               sizeof ((*Context)->DebugInterface));
+    ASSERT(NT_SUCCESS(status));
+
     RtlInitUnicodeString(&Unicode, L"\\KernelObjects\\LowMemoryCondition");
 
     (*Context)->LowMemoryEvent = IoCreateNotificationEvent(&Unicode,
@@ -961,15 +2005,119 @@ BalloonInitialize(
     if ((*Context)->LowMemoryEvent == NULL)
         goto fail2;
 
+    RtlInitUnicodeString(&Unicode, L"\\KernelObjects\\HighMemoryCondition");
+
+    (*Context)->HighMemoryEvent = IoCreateNotificationEvent(&Unicode,
+                                                            &(*Context)->HighMemoryHandle);
+
+    status = STATUS_UNSUCCESSFUL;
+    if ((*Context)->HighMemoryEvent == NULL)
+        goto fail3;
+
+    (*Context)->Worker = __BalloonAllocate(sizeof (PXENBUS_BALLOON_WORKER) *
+                                           XENBUS_BALLOON_MAXIMUM_WORKER_COUNT);
+
+    status = STATUS_NO_MEMORY;
+    if ((*Context)->Worker == NULL)
+        goto fail4;
+
+    // One worker per NUMA node, each allocating node-local memory. Node
+    // numbers need not be contiguous so skip any node that has no
+    // active processors for the worker to run on.
+    Highest = KeQueryHighestNodeNumber();
+    Index = 0;
+
+    for (Node = 0; Node <= Highest; Node++) {
+        GROUP_AFFINITY  Affinity;
+
+        if (Index == XENBUS_BALLOON_MAXIMUM_WORKER_COUNT)
+            break;
+
+        KeQueryNodeActiveAffinity((USHORT)Node, &Affinity, NULL);
+        if (Affinity.Mask == 0)
+            continue;
+
+        Worker = __BalloonAllocate(sizeof (XENBUS_BALLOON_WORKER));
+
+        status = STATUS_NO_MEMORY;
+        if (Worker == NULL)
+            goto fail5;
+
+        Worker->Context = *Context;
+        Worker->Index = Index;
+        Worker->Node = (USHORT)Node;
+        Worker->Seed = KeQueryPerformanceCounter(NULL).LowPart ^ Index;
+
+        KeInitializeEvent(&Worker->Done, SynchronizationEvent, FALSE);
+
+        status = ThreadCreate(BalloonWorker,
+                              Worker,
+                              &Worker->Thread);
+        if (!NT_SUCCESS(status))
+            goto fail6;
+
+        (*Context)->Worker[Index++] = Worker;
+    }
+
+    // The node we are running on has at least one active processor
+    ASSERT(Index != 0);
+    (*Context)->WorkerCount = Index;
+
+    BalloonGetReportOption(*Context);
+    BalloonGetCheckOption(*Context);
+
     (*Context)->Fdo = Fdo;
 
     Trace("<====\n");
 
     return STATUS_SUCCESS;
 
+fail6:
+    Error("fail6\n");
+
+    RtlZeroMemory(&Worker->Done, sizeof (KEVENT));
+
+    Worker->Seed = 0;
+    Worker->Node = 0;
+    Worker->Index = 0;
+    Worker->Context = NULL;
+
+    ASSERT(IsZeroMemory(Worker, sizeof (XENBUS_BALLOON_WORKER)));
+    __BalloonFree(Worker);
+
+fail5:
+    Error("fail5\n");
+
+    while (Index != 0) {
+        --Index;
+
+        BalloonWorkerDestroy((*Context)->Worker[Index]);
+        (*Context)->Worker[Index] = NULL;
+    }
+
+    __BalloonFree((*Context)->Worker);
+    (*Context)->Worker = NULL;
+
+fail4:
+    Error("fail4\n");
+
+    ZwClose((*Context)->HighMemoryHandle);
+    (*Context)->HighMemoryHandle = NULL;
+    (*Context)->HighMemoryEvent = NULL;
+
+fail3:
+    Error("fail3\n");
+
+    ZwClose((*Context)->LowMemoryHandle);
+    (*Context)->LowMemoryHandle = NULL;
+    (*Context)->LowMemoryEvent = NULL;
+
 fail2:
     Error("fail2\n");
 
+    RtlZeroMemory(&(*Context)->DebugInterface,
+                  sizeof (XENBUS_DEBUG_INTERFACE));
+
     RtlZeroMemory(&(*Context)->StoreInterface,
                   sizeof (XENBUS_STORE_INTERFACE));
 
@@ -1015,6 +2163,23 @@ BalloonGetInterface(
         status = STATUS_SUCCESS;
         break;
     }
+    case 2: {
+        struct _XENBUS_BALLOON_INTERFACE_V2  *BalloonInterface;
+
+        BalloonInterface = (struct _XENBUS_BALLOON_INTERFACE_V2 *)Interface;
+
+        status = STATUS_BUFFER_OVERFLOW;
+        if (Size < sizeof (struct _XENBUS_BALLOON_INTERFACE_V2))
+            break;
+
+        *BalloonInterface = BalloonInterfaceVersion2;
+
+        ASSERT3U(Interface->Version, ==, Version);
+        Interface->Context = Context;
+
+        status = STATUS_SUCCESS;
+        break;
+    }
     default:
         status = STATUS_NOT_SUPPORTED;
         break;
@@ -1036,14 +2201,39 @@ BalloonTeardown(
     IN  PXENBUS_BALLOON_CONTEXT Context
     )
 {
+    ULONG                       Index;
+
     Trace("====>\n");
 
     Context->Fdo = NULL;
 
+    Context->CheckPolicy = XENBUS_BALLOON_CHECK_OFF;
+    Context->CheckStride = 0;
+
+    Context->Report.Enabled = FALSE;
+    Context->Report.Period = 0;
+    Context->Report.Chunk = 0;
+
+    for (Index = 0; Index < Context->WorkerCount; Index++) {
+        BalloonWorkerDestroy(Context->Worker[Index]);
+        Context->Worker[Index] = NULL;
+    }
+
+    __BalloonFree(Context->Worker);
+    Context->Worker = NULL;
+    Context->WorkerCount = 0;
+
+    ZwClose(Context->HighMemoryHandle);
+    Context->HighMemoryHandle = NULL;
+    Context->HighMemoryEvent = NULL;
+
     ZwClose(Context->LowMemoryHandle);
     Context->LowMemoryHandle = NULL;
     Context->LowMemoryEvent = NULL;
 
+    RtlZeroMemory(&Context->DebugInterface,
+                  sizeof (XENBUS_DEBUG_INTERFACE));
+
     RtlZeroMemory(&Context->StoreInterface,
                   sizeof (XENBUS_STORE_INTERFACE));
 
@@ -38,6 +38,8 @@
 #include "high.h"
 #include "debug.h"
 #include "fdo.h"
+#include "thread.h"
+#include "registry.h"
 #include "dbg_print.h"
 #include "assert.h"
 #include "util.h"
@@ -50,6 +52,50 @@ struct _XENBUS_DEBUG_CALLBACK {
     CHAR                    Prefix[MAXIMUM_PREFIX_LENGTH];
     XENBUS_DEBUG_FUNCTION   Function;
     PVOID                   Argument;
+    LONG                    References;
+    LONG                    Busy;
+    LONG                    Count;
+    LONG64                  Maximum;
+};
+
+// Callbacks that take longer than this are called out in the log
+#define XENBUS_DEBUG_CALLBACK_BUDGET    10000   // us
+
+// Once a (non-crashing) dispatch has taken this long any callbacks that
+// have not yet been invoked are skipped
+#define XENBUS_DEBUG_DISPATCH_BUDGET    1000000 // us
+
+#define XENBUS_DEBUG_DEFAULT_WORKER_COUNT   4
+
+#define MAXIMUM_STATISTIC_NAME_LENGTH   32
+
+// Each CPU's counters are padded out to a whole number of cache lines
+// and, since pool allocations are not cache aligned, the array itself is
+// aligned by hand so that no two CPUs ever share a line.
+
+#define XENBUS_DEBUG_STATISTIC_PROCESSOR_LENGTH \
+        (sizeof (LONG64) * (3 + XENBUS_DEBUG_STATISTIC_BUCKET_COUNT))
+
+typedef struct _XENBUS_DEBUG_STATISTIC_PROCESSOR {
+    LONG64  Count;
+    LONG64  Sum;
+    LONG64  Maximum;
+    LONG64  Bucket[XENBUS_DEBUG_STATISTIC_BUCKET_COUNT];
+    UCHAR   Pad[P2ROUNDUP(XENBUS_DEBUG_STATISTIC_PROCESSOR_LENGTH,
+                          SYSTEM_CACHE_ALIGNMENT_SIZE) -
+                XENBUS_DEBUG_STATISTIC_PROCESSOR_LENGTH];
+} XENBUS_DEBUG_STATISTIC_PROCESSOR, *PXENBUS_DEBUG_STATISTIC_PROCESSOR;
+
+C_ASSERT((sizeof (XENBUS_DEBUG_STATISTIC_PROCESSOR) %
+          SYSTEM_CACHE_ALIGNMENT_SIZE) == 0);
+
+struct _XENBUS_DEBUG_STATISTIC {
+    LIST_ENTRY                          ListEntry;
+    CHAR                                Name[MAXIMUM_STATISTIC_NAME_LENGTH];
+    XENBUS_DEBUG_STATISTIC_TYPE         Type;
+    ULONG                               ProcessorCount;
+    PVOID                               Buffer;
+    PXENBUS_DEBUG_STATISTIC_PROCESSOR   Processor;
 };
 
 struct _XENBUS_DEBUG_CONTEXT {
@@ -58,8 +104,19 @@ struct _XENBUS_DEBUG_CONTEXT {
     LONG                        References;
     KBUGCHECK_CALLBACK_RECORD   CallbackRecord;
     LIST_ENTRY                  CallbackList;
-    const CHAR                  *CallbackPrefix;
+    const CHAR                  **CallbackPrefix;
+    ULONG                       ProcessorCount;
     HIGH_LOCK                   CallbackLock;
+    LIST_ENTRY                  StatisticList;
+    LARGE_INTEGER               Frequency;
+    ULONGLONG                   CycleFrequency;
+    PXENBUS_THREAD              SnapshotThread;
+    PKDPC                       WorkerDpc;
+    ULONG                       WorkerCount;
+    LONG                        Dispatching;
+    LONG                        WorkersActive;
+    PLIST_ENTRY                 DispatchCursor;
+    LARGE_INTEGER               DispatchStart;
 };
 
 #define XENBUS_DEBUG_TAG    'UBED'
@@ -116,6 +173,10 @@ DebugRegister(
     (*Callback)->Function = Function;
     (*Callback)->Argument = Argument;
 
+    // This reference belongs to the callback list and is dropped by
+    // DebugDeregister()
+    (*Callback)->References = 1;
+
     AcquireHighLock(&Context->CallbackLock, &Irql);
     InsertTailList(&Context->CallbackList, &(*Callback)->ListEntry);
     ReleaseHighLock(&Context->CallbackLock, Irql);
@@ -136,21 +197,80 @@ DebugPrintf(
     )
 {
     PXENBUS_DEBUG_CONTEXT       Context = Interface->Context;
+    const CHAR                  *Prefix;
+    CHAR                        Buffer[MAXIMUM_PREFIX_LENGTH * 2 + 128];
+    ULONG                       Cpu;
+    ULONG                       Index;
     va_list                     Arguments;
 
-    ASSERT(Context->CallbackPrefix != NULL);
+    // Callbacks are always invoked at DISPATCH_LEVEL or above so the
+    // prefix slot for this CPU cannot change underneath us.
+    ASSERT3U(KeGetCurrentIrql(), >=, DISPATCH_LEVEL);
 
-    LogPrintf(LOG_LEVEL_INFO,
-              "%s: ",
-              Context->CallbackPrefix);
+    Cpu = KeGetCurrentProcessorNumberEx(NULL);
+    ASSERT3U(Cpu, <, Context->ProcessorCount);
+
+    Prefix = Context->CallbackPrefix[Cpu];
+    ASSERT(Prefix != NULL);
+
+    // Callbacks may be running on several CPUs at once so, to keep the
+    // prefix on the same line as the message, fold it (with any '%'
+    // escaped) into the format string and log everything in one go.
+    Index = 0;
+    while (*Prefix != '\0') {
+        if (*Prefix == '%')
+            Buffer[Index++] = '%';
+        Buffer[Index++] = *Prefix++;
+    }
+    Buffer[Index++] = ':';
+    Buffer[Index++] = ' ';
 
     va_start(Arguments, Format);
-    LogVPrintf(LOG_LEVEL_INFO,
-               Format,
-               Arguments);
+
+    if (strlen(Format) < sizeof (Buffer) - Index) {
+        RtlCopyMemory(&Buffer[Index], Format, strlen(Format) + 1);
+
+        LogVPrintf(LOG_LEVEL_INFO,
+                   Buffer,
+                   Arguments);
+    } else {
+        LogPrintf(LOG_LEVEL_INFO,
+                  "%s: ",
+                  Context->CallbackPrefix[Cpu]);
+
+        LogVPrintf(LOG_LEVEL_INFO,
+                   Format,
+                   Arguments);
+    }
+
     va_end(Arguments);
 }
 
+static FORCEINLINE VOID
+__DebugCallbackReference(
+    IN  PXENBUS_DEBUG_CALLBACK  Callback
+    )
+{
+    LONG                        References;
+
+    References = InterlockedIncrement(&Callback->References);
+    ASSERT(References > 1);
+}
+
+static FORCEINLINE VOID
+__DebugCallbackDereference(
+    IN  PXENBUS_DEBUG_CALLBACK  Callback
+    )
+{
+    LONG                        References;
+
+    References = InterlockedDecrement(&Callback->References);
+    ASSERT(References >= 0);
+
+    if (References == 0)
+        __DebugFree(Callback);
+}
+
 static VOID
 DebugDeregister(
     IN  PINTERFACE              Interface,
@@ -159,12 +279,95 @@ DebugDeregister(
 {
     PXENBUS_DEBUG_CONTEXT       Context = Interface->Context;
     KIRQL                       Irql;
+    ULONG                       Cpu;
+    LONG                        Self;
 
     AcquireHighLock(&Context->CallbackLock, &Irql);
+
+    if (Context->DispatchCursor == &Callback->ListEntry)
+        Context->DispatchCursor = Callback->ListEntry.Flink;
+
     RemoveEntryList(&Callback->ListEntry);
+
     ReleaseHighLock(&Context->CallbackLock, Irql);
 
-    __DebugFree(Callback);
+    // Once off the list no new reference can be taken by a dispatch
+    // worker, but one may still be invoking the callback. Wait for that
+    // to finish unless this is being called from within the callback
+    // itself, in which case the invoker's reference is the one that
+    // will free it.
+    KeRaiseIrql(__max(KeGetCurrentIrql(), DISPATCH_LEVEL), &Irql);
+
+    Cpu = KeGetCurrentProcessorNumberEx(NULL);
+    Self = (Cpu < Context->ProcessorCount &&
+            Context->CallbackPrefix[Cpu] == Callback->Prefix) ? 1 : 0;
+
+    KeLowerIrql(Irql);
+
+    while (Callback->References > 1 + Self)
+        _mm_pause();
+
+    __DebugCallbackDereference(Callback);
+}
+
+static FORCEINLINE ULONGLONG
+__DebugTicksToMicroseconds(
+    IN  PXENBUS_DEBUG_CONTEXT   Context,
+    IN  ULONGLONG               Ticks
+    )
+{
+    ULONGLONG                   Frequency = Context->Frequency.QuadPart;
+
+    return ((Ticks / Frequency) * 1000000ull) +
+           (((Ticks % Frequency) * 1000000ull) / Frequency);
+}
+
+static FORCEINLINE ULONGLONG
+__DebugCyclesToMicroseconds(
+    IN  PXENBUS_DEBUG_CONTEXT   Context,
+    IN  ULONGLONG               Cycles
+    )
+{
+    ULONGLONG                   Frequency = Context->CycleFrequency;
+
+    return ((Cycles / Frequency) * 1000000ull) +
+           (((Cycles % Frequency) * 1000000ull) / Frequency);
+}
+
+// Statistics sampled in interrupt and DPC paths are recorded in TSC
+// cycles, since KeQueryPerformanceCounter() may trap to an emulated
+// timer. Work out how fast the TSC runs by timing a short stall against
+// the performance counter.
+static VOID
+DebugCalibrateCycles(
+    IN  PXENBUS_DEBUG_CONTEXT   Context
+    )
+{
+    LARGE_INTEGER               Start;
+    LARGE_INTEGER               End;
+    ULONGLONG                   StartCycles;
+    ULONGLONG                   EndCycles;
+    KIRQL                       Irql;
+
+    KeRaiseIrql(DISPATCH_LEVEL, &Irql);
+
+    Start = KeQueryPerformanceCounter(NULL);
+    StartCycles = __rdtsc();
+
+    KeStallExecutionProcessor(1000);
+
+    EndCycles = __rdtsc();
+    End = KeQueryPerformanceCounter(NULL);
+
+    KeLowerIrql(Irql);
+
+    Context->CycleFrequency = ((EndCycles - StartCycles) *
+                               Context->Frequency.QuadPart) /
+                              __max(End.QuadPart - Start.QuadPart, 1);
+    if (Context->CycleFrequency == 0)
+        Context->CycleFrequency = 1;
+
+    Info("%llu cycles/s\n", Context->CycleFrequency);
 }
 
 static VOID
@@ -176,6 +379,11 @@ DebugCallback(
 {
     PCHAR                       Name;
     ULONG_PTR                   Offset;
+    ULONG                       Cpu;
+    LARGE_INTEGER               Start;
+    LARGE_INTEGER               End;
+    ULONGLONG                   Duration;
+    LONG64                      Maximum;
 
     ModuleLookup((ULONG_PTR)Callback->Function, &Name, &Offset);
 
@@ -202,14 +410,282 @@ DebugCallback(
                   Name,
                   Offset);
 
-        Context->CallbackPrefix = Callback->Prefix;
+        Cpu = KeGetCurrentProcessorNumberEx(NULL);
+        ASSERT3U(Cpu, <, Context->ProcessorCount);
+
+        Start = KeQueryPerformanceCounter(NULL);
+
+        Context->CallbackPrefix[Cpu] = Callback->Prefix;
         Callback->Function(Callback->Argument, Crashing);
-        Context->CallbackPrefix = NULL;
+        Context->CallbackPrefix[Cpu] = NULL;
+
+        End = KeQueryPerformanceCounter(NULL);
+
+        Duration = __DebugTicksToMicroseconds(Context,
+                                              End.QuadPart - Start.QuadPart);
+
+        // The same callback may be timed by a dispatch worker and a
+        // direct trigger on different CPUs
+        (VOID) InterlockedIncrement(&Callback->Count);
+
+        do {
+            Maximum = Callback->Maximum;
+            if ((ULONGLONG)Maximum >= Duration)
+                break;
+        } while (InterlockedCompareExchange64(&Callback->Maximum,
+                                              (LONG64)Duration,
+                                              Maximum) != Maximum);
 
         LogPrintf(LOG_LEVEL_INFO,
-                  "XEN|DEBUG: <==== (%s + %p)\n",
+                  "XEN|DEBUG: <==== (%s + %p) %llu us (MAX = %llu us)%s\n",
                   Name,
-                  Offset);
+                  Offset,
+                  Duration,
+                  __max((ULONGLONG)Maximum, Duration),
+                  (Duration > XENBUS_DEBUG_CALLBACK_BUDGET) ? " OVER BUDGET" : "");
+    }
+}
+
+static NTSTATUS
+DebugStatisticCreate(
+    IN  PINTERFACE                  Interface,
+    IN  const CHAR                  *Name,
+    IN  XENBUS_DEBUG_STATISTIC_TYPE Type,
+    OUT PXENBUS_DEBUG_STATISTIC     *Statistic
+    )
+{
+    PXENBUS_DEBUG_CONTEXT           Context = Interface->Context;
+    ULONG                           Length;
+    KIRQL                           Irql;
+    NTSTATUS                        status;
+
+    ASSERT(Type == XENBUS_DEBUG_STATISTIC_TYPE_VALUE ||
+           Type == XENBUS_DEBUG_STATISTIC_TYPE_TIME ||
+           Type == XENBUS_DEBUG_STATISTIC_TYPE_CYCLES);
+
+    *Statistic = __DebugAllocate(sizeof (XENBUS_DEBUG_STATISTIC));
+
+    status = STATUS_NO_MEMORY;
+    if (*Statistic == NULL)
+        goto fail1;
+
+    Length = (ULONG)__min(strlen(Name), MAXIMUM_STATISTIC_NAME_LENGTH - 1);
+    RtlCopyMemory((*Statistic)->Name, Name, Length);
+
+    (*Statistic)->Type = Type;
+    (*Statistic)->ProcessorCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    (*Statistic)->Buffer = __DebugAllocate((sizeof (XENBUS_DEBUG_STATISTIC_PROCESSOR) *
+                                            (*Statistic)->ProcessorCount) +
+                                           SYSTEM_CACHE_ALIGNMENT_SIZE);
+
+    status = STATUS_NO_MEMORY;
+    if ((*Statistic)->Buffer == NULL)
+        goto fail2;
+
+    (*Statistic)->Processor = (PVOID)P2ROUNDUP((ULONG_PTR)(*Statistic)->Buffer,
+                                               SYSTEM_CACHE_ALIGNMENT_SIZE);
+
+    AcquireHighLock(&Context->CallbackLock, &Irql);
+    InsertTailList(&Context->StatisticList, &(*Statistic)->ListEntry);
+    ReleaseHighLock(&Context->CallbackLock, Irql);
+
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+    (*Statistic)->ProcessorCount = 0;
+
+    __DebugFree(*Statistic);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    *Statistic = NULL;
+
+    return status;
+}
+
+static FORCEINLINE ULONG
+__DebugStatisticBucket(
+    IN  ULONGLONG   Value
+    )
+{
+    ULONG           Bit;
+
+    if (Value == 0)
+        return 0;
+
+    if (Value >> 32) {
+        (VOID) _BitScanReverse((PULONG)&Bit, (ULONG)(Value >> 32));
+        Bit += 32;
+    } else {
+        (VOID) _BitScanReverse((PULONG)&Bit, (ULONG)Value);
+    }
+
+    return __min(Bit + 1, XENBUS_DEBUG_STATISTIC_BUCKET_COUNT - 1);
+}
+
+static VOID
+DebugStatisticRecord(
+    IN  PINTERFACE                      Interface,
+    IN  PXENBUS_DEBUG_STATISTIC         Statistic OPTIONAL,
+    IN  ULONGLONG                       Value
+    )
+{
+    PXENBUS_DEBUG_STATISTIC_PROCESSOR   Processor;
+    ULONG                               Cpu;
+    LONG64                              Maximum;
+
+    UNREFERENCED_PARAMETER(Interface);
+
+    if (Statistic == NULL)
+        return;
+
+    Cpu = KeGetCurrentProcessorNumberEx(NULL);
+    if (Cpu >= Statistic->ProcessorCount)
+        return;
+
+    // The slot is (almost always) only touched by the local CPU so the
+    // interlocked operations are uncontended.
+    Processor = &Statistic->Processor[Cpu];
+
+    (VOID) InterlockedIncrement64(&Processor->Count);
+    (VOID) InterlockedExchangeAdd64(&Processor->Sum, (LONG64)Value);
+    (VOID) InterlockedIncrement64(&Processor->Bucket[__DebugStatisticBucket(Value)]);
+
+    do {
+        Maximum = Processor->Maximum;
+        if ((ULONGLONG)Maximum >= Value)
+            break;
+    } while (InterlockedCompareExchange64(&Processor->Maximum,
+                                          (LONG64)Value,
+                                          Maximum) != Maximum);
+}
+
+static VOID
+DebugStatisticDestroy(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_DEBUG_STATISTIC Statistic OPTIONAL
+    )
+{
+    PXENBUS_DEBUG_CONTEXT       Context = Interface->Context;
+    KIRQL                       Irql;
+
+    if (Statistic == NULL)
+        return;
+
+    AcquireHighLock(&Context->CallbackLock, &Irql);
+    RemoveEntryList(&Statistic->ListEntry);
+    ReleaseHighLock(&Context->CallbackLock, Irql);
+
+    __DebugFree(Statistic->Buffer);
+    __DebugFree(Statistic);
+}
+
+static VOID
+DebugStatisticSnapshot(
+    IN  PXENBUS_DEBUG_CONTEXT               Context,
+    IN  PXENBUS_DEBUG_STATISTIC             Statistic,
+    OUT PXENBUS_DEBUG_STATISTIC_SNAPSHOT    Snapshot
+    )
+{
+    ULONG                                   Cpu;
+    ULONG                                   Index;
+
+    RtlZeroMemory(Snapshot, sizeof (XENBUS_DEBUG_STATISTIC_SNAPSHOT));
+
+    Snapshot->Type = Statistic->Type;
+    if (Statistic->Type == XENBUS_DEBUG_STATISTIC_TYPE_TIME)
+        Snapshot->Frequency = Context->Frequency.QuadPart;
+    else if (Statistic->Type == XENBUS_DEBUG_STATISTIC_TYPE_CYCLES)
+        Snapshot->Frequency = Context->CycleFrequency;
+
+    for (Cpu = 0; Cpu < Statistic->ProcessorCount; Cpu++) {
+        PXENBUS_DEBUG_STATISTIC_PROCESSOR   Processor = &Statistic->Processor[Cpu];
+
+        Snapshot->Count += Processor->Count;
+        Snapshot->Sum += Processor->Sum;
+        Snapshot->Maximum = __max(Snapshot->Maximum,
+                                  (ULONGLONG)Processor->Maximum);
+
+        for (Index = 0; Index < XENBUS_DEBUG_STATISTIC_BUCKET_COUNT; Index++)
+            Snapshot->Bucket[Index] += Processor->Bucket[Index];
+    }
+}
+
+// Return the (exclusive) upper bound of the bucket containing the
+// given percentile.
+static ULONGLONG
+DebugStatisticPercentile(
+    IN  PXENBUS_DEBUG_STATISTIC_SNAPSHOT    Snapshot,
+    IN  ULONG                               Percentile
+    )
+{
+    ULONGLONG                               Target;
+    ULONGLONG                               Total;
+    ULONG                                   Index;
+
+    Target = ((Snapshot->Count * Percentile) + 99) / 100;
+
+    Total = 0;
+    for (Index = 0; Index < XENBUS_DEBUG_STATISTIC_BUCKET_COUNT - 1; Index++) {
+        Total += Snapshot->Bucket[Index];
+        if (Total >= Target)
+            return 1ull << Index;
+    }
+
+    return Snapshot->Maximum;
+}
+
+static VOID
+DebugDumpStatistics(
+    IN  PXENBUS_DEBUG_CONTEXT   Context
+    )
+{
+    PLIST_ENTRY                 ListEntry;
+
+    for (ListEntry = Context->StatisticList.Flink;
+         ListEntry != &Context->StatisticList;
+         ListEntry = ListEntry->Flink) {
+        PXENBUS_DEBUG_STATISTIC         Statistic;
+        XENBUS_DEBUG_STATISTIC_SNAPSHOT Snapshot;
+        ULONGLONG                       Value[5];
+        ULONG                           Index;
+
+        Statistic = CONTAINING_RECORD(ListEntry,
+                                      XENBUS_DEBUG_STATISTIC,
+                                      ListEntry);
+
+        DebugStatisticSnapshot(Context, Statistic, &Snapshot);
+
+        if (Snapshot.Count == 0)
+            continue;
+
+        Value[0] = Snapshot.Sum / Snapshot.Count;
+        Value[1] = DebugStatisticPercentile(&Snapshot, 50);
+        Value[2] = DebugStatisticPercentile(&Snapshot, 90);
+        Value[3] = DebugStatisticPercentile(&Snapshot, 99);
+        Value[4] = Snapshot.Maximum;
+
+        if (Statistic->Type == XENBUS_DEBUG_STATISTIC_TYPE_TIME) {
+            for (Index = 0; Index < ARRAYSIZE(Value); Index++)
+                Value[Index] = __DebugTicksToMicroseconds(Context, Value[Index]);
+        } else if (Statistic->Type == XENBUS_DEBUG_STATISTIC_TYPE_CYCLES) {
+            for (Index = 0; Index < ARRAYSIZE(Value); Index++)
+                Value[Index] = __DebugCyclesToMicroseconds(Context, Value[Index]);
+        }
+
+        LogPrintf(LOG_LEVEL_INFO,
+                  "XEN|DEBUG: %s: COUNT = %llu MEAN = %llu P50 < %llu P90 < %llu P99 < %llu MAX = %llu%s\n",
+                  Statistic->Name,
+                  Snapshot.Count,
+                  Value[0],
+                  Value[1],
+                  Value[2],
+                  Value[3],
+                  Value[4],
+                  (Statistic->Type != XENBUS_DEBUG_STATISTIC_TYPE_VALUE) ? " (us)" : "");
     }
 }
 
@@ -233,11 +709,131 @@ DebugTriggerLocked(
 
             DebugCallback(Context, Callback, Crashing);
         }
+
+        DebugDumpStatistics(Context);
     } else {
         DebugCallback(Context, Callback, Crashing);
     }
 }
     
+static PXENBUS_DEBUG_CALLBACK
+DebugDispatchNext(
+    IN  PXENBUS_DEBUG_CONTEXT   Context
+    )
+{
+    PXENBUS_DEBUG_CALLBACK      Callback;
+    KIRQL                       Irql;
+
+    Callback = NULL;
+
+    AcquireHighLock(&Context->CallbackLock, &Irql);
+
+    while (Context->DispatchCursor != &Context->CallbackList) {
+        Callback = CONTAINING_RECORD(Context->DispatchCursor,
+                                     XENBUS_DEBUG_CALLBACK,
+                                     ListEntry);
+
+        Context->DispatchCursor = Context->DispatchCursor->Flink;
+
+        // If the callback is being directly triggered then its output
+        // is already on the way so skip it
+        if (InterlockedCompareExchange(&Callback->Busy, 1, 0) == 0) {
+            __DebugCallbackReference(Callback);
+            break;
+        }
+
+        Callback = NULL;
+    }
+
+    ReleaseHighLock(&Context->CallbackLock, Irql);
+
+    return Callback;
+}
+
+static
+_Function_class_(KDEFERRED_ROUTINE)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_min_(DISPATCH_LEVEL)
+_IRQL_requires_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+VOID
+DebugWorkerDpc(
+    IN  PKDPC               Dpc,
+    IN  PVOID               _Context,
+    IN  PVOID               Argument1,
+    IN  PVOID               Argument2
+    )
+{
+    PXENBUS_DEBUG_CONTEXT   Context = _Context;
+    PXENBUS_DEBUG_CALLBACK  Callback;
+    KIRQL                   Irql;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(Argument1);
+    UNREFERENCED_PARAMETER(Argument2);
+
+    ASSERT(Context != NULL);
+
+    while ((Callback = DebugDispatchNext(Context)) != NULL) {
+        LARGE_INTEGER   Now;
+        ULONGLONG       Elapsed;
+
+        Now = KeQueryPerformanceCounter(NULL);
+        Elapsed = __DebugTicksToMicroseconds(Context,
+                                             Now.QuadPart -
+                                             Context->DispatchStart.QuadPart);
+
+        if (Elapsed > XENBUS_DEBUG_DISPATCH_BUDGET)
+            LogPrintf(LOG_LEVEL_INFO,
+                      "XEN|DEBUG: SKIPPING %p PREFIX '%s' (BUDGET EXHAUSTED)\n",
+                      Callback->Function,
+                      Callback->Prefix);
+        else
+            DebugCallback(Context, Callback, FALSE);
+
+        (VOID) InterlockedExchange(&Callback->Busy, 0);
+        __DebugCallbackDereference(Callback);
+    }
+
+    if (InterlockedDecrement(&Context->WorkersActive) != 0)
+        return;
+
+    AcquireHighLock(&Context->CallbackLock, &Irql);
+    DebugDumpStatistics(Context);
+    ReleaseHighLock(&Context->CallbackLock, Irql);
+
+    LogPrintf(LOG_LEVEL_INFO, "XEN|DEBUG: <==== DISPATCH\n");
+
+    (VOID) InterlockedExchange(&Context->Dispatching, 0);
+}
+
+static VOID
+DebugDispatch(
+    IN  PXENBUS_DEBUG_CONTEXT   Context
+    )
+{
+    KIRQL                       Irql;
+    ULONG                       Index;
+
+    // Only one dispatch can be in progress at a time; any trigger that
+    // arrives in the meantime is covered by it.
+    if (InterlockedCompareExchange(&Context->Dispatching, 1, 0) != 0)
+        return;
+
+    LogPrintf(LOG_LEVEL_INFO, "XEN|DEBUG: ====> DISPATCH\n");
+
+    AcquireHighLock(&Context->CallbackLock, &Irql);
+    Context->DispatchCursor = Context->CallbackList.Flink;
+    Context->DispatchStart = KeQueryPerformanceCounter(NULL);
+    ReleaseHighLock(&Context->CallbackLock, Irql);
+
+    Context->WorkersActive = Context->WorkerCount;
+    KeMemoryBarrier();
+
+    for (Index = 0; Index < Context->WorkerCount; Index++)
+        (VOID) KeInsertQueueDpc(&Context->WorkerDpc[Index], NULL, NULL);
+}
+
 static VOID
 DebugTrigger(
     IN  PINTERFACE              Interface,
@@ -249,9 +845,29 @@ DebugTrigger(
 
     Trace("====>\n");
 
-    AcquireHighLock(&Context->CallbackLock, &Irql);
-    DebugTriggerLocked(Context, Callback, FALSE);
-    ReleaseHighLock(&Context->CallbackLock, Irql);
+    if (Callback == NULL) {
+        // The full set of callbacks is invoked asynchronously by DPCs,
+        // possibly spread across several CPUs, so this may be called
+        // at any IRQL without stalling the caller.
+        DebugDispatch(Context);
+    } else {
+        // The caller's registration keeps the callback on the list, so
+        // there is no need for the lock. Take a reference in case the
+        // callback deregisters itself, and don't invoke it if a
+        // dispatch worker already is.
+        KeRaiseIrql(__max(KeGetCurrentIrql(), DISPATCH_LEVEL), &Irql);
+
+        if (InterlockedCompareExchange(&Callback->Busy, 1, 0) == 0) {
+            __DebugCallbackReference(Callback);
+
+            DebugCallback(Context, Callback, FALSE);
+
+            (VOID) InterlockedExchange(&Callback->Busy, 0);
+            __DebugCallbackDereference(Callback);
+        }
+
+        KeLowerIrql(Irql);
+    }
 
     Trace("<====\n");
 }
@@ -357,13 +973,171 @@ static struct _XENBUS_DEBUG_INTERFACE_V1 DebugInterfaceVersion1 = {
     DebugTrigger,
     DebugDeregister
 };
-                     
+
+static struct _XENBUS_DEBUG_INTERFACE_V2 DebugInterfaceVersion2 = {
+    { sizeof (struct _XENBUS_DEBUG_INTERFACE_V2), 2, NULL, NULL, NULL },
+    DebugAcquire,
+    DebugRelease,
+    DebugRegister,
+    DebugPrintf,
+    DebugTrigger,
+    DebugDeregister,
+    DebugStatisticCreate,
+    DebugStatisticRecord,
+    DebugStatisticDestroy
+};
+
+static VOID
+DebugSnapshotStatistics(
+    IN  PXENBUS_DEBUG_CONTEXT       Context,
+    IN  HANDLE                      Key
+    )
+{
+    ULONG                           Index;
+
+    // The registry can only be written at PASSIVE_LEVEL so each
+    // statistic is snapshotted under the lock and then written out
+    // after it is dropped.
+    for (Index = 0;; Index++) {
+        PLIST_ENTRY                     ListEntry;
+        PXENBUS_DEBUG_STATISTIC         Statistic;
+        CHAR                            Name[MAXIMUM_STATISTIC_NAME_LENGTH];
+        XENBUS_DEBUG_STATISTIC_SNAPSHOT Snapshot;
+        ULONG                           Count;
+        KIRQL                           Irql;
+
+        AcquireHighLock(&Context->CallbackLock, &Irql);
+
+        Statistic = NULL;
+        Count = 0;
+
+        for (ListEntry = Context->StatisticList.Flink;
+             ListEntry != &Context->StatisticList;
+             ListEntry = ListEntry->Flink) {
+            if (Count++ == Index) {
+                Statistic = CONTAINING_RECORD(ListEntry,
+                                              XENBUS_DEBUG_STATISTIC,
+                                              ListEntry);
+                break;
+            }
+        }
+
+        if (Statistic != NULL) {
+            RtlCopyMemory(Name, Statistic->Name, sizeof (Name));
+            DebugStatisticSnapshot(Context, Statistic, &Snapshot);
+        }
+
+        ReleaseHighLock(&Context->CallbackLock, Irql);
+
+        if (Statistic == NULL)
+            break;
+
+        (VOID) RegistryUpdateBinaryValue(Key,
+                                         Name,
+                                         &Snapshot,
+                                         sizeof (Snapshot));
+    }
+}
+
+#define TIME_US(_us)        ((_us) * 10)
+#define TIME_MS(_ms)        (TIME_US((_ms) * 1000))
+#define TIME_S(_s)          (TIME_MS((_s) * 1000))
+#define TIME_RELATIVE(_t)   (-(_t))
+
+#define XENBUS_DEBUG_SNAPSHOT_PERIOD    30
+
+static NTSTATUS
+DebugSnapshot(
+    IN  PXENBUS_THREAD      Self,
+    IN  PVOID               _Context
+    )
+{
+    PXENBUS_DEBUG_CONTEXT   Context = _Context;
+    HANDLE                  ServiceKey;
+    HANDLE                  StatisticsKey;
+    LARGE_INTEGER           Timeout;
+    NTSTATUS                status;
+
+    Trace("====>\n");
+
+    status = RegistryOpenServiceKey(KEY_ALL_ACCESS, &ServiceKey);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    status = RegistryCreateSubKey(ServiceKey,
+                                  "Statistics",
+                                  REG_OPTION_VOLATILE,
+                                  &StatisticsKey);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    RegistryCloseKey(ServiceKey);
+
+    Timeout.QuadPart = TIME_RELATIVE(TIME_S(XENBUS_DEBUG_SNAPSHOT_PERIOD));
+
+    for (;;) {
+        PKEVENT Event;
+
+        Event = ThreadGetEvent(Self);
+
+        (VOID) KeWaitForSingleObject(Event,
+                                     Executive,
+                                     KernelMode,
+                                     FALSE,
+                                     &Timeout);
+        KeClearEvent(Event);
+
+        if (ThreadIsAlerted(Self))
+            break;
+
+        DebugSnapshotStatistics(Context, StatisticsKey);
+    }
+
+    RegistryCloseKey(StatisticsKey);
+
+    Trace("<====\n");
+
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+    RegistryCloseKey(ServiceKey);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static ULONG
+DebugGetWorkerCount(
+    VOID
+    )
+{
+    CHAR            Key[] = "XEN:DEBUG_WORKERS=";
+    PANSI_STRING    Option;
+    ULONG           Value;
+    NTSTATUS        status;
+
+    status = RegistryQuerySystemStartOption(Key, &Option);
+    if (!NT_SUCCESS(status))
+        return XENBUS_DEBUG_DEFAULT_WORKER_COUNT;
+
+    Value = strtoul(Option->Buffer + sizeof (Key) - 1, NULL, 0);
+
+    RegistryFreeSzValue(Option);
+
+    return __max(Value, 1);
+}
+
 NTSTATUS
 DebugInitialize(
     IN  PXENBUS_FDO             Fdo,
     OUT PXENBUS_DEBUG_CONTEXT   *Context
     )
 {
+    ULONG                       Index;
     NTSTATUS                    status;
 
     Trace("====>\n");
@@ -375,14 +1149,85 @@ DebugInitialize(
         goto fail1;
 
     InitializeListHead(&(*Context)->CallbackList);
+    InitializeListHead(&(*Context)->StatisticList);
     KeInitializeSpinLock(&(*Context)->Lock);
 
+    (VOID) KeQueryPerformanceCounter(&(*Context)->Frequency);
+    DebugCalibrateCycles(*Context);
+
+    (*Context)->ProcessorCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    (*Context)->CallbackPrefix = __DebugAllocate(sizeof (const CHAR *) *
+                                                 (*Context)->ProcessorCount);
+
+    status = STATUS_NO_MEMORY;
+    if ((*Context)->CallbackPrefix == NULL)
+        goto fail2;
+
+    (*Context)->WorkerCount = __min(DebugGetWorkerCount(),
+                                    KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS));
+    (*Context)->WorkerDpc = __DebugAllocate(sizeof (KDPC) *
+                                            (*Context)->WorkerCount);
+
+    status = STATUS_NO_MEMORY;
+    if ((*Context)->WorkerDpc == NULL)
+        goto fail3;
+
+    for (Index = 0; Index < (*Context)->WorkerCount; Index++) {
+        PKDPC               Dpc = &(*Context)->WorkerDpc[Index];
+        PROCESSOR_NUMBER    ProcNumber;
+
+        status = KeGetProcessorNumberFromIndex(Index, &ProcNumber);
+        ASSERT(NT_SUCCESS(status));
+
+        KeInitializeDpc(Dpc, DebugWorkerDpc, *Context);
+        KeSetImportanceDpc(Dpc, LowImportance);
+
+        status = KeSetTargetProcessorDpcEx(Dpc, &ProcNumber);
+        ASSERT(NT_SUCCESS(status));
+    }
+
+    Info("%u WORKER(S)\n", (*Context)->WorkerCount);
+
+    status = ThreadCreate(DebugSnapshot,
+                          *Context,
+                          &(*Context)->SnapshotThread);
+    if (!NT_SUCCESS(status))
+        goto fail4;
+
     (*Context)->Fdo = Fdo;
 
     Trace("<====\n");
 
     return STATUS_SUCCESS;
 
+fail4:
+    Error("fail4\n");
+
+    __DebugFree((*Context)->WorkerDpc);
+    (*Context)->WorkerDpc = NULL;
+
+fail3:
+    Error("fail3\n");
+
+    (*Context)->WorkerCount = 0;
+
+    __DebugFree((PVOID)(*Context)->CallbackPrefix);
+    (*Context)->CallbackPrefix = NULL;
+
+fail2:
+    Error("fail2\n");
+
+    (*Context)->ProcessorCount = 0;
+    (*Context)->CycleFrequency = 0;
+    (*Context)->Frequency.QuadPart = 0;
+
+    RtlZeroMemory(&(*Context)->Lock, sizeof (KSPIN_LOCK));
+    RtlZeroMemory(&(*Context)->StatisticList, sizeof (LIST_ENTRY));
+    RtlZeroMemory(&(*Context)->CallbackList, sizeof (LIST_ENTRY));
+
+    ASSERT(IsZeroMemory(*Context, sizeof (XENBUS_DEBUG_CONTEXT)));
+    __DebugFree(*Context);
+
 fail1:
     Error("fail1 (%08x)\n", status);
 
@@ -419,6 +1264,23 @@ DebugGetInterface(
         status = STATUS_SUCCESS;
         break;
     }
+    case 2: {
+        struct _XENBUS_DEBUG_INTERFACE_V2   *DebugInterface;
+
+        DebugInterface = (struct _XENBUS_DEBUG_INTERFACE_V2 *)Interface;
+
+        status = STATUS_BUFFER_OVERFLOW;
+        if (Size < sizeof (struct _XENBUS_DEBUG_INTERFACE_V2))
+            break;
+
+        *DebugInterface = DebugInterfaceVersion2;
+
+        ASSERT3U(Interface->Version, ==, Version);
+        Interface->Context = Context;
+
+        status = STATUS_SUCCESS;
+        break;
+    }
     default:
         status = STATUS_NOT_SUPPORTED;
         break;
@@ -444,7 +1306,32 @@ DebugTeardown(
 
     Context->Fdo = NULL;
 
+    ThreadAlert(Context->SnapshotThread);
+    ThreadJoin(Context->SnapshotThread);
+    Context->SnapshotThread = NULL;
+
+    KeFlushQueuedDpcs();
+
+    ASSERT3U(Context->Dispatching, ==, 0);
+    Context->DispatchCursor = NULL;
+    Context->DispatchStart.QuadPart = 0;
+
+    __DebugFree(Context->WorkerDpc);
+    Context->WorkerDpc = NULL;
+    Context->WorkerCount = 0;
+
+    __DebugFree((PVOID)Context->CallbackPrefix);
+    Context->CallbackPrefix = NULL;
+    Context->ProcessorCount = 0;
+
+    if (!IsListEmpty(&Context->StatisticList))
+        BUG("OUTSTANDING STATISTICS");
+
+    Context->CycleFrequency = 0;
+    Context->Frequency.QuadPart = 0;
+
     RtlZeroMemory(&Context->Lock, sizeof (KSPIN_LOCK));
+    RtlZeroMemory(&Context->StatisticList, sizeof (LIST_ENTRY));
     RtlZeroMemory(&Context->CallbackList, sizeof (LIST_ENTRY));
 
     ASSERT(IsZeroMemory(Context, sizeof (XENBUS_DEBUG_CONTEXT)));
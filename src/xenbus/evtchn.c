@@ -112,6 +112,7 @@ struct _XENBUS_EVTCHN_CONTEXT {
     PXENBUS_SUSPEND_CALLBACK        SuspendCallbackLate;
     XENBUS_DEBUG_INTERFACE          DebugInterface;
     PXENBUS_DEBUG_CALLBACK          DebugCallback;
+    PXENBUS_DEBUG_STATISTIC         CallbackStatistic;
     XENBUS_SHARED_INFO_INTERFACE    SharedInfoInterface;
     PXENBUS_EVTCHN_ABI_CONTEXT      EvtchnTwoLevelContext;
     PXENBUS_EVTCHN_ABI_CONTEXT      EvtchnFifoContext;
@@ -530,6 +531,8 @@ EvtchnPoll(
     PXENBUS_EVTCHN_PROCESSOR    Processor;
     BOOLEAN                     DoneSomething;
     PLIST_ENTRY                 ListEntry;
+    ULONGLONG                   Start;
+    ULONGLONG                   End;
 
     ASSERT3U(Cpu, <, Context->ProcessorCount);
     Processor = &Context->Processor[Cpu];
@@ -587,8 +590,17 @@ EvtchnPoll(
 	    KeMemoryBarrier();
             Channel->Count++;
 
+            Start = __rdtsc();
+
 #pragma warning(suppress:6387)  // NULL argument
             DoneSomething |= Channel->Callback(NULL, Channel->Argument);
+
+            End = __rdtsc();
+
+            XENBUS_DEBUG(StatisticRecord,
+                         &Context->DebugInterface,
+                         Context->CallbackStatistic,
+                         End - Start);
         } else if (List != NULL) {
             ASSERT(Channel->Pending != 0);
 
@@ -1551,6 +1563,12 @@ EvtchnAcquire(
     if (!NT_SUCCESS(status))
         goto fail5;
 
+    (VOID) XENBUS_DEBUG(StatisticCreate,
+                        &Context->DebugInterface,
+                        "EVTCHN|CALLBACK",
+                        XENBUS_DEBUG_STATISTIC_TYPE_CYCLES,
+                        &Context->CallbackStatistic);
+
     status = XENBUS_SHARED_INFO(Acquire, &Context->SharedInfoInterface);
     if (!NT_SUCCESS(status))
         goto fail6;
@@ -1656,6 +1674,11 @@ fail7:
 fail6:
     Error("fail6\n");
 
+    XENBUS_DEBUG(StatisticDestroy,
+                 &Context->DebugInterface,
+                 Context->CallbackStatistic);
+    Context->CallbackStatistic = NULL;
+
     XENBUS_DEBUG(Deregister,
                  &Context->DebugInterface,
                  Context->DebugCallback);
@@ -1752,6 +1775,11 @@ EvtchnRelease(
 
     XENBUS_SHARED_INFO(Release, &Context->SharedInfoInterface);
 
+    XENBUS_DEBUG(StatisticDestroy,
+                 &Context->DebugInterface,
+                 Context->CallbackStatistic);
+    Context->CallbackStatistic = NULL;
+
     XENBUS_DEBUG(Deregister,
                  &Context->DebugInterface,
                  Context->DebugCallback);
@@ -67,17 +67,19 @@ __EvtchnTwoLevelFree(
 
 static BOOLEAN
 EvtchnTwoLevelIsProcessorEnabled(
-    IN  PXENBUS_EVTCHN_ABI_CONTEXT  _Context,
-    IN  ULONG                       Index
+    IN  PXENBUS_EVTCHN_ABI_CONTEXT      _Context,
+    IN  ULONG                           Index
     )
 {
-    UNREFERENCED_PARAMETER(_Context);
+    PXENBUS_EVTCHN_TWO_LEVEL_CONTEXT    Context = (PVOID)_Context;
 
     //
-    // We currently rely on using the vcpu_info array that is embedded
-    // in the shared_info.
+    // A vCPU can only receive upcalls if it has a vcpu_info, either
+    // embedded in the shared_info or registered separately.
     //
-    return (Index < XEN_LEGACY_MAX_VCPUS) ? TRUE : FALSE;
+    return XENBUS_SHARED_INFO(IsProcessorEnabled,
+                              &Context->SharedInfoInterface,
+                              Index);
 }
 
 static BOOLEAN
@@ -80,15 +80,58 @@ struct _XENBUS_INTERRUPT {
     PVOID               Argument;
 };
 
+#define FDO_HOLE_ORDER              PAGE_ORDER_2M
+#define FDO_HOLE_PAGES              (1u << FDO_HOLE_ORDER)
+#define FDO_HOLE_SIZE               (FDO_HOLE_PAGES * PAGE_SIZE)
+#define FDO_HOLE_MAXIMUM_REGIONS    64
+
+// Each region of the hole is a 2M chunk of memory whose backing has
+// been handed back to Xen. Pages within a region are handed out by a
+// binary buddy allocator: Bitmap[Order] has a bit set for each free,
+// naturally aligned, block of 2^Order pages and Blocks[Order] counts
+// them.
+typedef struct _XENBUS_HOLE_REGION {
+    LIST_ENTRY  ListEntry;
+    PUCHAR      Buffer;
+    PMDL        Mdl;
+    PFN_NUMBER  Pfn;
+    BOOLEAN     Primary;
+    BOOLEAN     Reserved;
+    ULONG       Free;
+    ULONG       Blocks[FDO_HOLE_ORDER + 1];
+    ULONG       Bitmap[FDO_HOLE_ORDER + 1][FDO_HOLE_PAGES / 32];
+} XENBUS_HOLE_REGION, *PXENBUS_HOLE_REGION;
+
+#define FDO_WORK_MAXIMUM_THREADS    8
+
+typedef struct _XENBUS_FDO_WORK XENBUS_FDO_WORK, *PXENBUS_FDO_WORK;
+
+// There is one VIRQ per CPU for each type and its Count is updated from
+// that CPU's callback, so each allocation is padded out to a whole number
+// of cache lines to keep VIRQs for different CPUs from sharing one.
+
+#define XENBUS_VIRQ_LENGTH                      \
+        (sizeof (PXENBUS_FDO) +                 \
+         sizeof (LIST_ENTRY) +                  \
+         sizeof (PXENBUS_EVTCHN_CHANNEL) +      \
+         (sizeof (ULONG) * 3) +                 \
+         sizeof (LONG))
+
 typedef struct _XENBUS_VIRQ {
     PXENBUS_FDO             Fdo;
     LIST_ENTRY              ListEntry;
-    ULONG                   Type;
     PXENBUS_EVTCHN_CHANNEL  Channel;
+    ULONG                   Type;
     ULONG                   Cpu;
     ULONG                   Count;
+    LONG                    Generation;
+    UCHAR                   Pad[P2ROUNDUP(XENBUS_VIRQ_LENGTH,
+                                          SYSTEM_CACHE_ALIGNMENT_SIZE) -
+                                XENBUS_VIRQ_LENGTH];
 } XENBUS_VIRQ, *PXENBUS_VIRQ;
 
+C_ASSERT((sizeof (XENBUS_VIRQ) % SYSTEM_CACHE_ALIGNMENT_SIZE) == 0);
+
 struct _XENBUS_FDO {
     PXENBUS_DX                      Dx;
     PDEVICE_OBJECT                  LowerDeviceObject;
@@ -112,6 +155,28 @@ struct _XENBUS_FDO {
     PXENBUS_THREAD                  ScanThread;
     KEVENT                          ScanEvent;
     PXENBUS_STORE_WATCH             ScanWatch;
+    LARGE_INTEGER                   ScanParametersTime;
+    BOOLEAN                         ScanParametersValid;
+    ULONG                           ScanEnumerate;
+    PANSI_STRING                    ScanSyntheticClasses;
+    PANSI_STRING                    ScanSupportedClasses;
+    ULONG                           ScanWakeups;
+    ULONG                           ScanCoalesced;
+    ULONG                           ScanSynchronous;
+    ULONG                           ScanCount;
+    ULONG                           ScanParametersRefreshes;
+    ULONG                           EnumerateCount;
+    ULONG                           EnumerateInvalidations;
+    ULONGLONG                       EnumerateTime;
+    PXENBUS_THREAD                  WorkThread[FDO_WORK_MAXIMUM_THREADS - 1];
+    ULONG                           WorkThreadCount;
+    PXENBUS_FDO_WORK                Work;
+    LONG                            WorkPending;
+    KEVENT                          WorkDone;
+    ULONG                           WorkRuns;
+    LONG                            WorkItems;
+    ULONGLONG                       WorkTime;
+    ULONGLONG                       WorkMaximumTime;
 
     PXENBUS_THREAD                  SuspendThread;
     KEVENT                          SuspendEvent;
@@ -138,22 +203,31 @@ struct _XENBUS_FDO {
     PXENBUS_GNTTAB_CONTEXT          GnttabContext;
     PXENBUS_UNPLUG_CONTEXT          UnplugContext;
     PXENBUS_BALLOON_CONTEXT         BalloonContext;
+    PXENBUS_TIMER_CONTEXT           TimerContext;
 
     XENBUS_DEBUG_INTERFACE          DebugInterface;
     XENBUS_SUSPEND_INTERFACE        SuspendInterface;
     XENBUS_EVTCHN_INTERFACE         EvtchnInterface;
     XENBUS_STORE_INTERFACE          StoreInterface;
     XENBUS_CONSOLE_INTERFACE        ConsoleInterface;
-    XENBUS_RANGE_SET_INTERFACE      RangeSetInterface;
     XENBUS_BALLOON_INTERFACE        BalloonInterface;
 
     PUCHAR                          Buffer;
     PMDL                            Mdl;
-    PXENBUS_RANGE_SET               RangeSet;
+    HIGH_LOCK                       HoleLock;
+    LIST_ENTRY                      HoleList;
+    LIST_ENTRY                      HoleReleaseList;
+    PXENBUS_THREAD                  HoleThread;
+    ULONG                           HoleCount;
+    ULONG                           HoleGrows;
+    ULONG                           HoleShrinks;
+    LONG                            HoleFailures;
     LIST_ENTRY                      InterruptList;
 
     LIST_ENTRY                      VirqList;
-    HIGH_LOCK                       VirqLock;
+    LONG                            VirqTimerCount;
+    LONG                            VirqRemaining;
+    LONG                            VirqGeneration;
 
     ULONG                           Watchdog;
 
@@ -923,6 +997,7 @@ DEFINE_FDO_GET_CONTEXT(Cache, PXENBUS_CACHE_CONTEXT)
 DEFINE_FDO_GET_CONTEXT(Gnttab, PXENBUS_GNTTAB_CONTEXT)
 DEFINE_FDO_GET_CONTEXT(Unplug, PXENBUS_UNPLUG_CONTEXT)
 DEFINE_FDO_GET_CONTEXT(Balloon, PXENBUS_BALLOON_CONTEXT)
+DEFINE_FDO_GET_CONTEXT(Timer, PXENBUS_TIMER_CONTEXT)
 
 __drv_functionClass(IO_COMPLETION_ROUTINE)
 __drv_sameIRQL
@@ -1147,6 +1222,360 @@ FdoReleaseMutex(
     }
 }
 
+#define TIME_US(_us)            ((_us) * 10ll)
+#define TIME_MS(_ms)            (TIME_US((_ms) * 1000ll))
+#define TIME_S(_s)              (TIME_MS((_s) * 1000ll))
+#define TIME_RELATIVE(_t)       (-(_t))
+
+static VOID
+FdoSortAnsi(
+    IN  PANSI_STRING    *Ansi,
+    IN  ULONG           Count
+    )
+{
+    ULONG               Index;
+
+    // The class list is short so an insertion sort is fine
+    for (Index = 1; Index < Count; Index++) {
+        PANSI_STRING    Entry = Ansi[Index];
+        ULONG           Slot;
+
+        for (Slot = Index;
+             Slot != 0 && strcmp(Ansi[Slot - 1]->Buffer, Entry->Buffer) > 0;
+             --Slot)
+            Ansi[Slot] = Ansi[Slot - 1];
+
+        Ansi[Slot] = Entry;
+    }
+}
+
+// The entries of Ansi all point into a single array so sorting them by
+// address puts them back into the order of that array.
+static VOID
+FdoSortAnsiByAddress(
+    IN  PANSI_STRING    *Ansi,
+    IN  ULONG           Count
+    )
+{
+    ULONG               Index;
+
+    for (Index = 1; Index < Count; Index++) {
+        PANSI_STRING    Entry = Ansi[Index];
+        ULONG           Slot;
+
+        for (Slot = Index;
+             Slot != 0 && Ansi[Slot - 1] > Entry;
+             --Slot)
+            Ansi[Slot] = Ansi[Slot - 1];
+
+        Ansi[Slot] = Entry;
+    }
+}
+
+static VOID
+FdoSortPdos(
+    IN  PXENBUS_PDO *Pdo,
+    IN  ULONG       Count
+    )
+{
+    ULONG           Index;
+
+    for (Index = 1; Index < Count; Index++) {
+        PXENBUS_PDO Entry = Pdo[Index];
+        ULONG       Slot;
+
+        for (Slot = Index;
+             Slot != 0 && strcmp(PdoGetName(Pdo[Slot - 1]), PdoGetName(Entry)) > 0;
+             --Slot)
+            Pdo[Slot] = Pdo[Slot - 1];
+
+        Pdo[Slot] = Entry;
+    }
+}
+
+typedef VOID
+(*XENBUS_FDO_WORK_FUNCTION)(
+    IN  PXENBUS_FDO Fdo,
+    IN  PVOID       Argument,
+    IN  ULONG       Index
+    );
+
+struct _XENBUS_FDO_WORK {
+    PXENBUS_FDO                 Fdo;
+    XENBUS_FDO_WORK_FUNCTION    Function;
+    PVOID                       Argument;
+    ULONG                       Count;
+    LONG                        Next;
+    PULONGLONG                  Time;
+};
+
+static VOID
+FdoWorkRun(
+    IN  PXENBUS_FDO_WORK    Work
+    )
+{
+    PXENBUS_FDO             Fdo = Work->Fdo;
+
+    for (;;) {
+        ULONG           Index;
+        LARGE_INTEGER   Frequency;
+        LARGE_INTEGER   Start;
+        LARGE_INTEGER   End;
+        ULONGLONG       Time;
+        ULONGLONG       Maximum;
+
+        Index = (ULONG)InterlockedIncrement(&Work->Next) - 1;
+        if (Index >= Work->Count)
+            break;
+
+        Start = KeQueryPerformanceCounter(&Frequency);
+
+        Work->Function(Fdo, Work->Argument, Index);
+
+        End = KeQueryPerformanceCounter(NULL);
+
+        Time = ((End.QuadPart - Start.QuadPart) * 1000000ull) /
+               Frequency.QuadPart;
+
+        if (Work->Time != NULL)
+            Work->Time[Index] = Time;
+
+        InterlockedIncrement(&Fdo->WorkItems);
+        (VOID) InterlockedAdd64((PLONG64)&Fdo->WorkTime, (LONG64)Time);
+
+        do {
+            Maximum = Fdo->WorkMaximumTime;
+            if (Time <= Maximum)
+                break;
+        } while (InterlockedCompareExchange64((PLONG64)&Fdo->WorkMaximumTime,
+                                              (LONG64)Time,
+                                              (LONG64)Maximum) != (LONG64)Maximum);
+    }
+}
+
+static NTSTATUS
+FdoWorkThread(
+    IN  PXENBUS_THREAD  Self,
+    IN  PVOID           Context
+    )
+{
+    PXENBUS_FDO         Fdo = Context;
+    PKEVENT             Event;
+
+    Trace("====>\n");
+
+    Event = ThreadGetEvent(Self);
+
+    for (;;) {
+        (VOID) KeWaitForSingleObject(Event,
+                                     Executive,
+                                     KernelMode,
+                                     FALSE,
+                                     NULL);
+        KeClearEvent(Event);
+
+        if (ThreadIsAlerted(Self))
+            break;
+
+        FdoWorkRun(Fdo->Work);
+
+        if (InterlockedDecrement(&Fdo->WorkPending) == 0)
+            KeSetEvent(&Fdo->WorkDone, IO_NO_INCREMENT, FALSE);
+    }
+
+    Trace("<====\n");
+
+    return STATUS_SUCCESS;
+}
+
+// The helper threads live as long as the scan thread, which is the only
+// thing that uses them. Failing to create one is not fatal; there is just
+// less help.
+static VOID
+FdoWorkInitialize(
+    IN  PXENBUS_FDO Fdo
+    )
+{
+    ULONG           Threads;
+    ULONG           Index;
+    NTSTATUS        status;
+
+    KeInitializeEvent(&Fdo->WorkDone, SynchronizationEvent, FALSE);
+
+    Threads = __min(KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS),
+                    FDO_WORK_MAXIMUM_THREADS);
+
+    // The calling thread does its share
+    Threads = (Threads != 0) ? Threads - 1 : 0;
+
+    for (Index = 0; Index < Threads; Index++) {
+        status = ThreadCreate(FdoWorkThread, Fdo, &Fdo->WorkThread[Index]);
+        if (!NT_SUCCESS(status))
+            break;
+    }
+
+    Fdo->WorkThreadCount = Index;
+}
+
+static VOID
+FdoWorkTeardown(
+    IN  PXENBUS_FDO Fdo
+    )
+{
+    ULONG           Index;
+
+    for (Index = 0; Index < Fdo->WorkThreadCount; Index++) {
+        ThreadAlert(Fdo->WorkThread[Index]);
+        ThreadJoin(Fdo->WorkThread[Index]);
+        Fdo->WorkThread[Index] = NULL;
+    }
+
+    Fdo->WorkThreadCount = 0;
+
+    RtlZeroMemory(&Fdo->WorkDone, sizeof (KEVENT));
+}
+
+// Run Function for each Index in [0, Count) using the calling thread and
+// as many of the helper threads as can usefully be employed. All items
+// have completed when this function returns. If Time is not NULL then
+// it must have room for Count entries and will be filled in with the
+// time taken for each item, in microseconds.
+// NOTE: Only the scan thread calls this so there is never more than one
+//       piece of work outstanding.
+static VOID
+FdoRunWork(
+    IN  PXENBUS_FDO                 Fdo,
+    IN  XENBUS_FDO_WORK_FUNCTION    Function,
+    IN  PVOID                       Argument,
+    IN  ULONG                       Count,
+    OUT PULONGLONG                  Time OPTIONAL
+    )
+{
+    XENBUS_FDO_WORK                 Work;
+    ULONG                           Threads;
+    ULONG                           Index;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+    ASSERT3P(Fdo->Work, ==, NULL);
+
+    Work.Fdo = Fdo;
+    Work.Function = Function;
+    Work.Argument = Argument;
+    Work.Count = Count;
+    Work.Next = 0;
+    Work.Time = Time;
+
+    Threads = (Count != 0) ? __min(Fdo->WorkThreadCount, Count - 1) : 0;
+
+    if (Threads != 0) {
+        Fdo->Work = &Work;
+        Fdo->WorkPending = (LONG)Threads;
+        KeMemoryBarrier();
+
+        for (Index = 0; Index < Threads; Index++)
+            ThreadWake(Fdo->WorkThread[Index]);
+    }
+
+    FdoWorkRun(&Work);
+
+    if (Threads != 0) {
+        (VOID) KeWaitForSingleObject(&Fdo->WorkDone,
+                                     Executive,
+                                     KernelMode,
+                                     FALSE,
+                                     NULL);
+
+        Fdo->Work = NULL;
+    }
+
+    Fdo->WorkRuns++;
+}
+
+typedef struct _XENBUS_FDO_PDO_CREATE {
+    PANSI_STRING    *Name;
+    PXENBUS_PDO     *Pdo;
+} XENBUS_FDO_PDO_CREATE, *PXENBUS_FDO_PDO_CREATE;
+
+static VOID
+FdoPdoCreate(
+    IN  PXENBUS_FDO             Fdo,
+    IN  PVOID                   Argument,
+    IN  ULONG                   Index
+    )
+{
+    PXENBUS_FDO_PDO_CREATE      Create = Argument;
+    NTSTATUS                    status;
+
+    status = PdoCreate(Fdo, Create->Name[Index], &Create->Pdo[Index]);
+    if (!NT_SUCCESS(status))
+        Create->Pdo[Index] = NULL;
+}
+
+// Creating a PDO involves creating a device object and threads, and
+// logging its revisions, none of which depends on any other PDO so do
+// it in parallel. The PDOs are added in class order afterwards, with the
+// mutex still held, so bus relations look just as they would had they
+// been created one at a time.
+static BOOLEAN
+FdoCreatePdos(
+    IN  PXENBUS_FDO         Fdo,
+    IN  PANSI_STRING        *Name,
+    IN  ULONG               Count
+    )
+{
+    XENBUS_FDO_PDO_CREATE   Create;
+    PULONGLONG              Time;
+    BOOLEAN                 Created;
+    ULONG                   Index;
+
+    ASSERT3P(Fdo->Mutex.Owner, ==, KeGetCurrentThread());
+
+    if (Count == 0)
+        return FALSE;
+
+    Time = __FdoAllocate((sizeof (ULONGLONG) + sizeof (PXENBUS_PDO)) *
+                         Count);
+    if (Time == NULL) {
+        Created = FALSE;
+
+        for (Index = 0; Index < Count; Index++) {
+            PXENBUS_PDO Pdo;
+            NTSTATUS    status;
+
+            status = PdoCreate(Fdo, Name[Index], &Pdo);
+            if (!NT_SUCCESS(status))
+                continue;
+
+            FdoAddPhysicalDeviceObject(Fdo, Pdo);
+            Created = TRUE;
+        }
+
+        return Created;
+    }
+
+    Create.Name = Name;
+    Create.Pdo = (PXENBUS_PDO *)&Time[Count];
+
+    FdoRunWork(Fdo, FdoPdoCreate, &Create, Count, Time);
+
+    Created = FALSE;
+    for (Index = 0; Index < Count; Index++) {
+        PXENBUS_PDO Pdo = Create.Pdo[Index];
+
+        if (Pdo == NULL)
+            continue;
+
+        Info("%s: %lluus\n", PdoGetName(Pdo), Time[Index]);
+
+        FdoAddPhysicalDeviceObject(Fdo, Pdo);
+        Created = TRUE;
+    }
+
+    __FdoFree(Time);
+
+    return Created;
+}
+
 static BOOLEAN
 FdoEnumerate(
     IN  PXENBUS_FDO     Fdo,
@@ -1154,93 +1583,158 @@ FdoEnumerate(
     )
 {
     BOOLEAN             NeedInvalidate;
-    HANDLE              ParametersKey;
-    ULONG               Enumerate;
+    PANSI_STRING        *Class;
+    ULONG               ClassCount;
+    ULONG               ClassIndex;
+    ULONG               NewCount;
+    PXENBUS_PDO         *Pdo;
+    ULONG               PdoCount;
+    ULONG               PdoIndex;
     PLIST_ENTRY         ListEntry;
     ULONG               Index;
+    LARGE_INTEGER       Frequency;
+    LARGE_INTEGER       Start;
+    LARGE_INTEGER       End;
     NTSTATUS            status;
 
     Trace("====>\n");
 
     NeedInvalidate = FALSE;
 
-    ParametersKey = DriverGetParametersKey();
+    if (Fdo->ScanEnumerate == 0)
+        goto done;
 
-    status = RegistryQueryDwordValue(ParametersKey,
-                                     "Enumerate",
-                                     &Enumerate);
-    if (!NT_SUCCESS(status))
-        Enumerate = 1;
+    Start = KeQueryPerformanceCounter(&Frequency);
 
-    if (Enumerate == 0)
-        goto done;
+    // Build a sorted, duplicate free, list of the supported classes...
+    ClassCount = 0;
+    for (Index = 0; Classes[Index].Buffer != NULL; Index++)
+        ClassCount++;
 
-    __FdoAcquireMutex(Fdo);
+    Class = __FdoAllocate(sizeof (PANSI_STRING) * (ClassCount + 1));
 
-    ListEntry = Fdo->List.Flink;
-    while (ListEntry != &Fdo->List) {
-        PLIST_ENTRY     Next = ListEntry->Flink;
-        PXENBUS_DX      Dx = CONTAINING_RECORD(ListEntry, XENBUS_DX, ListEntry);
-        PXENBUS_PDO     Pdo = Dx->Pdo;
+    status = STATUS_NO_MEMORY;
+    if (Class == NULL)
+        goto fail1;
 
-        if (!PdoIsMissing(Pdo) && PdoGetDevicePnpState(Pdo) != Deleted) {
-            PCHAR           Name;
-            BOOLEAN         Missing;
+    ClassCount = 0;
+    for (Index = 0; Classes[Index].Buffer != NULL; Index++) {
+        if (Classes[Index].Length != 0)
+            Class[ClassCount++] = &Classes[Index];
+    }
 
-            Name = PdoGetName(Pdo);
-            Missing = TRUE;
+    FdoSortAnsi(Class, ClassCount);
 
-            // If the PDO already exists and its name is in the class list
-            // then we don't want to remove it.
-            for (Index = 0; Classes[Index].Buffer != NULL; Index++) {
-                PANSI_STRING Class = &Classes[Index];
+    for (Index = 1, ClassIndex = (ClassCount != 0) ? 1 : 0;
+         Index < ClassCount;
+         Index++) {
+        if (strcmp(Class[Index]->Buffer, Class[ClassIndex - 1]->Buffer) != 0)
+            Class[ClassIndex++] = Class[Index];
+    }
+    ClassCount = ClassIndex;
 
-                if (Class->Length == 0)
-                    continue;
+    __FdoAcquireMutex(Fdo);
 
-                if (strcmp(Name, Class->Buffer) == 0) {
-                    Missing = FALSE;
-                    Class->Length = 0;  // avoid duplication
-                    break;
-                }
-            }
+    // ...and a sorted list of the PDOs that are still live...
+    PdoCount = 0;
+    for (ListEntry = Fdo->List.Flink;
+         ListEntry != &Fdo->List;
+         ListEntry = ListEntry->Flink)
+        PdoCount++;
 
-            if (Missing) {
-                PdoSetMissing(Pdo, "device disappeared");
-
-                // If the PDO has not yet been enumerated then we can
-                // go ahead and mark it as deleted, otherwise we need
-                // to notify PnP manager and wait for the REMOVE_DEVICE
-                // IRP.
-                if (PdoGetDevicePnpState(Pdo) == Present) {
-                    PdoSetDevicePnpState(Pdo, Deleted);
-                    PdoDestroy(Pdo);
-                } else {
-                    NeedInvalidate = TRUE;
-                }
-            }
-        }
+    Pdo = __FdoAllocate(sizeof (PXENBUS_PDO) * (PdoCount + 1));
 
-        ListEntry = Next;
-    }
+    status = STATUS_NO_MEMORY;
+    if (Pdo == NULL)
+        goto fail2;
 
-    // Walk the class list and create PDOs for any new classes
-    for (Index = 0; Classes[Index].Buffer != NULL; Index++) {
-        PANSI_STRING Class = &Classes[Index];
+    PdoCount = 0;
+    for (ListEntry = Fdo->List.Flink;
+         ListEntry != &Fdo->List;
+         ListEntry = ListEntry->Flink) {
+        PXENBUS_DX  Dx = CONTAINING_RECORD(ListEntry, XENBUS_DX, ListEntry);
+
+        if (!PdoIsMissing(Dx->Pdo) && PdoGetDevicePnpState(Dx->Pdo) != Deleted)
+            Pdo[PdoCount++] = Dx->Pdo;
+    }
 
-        if (Class->Length != 0) {
-            status = PdoCreate(Fdo, Class);
-            if (NT_SUCCESS(status))
+    FdoSortPdos(Pdo, PdoCount);
+
+    // ...and then walk the two in step
+    PdoIndex = ClassIndex = NewCount = 0;
+    while (PdoIndex < PdoCount || ClassIndex < ClassCount) {
+        LONG    Compare;
+
+        if (PdoIndex == PdoCount)
+            Compare = 1;
+        else if (ClassIndex == ClassCount)
+            Compare = -1;
+        else
+            Compare = strcmp(PdoGetName(Pdo[PdoIndex]),
+                             Class[ClassIndex]->Buffer);
+
+        if (Compare < 0) {
+            PXENBUS_PDO Missing = Pdo[PdoIndex++];
+
+            PdoSetMissing(Missing, "device disappeared");
+
+            // If the PDO has not yet been enumerated then we can
+            // go ahead and mark it as deleted, otherwise we need
+            // to notify PnP manager and wait for the REMOVE_DEVICE
+            // IRP.
+            if (PdoGetDevicePnpState(Missing) == Present) {
+                PdoSetDevicePnpState(Missing, Deleted);
+                PdoDestroy(Missing);
+            } else {
                 NeedInvalidate = TRUE;
+            }
+        } else if (Compare > 0) {
+            // Gather new classes at the front of the array (we will not
+            // look at those entries again)
+            Class[NewCount++] = Class[ClassIndex++];
+        } else {
+            PdoIndex++;
+            ClassIndex++;
         }
     }
 
+    __FdoFree(Pdo);
+
+    // Create any new PDOs in the order in which the classes appear in
+    // xenstore (followed by the synthetic classes) rather than sorted
+    // order, so that they are added to bus relations in the same order
+    // as they always have been.
+    FdoSortAnsiByAddress(Class, NewCount);
+
+    if (FdoCreatePdos(Fdo, Class, NewCount))
+        NeedInvalidate = TRUE;
+
     __FdoReleaseMutex(Fdo);
 
+    __FdoFree(Class);
+
+    End = KeQueryPerformanceCounter(NULL);
+
+    Fdo->EnumerateCount++;
+    Fdo->EnumerateTime += ((End.QuadPart - Start.QuadPart) * 1000000ull) /
+                          Frequency.QuadPart;
+
 done:
     Trace("<====\n");
 
     return NeedInvalidate;
+
+fail2:
+    Error("fail2\n");
+
+    __FdoReleaseMutex(Fdo);
+
+    __FdoFree(Class);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return FALSE;
 }
 
 static PANSI_STRING
@@ -1411,30 +1905,108 @@ fail1:
     return NULL;
 }
 
-static NTSTATUS
-FdoScan(
-    IN  PXENBUS_THREAD  Self,
-    IN  PVOID           Context
+static VOID
+FdoScanFreeParameters(
+    IN  PXENBUS_FDO Fdo
     )
 {
-    PXENBUS_FDO         Fdo = Context;
-    PKEVENT             Event;
-    HANDLE              ParametersKey;
-    NTSTATUS            status;
-
-    Info("====>\n");
+    if (Fdo->ScanSupportedClasses != NULL) {
+        RegistryFreeSzValue(Fdo->ScanSupportedClasses);
+        Fdo->ScanSupportedClasses = NULL;
+    }
 
-    Event = ThreadGetEvent(Self);
+    if (Fdo->ScanSyntheticClasses != NULL) {
+        RegistryFreeSzValue(Fdo->ScanSyntheticClasses);
+        Fdo->ScanSyntheticClasses = NULL;
+    }
 
-    ParametersKey = DriverGetParametersKey();
+    Fdo->ScanEnumerate = 0;
+    Fdo->ScanParametersTime.QuadPart = 0;
+    Fdo->ScanParametersValid = FALSE;
+}
 
-    for (;;) {
-        PCHAR                   Buffer;
-        PANSI_STRING            StoreClasses;
-        PANSI_STRING            SyntheticClasses;
+// Re-read the parameters that control enumeration, but only if the key
+// has been written since we last looked.
+static VOID
+FdoScanRefreshParameters(
+    IN  PXENBUS_FDO Fdo
+    )
+{
+    HANDLE          ParametersKey;
+    LARGE_INTEGER   Time;
+    NTSTATUS        status;
+
+    ParametersKey = DriverGetParametersKey();
+
+    if (ParametersKey != NULL) {
+        status = RegistryQueryKeyLastWriteTime(ParametersKey, &Time);
+        if (!NT_SUCCESS(status))
+            Time.QuadPart = 0;
+    } else {
+        Time.QuadPart = 0;
+    }
+
+    if (Fdo->ScanParametersValid &&
+        Time.QuadPart != 0 &&
+        Time.QuadPart == Fdo->ScanParametersTime.QuadPart)
+        return;
+
+    FdoScanFreeParameters(Fdo);
+
+    Fdo->ScanParametersRefreshes++;
+
+    if (ParametersKey != NULL) {
+        status = RegistryQueryDwordValue(ParametersKey,
+                                         "Enumerate",
+                                         &Fdo->ScanEnumerate);
+        if (!NT_SUCCESS(status))
+            Fdo->ScanEnumerate = 1;
+
+        status = RegistryQuerySzValue(ParametersKey,
+                                      "SyntheticClasses",
+                                      NULL,
+                                      &Fdo->ScanSyntheticClasses);
+        if (!NT_SUCCESS(status))
+            Fdo->ScanSyntheticClasses = NULL;
+
+        status = RegistryQuerySzValue(ParametersKey,
+                                      "SupportedClasses",
+                                      NULL,
+                                      &Fdo->ScanSupportedClasses);
+        if (!NT_SUCCESS(status))
+            Fdo->ScanSupportedClasses = NULL;
+    } else {
+        Fdo->ScanEnumerate = 1;
+    }
+
+    Fdo->ScanParametersTime = Time;
+    Fdo->ScanParametersValid = TRUE;
+}
+
+#define SCAN_SETTLE_MS  50
+#define SCAN_SETTLE_MAX 10
+
+static NTSTATUS
+FdoScan(
+    IN  PXENBUS_THREAD  Self,
+    IN  PVOID           Context
+    )
+{
+    PXENBUS_FDO         Fdo = Context;
+    PKEVENT             Event;
+    NTSTATUS            status;
+
+    Info("====>\n");
+
+    Event = ThreadGetEvent(Self);
+
+    for (;;) {
+        PCHAR                   Buffer;
+        PANSI_STRING            StoreClasses;
         PANSI_STRING            SupportedClasses;
         PANSI_STRING            Classes;
         ULONG                   Index;
+        ULONG                   Settle;
         BOOLEAN                 NeedInvalidate;
 
         Trace("waiting...\n");
@@ -1448,6 +2020,8 @@ FdoScan(
 
         Trace("awake\n");
 
+        Fdo->ScanWakeups++;
+
         if (ThreadIsAlerted(Self))
             break;
 
@@ -1455,6 +2029,40 @@ FdoScan(
         if (__FdoGetDevicePnpState(Fdo) != Started)
             goto loop;
 
+        // Watches tend to fire in bursts (e.g. when a number of devices
+        // are hot-plugged together) so wait for things to settle, up to
+        // a limit, and then do a single scan. Anyone waiting synchronously
+        // for a scan clears ScanEvent first though, and they should not
+        // be kept waiting any longer than necessary.
+        for (Settle = 0; Settle < SCAN_SETTLE_MAX; Settle++) {
+            LARGE_INTEGER   Timeout;
+
+            if (KeReadStateEvent(&Fdo->ScanEvent) == 0) {
+                Fdo->ScanSynchronous++;
+                break;
+            }
+
+            Timeout.QuadPart = TIME_RELATIVE(TIME_MS(SCAN_SETTLE_MS));
+
+            status = KeWaitForSingleObject(Event,
+                                           Executive,
+                                           KernelMode,
+                                           FALSE,
+                                           &Timeout);
+            if (status == STATUS_TIMEOUT)
+                break;
+
+            KeClearEvent(Event);
+            Fdo->ScanCoalesced++;
+
+            if (ThreadIsAlerted(Self))
+                goto done;
+        }
+
+        Fdo->ScanCount++;
+
+        FdoScanRefreshParameters(Fdo);
+
         status = XENBUS_STORE(Directory,
                               &Fdo->StoreInterface,
                               NULL,
@@ -1471,34 +2079,15 @@ FdoScan(
             StoreClasses = NULL;
         }
 
-        status = RegistryQuerySzValue(ParametersKey,
-                                      "SyntheticClasses",
-                                      NULL,
-                                      &SyntheticClasses);
-        if (!NT_SUCCESS(status))
-            SyntheticClasses = NULL;
-
-        Classes = FdoCombineAnsi(StoreClasses, SyntheticClasses);
+        Classes = FdoCombineAnsi(StoreClasses, Fdo->ScanSyntheticClasses);
 
         if (StoreClasses != NULL)
             FdoFreeAnsi(StoreClasses);
 
-        if (SyntheticClasses != NULL)
-            RegistryFreeSzValue(SyntheticClasses);
-
         if (Classes == NULL)
             goto loop;
 
-        if (ParametersKey != NULL) {
-            status = RegistryQuerySzValue(ParametersKey,
-                                          "SupportedClasses",
-                                          NULL,
-                                          &SupportedClasses);
-            if (!NT_SUCCESS(status))
-                SupportedClasses = NULL;
-        } else {
-            SupportedClasses = NULL;
-        }
+        SupportedClasses = Fdo->ScanSupportedClasses;
 
         // NULL out anything in the Classes list that not in the
         // SupportedClasses list    
@@ -1524,15 +2113,13 @@ FdoScan(
                 Class->Length = 0;
         }
 
-        if (SupportedClasses != NULL)
-            RegistryFreeSzValue(SupportedClasses);
-
         NeedInvalidate = FdoEnumerate(Fdo, Classes);
 
         FdoFreeAnsi(Classes);
 
         if (NeedInvalidate) {
             NeedInvalidate = FALSE;
+            Fdo->EnumerateInvalidations++;
             IoInvalidateDeviceRelations(__FdoGetPhysicalDeviceObject(Fdo), 
                                         BusRelations);
         }
@@ -1541,6 +2128,18 @@ loop:
         KeSetEvent(&Fdo->ScanEvent, IO_NO_INCREMENT, FALSE);
     }
 
+done:
+    FdoScanFreeParameters(Fdo);
+
+    Fdo->EnumerateTime = 0;
+    Fdo->EnumerateInvalidations = 0;
+    Fdo->EnumerateCount = 0;
+    Fdo->ScanParametersRefreshes = 0;
+    Fdo->ScanCount = 0;
+    Fdo->ScanSynchronous = 0;
+    Fdo->ScanCoalesced = 0;
+    Fdo->ScanWakeups = 0;
+
     KeSetEvent(&Fdo->ScanEvent, IO_NO_INCREMENT, FALSE);
 
     Info("<====\n");
@@ -1673,11 +2272,6 @@ loop:
     return STATUS_SUCCESS;
 }
 
-#define TIME_US(_us)            ((_us) * 10ll)
-#define TIME_MS(_ms)            (TIME_US((_ms) * 1000ll))
-#define TIME_S(_s)              (TIME_MS((_s) * 1000ll))
-#define TIME_RELATIVE(_t)       (-(_t))
-
 static FORCEINLINE NTSTATUS
 __FdoBalloonSetActive(
     IN  PXENBUS_FDO         Fdo
@@ -1727,6 +2321,34 @@ __FdoBalloonClearActive(
 }
 
 #define XENBUS_BALLOON_RETRY_PERIOD 1
+#define XENBUS_BALLOON_YIELD_PERIOD 100
+#define XENBUS_BALLOON_REPORT_PERIOD 5
+
+static VOID
+FdoBalloonReport(
+    IN  PXENBUS_FDO     Fdo,
+    OUT PBOOLEAN        Reporting
+    )
+{
+    NTSTATUS            status;
+
+    // Free page reporting changes the P2M just like ballooning so
+    // it must not race with suspend
+    if (!TryAcquireMutex(&Fdo->BalloonSuspendMutex))
+        return;
+
+    status = XENBUS_BALLOON(Report,
+                            &Fdo->BalloonInterface);
+    *Reporting = (status != STATUS_NOT_SUPPORTED) ? TRUE : FALSE;
+
+    ReleaseMutex(&Fdo->BalloonSuspendMutex);
+
+    //
+    // We may have missed initiating a suspend
+    // whilst reporting.
+    //
+    ThreadWake(Fdo->SuspendThread);
+}
 
 static NTSTATUS
 FdoBalloon(
@@ -1737,9 +2359,13 @@ FdoBalloon(
     PXENBUS_FDO         Fdo = Context;
     PKEVENT             Event;
     LARGE_INTEGER       Timeout;
+    LARGE_INTEGER       Yield;
+    LARGE_INTEGER       Poll;
     ULONGLONG           StaticMax;
     BOOLEAN             Initialized;
     BOOLEAN             Active;
+    BOOLEAN             Pending;
+    BOOLEAN             Reporting;
     NTSTATUS            status;
 
     Info("====>\n");
@@ -1747,10 +2373,14 @@ FdoBalloon(
     Event = ThreadGetEvent(Self);
 
     Timeout.QuadPart = TIME_RELATIVE(TIME_S(XENBUS_BALLOON_RETRY_PERIOD));
+    Yield.QuadPart = TIME_RELATIVE(TIME_MS(XENBUS_BALLOON_YIELD_PERIOD));
+    Poll.QuadPart = TIME_RELATIVE(TIME_S(XENBUS_BALLOON_REPORT_PERIOD));
 
     StaticMax = 0;
     Initialized = FALSE;
     Active = FALSE;
+    Pending = FALSE;
+    Reporting = FALSE;
 
     for (;;) {
         PCHAR                   Buffer;
@@ -1759,17 +2389,25 @@ FdoBalloon(
 
         Trace("waiting%s...\n", (Active) ? " (Active)" : "");
 
+        // Between steps of an adjustment we only yield briefly so
+        // that the rest of the guest gets a look in
         (VOID) KeWaitForSingleObject(Event,
                                      Executive,
                                      KernelMode,
                                      FALSE,
+                                     (Pending) ?
+                                     &Yield :
                                      (Active) ?
                                      &Timeout :
+                                     (Reporting) ?
+                                     &Poll :
                                      NULL);
         KeClearEvent(Event);
         
         Trace("awake\n");
 
+        Pending = FALSE;
+
         if (ThreadIsAlerted(Self))
             break;
 
@@ -1781,6 +2419,15 @@ FdoBalloon(
                 __FdoBalloonClearActive(Fdo);
             }
 
+            // Reported memory must be back before the balloon
+            // interface is released
+            if (Reporting) {
+                Reporting = FALSE;
+
+                (VOID) XENBUS_BALLOON(Reclaim,
+                                      &Fdo->BalloonInterface);
+            }
+
             goto loop;
         }
 
@@ -1857,6 +2504,10 @@ FdoBalloon(
         if (XENBUS_BALLOON(GetSize,
                            &Fdo->BalloonInterface) == Size) {
             Trace("nothing to do\n");
+
+            if (!Active)
+                FdoBalloonReport(Fdo, &Reporting);
+
             goto loop;
         }
 
@@ -1871,6 +2522,11 @@ FdoBalloon(
         status = XENBUS_BALLOON(Adjust,
                                 &Fdo->BalloonInterface,
                                 Size);
+        if (status == STATUS_PENDING) {
+            Pending = TRUE;
+            goto loop;
+        }
+
         if (!NT_SUCCESS(status))
             goto loop;
 
@@ -2760,43 +3416,44 @@ FdoOutputBuffer(
                           (ULONG)(Cursor - FdoOutBuffer));
 }
 
+//
+// Each timer VIRQ counts itself off once per generation. Whichever CPU
+// counts off last (i.e. the watchdog has now seen every vCPU tick since
+// the previous pat) re-arms the count, opens a new generation and pats.
+// This keeps the interrupt path free of any lock and avoids walking the
+// VIRQ list at HIGH_LEVEL; the only shared writes are one interlocked
+// decrement per CPU per generation.
+//
 static FORCEINLINE BOOLEAN
 __FdoVirqPatWatchdog(
     IN  PXENBUS_VIRQ    Virq
     )
 {
     PXENBUS_FDO         Fdo = Virq->Fdo;
-    ULONG               Cpu;
-    ULONG               Count;
-    BOOLEAN             Pat;
-    KIRQL               Irql;
-    PLIST_ENTRY         ListEntry;
+    LONG                Generation;
 
-    AcquireHighLock(&Fdo->VirqLock, &Irql);
+    Virq->Count++;
 
-    Cpu = Virq->Cpu;
-    Count = Virq->Count++;
-    Pat = TRUE;
+    if (Fdo->VirqTimerCount == 0) // not yet armed
+        return FALSE;
 
-    if (Virq->Count == 0) // wrapped
-        goto out;
+    KeMemoryBarrier();
 
-    for (ListEntry = Fdo->VirqList.Flink;
-         ListEntry != &Fdo->VirqList;
-         ListEntry = ListEntry->Flink) {
-        Virq = CONTAINING_RECORD(ListEntry, XENBUS_VIRQ, ListEntry);
+    Generation = Fdo->VirqGeneration;
+    if (Virq->Generation == Generation)
+        return FALSE;
 
-        if (Virq->Type != VIRQ_TIMER || Virq->Cpu == Cpu)
-            continue;
+    Virq->Generation = Generation;
 
-        if (Virq->Count <= Count)
-            Pat = FALSE;
-    }
+    if (InterlockedDecrement(&Fdo->VirqRemaining) != 0)
+        return FALSE;
 
-out:
-    ReleaseHighLock(&Fdo->VirqLock, Irql);
+    Fdo->VirqRemaining = Fdo->VirqTimerCount;
+    KeMemoryBarrier();
 
-    return Pat;
+    (VOID) InterlockedIncrement(&Fdo->VirqGeneration);
+
+    return TRUE;
 }
 
 static
@@ -2824,6 +3481,8 @@ FdoVirqCallback(
         break;
 
     case VIRQ_TIMER:
+        TimerInterrupt(__FdoGetTimerContext(Fdo), Virq->Cpu);
+
         if (__FdoVirqPatWatchdog(Virq))
             SystemSetWatchdog(Fdo->Watchdog);
 
@@ -2907,10 +3566,14 @@ __FdoVirqCreate(
         status = SystemVirtualCpuIndex(Cpu, &vcpu_id);
         ASSERT(NT_SUCCESS(status));
 
-        BUG_ON(Fdo->Watchdog == 0);
-        Period.QuadPart = TIME_S(Fdo->Watchdog / 2);
+        if (Fdo->Watchdog != 0) {
+            Period.QuadPart = TIME_S(Fdo->Watchdog / 2);
 
-        status = VcpuSetPeriodicTimer(vcpu_id, &Period);
+            status = VcpuSetPeriodicTimer(vcpu_id, &Period);
+        } else {
+            // Only one-shot timers should raise the VIRQ
+            status = VcpuSetPeriodicTimer(vcpu_id, NULL);
+        }
         if (!NT_SUCCESS(status))
             goto fail3;
     }
@@ -2966,7 +3629,10 @@ FdoVirqTeardown(
         __FdoVirqDestroy(Virq);
     }
 
-    RtlZeroMemory(&Fdo->VirqLock, sizeof (HIGH_LOCK));
+    Fdo->VirqGeneration = 0;
+    Fdo->VirqRemaining = 0;
+    Fdo->VirqTimerCount = 0;
+
     RtlZeroMemory(&Fdo->VirqList, sizeof (LIST_ENTRY));
 }
 
@@ -2982,7 +3648,6 @@ FdoVirqInitialize(
     NTSTATUS        status;
 
     InitializeListHead(&Fdo->VirqList);
-    InitializeHighLock(&Fdo->VirqLock);
 
     status = __FdoVirqCreate(Fdo, VIRQ_DEBUG, 0, &Virq);
     if (!NT_SUCCESS(status))
@@ -2990,9 +3655,8 @@ FdoVirqInitialize(
 
     InsertTailList(&Fdo->VirqList, &Virq->ListEntry);
 
-    if (Fdo->Watchdog == 0)
-        goto done;
-
+    // VIRQ_TIMER is always bound since it also delivers the one-shot
+    // timers used by the TIMER interface.
     Count = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
 
     Timer = 0;
@@ -3003,15 +3667,28 @@ FdoVirqInitialize(
 
         InsertTailList(&Fdo->VirqList, &Virq->ListEntry);
         Timer++;
+
+        // Get any pending timers for this CPU re-programmed
+        TimerInterrupt(__FdoGetTimerContext(Fdo), Index);
     }
 
-    if (Timer != 0) {
+    if (Fdo->Watchdog != 0 && Timer != 0) {
+        //
+        // Only count the CPUs that actually have a timer VIRQ. The
+        // count must be in place before the first generation opens
+        // and the generation must be open before the pat logic is armed.
+        //
+        Fdo->VirqRemaining = Timer;
+        KeMemoryBarrier();
+
+        (VOID) InterlockedIncrement(&Fdo->VirqGeneration);
+        (VOID) InterlockedExchange(&Fdo->VirqTimerCount, Timer);
+
         status = SystemSetWatchdog(Fdo->Watchdog);
         if (!NT_SUCCESS(status))
             goto fail2;
     }
 
-done:
     return STATUS_SUCCESS;
 
 fail2:
@@ -3048,6 +3725,12 @@ __FdoD3ToD0(
                                &Fdo->LogDisposition);
     ASSERT(NT_SUCCESS(status));
 
+    // Adding the watch will trigger a rescan. Clear ScanEvent so that
+    // a subsequent QUERY_DEVICE_RELATIONS waits for it to complete and
+    // so that the scan thread does not hang around waiting for things
+    // to settle.
+    KeClearEvent(&Fdo->ScanEvent);
+
     status = XENBUS_STORE(WatchAdd,
                           &Fdo->StoreInterface,
                           NULL,
@@ -3122,6 +3805,8 @@ fail3:
 fail2:
     Error("fail2\n");
 
+    KeSetEvent(&Fdo->ScanEvent, IO_NO_INCREMENT, FALSE);
+
     LogRemoveDisposition(Fdo->LogDisposition);
     Fdo->LogDisposition = NULL;
 
@@ -3140,118 +3825,600 @@ __FdoD0ToD3(
 {
     Trace("====>\n");
 
-    ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
+    ASSERT3U(KeGetCurrentIrql(), ==, DISPATCH_LEVEL);
+
+    if (Fdo->BalloonInterface.Interface.Context != NULL) {
+        (VOID) XENBUS_STORE(Remove,
+                            &Fdo->StoreInterface,
+                            NULL,
+                            "control",
+                            "feature-balloon");
+
+        (VOID) XENBUS_STORE(WatchRemove,
+                            &Fdo->StoreInterface,
+                            Fdo->BalloonWatch);
+        Fdo->BalloonWatch = NULL;
+    }
+
+    (VOID) XENBUS_STORE(Remove,
+                        &Fdo->StoreInterface,
+                        NULL,
+                        "control",
+                        "feature-suspend");
+
+    (VOID) XENBUS_STORE(WatchRemove,
+                        &Fdo->StoreInterface,
+                        Fdo->SuspendWatch);
+    Fdo->SuspendWatch = NULL;
+
+    (VOID) XENBUS_STORE(WatchRemove,
+                        &Fdo->StoreInterface,
+                        Fdo->ScanWatch);
+    Fdo->ScanWatch = NULL;
+
+    LogRemoveDisposition(Fdo->LogDisposition);
+    Fdo->LogDisposition = NULL;
+
+    FdoVirqTeardown(Fdo);
+
+    FdoClearDistribution(Fdo);
+
+    Trace("<====\n");
+}
+
+static VOID
+FdoSuspendCallbackLate(
+    IN  PVOID   Argument
+    )
+{
+    PXENBUS_FDO Fdo = Argument;
+    NTSTATUS    status;
+
+    __FdoD0ToD3(Fdo);
+
+    status = __FdoD3ToD0(Fdo);
+    ASSERT(NT_SUCCESS(status));
+}
+
+static NTSTATUS
+FdoAllocateHoleBuffer(
+    OUT PUCHAR          *Buffer,
+    OUT PMDL            *Mdl
+    )
+{
+    PHYSICAL_ADDRESS    Low;
+    PHYSICAL_ADDRESS    High;
+    PHYSICAL_ADDRESS    Align;
+    PVOID               Va;
+    NTSTATUS            status;
+
+    *Buffer = NULL;
+    *Mdl = NULL;
+
+    Low.QuadPart = 0;
+    High = SystemMaximumPhysicalAddress();
+    Align.QuadPart = FDO_HOLE_SIZE;
+
+    Va = MmAllocateContiguousNodeMemory((SIZE_T)FDO_HOLE_SIZE,
+                                        Low,
+                                        High,
+                                        Align,
+                                        PAGE_READWRITE,
+                                        MM_ANY_NODE_OK);
+
+    status = STATUS_NO_MEMORY;
+    if (Va == NULL)
+        goto fail1;
+
+    *Mdl = IoAllocateMdl(Va,
+                         (ULONG)FDO_HOLE_SIZE,
+                         FALSE,
+                         FALSE,
+                         NULL);
+
+    status = STATUS_NO_MEMORY;
+    if (*Mdl == NULL)
+        goto fail2;
+
+    MmBuildMdlForNonPagedPool(*Mdl);
+
+    ASSERT3U((*Mdl)->ByteOffset, ==, 0);
+    ASSERT3U((*Mdl)->ByteCount, ==, FDO_HOLE_SIZE);
+
+    *Buffer = MmGetSystemAddressForMdlSafe(*Mdl, NormalPagePriority);
+
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+    // We may be at DISPATCH_LEVEL so the caller must arrange for the
+    // buffer to be freed
+    *Buffer = Va;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static VOID
+FdoFreeHoleBuffer(
+    IN  PUCHAR  Buffer,
+    IN  PMDL    Mdl OPTIONAL
+    )
+{
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+
+    if (Mdl != NULL)
+        ExFreePool(Mdl);
+
+    MmFreeContiguousMemory(Buffer);
+}
+
+static FORCEINLINE BOOLEAN
+__FdoHoleTestBlock(
+    IN  PXENBUS_HOLE_REGION Region,
+    IN  ULONG               Order,
+    IN  ULONG               Index
+    )
+{
+    return (Region->Bitmap[Order][Index / 32] & (1u << (Index % 32))) ?
+           TRUE :
+           FALSE;
+}
+
+static FORCEINLINE VOID
+__FdoHoleSetBlock(
+    IN  PXENBUS_HOLE_REGION Region,
+    IN  ULONG               Order,
+    IN  ULONG               Index
+    )
+{
+    ASSERT(!__FdoHoleTestBlock(Region, Order, Index));
+
+    Region->Bitmap[Order][Index / 32] |= 1u << (Index % 32);
+    Region->Blocks[Order]++;
+}
+
+static FORCEINLINE VOID
+__FdoHoleClearBlock(
+    IN  PXENBUS_HOLE_REGION Region,
+    IN  ULONG               Order,
+    IN  ULONG               Index
+    )
+{
+    ASSERT(__FdoHoleTestBlock(Region, Order, Index));
+
+    Region->Bitmap[Order][Index / 32] &= ~(1u << (Index % 32));
+    --Region->Blocks[Order];
+}
+
+// Free the naturally aligned block of 2^Order pages at page Offset,
+// merging it with its buddy for as long as the buddy is also free.
+static VOID
+FdoHoleFreeBlock(
+    IN  PXENBUS_HOLE_REGION Region,
+    IN  ULONG               Offset,
+    IN  ULONG               Order
+    )
+{
+    ASSERT3U(Offset & ((1u << Order) - 1), ==, 0);
+
+    Region->Free += 1u << Order;
+
+    while (Order < FDO_HOLE_ORDER) {
+        ULONG   Buddy = Offset ^ (1u << Order);
+
+        if (!__FdoHoleTestBlock(Region, Order, Buddy >> Order))
+            break;
+
+        __FdoHoleClearBlock(Region, Order, Buddy >> Order);
+
+        Offset &= ~(1u << Order);
+        Order++;
+    }
+
+    __FdoHoleSetBlock(Region, Order, Offset >> Order);
+}
+
+// Free an arbitrary run of pages by splitting it into the largest
+// naturally aligned blocks possible.
+static VOID
+FdoHoleFreeRange(
+    IN  PXENBUS_HOLE_REGION Region,
+    IN  ULONG               Offset,
+    IN  ULONG               Count
+    )
+{
+    ASSERT3U(Offset + Count, <=, FDO_HOLE_PAGES);
+
+    while (Count != 0) {
+        ULONG   Order = 0;
+
+        while (Order < FDO_HOLE_ORDER &&
+               (Offset & ((2u << Order) - 1)) == 0 &&
+               (2u << Order) <= Count)
+            Order++;
+
+        FdoHoleFreeBlock(Region, Offset, Order);
+
+        Offset += 1u << Order;
+        Count -= 1u << Order;
+    }
+}
+
+static BOOLEAN
+FdoHoleAllocateRange(
+    IN  PXENBUS_HOLE_REGION Region,
+    IN  ULONG               Count,
+    OUT PULONG              Offset
+    )
+{
+    ULONG                   Order;
+    ULONG                   Found;
+    ULONG                   Word;
+    ULONG                   Bit;
+
+    Order = 0;
+    while ((1u << Order) < Count)
+        Order++;
+
+    ASSERT3U(Order, <=, FDO_HOLE_ORDER);
+
+    for (Found = Order; Found <= FDO_HOLE_ORDER; Found++) {
+        if (Region->Blocks[Found] != 0)
+            break;
+    }
+
+    if (Found > FDO_HOLE_ORDER)
+        return FALSE;
+
+    for (Word = 0; Region->Bitmap[Found][Word] == 0; Word++)
+        ASSERT3U(Word, <, FDO_HOLE_PAGES / 32);
+
+    (VOID) _BitScanForward(&Bit, Region->Bitmap[Found][Word]);
+
+    __FdoHoleClearBlock(Region, Found, (Word * 32) + Bit);
+    Region->Free -= 1u << Found;
+
+    *Offset = ((Word * 32) + Bit) << Found;
+
+    // Hand back the upper half of the block until it is the right order
+    while (Found > Order) {
+        --Found;
+
+        __FdoHoleSetBlock(Region, Found, (*Offset >> Found) + 1);
+        Region->Free += 1u << Found;
+    }
+
+    // Hand back any pages beyond those requested
+    if (Count < (1u << Order))
+        FdoHoleFreeRange(Region, *Offset + Count, (1u << Order) - Count);
+
+    return TRUE;
+}
+
+static ULONG
+FdoHoleLargestBlock(
+    IN  PXENBUS_HOLE_REGION Region
+    )
+{
+    LONG                    Order;
+
+    for (Order = FDO_HOLE_ORDER; Order >= 0; --Order) {
+        if (Region->Blocks[Order] != 0)
+            return 1u << Order;
+    }
+
+    return 0;
+}
+
+static NTSTATUS
+FdoHoleCreateRegion(
+    IN  PXENBUS_HOLE_REGION Region,
+    IN  PUCHAR              Buffer,
+    IN  PMDL                Mdl
+    )
+{
+    PFN_NUMBER              Pfn;
+
+    Region->Buffer = Buffer;
+    Region->Mdl = Mdl;
+    Region->Pfn = MmGetMdlPfnArray(Mdl)[0];
+
+    Pfn = Region->Pfn;
+
+    if (MemoryDecreaseReservation(PAGE_ORDER_2M, 1, &Pfn) != 1)
+        return STATUS_UNSUCCESSFUL;
+
+    Region->Reserved = TRUE;
+
+    FdoHoleFreeBlock(Region, 0, FDO_HOLE_ORDER);
+    ASSERT3U(Region->Free, ==, FDO_HOLE_PAGES);
+
+    Trace("%08x - %08x\n",
+          Region->Pfn,
+          Region->Pfn + FDO_HOLE_PAGES - 1);
+
+    return STATUS_SUCCESS;
+}
+
+// If the region cannot be completely re-populated then any pages that
+// were are given back again, so that the region is left wholly reserved
+// and can stay in the hole.
+static NTSTATUS
+FdoHoleDestroyRegion(
+    IN  PXENBUS_HOLE_REGION Region
+    )
+{
+    PFN_NUMBER              Pfn;
+    ULONG                   Index;
+
+    if (!Region->Reserved)
+        return STATUS_SUCCESS;
+
+    ASSERT3U(Region->Free, ==, FDO_HOLE_PAGES);
+
+    Pfn = Region->Pfn;
+
+    Trace("%08x - %08x\n", Pfn, Pfn + FDO_HOLE_PAGES - 1);
+
+    if (MemoryPopulatePhysmap(PAGE_ORDER_2M, 1, &Pfn) == 1)
+        goto done;
+
+    for (Index = 0; Index < FDO_HOLE_PAGES; Index++) {
+        if (MemoryPopulatePhysmap(PAGE_ORDER_4K, 1, &Pfn) != 1)
+            goto fail1;
+
+        Pfn++;
+    }
+
+done:
+    Region->Reserved = FALSE;
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1\n");
+
+    while (Index != 0) {
+        --Index;
+        --Pfn;
+
+        // A page that cannot be given back is simply part of our own
+        // buffer; Xen will replace it if it is ever mapped over
+        (VOID) MemoryDecreaseReservation(PAGE_ORDER_4K, 1, &Pfn);
+    }
+
+    return STATUS_UNSUCCESSFUL;
+}
+
+// Contiguous memory can only be freed at PASSIVE_LEVEL but the hole is
+// generally used at DISPATCH_LEVEL so the buffers of regions that are no
+// longer needed are handed to a thread to free.
+static VOID
+FdoHoleReleaseRegion(
+    IN  PXENBUS_FDO         Fdo,
+    IN  PXENBUS_HOLE_REGION Region
+    )
+{
+    KIRQL                   Irql;
+    NTSTATUS                status;
+
+    ASSERT(!Region->Primary);
+
+    status = FdoHoleDestroyRegion(Region);
+    if (!NT_SUCCESS(status))
+        BUG("FAILED TO RE-POPULATE HOLE");
+
+    AcquireHighLock(&Fdo->HoleLock, &Irql);
+    InsertTailList(&Fdo->HoleReleaseList, &Region->ListEntry);
+    ReleaseHighLock(&Fdo->HoleLock, Irql);
+
+    ThreadWake(Fdo->HoleThread);
+}
+
+// Give back an idle region that has already been taken out of the hole.
+// If that fails then it simply goes back in, still reserved.
+static VOID
+FdoHoleShrink(
+    IN  PXENBUS_FDO         Fdo,
+    IN  PXENBUS_HOLE_REGION Region
+    )
+{
+    KIRQL                   Irql;
+    NTSTATUS                status;
+
+    ASSERT(!Region->Primary);
+
+    status = FdoHoleDestroyRegion(Region);
+
+    AcquireHighLock(&Fdo->HoleLock, &Irql);
+
+    if (!NT_SUCCESS(status)) {
+        InsertTailList(&Fdo->HoleList, &Region->ListEntry);
+        ReleaseHighLock(&Fdo->HoleLock, Irql);
+
+        Warning("%08x - %08x: failed to re-populate\n",
+                Region->Pfn,
+                Region->Pfn + FDO_HOLE_PAGES - 1);
+        return;
+    }
+
+    --Fdo->HoleCount;
+    Fdo->HoleShrinks++;
+
+    InsertTailList(&Fdo->HoleReleaseList, &Region->ListEntry);
+    ReleaseHighLock(&Fdo->HoleLock, Irql);
+
+    ThreadWake(Fdo->HoleThread);
+}
+
+static NTSTATUS
+FdoHole(
+    IN  PXENBUS_THREAD  Self,
+    IN  PVOID           Context
+    )
+{
+    PXENBUS_FDO         Fdo = Context;
+    PKEVENT             Event;
+
+    Trace("====>\n");
+
+    Event = ThreadGetEvent(Self);
+
+    for (;;) {
+        KIRQL   Irql;
+
+        (VOID) KeWaitForSingleObject(Event,
+                                     Executive,
+                                     KernelMode,
+                                     FALSE,
+                                     NULL);
+        KeClearEvent(Event);
+
+        AcquireHighLock(&Fdo->HoleLock, &Irql);
+
+        while (!IsListEmpty(&Fdo->HoleReleaseList)) {
+            PLIST_ENTRY         ListEntry;
+            PXENBUS_HOLE_REGION Region;
+
+            ListEntry = RemoveHeadList(&Fdo->HoleReleaseList);
+            ASSERT(ListEntry != &Fdo->HoleReleaseList);
+
+            ReleaseHighLock(&Fdo->HoleLock, Irql);
+
+            Region = CONTAINING_RECORD(ListEntry, XENBUS_HOLE_REGION, ListEntry);
+
+            ASSERT(!Region->Reserved);
+            FdoFreeHoleBuffer(Region->Buffer, Region->Mdl);
+            __FdoFree(Region);
+
+            AcquireHighLock(&Fdo->HoleLock, &Irql);
+        }
+
+        ReleaseHighLock(&Fdo->HoleLock, Irql);
+
+        if (ThreadIsAlerted(Self))
+            break;
+    }
+
+    Trace("<====\n");
+
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS
+FdoHoleGrow(
+    IN  PXENBUS_FDO     Fdo
+    )
+{
+    PXENBUS_HOLE_REGION Region;
+    KIRQL               Irql;
+    NTSTATUS            status;
+
+    // Claim a slot up front so that concurrent callers cannot push us
+    // past the limit
+    AcquireHighLock(&Fdo->HoleLock, &Irql);
+
+    status = STATUS_INSUFFICIENT_RESOURCES;
+    if (Fdo->HoleCount >= FDO_HOLE_MAXIMUM_REGIONS) {
+        ReleaseHighLock(&Fdo->HoleLock, Irql);
+        goto fail1;
+    }
+
+    Fdo->HoleCount++;
 
-    if (Fdo->BalloonInterface.Interface.Context != NULL) {
-        (VOID) XENBUS_STORE(Remove,
-                            &Fdo->StoreInterface,
-                            NULL,
-                            "control",
-                            "feature-balloon");
+    ReleaseHighLock(&Fdo->HoleLock, Irql);
 
-        (VOID) XENBUS_STORE(WatchRemove,
-                            &Fdo->StoreInterface,
-                            Fdo->BalloonWatch);
-        Fdo->BalloonWatch = NULL;
+    Region = __FdoAllocate(sizeof (XENBUS_HOLE_REGION));
+
+    status = STATUS_NO_MEMORY;
+    if (Region == NULL)
+        goto fail2;
+
+    status = FdoAllocateHoleBuffer(&Region->Buffer, &Region->Mdl);
+    if (!NT_SUCCESS(status)) {
+        // We may be at DISPATCH_LEVEL so let the thread free any buffer
+        if (Region->Buffer != NULL) {
+            FdoHoleReleaseRegion(Fdo, Region);
+            Region = NULL;
+        }
+
+        goto fail3;
     }
 
-    (VOID) XENBUS_STORE(Remove,
-                        &Fdo->StoreInterface,
-                        NULL,
-                        "control",
-                        "feature-suspend");
+    status = FdoHoleCreateRegion(Region, Region->Buffer, Region->Mdl);
+    if (!NT_SUCCESS(status))
+        goto fail4;
 
-    (VOID) XENBUS_STORE(WatchRemove,
-                        &Fdo->StoreInterface,
-                        Fdo->SuspendWatch);
-    Fdo->SuspendWatch = NULL;
+    AcquireHighLock(&Fdo->HoleLock, &Irql);
+    InsertTailList(&Fdo->HoleList, &Region->ListEntry);
+    Fdo->HoleGrows++;
+    ReleaseHighLock(&Fdo->HoleLock, Irql);
 
-    (VOID) XENBUS_STORE(WatchRemove,
-                        &Fdo->StoreInterface,
-                        Fdo->ScanWatch);
-    Fdo->ScanWatch = NULL;
+    return STATUS_SUCCESS;
 
-    LogRemoveDisposition(Fdo->LogDisposition);
-    Fdo->LogDisposition = NULL;
+fail4:
+    Error("fail4\n");
 
-    FdoVirqTeardown(Fdo);
+    FdoHoleReleaseRegion(Fdo, Region);
+    Region = NULL;
 
-    FdoClearDistribution(Fdo);
+fail3:
+    Error("fail3\n");
 
-    Trace("<====\n");
-}
+    if (Region != NULL)
+        __FdoFree(Region);
 
-static VOID
-FdoSuspendCallbackLate(
-    IN  PVOID   Argument
-    )
-{
-    PXENBUS_FDO Fdo = Argument;
-    NTSTATUS    status;
+fail2:
+    Error("fail2\n");
 
-    __FdoD0ToD3(Fdo);
+    AcquireHighLock(&Fdo->HoleLock, &Irql);
+    --Fdo->HoleCount;
+    ReleaseHighLock(&Fdo->HoleLock, Irql);
 
-    status = __FdoD3ToD0(Fdo);
-    ASSERT(NT_SUCCESS(status));
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
 }
 
 static NTSTATUS
 FdoCreateHole(
-    IN  PXENBUS_FDO Fdo
+    IN  PXENBUS_FDO     Fdo
     )
 {
-    PMDL            Mdl;
-    PFN_NUMBER      Pfn;
-    LONGLONG        Start;
-    ULONG           Count;
-    NTSTATUS        status;
+    PXENBUS_HOLE_REGION Region;
+    NTSTATUS            status;
 
-    status = XENBUS_RANGE_SET(Create,
-                              &Fdo->RangeSetInterface,
-                              "hole",
-                              &Fdo->RangeSet);
-    if (!NT_SUCCESS(status))
-        goto fail1;
+    ASSERT(IsListEmpty(&Fdo->HoleList));
+    ASSERT3U(Fdo->HoleCount, ==, 0);
 
-    Mdl = Fdo->Mdl;
+    Region = __FdoAllocate(sizeof (XENBUS_HOLE_REGION));
 
-    Pfn = MmGetMdlPfnArray(Mdl)[0];
+    status = STATUS_NO_MEMORY;
+    if (Region == NULL)
+        goto fail1;
 
-    Start = Pfn;
-    Count = BYTES_TO_PAGES(Mdl->ByteCount);
+    // The primary region uses the buffer allocated when the FDO was
+    // created and is never released while the FDO is powered up
+    Region->Primary = TRUE;
 
-    status = XENBUS_RANGE_SET(Put,
-                              &Fdo->RangeSetInterface,
-                              Fdo->RangeSet,
-                              Start,
-                              Count);
+    status = FdoHoleCreateRegion(Region, Fdo->Buffer, Fdo->Mdl);
     if (!NT_SUCCESS(status))
         goto fail2;
 
-    status = STATUS_UNSUCCESSFUL;
-    if (MemoryDecreaseReservation(PAGE_ORDER_2M, 1, &Pfn) != 1)
-        goto fail3;
-
-    Trace("%08x - %08x\n", Start, Start + Count - 1);
+    InsertTailList(&Fdo->HoleList, &Region->ListEntry);
+    Fdo->HoleCount = 1;
 
     return STATUS_SUCCESS;
 
-fail3:
-    Error("fail3\n");
-
-    XENBUS_RANGE_SET(Get,
-                     &Fdo->RangeSetInterface,
-                     Fdo->RangeSet,
-                     Start,
-                     Count);
-
 fail2:
     Error("fail2\n");
 
-    XENBUS_RANGE_SET(Destroy,
-                     &Fdo->RangeSetInterface,
-                     Fdo->RangeSet);
-    Fdo->RangeSet = NULL;
+    __FdoFree(Region);
 
 fail1:
     Error("fail1 (%08x)\n", status);
@@ -3267,35 +4434,56 @@ FdoAllocateHole(
     OUT PPHYSICAL_ADDRESS   PhysicalAddress
     )
 {
+    PXENBUS_HOLE_REGION     Region;
+    ULONG                   Offset;
     LONGLONG                Start;
+    KIRQL                   Irql;
     NTSTATUS                status;
 
-    status = XENBUS_RANGE_SET(Pop,
-                              &Fdo->RangeSetInterface,
-                              Fdo->RangeSet,
-                              Count,
-                              &Start);
-    if (!NT_SUCCESS(status))
+    status = STATUS_INVALID_PARAMETER;
+    if (Count == 0 || Count > FDO_HOLE_PAGES)
         goto fail1;
 
-    Trace("%08x - %08x\n", Start, Start + Count - 1);
+    for (;;) {
+        PLIST_ENTRY ListEntry;
+
+        AcquireHighLock(&Fdo->HoleLock, &Irql);
+
+        for (ListEntry = Fdo->HoleList.Flink;
+             ListEntry != &Fdo->HoleList;
+             ListEntry = ListEntry->Flink) {
+            Region = CONTAINING_RECORD(ListEntry, XENBUS_HOLE_REGION, ListEntry);
 
-    if (VirtualAddress != NULL) {
-        PUCHAR  StartVa = Fdo->Buffer;
-        PMDL    Mdl = Fdo->Mdl;
-        ULONG   Index;
-        ULONG   ByteOffset;
+            if (Region->Free >= Count &&
+                FdoHoleAllocateRange(Region, Count, &Offset))
+                goto found;
+        }
 
-        Index = (ULONG)((PFN_NUMBER)Start - MmGetMdlPfnArray(Mdl)[0]);
-        ByteOffset = Index * PAGE_SIZE;
-        ASSERT3U(ByteOffset, <=, Mdl->ByteCount);
+        ReleaseHighLock(&Fdo->HoleLock, Irql);
 
-        *VirtualAddress = StartVa + ByteOffset;
+        status = FdoHoleGrow(Fdo);
+        if (!NT_SUCCESS(status))
+            goto fail2;
     }
 
+found:
+    ReleaseHighLock(&Fdo->HoleLock, Irql);
+
+    Start = Region->Pfn + Offset;
+
+    Trace("%08x - %08x\n", Start, Start + Count - 1);
+
+    if (VirtualAddress != NULL)
+        *VirtualAddress = Region->Buffer + ((ULONG_PTR)Offset * PAGE_SIZE);
+
     PhysicalAddress->QuadPart = Start << PAGE_SHIFT;
 
-    return STATUS_SUCCESS;;
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+    InterlockedIncrement(&Fdo->HoleFailures);
 
 fail1:
     Error("fail1 (%08x)\n", status);
@@ -3310,20 +4498,65 @@ FdoFreeHole(
     IN  ULONG               Count
     )
 {
+    PXENBUS_HOLE_REGION     Region;
+    PLIST_ENTRY             ListEntry;
     LONGLONG                Start;
-    NTSTATUS                status;
+    BOOLEAN                 Release;
+    KIRQL                   Irql;
 
     ASSERT3U(PhysicalAddress.QuadPart & (PAGE_SIZE - 1), ==, 0);
     Start = PhysicalAddress.QuadPart >> PAGE_SHIFT;
 
     Trace("%08x - %08x\n", Start, Start + Count - 1);
 
-    status = XENBUS_RANGE_SET(Put,
-                              &Fdo->RangeSetInterface,
-                              Fdo->RangeSet,
-                              Start,
-                              Count);
-    ASSERT(NT_SUCCESS(status));
+    AcquireHighLock(&Fdo->HoleLock, &Irql);
+
+    Region = NULL;
+    for (ListEntry = Fdo->HoleList.Flink;
+         ListEntry != &Fdo->HoleList;
+         ListEntry = ListEntry->Flink) {
+        Region = CONTAINING_RECORD(ListEntry, XENBUS_HOLE_REGION, ListEntry);
+
+        if (Start >= (LONGLONG)Region->Pfn &&
+            Start < (LONGLONG)(Region->Pfn + FDO_HOLE_PAGES))
+            break;
+
+        Region = NULL;
+    }
+
+    if (Region == NULL)
+        BUG("NOT IN HOLE");
+
+    FdoHoleFreeRange(Region, (ULONG)(Start - Region->Pfn), Count);
+
+    // Only give back an idle region if the rest of the hole still has
+    // plenty of room, otherwise we'd flap under a steady load
+    Release = FALSE;
+    if (!Region->Primary && Region->Free == FDO_HOLE_PAGES) {
+        ULONG   Free = 0;
+
+        for (ListEntry = Fdo->HoleList.Flink;
+             ListEntry != &Fdo->HoleList;
+             ListEntry = ListEntry->Flink) {
+            PXENBUS_HOLE_REGION Other;
+
+            Other = CONTAINING_RECORD(ListEntry, XENBUS_HOLE_REGION, ListEntry);
+            if (Other != Region)
+                Free += Other->Free;
+        }
+
+        // The region keeps its slot in HoleCount until it has really
+        // gone, since it may have to come back
+        if (Free >= FDO_HOLE_PAGES / 2) {
+            RemoveEntryList(&Region->ListEntry);
+            Release = TRUE;
+        }
+    }
+
+    ReleaseHighLock(&Fdo->HoleLock, Irql);
+
+    if (Release)
+        FdoHoleShrink(Fdo, Region);
 }
 
 static VOID
@@ -3331,45 +4564,39 @@ FdoDestroyHole(
     IN  PXENBUS_FDO Fdo
     )
 {
-    PMDL            Mdl;
-    PFN_NUMBER      Pfn;
-    LONGLONG        Start;
-    ULONG           Count;
-    ULONG           Index;
-    NTSTATUS        status;
+    KIRQL           Irql;
 
-    Mdl = Fdo->Mdl;
+    AcquireHighLock(&Fdo->HoleLock, &Irql);
 
-    Pfn = MmGetMdlPfnArray(Mdl)[0];
+    while (!IsListEmpty(&Fdo->HoleList)) {
+        PLIST_ENTRY         ListEntry;
+        PXENBUS_HOLE_REGION Region;
 
-    Start = Pfn;
-    Count = BYTES_TO_PAGES(Mdl->ByteCount);
+        ListEntry = RemoveHeadList(&Fdo->HoleList);
+        ASSERT(ListEntry != &Fdo->HoleList);
 
-    Trace("%08x - %08x\n", Start, Start + Count - 1);
+        ReleaseHighLock(&Fdo->HoleLock, Irql);
 
-    ASSERT3U(Count & ((1u << PAGE_ORDER_2M) - 1), ==, 0);
-    if (MemoryPopulatePhysmap(PAGE_ORDER_2M, 1, &Pfn) == 1)
-        goto done;
+        Region = CONTAINING_RECORD(ListEntry, XENBUS_HOLE_REGION, ListEntry);
 
-    for (Index = 0; Index < Count; Index++) {
-        if (MemoryPopulatePhysmap(PAGE_ORDER_4K, 1, &Pfn) != 1)
-            BUG("FAILED TO RE-POPULATE HOLE");
+        if (Region->Primary) {
+            NTSTATUS    status;
 
-        Pfn++;
+            status = FdoHoleDestroyRegion(Region);
+            if (!NT_SUCCESS(status))
+                BUG("FAILED TO RE-POPULATE HOLE");
+
+            __FdoFree(Region);
+        } else {
+            FdoHoleReleaseRegion(Fdo, Region);
+        }
+
+        AcquireHighLock(&Fdo->HoleLock, &Irql);
     }
 
-done:
-    status = XENBUS_RANGE_SET(Get,
-                              &Fdo->RangeSetInterface,
-                              Fdo->RangeSet,
-                              Start,
-                              Count);
-    ASSERT(NT_SUCCESS(status));
+    Fdo->HoleCount = 0;
 
-    XENBUS_RANGE_SET(Destroy,
-                     &Fdo->RangeSetInterface,
-                     Fdo->RangeSet);
-    Fdo->RangeSet = NULL;
+    ReleaseHighLock(&Fdo->HoleLock, Irql);
 }
 
 static VOID
@@ -3379,8 +4606,59 @@ FdoDebugCallback(
     )
 {
     PXENBUS_FDO Fdo = Argument;
+    ULONG       Ordinal;
+
+    XENBUS_DEBUG(Printf,
+                 &Fdo->DebugInterface,
+                 "HYPERCALLS:\n");
 
-    UNREFERENCED_PARAMETER(Crashing);
+    for (Ordinal = 0; Ordinal < HYPERCALL_MAXIMUM_ORDINAL; Ordinal++) {
+        ULONGLONG   Count;
+        ULONGLONG   Batched;
+        ULONGLONG   Cycles;
+
+        HypercallQueryStatistics(Ordinal, &Count, &Batched, &Cycles);
+
+        if (Count == 0 && Batched == 0)
+            continue;
+
+        XENBUS_DEBUG(Printf,
+                     &Fdo->DebugInterface,
+                     "- %u: Count = %llu Batched = %llu Cycles = %llu (%llu per call)\n",
+                     Ordinal,
+                     Count,
+                     Batched,
+                     Cycles,
+                     (Count != 0) ? Cycles / Count : 0);
+    }
+
+    XENBUS_DEBUG(Printf,
+                 &Fdo->DebugInterface,
+                 "SCAN: Wakeups = %u Coalesced = %u Synchronous = %u Scans = %u ParameterRefreshes = %u\n",
+                 Fdo->ScanWakeups,
+                 Fdo->ScanCoalesced,
+                 Fdo->ScanSynchronous,
+                 Fdo->ScanCount,
+                 Fdo->ScanParametersRefreshes);
+
+    XENBUS_DEBUG(Printf,
+                 &Fdo->DebugInterface,
+                 "ENUMERATE: Count = %u Invalidations = %u Time = %lluus (%lluus per pass)\n",
+                 Fdo->EnumerateCount,
+                 Fdo->EnumerateInvalidations,
+                 Fdo->EnumerateTime,
+                 (Fdo->EnumerateCount != 0) ?
+                 Fdo->EnumerateTime / Fdo->EnumerateCount :
+                 0);
+
+    XENBUS_DEBUG(Printf,
+                 &Fdo->DebugInterface,
+                 "WORK: Threads = %u Runs = %u Items = %u Time = %lluus Maximum = %lluus\n",
+                 Fdo->WorkThreadCount + 1,
+                 Fdo->WorkRuns,
+                 Fdo->WorkItems,
+                 Fdo->WorkTime,
+                 Fdo->WorkMaximumTime);
 
     if (!IsListEmpty(&Fdo->VirqList)) {
         PLIST_ENTRY ListEntry;
@@ -3410,6 +4688,51 @@ FdoDebugCallback(
                          Virq->Count);
         }
     }
+
+    if (!IsListEmpty(&Fdo->HoleList)) {
+        PLIST_ENTRY ListEntry;
+        KIRQL       Irql;
+
+        // Don't risk the lock if we are crashing
+        if (!Crashing)
+            AcquireHighLock(&Fdo->HoleLock, &Irql);
+
+        XENBUS_DEBUG(Printf,
+                     &Fdo->DebugInterface,
+                     "HOLE: Regions = %u Grows = %u Shrinks = %u Failures = %d\n",
+                     Fdo->HoleCount,
+                     Fdo->HoleGrows,
+                     Fdo->HoleShrinks,
+                     Fdo->HoleFailures);
+
+        for (ListEntry = Fdo->HoleList.Flink;
+             ListEntry != &Fdo->HoleList;
+             ListEntry = ListEntry->Flink) {
+            PXENBUS_HOLE_REGION Region;
+            ULONG               Largest;
+
+            Region = CONTAINING_RECORD(ListEntry, XENBUS_HOLE_REGION, ListEntry);
+            Largest = FdoHoleLargestBlock(Region);
+
+            // Fragmentation is the proportion of free pages that are
+            // not in the largest free block
+            XENBUS_DEBUG(Printf,
+                         &Fdo->DebugInterface,
+                         "- %08x - %08x%s: Free = %u/%u Largest = %u Fragmentation = %u%%\n",
+                         (ULONG)Region->Pfn,
+                         (ULONG)(Region->Pfn + FDO_HOLE_PAGES - 1),
+                         (Region->Primary) ? " (PRIMARY)" : "",
+                         Region->Free,
+                         FDO_HOLE_PAGES,
+                         Largest,
+                         (Region->Free != 0) ?
+                         ((Region->Free - Largest) * 100) / Region->Free :
+                         0);
+        }
+
+        if (!Crashing)
+            ReleaseHighLock(&Fdo->HoleLock, Irql);
+    }
 }
 
 // This function must not touch pageable code or data
@@ -3441,36 +4764,32 @@ FdoD3ToD0(
     if (!NT_SUCCESS(status))
         goto fail2;
 
-    status = XENBUS_RANGE_SET(Acquire, &Fdo->RangeSetInterface);
-    if (!NT_SUCCESS(status))
-        goto fail3;
-
     // Subsequent interfaces require use of BAR space
     status = FdoCreateHole(Fdo);
     if (!NT_SUCCESS(status))
-        goto fail4;
+        goto fail3;
 
     status = XENBUS_EVTCHN(Acquire, &Fdo->EvtchnInterface);
     if (!NT_SUCCESS(status))
-        goto fail5;
+        goto fail4;
 
     status = XENBUS_STORE(Acquire, &Fdo->StoreInterface);
     if (!NT_SUCCESS(status))
-        goto fail6;
+        goto fail5;
 
     status = XENBUS_CONSOLE(Acquire, &Fdo->ConsoleInterface);
     if (!NT_SUCCESS(status))
-        goto fail7;
+        goto fail6;
 
     if (Fdo->BalloonInterface.Interface.Context != NULL) {
         status = XENBUS_BALLOON(Acquire, &Fdo->BalloonInterface);
         if (!NT_SUCCESS(status))
-            goto fail8;
+            goto fail7;
     }
 
     status = __FdoD3ToD0(Fdo);
     if (!NT_SUCCESS(status))
-        goto fail9;
+        goto fail8;
 
     status = XENBUS_SUSPEND(Register,
                             &Fdo->SuspendInterface,
@@ -3479,7 +4798,7 @@ FdoD3ToD0(
                             Fdo,
                             &Fdo->SuspendCallbackLate);
     if (!NT_SUCCESS(status))
-        goto fail10;
+        goto fail9;
 
     status = XENBUS_DEBUG(Register,
                           &Fdo->DebugInterface,
@@ -3488,7 +4807,7 @@ FdoD3ToD0(
                           Fdo,
                           &Fdo->DebugCallback);
     if (!NT_SUCCESS(status))
-        goto fail11;
+        goto fail10;
 
     KeLowerIrql(Irql);
 
@@ -3519,49 +4838,44 @@ not_active:
 
     return STATUS_SUCCESS;
 
-fail11:
-    Error("fail11\n");
+fail10:
+    Error("fail10\n");
 
     XENBUS_SUSPEND(Deregister,
                    &Fdo->SuspendInterface,
                    Fdo->SuspendCallbackLate);
     Fdo->SuspendCallbackLate = NULL;
 
-fail10:
-    Error("fail10\n");
-
-    __FdoD0ToD3(Fdo);
-
 fail9:
     Error("fail9\n");
 
-    if (Fdo->BalloonInterface.Interface.Context != NULL)
-        XENBUS_BALLOON(Release, &Fdo->BalloonInterface);
+    __FdoD0ToD3(Fdo);
 
 fail8:
     Error("fail8\n");
 
-    XENBUS_CONSOLE(Release, &Fdo->ConsoleInterface);
+    if (Fdo->BalloonInterface.Interface.Context != NULL)
+        XENBUS_BALLOON(Release, &Fdo->BalloonInterface);
 
 fail7:
     Error("fail7\n");
 
-    XENBUS_STORE(Release, &Fdo->StoreInterface);
+    XENBUS_CONSOLE(Release, &Fdo->ConsoleInterface);
 
 fail6:
     Error("fail6\n");
 
-    XENBUS_EVTCHN(Release, &Fdo->EvtchnInterface);
+    XENBUS_STORE(Release, &Fdo->StoreInterface);
 
 fail5:
     Error("fail5\n");
 
-    FdoDestroyHole(Fdo);
+    XENBUS_EVTCHN(Release, &Fdo->EvtchnInterface);
 
 fail4:
     Error("fail4\n");
 
-    XENBUS_RANGE_SET(Release, &Fdo->RangeSetInterface);
+    FdoDestroyHole(Fdo);
 
 fail3:
     Error("fail3\n");
@@ -3678,8 +4992,6 @@ FdoD0ToD3(
 
     FdoDestroyHole(Fdo);
 
-    XENBUS_RANGE_SET(Release, &Fdo->RangeSetInterface);
-
     XENBUS_SUSPEND(Release, &Fdo->SuspendInterface);
 
     XENBUS_DEBUG(Release, &Fdo->DebugInterface);
@@ -3743,6 +5055,7 @@ FdoS3ToS4(
     BUG_ON(ConsoleGetReferences(Fdo->ConsoleContext) != 0);
     BUG_ON(GnttabGetReferences(Fdo->GnttabContext) != 0);
     BUG_ON(BalloonGetReferences(Fdo->BalloonContext) != 0);
+    BUG_ON(TimerGetReferences(Fdo->TimerContext) != 0);
 
 not_active:
     __FdoSetSystemPowerState(Fdo, PowerSystemHibernate);
@@ -3854,6 +5167,8 @@ FdoStartDevice(
     if (!NT_SUCCESS(status))
         goto fail4;
 
+    FdoWorkInitialize(Fdo);
+
     KeInitializeEvent(&Fdo->ScanEvent, NotificationEvent, FALSE);
 
     status = ThreadCreate(FdoScan, Fdo, &Fdo->ScanThread);
@@ -3965,6 +5280,8 @@ fail5:
 
     RtlZeroMemory(&Fdo->ScanEvent, sizeof (KEVENT));
 
+    FdoWorkTeardown(Fdo);
+
     FdoDestroyInterrupt(Fdo);
 
 fail4:
@@ -4076,6 +5393,8 @@ FdoStopDevice(
 
     RtlZeroMemory(&Fdo->ScanEvent, sizeof (KEVENT));
 
+    FdoWorkTeardown(Fdo);
+
     FdoDestroyInterrupt(Fdo);
 
 not_active:
@@ -4260,6 +5579,8 @@ FdoRemoveDevice(
 
     RtlZeroMemory(&Fdo->ScanEvent, sizeof (KEVENT));
 
+    FdoWorkTeardown(Fdo);
+
     FdoDestroyInterrupt(Fdo);
 
 not_active:
@@ -5482,66 +6803,48 @@ fail1:
                       (_Optional))
 
 
-#define FDO_HOLE_SIZE   (2ull << 20)
-
 static FORCEINLINE NTSTATUS
 __FdoAllocateBuffer(
-    IN  PXENBUS_FDO     Fdo
+    IN  PXENBUS_FDO Fdo
     )
 {
-    ULONG               Size;
-    PHYSICAL_ADDRESS    Low;
-    PHYSICAL_ADDRESS    High;
-    PHYSICAL_ADDRESS    Align;
-    PVOID               Buffer;
-    PMDL                Mdl;
-    NTSTATUS            status;
-
-    Size = 2 << 20;
+    NTSTATUS        status;
 
-    Low.QuadPart = 0;
-    High = SystemMaximumPhysicalAddress();
-    Align.QuadPart = Size;
+    InitializeHighLock(&Fdo->HoleLock);
+    InitializeListHead(&Fdo->HoleList);
+    InitializeListHead(&Fdo->HoleReleaseList);
 
-    Buffer = MmAllocateContiguousNodeMemory((SIZE_T)Size,
-                                            Low,
-                                            High,
-                                            Align,
-                                            PAGE_READWRITE,
-                                            MM_ANY_NODE_OK);
+    status = FdoAllocateHoleBuffer(&Fdo->Buffer, &Fdo->Mdl);
+    if (!NT_SUCCESS(status)) {
+        if (Fdo->Buffer != NULL) {
+            FdoFreeHoleBuffer(Fdo->Buffer, NULL);
+            Fdo->Buffer = NULL;
+        }
 
-    status = STATUS_NO_MEMORY;
-    if (Buffer == NULL)
         goto fail1;
+    }
 
-    Mdl = IoAllocateMdl(Buffer,
-                        Size,
-                        FALSE,
-                        FALSE,
-                        NULL);
-
-    status = STATUS_NO_MEMORY;
-    if (Mdl == NULL)
+    status = ThreadCreate(FdoHole, Fdo, &Fdo->HoleThread);
+    if (!NT_SUCCESS(status))
         goto fail2;
 
-    MmBuildMdlForNonPagedPool(Mdl);
-
-    ASSERT3U(Mdl->ByteOffset, ==, 0);
-    ASSERT3U(Mdl->ByteCount, ==, Size);
-
-    Fdo->Buffer = MmGetSystemAddressForMdlSafe(Mdl, NormalPagePriority);
-    Fdo->Mdl = Mdl;
-
     return STATUS_SUCCESS;
 
 fail2:
     Error("fail2\n");
 
-    MmFreeContiguousMemory(Buffer);
+    FdoFreeHoleBuffer(Fdo->Buffer, Fdo->Mdl);
+
+    Fdo->Mdl = NULL;
+    Fdo->Buffer = NULL;
 
 fail1:
     Error("fail1 (%08x)\n", status);
 
+    RtlZeroMemory(&Fdo->HoleReleaseList, sizeof (LIST_ENTRY));
+    RtlZeroMemory(&Fdo->HoleList, sizeof (LIST_ENTRY));
+    RtlZeroMemory(&Fdo->HoleLock, sizeof (HIGH_LOCK));
+
     return status;
 }
 
@@ -5550,11 +6853,26 @@ __FdoFreeBuffer(
     IN  PXENBUS_FDO Fdo
     )
 {
-    ExFreePool(Fdo->Mdl);
-    Fdo->Mdl = NULL;
+    // The thread drains the release list before it exits
+    ThreadAlert(Fdo->HoleThread);
+    ThreadJoin(Fdo->HoleThread);
+    Fdo->HoleThread = NULL;
+
+    ASSERT(IsListEmpty(&Fdo->HoleReleaseList));
+    ASSERT(IsListEmpty(&Fdo->HoleList));
+
+    FdoFreeHoleBuffer(Fdo->Buffer, Fdo->Mdl);
 
-    MmFreeContiguousMemory(Fdo->Buffer);
+    Fdo->Mdl = NULL;
     Fdo->Buffer = NULL;
+
+    Fdo->HoleFailures = 0;
+    Fdo->HoleShrinks = 0;
+    Fdo->HoleGrows = 0;
+
+    RtlZeroMemory(&Fdo->HoleReleaseList, sizeof (LIST_ENTRY));
+    RtlZeroMemory(&Fdo->HoleList, sizeof (LIST_ENTRY));
+    RtlZeroMemory(&Fdo->HoleLock, sizeof (HIGH_LOCK));
 }
 
 static NTSTATUS
@@ -5756,6 +7074,10 @@ FdoCreate(
     if (!NT_SUCCESS(status))
         goto fail20;
 
+    status = TimerInitialize(Fdo, &Fdo->TimerContext);
+    if (!NT_SUCCESS(status))
+        goto fail21;
+
     status = DebugGetInterface(__FdoGetDebugContext(Fdo),
                                XENBUS_DEBUG_INTERFACE_VERSION_MAX,
                                (PINTERFACE)&Fdo->DebugInterface,
@@ -5777,13 +7099,6 @@ FdoCreate(
     ASSERT(NT_SUCCESS(status));
     ASSERT(Fdo->EvtchnInterface.Interface.Context != NULL);
 
-    status = RangeSetGetInterface(__FdoGetRangeSetContext(Fdo),
-                                  XENBUS_RANGE_SET_INTERFACE_VERSION_MAX,
-                                  (PINTERFACE)&Fdo->RangeSetInterface,
-                                  sizeof (Fdo->RangeSetInterface));
-    ASSERT(NT_SUCCESS(status));
-    ASSERT(Fdo->RangeSetInterface.Interface.Context != NULL);
-
     status = StoreGetInterface(__FdoGetStoreContext(Fdo),
                                XENBUS_STORE_INTERFACE_VERSION_MAX,
                                (PINTERFACE)&Fdo->StoreInterface,
@@ -5825,6 +7140,11 @@ done:
 
     return STATUS_SUCCESS;
 
+fail21:
+    Error("fail21\n");
+
+    FdoBalloonTeardown(Fdo);
+
 fail20:
     Error("fail20\n");
 
@@ -5987,9 +7307,6 @@ FdoDestroy(
         RtlZeroMemory(&Fdo->StoreInterface,
                       sizeof (XENBUS_STORE_INTERFACE));
 
-        RtlZeroMemory(&Fdo->RangeSetInterface,
-                      sizeof (XENBUS_RANGE_SET_INTERFACE));
-
         RtlZeroMemory(&Fdo->EvtchnInterface,
                       sizeof (XENBUS_EVTCHN_INTERFACE));
 
@@ -5999,6 +7316,9 @@ FdoDestroy(
         RtlZeroMemory(&Fdo->DebugInterface,
                       sizeof (XENBUS_DEBUG_INTERFACE));
 
+        TimerTeardown(Fdo->TimerContext);
+        Fdo->TimerContext = NULL;
+
         FdoBalloonTeardown(Fdo);
 
         UnplugTeardown(Fdo->UnplugContext);
@@ -6036,6 +7356,11 @@ FdoDestroy(
         FdoClearActive(Fdo);
     }
 
+    Fdo->WorkMaximumTime = 0;
+    Fdo->WorkTime = 0;
+    Fdo->WorkItems = 0;
+    Fdo->WorkRuns = 0;
+
     RtlZeroMemory(Fdo->VendorName, MAXNAMELEN);
 
     FdoReleaseLowerBusInterface(Fdo);
@@ -267,6 +267,13 @@ FdoGetConsoleContext(
     IN  PXENBUS_FDO Fdo
     );
 
+#include "timer.h"
+
+extern PXENBUS_TIMER_CONTEXT
+FdoGetTimerContext(
+    IN  PXENBUS_FDO Fdo
+    );
+
 extern NTSTATUS
 FdoDispatch(
     IN  PXENBUS_FDO Fdo,
@@ -68,11 +68,31 @@ struct _XENBUS_GNTTAB_ENTRY {
     grant_entry_v1_t    Entry;
 };
 
+// Entries created by GnttabMapForeignPagesCached() are marked Cacheable
+// (which never changes) and reference counted. They are kept on a hash
+// chain while they are eligible for re-use (Cached) and on the LRU list
+// while they are also idle. The grant references follow the map handles.
 typedef struct _XENBUS_GNTTAB_MAP_ENTRY {
-    ULONG   NumberPages;
-    ULONG   MapHandles[1];
+    LIST_ENTRY          ListEntry;
+    LIST_ENTRY          LruListEntry;
+    PHYSICAL_ADDRESS    Address;
+    USHORT              Domain;
+    BOOLEAN             ReadOnly;
+    BOOLEAN             Cacheable;
+    BOOLEAN             Cached;
+    ULONG               Hash;
+    ULONG               Generation;
+    ULONG               References;
+    ULONG               NumberPages;
+    ULONG               MapHandles[1];
 } XENBUS_GNTTAB_MAP_ENTRY, *PXENBUS_GNTTAB_MAP_ENTRY;
 
+#define XENBUS_GNTTAB_MAP_CACHE_BUCKETS 64
+
+// Idle cached mappings hold on to hole space so keep them to a fraction
+// of what the hole can grow to
+#define XENBUS_GNTTAB_MAP_CACHE_MAXIMUM_PAGES   8192
+
 struct _XENBUS_GNTTAB_CONTEXT {
     PXENBUS_FDO                 Fdo;
     KSPIN_LOCK                  Lock;
@@ -88,7 +108,20 @@ struct _XENBUS_GNTTAB_CONTEXT {
     PXENBUS_SUSPEND_CALLBACK    SuspendCallbackEarly;
     XENBUS_DEBUG_INTERFACE      DebugInterface;
     PXENBUS_DEBUG_CALLBACK      DebugCallback;
+    PXENBUS_DEBUG_STATISTIC     MapStatistic;
+    PXENBUS_DEBUG_STATISTIC     UnmapStatistic;
     PXENBUS_HASH_TABLE          MapTable;
+    KSPIN_LOCK                  MapCacheLock;
+    LIST_ENTRY                  MapCacheBucket[XENBUS_GNTTAB_MAP_CACHE_BUCKETS];
+    LIST_ENTRY                  MapCacheLruList;
+    ULONG                       MapGeneration;
+    ULONG                       MapCacheGeneration;
+    ULONG                       MapCacheEntries;
+    ULONG                       MapCacheIdlePages;
+    ULONG                       MapCacheHits;
+    ULONG                       MapCacheMisses;
+    ULONG                       MapCacheEvictions;
+    ULONG                       MapCacheInvalidations;
     LIST_ENTRY                  List;
 };
 
@@ -186,12 +219,17 @@ GnttabMap(
 
     Address = Context->Address;
 
-    for (Index = 0; Index <= Context->FrameIndex; Index++) {
-        status = MemoryAddToPhysmap((PFN_NUMBER)(Address.QuadPart >> PAGE_SHIFT),
-                                    XENMAPSPACE_grant_table,
-                                    Index);
-        ASSERT(NT_SUCCESS(status));
+    if (Context->FrameIndex < 0)
+        return;
 
+    status = MemoryAddToPhysmapRange((PFN_NUMBER)(Address.QuadPart >> PAGE_SHIFT),
+                                     XENMAPSPACE_grant_table,
+                                     0,
+                                     Context->FrameIndex + 1);
+    if (!NT_SUCCESS(status))
+        BUG("FAILED TO MAP GRANT TABLE");
+
+    for (Index = 0; Index <= Context->FrameIndex; Index++) {
         LogPrintf(LOG_LEVEL_INFO,
                   "GNTTAB: MAP XENMAPSPACE_grant_table[%d] @ %08x.%08x\n",
                   Index,
@@ -597,46 +635,90 @@ fail1:
     return status;
 }
 
+static FORCEINLINE PULONG
+__GnttabMapEntryReferences(
+    IN  PXENBUS_GNTTAB_MAP_ENTRY    MapEntry
+    )
+{
+    return &MapEntry->MapHandles[MapEntry->NumberPages];
+}
+
+static ULONG
+GnttabMapHash(
+    IN  USHORT  Domain,
+    IN  ULONG   NumberPages,
+    IN  PULONG  References,
+    IN  BOOLEAN ReadOnly
+    )
+{
+    ULONG       Hash;
+    ULONG       Index;
+
+    // FNV-1a
+    Hash = 2166136261u;
+
+    Hash = (Hash ^ Domain) * 16777619u;
+    Hash = (Hash ^ ReadOnly) * 16777619u;
+    Hash = (Hash ^ NumberPages) * 16777619u;
+
+    for (Index = 0; Index < NumberPages; Index++)
+        Hash = (Hash ^ References[Index]) * 16777619u;
+
+    return Hash;
+}
+
 static NTSTATUS
-GnttabMapForeignPages(
-    IN  PINTERFACE              Interface,
-    IN  USHORT                  Domain,
-    IN  ULONG                   NumberPages,
-    IN  PULONG                  References,
-    IN  BOOLEAN                 ReadOnly,
-    OUT PHYSICAL_ADDRESS        *Address
+GnttabMapEntryCreate(
+    IN  PXENBUS_GNTTAB_CONTEXT      Context,
+    IN  USHORT                      Domain,
+    IN  ULONG                       NumberPages,
+    IN  PULONG                      References,
+    IN  BOOLEAN                     ReadOnly,
+    IN  BOOLEAN                     Cacheable,
+    OUT PXENBUS_GNTTAB_MAP_ENTRY    *MapEntry
     )
 {
-    PXENBUS_GNTTAB_CONTEXT      Context = Interface->Context;
-    LONG                        PageIndex;
-    PHYSICAL_ADDRESS            PageAddress;
-    PXENBUS_GNTTAB_MAP_ENTRY    MapEntry;
-    NTSTATUS                    status;
+    PHYSICAL_ADDRESS                Address;
+    LONG                            PageIndex;
+    PHYSICAL_ADDRESS                PageAddress;
+    NTSTATUS                        status;
 
     status = FdoAllocateHole(Context->Fdo,
                              NumberPages,
                              NULL,
-                             Address);
+                             &Address);
     if (!NT_SUCCESS(status))
         goto fail1;
 
-    MapEntry = __GnttabAllocate(FIELD_OFFSET(XENBUS_GNTTAB_MAP_ENTRY,
-                                             MapHandles) +
-                                (NumberPages * sizeof (ULONG)));
+    *MapEntry = __GnttabAllocate(FIELD_OFFSET(XENBUS_GNTTAB_MAP_ENTRY,
+                                              MapHandles) +
+                                 (2 * NumberPages * sizeof (ULONG)));
 
     status = STATUS_NO_MEMORY;
-    if (MapEntry == NULL)
+    if (*MapEntry == NULL)
         goto fail2;
 
-    PageAddress.QuadPart = Address->QuadPart;
-    MapEntry->NumberPages = NumberPages;
+    (*MapEntry)->Address = Address;
+    (*MapEntry)->Domain = Domain;
+    (*MapEntry)->ReadOnly = ReadOnly;
+    (*MapEntry)->Cacheable = Cacheable;
+    (*MapEntry)->NumberPages = NumberPages;
+
+    // The mappings belong to the domain as it is now
+    (*MapEntry)->Generation = Context->MapGeneration;
+
+    RtlCopyMemory(__GnttabMapEntryReferences(*MapEntry),
+                  References,
+                  NumberPages * sizeof (ULONG));
+
+    PageAddress.QuadPart = Address.QuadPart;
 
     for (PageIndex = 0; PageIndex < (LONG)NumberPages; PageIndex++) {
         status = GrantTableMapForeignPage(Domain,
                                           References[PageIndex],
                                           PageAddress,
                                           ReadOnly,
-                                          &MapEntry->MapHandles[PageIndex]);
+                                          &(*MapEntry)->MapHandles[PageIndex]);
         if (!NT_SUCCESS(status))
             goto fail3;
 
@@ -644,8 +726,8 @@ GnttabMapForeignPages(
     }
 
     status = HashTableAdd(Context->MapTable,
-                          (ULONG_PTR)Address->QuadPart,
-                          (ULONG_PTR)MapEntry);
+                          (ULONG_PTR)Address.QuadPart,
+                          (ULONG_PTR)*MapEntry);
     if (!NT_SUCCESS(status))
         goto fail4;
 
@@ -659,16 +741,335 @@ fail3:
 
     while (--PageIndex >= 0) {
         PageAddress.QuadPart -= PAGE_SIZE;
-        (VOID) GrantTableUnmapForeignPage(MapEntry->MapHandles[PageIndex],
+        (VOID) GrantTableUnmapForeignPage((*MapEntry)->MapHandles[PageIndex],
                                           PageAddress);
     }
 
-    __GnttabFree(MapEntry);
+    __GnttabFree(*MapEntry);
+    *MapEntry = NULL;
 
 fail2:
     Error("fail2\n");
 
-    FdoFreeHole(Context->Fdo, *Address, NumberPages);
+    FdoFreeHole(Context->Fdo, Address, NumberPages);
+
+fail1:
+    Error("fail1: (%08x)\n", status);
+
+    return status;
+}
+
+static VOID
+GnttabMapEntryDestroy(
+    IN  PXENBUS_GNTTAB_CONTEXT      Context,
+    IN  PXENBUS_GNTTAB_MAP_ENTRY    MapEntry,
+    IN  BOOLEAN                     Unmap
+    )
+{
+    ULONG                           PageIndex;
+    PHYSICAL_ADDRESS                PageAddress;
+    NTSTATUS                        status;
+
+    status = HashTableRemove(Context->MapTable,
+                             (ULONG_PTR)MapEntry->Address.QuadPart);
+    BUG_ON(!NT_SUCCESS(status));
+
+    PageAddress.QuadPart = MapEntry->Address.QuadPart;
+
+    // Foreign mappings do not survive a resume so there is nothing to
+    // unmap for an entry that pre-dates it
+    for (PageIndex = 0; Unmap && PageIndex < MapEntry->NumberPages; PageIndex++) {
+        status = GrantTableUnmapForeignPage(MapEntry->MapHandles[PageIndex],
+                                            PageAddress);
+        BUG_ON(!NT_SUCCESS(status));
+
+        PageAddress.QuadPart += PAGE_SIZE;
+    }
+
+    FdoFreeHole(Context->Fdo,
+                MapEntry->Address,
+                MapEntry->NumberPages);
+
+    __GnttabFree(MapEntry);
+}
+
+// Take an entry out of the cache, so that it cannot be handed out
+// again. Idle entries are moved onto List for the caller to destroy
+// once the lock is dropped, in-use entries are destroyed when they are
+// released.
+static VOID
+__GnttabMapCacheRemove(
+    IN  PXENBUS_GNTTAB_CONTEXT      Context,
+    IN  PXENBUS_GNTTAB_MAP_ENTRY    MapEntry,
+    IN  PLIST_ENTRY                 List
+    )
+{
+    ASSERT(MapEntry->Cached);
+
+    RemoveEntryList(&MapEntry->ListEntry);
+    MapEntry->Cached = FALSE;
+    --Context->MapCacheEntries;
+
+    if (MapEntry->References != 0)
+        return;
+
+    RemoveEntryList(&MapEntry->LruListEntry);
+    Context->MapCacheIdlePages -= MapEntry->NumberPages;
+
+    InsertTailList(List, &MapEntry->LruListEntry);
+}
+
+static VOID
+GnttabMapCacheDestroyList(
+    IN  PXENBUS_GNTTAB_CONTEXT  Context,
+    IN  PLIST_ENTRY             List
+    )
+{
+    while (!IsListEmpty(List)) {
+        PLIST_ENTRY                 ListEntry;
+        PXENBUS_GNTTAB_MAP_ENTRY    MapEntry;
+
+        ListEntry = RemoveHeadList(List);
+        ASSERT(ListEntry != List);
+
+        MapEntry = CONTAINING_RECORD(ListEntry,
+                                     XENBUS_GNTTAB_MAP_ENTRY,
+                                     LruListEntry);
+
+        GnttabMapEntryDestroy(Context,
+                              MapEntry,
+                              MapEntry->Generation == Context->MapGeneration);
+    }
+}
+
+// If the domain has been resumed since the cache was last used then
+// none of its mappings are valid any more.
+static VOID
+__GnttabMapCacheCheckGeneration(
+    IN  PXENBUS_GNTTAB_CONTEXT  Context,
+    IN  PLIST_ENTRY             List
+    )
+{
+    ULONG                       Index;
+
+    if (Context->MapCacheGeneration == Context->MapGeneration)
+        return;
+
+    for (Index = 0; Index < XENBUS_GNTTAB_MAP_CACHE_BUCKETS; Index++) {
+        PLIST_ENTRY Bucket = &Context->MapCacheBucket[Index];
+
+        while (!IsListEmpty(Bucket)) {
+            PXENBUS_GNTTAB_MAP_ENTRY    MapEntry;
+
+            MapEntry = CONTAINING_RECORD(Bucket->Flink,
+                                         XENBUS_GNTTAB_MAP_ENTRY,
+                                         ListEntry);
+
+            __GnttabMapCacheRemove(Context, MapEntry, List);
+            Context->MapCacheInvalidations++;
+        }
+    }
+
+    ASSERT3U(Context->MapCacheEntries, ==, 0);
+    ASSERT(IsListEmpty(&Context->MapCacheLruList));
+
+    Context->MapCacheGeneration = Context->MapGeneration;
+}
+
+// Evict least recently used idle entries until the cache is back
+// within its limit, or until it is empty if Flush is set.
+static VOID
+__GnttabMapCacheTrim(
+    IN  PXENBUS_GNTTAB_CONTEXT  Context,
+    IN  BOOLEAN                 Flush,
+    IN  PLIST_ENTRY             List
+    )
+{
+    while (!IsListEmpty(&Context->MapCacheLruList) &&
+           (Flush ||
+            Context->MapCacheIdlePages > XENBUS_GNTTAB_MAP_CACHE_MAXIMUM_PAGES)) {
+        PXENBUS_GNTTAB_MAP_ENTRY    MapEntry;
+
+        MapEntry = CONTAINING_RECORD(Context->MapCacheLruList.Flink,
+                                     XENBUS_GNTTAB_MAP_ENTRY,
+                                     LruListEntry);
+
+        __GnttabMapCacheRemove(Context, MapEntry, List);
+        Context->MapCacheEvictions++;
+    }
+}
+
+static NTSTATUS
+GnttabMapForeignPages(
+    IN  PINTERFACE              Interface,
+    IN  USHORT                  Domain,
+    IN  ULONG                   NumberPages,
+    IN  PULONG                  References,
+    IN  BOOLEAN                 ReadOnly,
+    OUT PHYSICAL_ADDRESS        *Address
+    )
+{
+    PXENBUS_GNTTAB_CONTEXT      Context = Interface->Context;
+    PXENBUS_GNTTAB_MAP_ENTRY    MapEntry;
+    ULONGLONG                   Start;
+    ULONGLONG                   End;
+    NTSTATUS                    status;
+
+    Start = __rdtsc();
+
+    status = GnttabMapEntryCreate(Context,
+                                  Domain,
+                                  NumberPages,
+                                  References,
+                                  ReadOnly,
+                                  FALSE,
+                                  &MapEntry);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    *Address = MapEntry->Address;
+
+    End = __rdtsc();
+
+    XENBUS_DEBUG(StatisticRecord,
+                 &Context->DebugInterface,
+                 Context->MapStatistic,
+                 End - Start);
+
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1: (%08x)\n", status);
+
+    return status;
+}
+
+static NTSTATUS
+GnttabMapForeignPagesCached(
+    IN  PINTERFACE              Interface,
+    IN  USHORT                  Domain,
+    IN  ULONG                   NumberPages,
+    IN  PULONG                  References,
+    IN  BOOLEAN                 ReadOnly,
+    OUT PHYSICAL_ADDRESS        *Address
+    )
+{
+    PXENBUS_GNTTAB_CONTEXT      Context = Interface->Context;
+    PXENBUS_GNTTAB_MAP_ENTRY    MapEntry;
+    ULONG                       Hash;
+    PLIST_ENTRY                 Bucket;
+    PLIST_ENTRY                 ListEntry;
+    LIST_ENTRY                  List;
+    ULONGLONG                   Start;
+    ULONGLONG                   End;
+    KIRQL                       Irql;
+    NTSTATUS                    status;
+
+    Start = __rdtsc();
+
+    InitializeListHead(&List);
+
+    Hash = GnttabMapHash(Domain, NumberPages, References, ReadOnly);
+    Bucket = &Context->MapCacheBucket[Hash % XENBUS_GNTTAB_MAP_CACHE_BUCKETS];
+
+    KeAcquireSpinLock(&Context->MapCacheLock, &Irql);
+
+    __GnttabMapCacheCheckGeneration(Context, &List);
+
+    for (ListEntry = Bucket->Flink;
+         ListEntry != Bucket;
+         ListEntry = ListEntry->Flink) {
+        MapEntry = CONTAINING_RECORD(ListEntry,
+                                     XENBUS_GNTTAB_MAP_ENTRY,
+                                     ListEntry);
+
+        if (MapEntry->Hash == Hash &&
+            MapEntry->Domain == Domain &&
+            MapEntry->ReadOnly == ReadOnly &&
+            MapEntry->NumberPages == NumberPages &&
+            RtlEqualMemory(__GnttabMapEntryReferences(MapEntry),
+                           References,
+                           NumberPages * sizeof (ULONG)))
+            goto hit;
+    }
+
+    Context->MapCacheMisses++;
+
+    KeReleaseSpinLock(&Context->MapCacheLock, Irql);
+
+    GnttabMapCacheDestroyList(Context, &List);
+
+    status = GnttabMapEntryCreate(Context,
+                                  Domain,
+                                  NumberPages,
+                                  References,
+                                  ReadOnly,
+                                  TRUE,
+                                  &MapEntry);
+    if (!NT_SUCCESS(status) && Context->MapCacheIdlePages != 0) {
+        // The hole is full, so give back whatever we are holding on to
+        // and try again
+        KeAcquireSpinLock(&Context->MapCacheLock, &Irql);
+        __GnttabMapCacheTrim(Context, TRUE, &List);
+        KeReleaseSpinLock(&Context->MapCacheLock, Irql);
+
+        GnttabMapCacheDestroyList(Context, &List);
+
+        status = GnttabMapEntryCreate(Context,
+                                      Domain,
+                                      NumberPages,
+                                      References,
+                                      ReadOnly,
+                                      TRUE,
+                                      &MapEntry);
+    }
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    MapEntry->Hash = Hash;
+    MapEntry->References = 1;
+
+    KeAcquireSpinLock(&Context->MapCacheLock, &Irql);
+
+    __GnttabMapCacheCheckGeneration(Context, &List);
+
+    // A resume may have happened since we mapped, in which case the
+    // mapping is already stale and must not be cached
+    if (MapEntry->Generation == Context->MapCacheGeneration) {
+        InsertTailList(Bucket, &MapEntry->ListEntry);
+        MapEntry->Cached = TRUE;
+        Context->MapCacheEntries++;
+    }
+
+    KeReleaseSpinLock(&Context->MapCacheLock, Irql);
+
+    GnttabMapCacheDestroyList(Context, &List);
+
+    goto done;
+
+hit:
+    if (MapEntry->References++ == 0) {
+        RemoveEntryList(&MapEntry->LruListEntry);
+        Context->MapCacheIdlePages -= NumberPages;
+    }
+
+    Context->MapCacheHits++;
+
+    KeReleaseSpinLock(&Context->MapCacheLock, Irql);
+
+    GnttabMapCacheDestroyList(Context, &List);
+
+done:
+    *Address = MapEntry->Address;
+
+    End = __rdtsc();
+
+    XENBUS_DEBUG(StatisticRecord,
+                 &Context->DebugInterface,
+                 Context->MapStatistic,
+                 End - Start);
+
+    return STATUS_SUCCESS;
 
 fail1:
     Error("fail1: (%08x)\n", status);
@@ -683,49 +1084,129 @@ GnttabUnmapForeignPages(
     )
 {
     PXENBUS_GNTTAB_CONTEXT      Context = Interface->Context;
-    ULONG                       PageIndex;
-    PHYSICAL_ADDRESS            PageAddress;
     PXENBUS_GNTTAB_MAP_ENTRY    MapEntry;
+    ULONGLONG                   Start;
+    ULONGLONG                   End;
+    KIRQL                       Irql;
     NTSTATUS                    status;
 
+    Start = __rdtsc();
+
     status = HashTableLookup(Context->MapTable,
                              (ULONG_PTR)Address.QuadPart,
                              (PULONG_PTR)&MapEntry);
     if (!NT_SUCCESS(status))
         goto fail1;
 
-    status = HashTableRemove(Context->MapTable,
-                             (ULONG_PTR)Address.QuadPart);
-    if (!NT_SUCCESS(status))
-        goto fail2;
+    // Entries created by GnttabMapForeignPages() have no references
+    if (MapEntry->Cacheable) {
+        LIST_ENTRY  List;
 
-    PageAddress.QuadPart = Address.QuadPart;
+        InitializeListHead(&List);
 
-    for (PageIndex = 0; PageIndex < MapEntry->NumberPages; PageIndex++) {
-        status = GrantTableUnmapForeignPage(MapEntry->MapHandles[PageIndex],
-                                            PageAddress);
-        BUG_ON(!NT_SUCCESS(status));
+        KeAcquireSpinLock(&Context->MapCacheLock, &Irql);
 
-        PageAddress.QuadPart += PAGE_SIZE;
+        __GnttabMapCacheCheckGeneration(Context, &List);
+
+        // An idle entry belongs to the cache, not the caller
+        if (MapEntry->References == 0)
+            BUG("UNMAP OF IDLE CACHED MAPPING");
+
+        if (--MapEntry->References == 0) {
+            if (MapEntry->Cached) {
+                InsertTailList(&Context->MapCacheLruList,
+                               &MapEntry->LruListEntry);
+                Context->MapCacheIdlePages += MapEntry->NumberPages;
+
+                __GnttabMapCacheTrim(Context, FALSE, &List);
+            } else {
+                InsertTailList(&List, &MapEntry->LruListEntry);
+            }
+        }
+
+        KeReleaseSpinLock(&Context->MapCacheLock, Irql);
+
+        GnttabMapCacheDestroyList(Context, &List);
+    } else {
+        ASSERT3U(MapEntry->References, ==, 0);
+        GnttabMapEntryDestroy(Context, MapEntry, TRUE);
     }
 
-    FdoFreeHole(Context->Fdo,
-                Address,
-                MapEntry->NumberPages);
+    End = __rdtsc();
 
-    __GnttabFree(MapEntry);
+    XENBUS_DEBUG(StatisticRecord,
+                 &Context->DebugInterface,
+                 Context->UnmapStatistic,
+                 End - Start);
 
     return STATUS_SUCCESS;
 
-fail2:
-    Error("fail2\n");
-
 fail1:
     Error("fail1: (%08x)\n", status);
 
     return status;
 }
 
+static VOID
+GnttabFlushForeignPages(
+    IN  PINTERFACE              Interface,
+    IN  USHORT                  Domain
+    )
+{
+    PXENBUS_GNTTAB_CONTEXT      Context = Interface->Context;
+    LIST_ENTRY                  List;
+    ULONG                       Index;
+    KIRQL                       Irql;
+
+    InitializeListHead(&List);
+
+    KeAcquireSpinLock(&Context->MapCacheLock, &Irql);
+
+    __GnttabMapCacheCheckGeneration(Context, &List);
+
+    for (Index = 0; Index < XENBUS_GNTTAB_MAP_CACHE_BUCKETS; Index++) {
+        PLIST_ENTRY Bucket = &Context->MapCacheBucket[Index];
+        PLIST_ENTRY ListEntry;
+
+        ListEntry = Bucket->Flink;
+        while (ListEntry != Bucket) {
+            PXENBUS_GNTTAB_MAP_ENTRY    MapEntry;
+
+            MapEntry = CONTAINING_RECORD(ListEntry,
+                                         XENBUS_GNTTAB_MAP_ENTRY,
+                                         ListEntry);
+            ListEntry = ListEntry->Flink;
+
+            if (MapEntry->Domain == Domain)
+                __GnttabMapCacheRemove(Context, MapEntry, &List);
+        }
+    }
+
+    KeReleaseSpinLock(&Context->MapCacheLock, Irql);
+
+    GnttabMapCacheDestroyList(Context, &List);
+}
+
+static VOID
+GnttabMapCacheFlush(
+    IN  PXENBUS_GNTTAB_CONTEXT  Context
+    )
+{
+    LIST_ENTRY                  List;
+    KIRQL                       Irql;
+
+    InitializeListHead(&List);
+
+    KeAcquireSpinLock(&Context->MapCacheLock, &Irql);
+
+    __GnttabMapCacheCheckGeneration(Context, &List);
+    __GnttabMapCacheTrim(Context, TRUE, &List);
+
+    KeReleaseSpinLock(&Context->MapCacheLock, Irql);
+
+    GnttabMapCacheDestroyList(Context, &List);
+}
+
 static VOID
 GnttabSuspendCallbackEarly(
     IN  PVOID               Argument
@@ -734,6 +1215,9 @@ GnttabSuspendCallbackEarly(
     PXENBUS_GNTTAB_CONTEXT  Context = Argument;
 
     GnttabMap(Context);
+
+    // Any cached foreign mappings are now stale
+    Context->MapGeneration++;
 }
                      
 static VOID
@@ -756,6 +1240,20 @@ GnttabDebugCallback(
                  &Context->DebugInterface,
                  "FrameIndex = %d\n",
                  Context->FrameIndex);
+
+    XENBUS_DEBUG(Printf,
+                 &Context->DebugInterface,
+                 "MapCache: Entries = %u IdlePages = %u Hits = %u Misses = %u (%u%% hit rate) Evictions = %u Invalidations = %u\n",
+                 Context->MapCacheEntries,
+                 Context->MapCacheIdlePages,
+                 Context->MapCacheHits,
+                 Context->MapCacheMisses,
+                 (Context->MapCacheHits + Context->MapCacheMisses != 0) ?
+                 (ULONG)(((ULONGLONG)Context->MapCacheHits * 100) /
+                         ((ULONGLONG)Context->MapCacheHits + Context->MapCacheMisses)) :
+                 0,
+                 Context->MapCacheEvictions,
+                 Context->MapCacheInvalidations);
 }
                      
 NTSTATUS
@@ -833,6 +1331,18 @@ GnttabAcquire(
     if (!NT_SUCCESS(status))
         goto fail9;
 
+    (VOID) XENBUS_DEBUG(StatisticCreate,
+                        &Context->DebugInterface,
+                        "GNTTAB|MAP_FOREIGN",
+                        XENBUS_DEBUG_STATISTIC_TYPE_CYCLES,
+                        &Context->MapStatistic);
+
+    (VOID) XENBUS_DEBUG(StatisticCreate,
+                        &Context->DebugInterface,
+                        "GNTTAB|UNMAP_FOREIGN",
+                        XENBUS_DEBUG_STATISTIC_TYPE_CYCLES,
+                        &Context->UnmapStatistic);
+
     /* Make sure at least the reserved refrences are present */
     status = GnttabExpand(Context);
     if (!NT_SUCCESS(status))
@@ -848,6 +1358,16 @@ done:
 fail10:
     Error("fail10\n");
 
+    XENBUS_DEBUG(StatisticDestroy,
+                 &Context->DebugInterface,
+                 Context->UnmapStatistic);
+    Context->UnmapStatistic = NULL;
+
+    XENBUS_DEBUG(StatisticDestroy,
+                 &Context->DebugInterface,
+                 Context->MapStatistic);
+    Context->MapStatistic = NULL;
+
     XENBUS_DEBUG(Deregister,
                  &Context->DebugInterface,
                  Context->DebugCallback);
@@ -937,6 +1457,18 @@ GnttabRelease(
     if (!IsListEmpty(&Context->List))
         BUG("OUTSTANDING CACHES");
 
+    GnttabMapCacheFlush(Context);
+
+    XENBUS_DEBUG(StatisticDestroy,
+                 &Context->DebugInterface,
+                 Context->UnmapStatistic);
+    Context->UnmapStatistic = NULL;
+
+    XENBUS_DEBUG(StatisticDestroy,
+                 &Context->DebugInterface,
+                 Context->MapStatistic);
+    Context->MapStatistic = NULL;
+
     XENBUS_DEBUG(Deregister,
                  &Context->DebugInterface,
                  Context->DebugCallback);
@@ -1031,12 +1563,29 @@ static struct _XENBUS_GNTTAB_INTERFACE_V4   GnttabInterfaceVersion4 = {
     GnttabUnmapForeignPages
 };
 
+static struct _XENBUS_GNTTAB_INTERFACE_V5   GnttabInterfaceVersion5 = {
+    { sizeof (struct _XENBUS_GNTTAB_INTERFACE_V5), 5, NULL, NULL, NULL },
+    GnttabAcquire,
+    GnttabRelease,
+    GnttabCreateCache,
+    GnttabPermitForeignAccess,
+    GnttabRevokeForeignAccess,
+    GnttabGetReference,
+    GnttabQueryReference,
+    GnttabDestroyCache,
+    GnttabMapForeignPages,
+    GnttabUnmapForeignPages,
+    GnttabMapForeignPagesCached,
+    GnttabFlushForeignPages
+};
+
 NTSTATUS
 GnttabInitialize(
     IN  PXENBUS_FDO             Fdo,
     OUT PXENBUS_GNTTAB_CONTEXT  *Context
     )
 {
+    ULONG                       Index;
     NTSTATUS                    status;
 
     Trace("====>\n");
@@ -1078,6 +1627,11 @@ GnttabInitialize(
     InitializeListHead(&(*Context)->List);
     KeInitializeSpinLock(&(*Context)->Lock);
 
+    KeInitializeSpinLock(&(*Context)->MapCacheLock);
+    for (Index = 0; Index < XENBUS_GNTTAB_MAP_CACHE_BUCKETS; Index++)
+        InitializeListHead(&(*Context)->MapCacheBucket[Index]);
+    InitializeListHead(&(*Context)->MapCacheLruList);
+
     status = HashTableCreate(&(*Context)->MapTable);
     if (!NT_SUCCESS(status))
         goto fail2;
@@ -1178,6 +1732,23 @@ GnttabGetInterface(
         status = STATUS_SUCCESS;
         break;
     }
+    case 5: {
+        struct _XENBUS_GNTTAB_INTERFACE_V5  *GnttabInterface;
+
+        GnttabInterface = (struct _XENBUS_GNTTAB_INTERFACE_V5 *)Interface;
+
+        status = STATUS_BUFFER_OVERFLOW;
+        if (Size < sizeof (struct _XENBUS_GNTTAB_INTERFACE_V5))
+            break;
+
+        *GnttabInterface = GnttabInterfaceVersion5;
+
+        ASSERT3U(Interface->Version, ==, Version);
+        Interface->Context = Context;
+
+        status = STATUS_SUCCESS;
+        break;
+    }
     default:
         status = STATUS_NOT_SUPPORTED;
         break;
@@ -1203,6 +1774,21 @@ GnttabTeardown(
 
     Context->Fdo = NULL;
 
+    ASSERT3U(Context->MapCacheEntries, ==, 0);
+    ASSERT3U(Context->MapCacheIdlePages, ==, 0);
+
+    Context->MapCacheInvalidations = 0;
+    Context->MapCacheEvictions = 0;
+    Context->MapCacheMisses = 0;
+    Context->MapCacheHits = 0;
+    Context->MapCacheGeneration = 0;
+    Context->MapGeneration = 0;
+
+    RtlZeroMemory(&Context->MapCacheLruList, sizeof (LIST_ENTRY));
+    RtlZeroMemory(Context->MapCacheBucket,
+                  sizeof (LIST_ENTRY) * XENBUS_GNTTAB_MAP_CACHE_BUCKETS);
+    RtlZeroMemory(&Context->MapCacheLock, sizeof (KSPIN_LOCK));
+
     HashTableDestroy(Context->MapTable);
     Context->MapTable = NULL;
 
@@ -365,10 +365,11 @@ typedef struct _XENBUS_PDO_REVISION {
     ULONG   UnplugInterfaceVersion;
     ULONG   ConsoleInterfaceVersion;
     ULONG   EmulatedInterfaceVersion;
+    ULONG   TimerInterfaceVersion;
 } XENBUS_PDO_REVISION, *PXENBUS_PDO_REVISION;
 
-#define DEFINE_REVISION(_N, _S, _SI, _E, _D, _ST, _R, _C, _G, _U, _CO, _EM) \
-    { (_N), (_S), (_SI), (_E), (_D), (_ST), (_R), (_C), (_G), (_U), (_CO), (_EM) }
+#define DEFINE_REVISION(_N, _S, _SI, _E, _D, _ST, _R, _C, _G, _U, _CO, _EM, _T) \
+    { (_N), (_S), (_SI), (_E), (_D), (_ST), (_R), (_C), (_G), (_U), (_CO), (_EM), (_T) }
 
 static XENBUS_PDO_REVISION PdoRevision[] = {
     DEFINE_REVISION_TABLE
@@ -445,6 +446,13 @@ PdoDumpRevisions(
         ASSERT(IMPLY(Index == ARRAYSIZE(PdoRevision) - 1,
                      Revision->EmulatedInterfaceVersion == XENFILT_EMULATED_INTERFACE_VERSION_MAX));
 
+        ASSERT(IMPLY(Revision->TimerInterfaceVersion != 0,
+                     Revision->TimerInterfaceVersion >= XENBUS_TIMER_INTERFACE_VERSION_MIN));
+        ASSERT(IMPLY(Revision->TimerInterfaceVersion != 0,
+                     Revision->TimerInterfaceVersion <= XENBUS_TIMER_INTERFACE_VERSION_MAX));
+        ASSERT(IMPLY(Index == ARRAYSIZE(PdoRevision) - 1,
+                     Revision->TimerInterfaceVersion == XENBUS_TIMER_INTERFACE_VERSION_MAX));
+
         Info("%08X -> "
              "SUSPEND v%u "
              "SHARED_INFO v%u "
@@ -456,7 +464,8 @@ PdoDumpRevisions(
              "GNTTAB v%u "
              "UNPLUG v%u "
              "CONSOLE v%u "
-             "EMULATED v%u\n",
+             "EMULATED v%u "
+             "TIMER v%u\n",
              Revision->Number,
              Revision->SuspendInterfaceVersion,
              Revision->SharedInfoInterfaceVersion,
@@ -468,7 +477,8 @@ PdoDumpRevisions(
              Revision->GnttabInterfaceVersion,
              Revision->UnplugInterfaceVersion,
              Revision->ConsoleInterfaceVersion,
-             Revision->EmulatedInterfaceVersion);
+             Revision->EmulatedInterfaceVersion,
+             Revision->TimerInterfaceVersion);
     }
 }
 
@@ -1034,6 +1044,7 @@ DEFINE_PDO_QUERY_INTERFACE(Cache)
 DEFINE_PDO_QUERY_INTERFACE(Gnttab)
 DEFINE_PDO_QUERY_INTERFACE(Unplug)
 DEFINE_PDO_QUERY_INTERFACE(Console)
+DEFINE_PDO_QUERY_INTERFACE(Timer)
 
 struct _INTERFACE_ENTRY {
     const GUID  *Guid;
@@ -1053,6 +1064,7 @@ static struct _INTERFACE_ENTRY PdoInterfaceTable[] = {
     { &GUID_XENBUS_GNTTAB_INTERFACE, "GNTTAB_INTERFACE", PdoQueryGnttabInterface },
     { &GUID_XENBUS_UNPLUG_INTERFACE, "UNPLUG_INTERFACE", PdoQueryUnplugInterface },
     { &GUID_XENBUS_CONSOLE_INTERFACE, "CONSOLE_INTERFACE", PdoQueryConsoleInterface },
+    { &GUID_XENBUS_TIMER_INTERFACE, "TIMER_INTERFACE", PdoQueryTimerInterface },
     { &GUID_XENFILT_EMULATED_INTERFACE, "EMULATED_INTERFACE", PdoDelegateIrp },
     { NULL, NULL, NULL }
 };
@@ -2060,12 +2072,12 @@ PdoSuspend(
 NTSTATUS
 PdoCreate(
     IN  PXENBUS_FDO     Fdo,
-    IN  PANSI_STRING    Name
+    IN  PANSI_STRING    Name,
+    OUT PXENBUS_PDO     *Pdo
     )
 {
     PDEVICE_OBJECT      PhysicalDeviceObject;
     PXENBUS_DX          Dx;
-    PXENBUS_PDO         Pdo;
     NTSTATUS            status;
 
 #pragma prefast(suppress:28197) // Possibly leaking memory 'PhysicalDeviceObject'
@@ -2089,76 +2101,75 @@ PdoCreate(
     Dx->SystemPowerState = PowerSystemWorking;
     Dx->DevicePowerState = PowerDeviceD3;
 
-    Pdo = __PdoAllocate(sizeof (XENBUS_PDO));
+    *Pdo = __PdoAllocate(sizeof (XENBUS_PDO));
 
     status = STATUS_NO_MEMORY;
-    if (Pdo == NULL)
+    if (*Pdo == NULL)
         goto fail2;
 
-    Pdo->Dx = Dx;
-    Pdo->Fdo = Fdo;
+    (*Pdo)->Dx = Dx;
+    (*Pdo)->Fdo = Fdo;
 
-    status = ThreadCreate(PdoSystemPower, Pdo, &Pdo->SystemPowerThread);
+    status = ThreadCreate(PdoSystemPower, *Pdo, &(*Pdo)->SystemPowerThread);
     if (!NT_SUCCESS(status))
         goto fail3;
 
-    status = ThreadCreate(PdoDevicePower, Pdo, &Pdo->DevicePowerThread);
+    status = ThreadCreate(PdoDevicePower, *Pdo, &(*Pdo)->DevicePowerThread);
     if (!NT_SUCCESS(status))
         goto fail4;
 
-    __PdoSetName(Pdo, Name);
-    __PdoSetRemovable(Pdo);
-    __PdoSetEjectable(Pdo);
+    __PdoSetName(*Pdo, Name);
+    __PdoSetRemovable(*Pdo);
+    __PdoSetEjectable(*Pdo);
 
-    status = BusInitialize(Pdo, &Pdo->BusInterface);
+    status = BusInitialize(*Pdo, &(*Pdo)->BusInterface);
     if (!NT_SUCCESS(status))
         goto fail5;
 
     status = SuspendGetInterface(FdoGetSuspendContext(Fdo),
                                  XENBUS_SUSPEND_INTERFACE_VERSION_MAX,
-                                 (PINTERFACE)&Pdo->SuspendInterface,
-                                 sizeof (Pdo->SuspendInterface));
+                                 (PINTERFACE)&(*Pdo)->SuspendInterface,
+                                 sizeof ((*Pdo)->SuspendInterface));
     ASSERT(NT_SUCCESS(status));
-    ASSERT(Pdo->SuspendInterface.Interface.Context != NULL);
+    ASSERT((*Pdo)->SuspendInterface.Interface.Context != NULL);
 
     Info("%p (%s)\n",
          PhysicalDeviceObject,
-         __PdoGetName(Pdo));
+         __PdoGetName(*Pdo));
 
-    PdoDumpRevisions(Pdo);
+    PdoDumpRevisions(*Pdo);
 
-    Dx->Pdo = Pdo;
+    Dx->Pdo = *Pdo;
     PhysicalDeviceObject->Flags &= ~DO_DEVICE_INITIALIZING;
 
-    FdoAddPhysicalDeviceObject(Fdo, Pdo);
-
     return STATUS_SUCCESS;
 
 fail5:
     Error("fail5\n");
 
-    Pdo->Ejectable = FALSE;
-    Pdo->Removable = FALSE;
+    (*Pdo)->Ejectable = FALSE;
+    (*Pdo)->Removable = FALSE;
 
-    ThreadAlert(Pdo->DevicePowerThread);
-    ThreadJoin(Pdo->DevicePowerThread);
-    Pdo->DevicePowerThread = NULL;
+    ThreadAlert((*Pdo)->DevicePowerThread);
+    ThreadJoin((*Pdo)->DevicePowerThread);
+    (*Pdo)->DevicePowerThread = NULL;
 
 fail4:
     Error("fail4\n");
 
-    ThreadAlert(Pdo->SystemPowerThread);
-    ThreadJoin(Pdo->SystemPowerThread);
-    Pdo->SystemPowerThread = NULL;
+    ThreadAlert((*Pdo)->SystemPowerThread);
+    ThreadJoin((*Pdo)->SystemPowerThread);
+    (*Pdo)->SystemPowerThread = NULL;
 
 fail3:
     Error("fail3\n");
 
-    Pdo->Fdo = NULL;
-    Pdo->Dx = NULL;
+    (*Pdo)->Fdo = NULL;
+    (*Pdo)->Dx = NULL;
 
-    ASSERT(IsZeroMemory(Pdo, sizeof (XENBUS_PDO)));
-    __PdoFree(Pdo);
+    ASSERT(IsZeroMemory(*Pdo, sizeof (XENBUS_PDO)));
+    __PdoFree(*Pdo);
+    *Pdo = NULL;
 
 fail2:
     Error("fail2\n");
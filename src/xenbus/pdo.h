@@ -111,7 +111,8 @@ PdoGetBusData(
 extern NTSTATUS
 PdoCreate(
     IN  PXENBUS_FDO     Fdo,
-    IN  PANSI_STRING    Name
+    IN  PANSI_STRING    Name,
+    OUT PXENBUS_PDO     *Pdo
     );
 
 extern VOID
@@ -249,6 +249,64 @@ fail1:
     return status;
 }
 
+static NTSTATUS
+RangeSetTake(
+    IN  PINTERFACE          Interface,
+    IN  PXENBUS_RANGE_SET   RangeSet,
+    IN  ULONGLONG           Count,
+    OUT PLONGLONG           Start,
+    OUT PULONGLONG          Taken
+    )
+{
+    PLIST_ENTRY             Cursor;
+    PRANGE                  Range;
+    KIRQL                   Irql;
+    NTSTATUS                status;
+
+    UNREFERENCED_PARAMETER(Interface);
+
+    status = STATUS_INVALID_PARAMETER;
+
+    if (Count == 0)
+        goto fail1;
+
+    KeAcquireSpinLock(&RangeSet->Lock, &Irql);
+
+    status = STATUS_INSUFFICIENT_RESOURCES;
+
+    if (__RangeSetIsEmpty(RangeSet))
+        goto fail2;
+
+    Cursor = RangeSet->List.Flink;
+    Range = CONTAINING_RECORD(Cursor, RANGE, ListEntry);
+
+    RangeSet->Cursor = Cursor;
+
+    *Start = Range->Start;
+    *Taken = __min(Count, (ULONGLONG)(Range->End + 1 - Range->Start));
+    Range->Start += *Taken;
+
+    ASSERT3U(RangeSet->ItemCount, >=, *Taken);
+    RangeSet->ItemCount -= *Taken;
+
+    if (Range->Start > Range->End)    // Invalid
+        RangeSetRemove(RangeSet, TRUE);
+
+    KeReleaseSpinLock(&RangeSet->Lock, Irql);
+
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+    KeReleaseSpinLock(&RangeSet->Lock, Irql);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
 static NTSTATUS
 RangeSetAdd(
     IN  PXENBUS_RANGE_SET   RangeSet,
@@ -818,6 +876,18 @@ static struct _XENBUS_RANGE_SET_INTERFACE_V1 RangeSetInterfaceVersion1 = {
     RangeSetGet,
     RangeSetDestroy
 };
+
+static struct _XENBUS_RANGE_SET_INTERFACE_V2 RangeSetInterfaceVersion2 = {
+    { sizeof (struct _XENBUS_RANGE_SET_INTERFACE_V2), 2, NULL, NULL, NULL },
+    RangeSetAcquire,
+    RangeSetRelease,
+    RangeSetCreate,
+    RangeSetPut,
+    RangeSetPop,
+    RangeSetGet,
+    RangeSetDestroy,
+    RangeSetTake
+};
                      
 NTSTATUS
 RangeSetInitialize(
@@ -887,6 +957,23 @@ RangeSetGetInterface(
         status = STATUS_SUCCESS;
         break;
     }
+    case 2: {
+        struct _XENBUS_RANGE_SET_INTERFACE_V2  *RangeSetInterface;
+
+        RangeSetInterface = (struct _XENBUS_RANGE_SET_INTERFACE_V2 *)Interface;
+
+        status = STATUS_BUFFER_OVERFLOW;
+        if (Size < sizeof (struct _XENBUS_RANGE_SET_INTERFACE_V2))
+            break;
+
+        *RangeSetInterface = RangeSetInterfaceVersion2;
+
+        ASSERT3U(Interface->Version, ==, Version);
+        Interface->Context = Context;
+
+        status = STATUS_SUCCESS;
+        break;
+    }
     default:
         status = STATUS_NOT_SUPPORTED;
         break;
@@ -42,15 +42,58 @@
 #define XENBUS_SHARED_INFO_EVTCHN_PER_SELECTOR     (sizeof (ULONG_PTR) * 8)
 #define XENBUS_SHARED_INFO_EVTCHN_SELECTOR_COUNT   (RTL_FIELD_SIZE(shared_info_t, evtchn_pending) / sizeof (ULONG_PTR))
 
+#define XENBUS_SHARED_INFO_MAXIMUM_NODES    64
+
+// The first XEN_LEGACY_MAX_VCPUS vCPUs always use the vcpu_info
+// embedded in the shared_info. A registration cannot be undone and we
+// cannot find out where an earlier instance of this driver put one, so
+// registering those vCPUs would leave vCPU 0 without a usable vcpu_info
+// after a reload. Any other vCPU has its vcpu_info registered with Xen
+// at a cache line aligned location in memory local to the NUMA node of
+// its processor.
+//
+// Each entry is padded to a whole number of cache lines and the array
+// is aligned by hand (pool allocations are not cache aligned) so that
+// vCPUs never share a line.
+
+#define XENBUS_SHARED_INFO_VCPU_LENGTH                  \
+        ((sizeof (vcpu_info_t *) * 2) +                 \
+         sizeof (PHYSICAL_ADDRESS) +                    \
+         sizeof (LONGLONG) +                            \
+         sizeof (NTSTATUS) +                            \
+         sizeof (ULONG) +                               \
+         sizeof (BOOLEAN))
+
+typedef struct _XENBUS_SHARED_INFO_VCPU {
+    vcpu_info_t         *Info;
+    vcpu_info_t         *Local;
+    PHYSICAL_ADDRESS    Address;
+    LONGLONG            LastSystemTime;
+    NTSTATUS            Status;
+    ULONG               Port;
+    BOOLEAN             Registered;
+    UCHAR               Pad[P2ROUNDUP(XENBUS_SHARED_INFO_VCPU_LENGTH,
+                                      SYSTEM_CACHE_ALIGNMENT_SIZE) -
+                            XENBUS_SHARED_INFO_VCPU_LENGTH];
+} XENBUS_SHARED_INFO_VCPU, *PXENBUS_SHARED_INFO_VCPU;
+
+C_ASSERT((sizeof (XENBUS_SHARED_INFO_VCPU) % SYSTEM_CACHE_ALIGNMENT_SIZE) == 0);
+
 struct _XENBUS_SHARED_INFO_CONTEXT {
     PXENBUS_FDO                 Fdo;
     KSPIN_LOCK                  Lock;
     LONG                        References;
     PHYSICAL_ADDRESS            Address;
     shared_info_t               *Shared;
-    ULONG                       Port[HVM_MAX_VCPUS];
+    PVOID                       VcpuBuffer;
+    PXENBUS_SHARED_INFO_VCPU    Vcpu;
+    PVOID                       Node[XENBUS_SHARED_INFO_MAXIMUM_NODES];
+    ULONG                       NodeSize[XENBUS_SHARED_INFO_MAXIMUM_NODES];
+    BOOLEAN                     Registered;
+    ULONG                       SuspendCount;
     XENBUS_SUSPEND_INTERFACE    SuspendInterface;
     PXENBUS_SUSPEND_CALLBACK    SuspendCallbackEarly;
+    PXENBUS_SUSPEND_CALLBACK    SuspendCallbackLate;
     XENBUS_DEBUG_INTERFACE      DebugInterface;
     PXENBUS_DEBUG_CALLBACK      DebugCallback;
 };
@@ -160,18 +203,22 @@ SharedInfoUpcallPending(
     )
 {
     PXENBUS_SHARED_INFO_CONTEXT Context = Interface->Context;
-    shared_info_t               *Shared = Context->Shared;
+    vcpu_info_t                 *Info;
     unsigned int                vcpu_id;
     UCHAR                       Pending;
     NTSTATUS                    status;
 
     status = SystemVirtualCpuIndex(Index, &vcpu_id);
-    if (!NT_SUCCESS(status))
+    if (!NT_SUCCESS(status) || vcpu_id >= HVM_MAX_VCPUS)
+        return FALSE;
+
+    Info = Context->Vcpu[vcpu_id].Info;
+    if (Info == NULL)
         return FALSE;
 
     KeMemoryBarrier();
 
-    Pending = _InterlockedExchange8((CHAR *)&Shared->vcpu_info[vcpu_id].evtchn_upcall_pending, 0);
+    Pending = _InterlockedExchange8((CHAR *)&Info->evtchn_upcall_pending, 0);
 
     return (Pending != 0) ? TRUE : FALSE;
 }
@@ -186,6 +233,7 @@ SharedInfoEvtchnPoll(
 {
     PXENBUS_SHARED_INFO_CONTEXT     Context = Interface->Context;
     shared_info_t                   *Shared = Context->Shared;
+    PXENBUS_SHARED_INFO_VCPU        Vcpu;
     unsigned int                    vcpu_id;
     ULONG                           Port;
     ULONG_PTR                       SelectorMask;
@@ -195,16 +243,20 @@ SharedInfoEvtchnPoll(
     DoneSomething = FALSE;
 
     status = SystemVirtualCpuIndex(Index, &vcpu_id);
-    if (!NT_SUCCESS(status))
+    if (!NT_SUCCESS(status) || vcpu_id >= HVM_MAX_VCPUS)
+        goto done;
+
+    Vcpu = &Context->Vcpu[vcpu_id];
+    if (Vcpu->Info == NULL)
         goto done;
 
     KeMemoryBarrier();
 
-    SelectorMask = (ULONG_PTR)InterlockedExchangePointer((PVOID *)&Shared->vcpu_info[vcpu_id].evtchn_pending_sel, (PVOID)0);
+    SelectorMask = (ULONG_PTR)InterlockedExchangePointer((PVOID *)&Vcpu->Info->evtchn_pending_sel, (PVOID)0);
 
     KeMemoryBarrier();
 
-    Port = Context->Port[vcpu_id];
+    Port = Vcpu->Port;
 
     while (SelectorMask != 0) {
         ULONG   SelectorBit;
@@ -241,7 +293,7 @@ SharedInfoEvtchnPoll(
             Port = 0;
     }
 
-    Context->Port[vcpu_id] = Port;
+    Vcpu->Port = Port;
 
 done:
     return DoneSomething;
@@ -309,6 +361,23 @@ SharedInfoEvtchnUnmask(
     return SharedInfoTestBit(&Shared->evtchn_pending[SelectorBit], PortBit);
 }
 
+static BOOLEAN
+SharedInfoIsProcessorEnabled(
+    IN  PINTERFACE              Interface,
+    IN  ULONG                   Index
+    )
+{
+    PXENBUS_SHARED_INFO_CONTEXT Context = Interface->Context;
+    unsigned int                vcpu_id;
+    NTSTATUS                    status;
+
+    status = SystemVirtualCpuIndex(Index, &vcpu_id);
+    if (!NT_SUCCESS(status) || vcpu_id >= HVM_MAX_VCPUS)
+        return FALSE;
+
+    return (Context->Vcpu[vcpu_id].Info != NULL) ? TRUE : FALSE;
+}
+
 static VOID
 SharedInfoGetTime(
     IN  PINTERFACE              Interface,
@@ -320,6 +389,7 @@ SharedInfoGetTime(
 
     PXENBUS_SHARED_INFO_CONTEXT Context = Interface->Context;
     shared_info_t               *Shared;
+    vcpu_info_t                 *Info;
     ULONG                       WcVersion;
     ULONG                       TimeVersion;
     ULONGLONG                   Seconds;
@@ -336,11 +406,12 @@ SharedInfoGetTime(
     KeRaiseIrql(DISPATCH_LEVEL, &Irql);
 
     Shared = Context->Shared;
+    Info = Context->Vcpu[0].Info;
 
     // Loop until we can read a consistent set of values from the same update
     do {
         WcVersion = Shared->wc_version;
-        TimeVersion = Shared->vcpu_info[0].time.version;
+        TimeVersion = Info->time.version;
         KeMemoryBarrier();
 
         // Wallclock time at system time zero (guest boot or resume)
@@ -348,21 +419,21 @@ SharedInfoGetTime(
         NanoSeconds = Shared->wc_nsec;
 
         // Cached time in nanoseconds since guest boot
-        SystemTime = Shared->vcpu_info[0].time.system_time;
+        SystemTime = Info->time.system_time;
 
         // Timestamp counter value when these time values were last updated
-        Timestamp = Shared->vcpu_info[0].time.tsc_timestamp;
+        Timestamp = Info->time.tsc_timestamp;
 
         // Timestamp modifiers
-        TscShift = Shared->vcpu_info[0].time.tsc_shift;
-        TscSystemMul = Shared->vcpu_info[0].time.tsc_to_system_mul;
+        TscShift = Info->time.tsc_shift;
+        TscSystemMul = Info->time.tsc_to_system_mul;
         KeMemoryBarrier();
 
     // Version is incremented to indicate update in progress.
     // LSB of version is set if update in progress.
     // Version is incremented again once update has completed.
     } while (Shared->wc_version != WcVersion ||
-             Shared->vcpu_info[0].time.version != TimeVersion ||
+             Info->time.version != TimeVersion ||
              (WcVersion & 1) ||
              (TimeVersion & 1));
 
@@ -410,6 +481,117 @@ SharedInfoGetTime(
 #undef NS_PER_S
 }
 
+// Scale a TSC delta to nanoseconds in the same way as Xen itself (see
+// scale_delta() in the hypervisor). The 64x32 bit multiply is split so
+// that the intermediate product cannot overflow.
+static FORCEINLINE ULONGLONG
+__SharedInfoScaleDelta(
+    IN  ULONGLONG   Delta,
+    IN  ULONG       TscSystemMul,
+    IN  CHAR        TscShift
+    )
+{
+    ULONGLONG       Product;
+
+    if (TscShift < 0)
+        Delta >>= -TscShift;
+    else
+        Delta <<= TscShift;
+
+    Product = ((Delta & 0xFFFFFFFF) * TscSystemMul) >> 32;
+    Product += (Delta >> 32) * TscSystemMul;
+
+    return Product;
+}
+
+// This is intended to be cheap enough to be used per-packet so there
+// is no IRQL raise and nothing is logged. The time is read from the
+// pvclock of the vCPU we are running on. If we migrate to another vCPU
+// while reading it, and Xen does not tell us the TSC is stable across
+// vCPUs, then the read is simply retried.
+static LONGLONG
+SharedInfoGetSystemTime(
+    IN  PINTERFACE              Interface
+    )
+{
+    PXENBUS_SHARED_INFO_CONTEXT Context = Interface->Context;
+    PXENBUS_SHARED_INFO_VCPU    Vcpu;
+    vcpu_info_t                 *Info;
+    ULONG                       Index;
+    unsigned int                vcpu_id;
+    ULONG                       TimeVersion;
+    ULONGLONG                   SystemTime;
+    ULONGLONG                   Timestamp;
+    ULONGLONG                   Tsc;
+    ULONG                       TscSystemMul;
+    CHAR                        TscShift;
+    UCHAR                       Flags;
+    LONGLONG                    Time;
+    LONGLONG                    Last;
+    NTSTATUS                    status;
+
+    for (;;) {
+        Index = KeGetCurrentProcessorNumberEx(NULL);
+
+        status = SystemVirtualCpuIndex(Index, &vcpu_id);
+        Vcpu = (NT_SUCCESS(status) && vcpu_id < HVM_MAX_VCPUS) ?
+               &Context->Vcpu[vcpu_id] :
+               NULL;
+
+        // Another vCPU's pvclock cannot be scaled using our TSC, so
+        // fall back to the interrupt time (in 100ns units) if this
+        // vCPU has no vcpu_info
+        Info = (Vcpu != NULL) ? Vcpu->Info : NULL;
+        if (Info == NULL)
+            return (LONGLONG)KeQueryInterruptTime() * 100;
+
+        // Loop until we can read a consistent set of values from the
+        // same update
+        do {
+            TimeVersion = Info->time.version;
+            KeMemoryBarrier();
+
+            SystemTime = Info->time.system_time;
+            Timestamp = Info->time.tsc_timestamp;
+            TscShift = Info->time.tsc_shift;
+            TscSystemMul = Info->time.tsc_to_system_mul;
+            Flags = Info->time.flags;
+
+            Tsc = __rdtsc();
+            KeMemoryBarrier();
+        } while (Info->time.version != TimeVersion ||
+                 (TimeVersion & 1));
+
+        if (Flags & XEN_PVCLOCK_TSC_STABLE_BIT)
+            return (LONGLONG)(SystemTime +
+                              __SharedInfoScaleDelta(Tsc - Timestamp,
+                                                     TscSystemMul,
+                                                     TscShift));
+
+        if (KeGetCurrentProcessorNumberEx(NULL) == Index)
+            break;
+    }
+
+    Time = (LONGLONG)(SystemTime +
+                      __SharedInfoScaleDelta(Tsc - Timestamp,
+                                             TscSystemMul,
+                                             TscShift));
+
+    // Without a stable TSC the pvclock may be re-based at each update
+    // so never hand back a time earlier than one this vCPU has handed
+    // back before. Only this vCPU (or something interrupting it) writes
+    // its last value so the compare-exchange is not contended.
+    do {
+        Last = Vcpu->LastSystemTime;
+        if (Time <= Last)
+            return Last;
+    } while (InterlockedCompareExchange64(&Vcpu->LastSystemTime,
+                                          Time,
+                                          Last) != Last);
+
+    return Time;
+}
+
 static LARGE_INTEGER
 SharedInfoGetTimeVersion2(
     IN  PINTERFACE  Interface
@@ -453,15 +635,295 @@ SharedInfoUnmap(
     // Not clear what to do here
 }
 
+static USHORT
+SharedInfoGetNode(
+    IN  ULONG           Index
+    )
+{
+    PROCESSOR_NUMBER    ProcNumber;
+    USHORT              Node;
+    NTSTATUS            status;
+
+    status = KeGetProcessorNumberFromIndex(Index, &ProcNumber);
+    ASSERT(NT_SUCCESS(status));
+
+    for (Node = 0; Node <= KeQueryHighestNodeNumber(); Node++) {
+        GROUP_AFFINITY  Affinity;
+
+        KeQueryNodeActiveAffinity(Node, &Affinity, NULL);
+
+        if (Affinity.Group == ProcNumber.Group &&
+            (Affinity.Mask & ((KAFFINITY)1 << ProcNumber.Number)) != 0)
+            return Node;
+    }
+
+    return 0;
+}
+
+static BOOLEAN
+SharedInfoVcpuNeedsRegistration(
+    IN  ULONG           Index,
+    OUT unsigned int    *vcpu_id
+    )
+{
+    NTSTATUS            status;
+
+    status = SystemVirtualCpuIndex(Index, vcpu_id);
+    if (!NT_SUCCESS(status))
+        return FALSE;
+
+    return (*vcpu_id >= XEN_LEGACY_MAX_VCPUS &&
+            *vcpu_id < HVM_MAX_VCPUS) ? TRUE : FALSE;
+}
+
+static VOID
+SharedInfoAllocateVcpuInfo(
+    IN  PXENBUS_SHARED_INFO_CONTEXT Context
+    )
+{
+    ULONG                           Count;
+    ULONG                           Index;
+    USHORT                          Node;
+    PHYSICAL_ADDRESS                LowestAcceptableAddress;
+    PHYSICAL_ADDRESS                HighestAcceptableAddress;
+    PHYSICAL_ADDRESS                BoundaryAddressMultiple;
+
+    Count = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+    for (Index = 0; Index < Count; Index++) {
+        unsigned int    vcpu_id;
+
+        if (!SharedInfoVcpuNeedsRegistration(Index, &vcpu_id))
+            continue;
+
+        Node = SharedInfoGetNode(Index) % XENBUS_SHARED_INFO_MAXIMUM_NODES;
+        Context->NodeSize[Node] += sizeof (vcpu_info_t);
+    }
+
+    LowestAcceptableAddress.QuadPart = 0;
+    HighestAcceptableAddress.QuadPart = -1;
+    BoundaryAddressMultiple.QuadPart = 0;
+
+    for (Node = 0; Node < XENBUS_SHARED_INFO_MAXIMUM_NODES; Node++) {
+        if (Context->NodeSize[Node] == 0)
+            continue;
+
+        Context->NodeSize[Node] = P2ROUNDUP(Context->NodeSize[Node], PAGE_SIZE);
+
+        Context->Node[Node] = MmAllocateContiguousNodeMemory(Context->NodeSize[Node],
+                                                             LowestAcceptableAddress,
+                                                             HighestAcceptableAddress,
+                                                             BoundaryAddressMultiple,
+                                                             PAGE_READWRITE,
+                                                             Node);
+        if (Context->Node[Node] == NULL) {
+            Warning("failed to allocate vcpu_info for node %u\n", Node);
+
+            Context->NodeSize[Node] = 0;
+            continue;
+        }
+
+        RtlZeroMemory(Context->Node[Node], Context->NodeSize[Node]);
+        Context->NodeSize[Node] = 0;
+    }
+
+    // Carve out a slot for each vCPU. A vcpu_info is a whole number of
+    // cache lines and hence never straddles a page boundary.
+    for (Index = 0; Index < Count; Index++) {
+        PXENBUS_SHARED_INFO_VCPU    Vcpu;
+        unsigned int                vcpu_id;
+        PUCHAR                      Buffer;
+
+        if (!SharedInfoVcpuNeedsRegistration(Index, &vcpu_id))
+            continue;
+
+        Node = SharedInfoGetNode(Index) % XENBUS_SHARED_INFO_MAXIMUM_NODES;
+        if (Context->Node[Node] == NULL)
+            continue;
+
+        Buffer = (PUCHAR)Context->Node[Node] + Context->NodeSize[Node];
+        Context->NodeSize[Node] += sizeof (vcpu_info_t);
+
+        Vcpu = &Context->Vcpu[vcpu_id];
+
+        Vcpu->Local = (vcpu_info_t *)Buffer;
+        Vcpu->Address = MmGetPhysicalAddress(Buffer);
+    }
+
+    for (Node = 0; Node < XENBUS_SHARED_INFO_MAXIMUM_NODES; Node++) {
+        if (Context->Node[Node] == NULL)
+            continue;
+
+        Context->NodeSize[Node] = P2ROUNDUP(Context->NodeSize[Node], PAGE_SIZE);
+    }
+}
+
+static VOID
+SharedInfoFreeVcpuInfo(
+    IN  PXENBUS_SHARED_INFO_CONTEXT Context
+    )
+{
+    USHORT                          Node;
+
+    // Xen will carry on writing to registered memory so it must never
+    // be returned to the system
+    if (Context->Registered) {
+        Warning("leaking registered vcpu_info\n");
+
+        RtlZeroMemory(Context->Node, sizeof (Context->Node));
+        RtlZeroMemory(Context->NodeSize, sizeof (Context->NodeSize));
+        Context->Registered = FALSE;
+        goto done;
+    }
+
+    for (Node = 0; Node < XENBUS_SHARED_INFO_MAXIMUM_NODES; Node++) {
+        if (Context->Node[Node] == NULL)
+            continue;
+
+        MmFreeContiguousMemory(Context->Node[Node]);
+        Context->Node[Node] = NULL;
+        Context->NodeSize[Node] = 0;
+    }
+
+done:
+    RtlZeroMemory(Context->Vcpu,
+                  sizeof (XENBUS_SHARED_INFO_VCPU) * HVM_MAX_VCPUS);
+}
+
+static VOID
+SharedInfoResetVcpuInfo(
+    IN  PXENBUS_SHARED_INFO_CONTEXT Context
+    )
+{
+    shared_info_t                   *Shared = Context->Shared;
+    unsigned int                    vcpu_id;
+
+    for (vcpu_id = 0; vcpu_id < HVM_MAX_VCPUS; vcpu_id++) {
+        PXENBUS_SHARED_INFO_VCPU    Vcpu = &Context->Vcpu[vcpu_id];
+
+        // A vCPU beyond XEN_LEGACY_MAX_VCPUS whose registration failed
+        // (e.g. with EINVAL because it was registered before the driver
+        // was reloaded) has no vcpu_info that we know of.
+        if (Vcpu->Registered)
+            Vcpu->Info = Vcpu->Local;
+        else if (vcpu_id < XEN_LEGACY_MAX_VCPUS)
+            Vcpu->Info = &Shared->vcpu_info[vcpu_id];
+        else
+            Vcpu->Info = NULL;
+    }
+}
+
+// VCPUOP_register_vcpu_info can only be issued by a vCPU for itself
+// so this is run on every CPU by KeIpiGenericCall(). Nothing is logged
+// here as we are at IPI_LEVEL.
+static ULONG_PTR
+SharedInfoRegisterVcpuInfo(
+    IN  ULONG_PTR               Argument
+    )
+{
+    PXENBUS_SHARED_INFO_CONTEXT Context = (PVOID)Argument;
+    PXENBUS_SHARED_INFO_VCPU    Vcpu;
+    ULONG                       Index;
+    unsigned int                vcpu_id;
+    NTSTATUS                    status;
+
+    Index = KeGetCurrentProcessorNumberEx(NULL);
+
+    status = SystemVirtualCpuIndex(Index, &vcpu_id);
+    if (!NT_SUCCESS(status) || vcpu_id >= HVM_MAX_VCPUS)
+        goto done;
+
+    Vcpu = &Context->Vcpu[vcpu_id];
+
+    if (Vcpu->Local == NULL || Vcpu->Registered)
+        goto done;
+
+    // Xen copies the current content into the new location and then
+    // marks everything as pending so no events can be lost
+    Vcpu->Status = VcpuRegisterVcpuInfo(vcpu_id,
+                                        (PFN_NUMBER)(Vcpu->Address.QuadPart >> PAGE_SHIFT),
+                                        (ULONG)(Vcpu->Address.QuadPart & (PAGE_SIZE - 1)));
+    if (!NT_SUCCESS(Vcpu->Status))
+        goto done;
+
+    Vcpu->Registered = TRUE;
+    Vcpu->Info = Vcpu->Local;
+
+done:
+    return 0;
+}
+
+static VOID
+SharedInfoRegister(
+    IN  PXENBUS_SHARED_INFO_CONTEXT Context
+    )
+{
+    unsigned int                    vcpu_id;
+    ULONG                           Count;
+
+    (VOID) KeIpiGenericCall(SharedInfoRegisterVcpuInfo, (ULONG_PTR)Context);
+
+    Context->SuspendCount = XENBUS_SUSPEND(GetCount, &Context->SuspendInterface);
+
+    Count = 0;
+    for (vcpu_id = 0; vcpu_id < HVM_MAX_VCPUS; vcpu_id++) {
+        PXENBUS_SHARED_INFO_VCPU    Vcpu = &Context->Vcpu[vcpu_id];
+
+        if (Vcpu->Registered) {
+            Context->Registered = TRUE;
+            Count++;
+        } else if (Vcpu->Local != NULL) {
+            Warning("vCPU %u: failed to register vcpu_info (%08x)\n",
+                    vcpu_id,
+                    Vcpu->Status);
+        }
+    }
+
+    LogPrintf(LOG_LEVEL_INFO,
+              "SHARED_INFO: REGISTERED %u vcpu_info\n",
+              Count);
+}
+
 static VOID
 SharedInfoSuspendCallbackEarly(
     IN  PVOID                   Argument
     )
 {
     PXENBUS_SHARED_INFO_CONTEXT Context = Argument;
+    unsigned int                vcpu_id;
 
     SharedInfoMap(Context);
     SharedInfoEvtchnMaskAll(Context);
+
+    // Registrations do not survive into the new domain so, until the
+    // late callback re-registers them, Xen is back to using the
+    // vcpu_info in the shared_info (for those vCPUs that have one).
+    for (vcpu_id = 0; vcpu_id < HVM_MAX_VCPUS; vcpu_id++) {
+        PXENBUS_SHARED_INFO_VCPU    Vcpu = &Context->Vcpu[vcpu_id];
+
+        Vcpu->Registered = FALSE;
+        Vcpu->Status = STATUS_SUCCESS;
+    }
+
+    SharedInfoResetVcpuInfo(Context);
+}
+
+static VOID
+SharedInfoSuspendCallbackLate(
+    IN  PVOID                   Argument
+    )
+{
+    PXENBUS_SHARED_INFO_CONTEXT Context = Argument;
+    unsigned int                vcpu_id;
+
+    SharedInfoRegister(Context);
+    SharedInfoResetVcpuInfo(Context);
+
+    // System time restarts from the new host's view after migration.
+    // This must not happen until Info is pointing at the vcpu_info Xen
+    // is now updating, otherwise a stale time could be latched.
+    for (vcpu_id = 0; vcpu_id < HVM_MAX_VCPUS; vcpu_id++)
+        Context->Vcpu[vcpu_id].LastSystemTime = 0;
 }
 
 static VOID
@@ -495,18 +957,29 @@ SharedInfoDebugCallback(
             NTSTATUS            status;
 
             status = SystemVirtualCpuIndex(Index, &vcpu_id);
-            if (!NT_SUCCESS(status))
+            if (!NT_SUCCESS(status) ||
+                vcpu_id >= HVM_MAX_VCPUS ||
+                Context->Vcpu[vcpu_id].Info == NULL)
                 continue;
 
             status = KeGetProcessorNumberFromIndex(Index, &ProcNumber);
             ASSERT(NT_SUCCESS(status));
 
+            XENBUS_DEBUG(Printf,
+                         &Context->DebugInterface,
+                         "CPU %u:%u: VCPU_INFO: %s\n",
+                         ProcNumber.Group,
+                         ProcNumber.Number,
+                         Context->Vcpu[vcpu_id].Registered ?
+                         "REGISTERED" :
+                         "SHARED");
+
             XENBUS_DEBUG(Printf,
                          &Context->DebugInterface,
                          "CPU %u:%u: PENDING: %s\n",
                          ProcNumber.Group,
                          ProcNumber.Number,
-                         Shared->vcpu_info[vcpu_id].evtchn_upcall_pending ?
+                         Context->Vcpu[vcpu_id].Info->evtchn_upcall_pending ?
                          "TRUE" :
                          "FALSE");
 
@@ -515,7 +988,7 @@ SharedInfoDebugCallback(
                          "CPU %u:%u: SELECTOR MASK: %p\n",
                          ProcNumber.Group,
                          ProcNumber.Number,
-                         (PVOID)Shared->vcpu_info[vcpu_id].evtchn_pending_sel);
+                         (PVOID)Context->Vcpu[vcpu_id].Info->evtchn_pending_sel);
         }
 
         for (Selector = 0; Selector < XENBUS_SHARED_INFO_EVTCHN_SELECTOR_COUNT; Selector += 4) {
@@ -550,6 +1023,7 @@ SharedInfoAcquire(
     PXENBUS_SHARED_INFO_CONTEXT Context = Interface->Context;
     PXENBUS_FDO                 Fdo = Context->Fdo;
     KIRQL                       Irql;
+    unsigned int                vcpu_id;
     NTSTATUS                    status;
 
     KeAcquireSpinLock(&Context->Lock, &Irql);
@@ -570,6 +1044,21 @@ SharedInfoAcquire(
     if (!NT_SUCCESS(status))
         goto fail2;
 
+    // Any registrations will have been lost if we have been resumed
+    // into a new domain since they were made
+    if (XENBUS_SUSPEND(GetCount, &Context->SuspendInterface) != Context->SuspendCount) {
+        for (vcpu_id = 0; vcpu_id < HVM_MAX_VCPUS; vcpu_id++)
+            Context->Vcpu[vcpu_id].Registered = FALSE;
+    }
+
+    SharedInfoRegister(Context);
+    SharedInfoResetVcpuInfo(Context);
+
+    // Nothing works without vCPU 0
+    status = STATUS_UNSUCCESSFUL;
+    if (Context->Vcpu[0].Info == NULL)
+        goto fail3;
+
     status = XENBUS_SUSPEND(Register,
                             &Context->SuspendInterface,
                             SUSPEND_CALLBACK_EARLY,
@@ -577,11 +1066,20 @@ SharedInfoAcquire(
                             Context,
                             &Context->SuspendCallbackEarly);
     if (!NT_SUCCESS(status))
-        goto fail3;
+        goto fail4;
+
+    status = XENBUS_SUSPEND(Register,
+                            &Context->SuspendInterface,
+                            SUSPEND_CALLBACK_LATE,
+                            SharedInfoSuspendCallbackLate,
+                            Context,
+                            &Context->SuspendCallbackLate);
+    if (!NT_SUCCESS(status))
+        goto fail5;
 
     status = XENBUS_DEBUG(Acquire, &Context->DebugInterface);
     if (!NT_SUCCESS(status))
-        goto fail4;
+        goto fail6;
 
     status = XENBUS_DEBUG(Register,
                           &Context->DebugInterface,
@@ -590,7 +1088,7 @@ SharedInfoAcquire(
                           Context,
                           &Context->DebugCallback);
     if (!NT_SUCCESS(status))
-        goto fail5;
+        goto fail7;
 
     Trace("<====\n");
 
@@ -599,22 +1097,36 @@ done:
 
     return STATUS_SUCCESS;
 
-fail5:
-    Error("fail5\n");
+fail7:
+    Error("fail7\n");
 
     XENBUS_DEBUG(Release, &Context->DebugInterface);
 
-fail4:
-    Error("fail4\n");
+fail6:
+    Error("fail6\n");
+
+    XENBUS_SUSPEND(Deregister,
+                   &Context->SuspendInterface,
+                   Context->SuspendCallbackLate);
+    Context->SuspendCallbackLate = NULL;
+
+fail5:
+    Error("fail5\n");
 
     XENBUS_SUSPEND(Deregister,
                    &Context->SuspendInterface,
                    Context->SuspendCallbackEarly);
     Context->SuspendCallbackEarly = NULL;
 
+fail4:
+    Error("fail4\n");
+
 fail3:
     Error("fail3\n");
 
+    for (vcpu_id = 0; vcpu_id < HVM_MAX_VCPUS; vcpu_id++)
+        Context->Vcpu[vcpu_id].Info = NULL;
+
     XENBUS_SUSPEND(Release, &Context->SuspendInterface);
 
 fail2:
@@ -644,6 +1156,7 @@ SharedInfoRelease (
     PXENBUS_SHARED_INFO_CONTEXT Context = Interface->Context;
     PXENBUS_FDO                 Fdo = Context->Fdo;
     KIRQL                       Irql;
+    unsigned int                vcpu_id;
 
     KeAcquireSpinLock(&Context->Lock, &Irql);
 
@@ -652,7 +1165,15 @@ SharedInfoRelease (
 
     Trace("====>\n");
 
-    RtlZeroMemory(Context->Port, sizeof (ULONG) * HVM_MAX_VCPUS);
+    // Registrations persist so only the pointers, ports and times are
+    // reset
+    for (vcpu_id = 0; vcpu_id < HVM_MAX_VCPUS; vcpu_id++) {
+        PXENBUS_SHARED_INFO_VCPU    Vcpu = &Context->Vcpu[vcpu_id];
+
+        Vcpu->Info = NULL;
+        Vcpu->Port = 0;
+        Vcpu->LastSystemTime = 0;
+    }
 
     XENBUS_DEBUG(Deregister,
                  &Context->DebugInterface,
@@ -661,6 +1182,11 @@ SharedInfoRelease (
 
     XENBUS_DEBUG(Release, &Context->DebugInterface);
 
+    XENBUS_SUSPEND(Deregister,
+                   &Context->SuspendInterface,
+                   Context->SuspendCallbackLate);
+    Context->SuspendCallbackLate = NULL;
+
     XENBUS_SUSPEND(Deregister,
                    &Context->SuspendInterface,
                    Context->SuspendCallbackEarly);
@@ -703,6 +1229,33 @@ static struct _XENBUS_SHARED_INFO_INTERFACE_V3 SharedInfoInterfaceVersion3 = {
     SharedInfoEvtchnUnmask,
     SharedInfoGetTime
 };
+
+static struct _XENBUS_SHARED_INFO_INTERFACE_V4 SharedInfoInterfaceVersion4 = {
+    { sizeof (struct _XENBUS_SHARED_INFO_INTERFACE_V4), 4, NULL, NULL, NULL },
+    SharedInfoAcquire,
+    SharedInfoRelease,
+    SharedInfoUpcallPending,
+    SharedInfoEvtchnPoll,
+    SharedInfoEvtchnAck,
+    SharedInfoEvtchnMask,
+    SharedInfoEvtchnUnmask,
+    SharedInfoGetTime,
+    SharedInfoIsProcessorEnabled
+};
+
+static struct _XENBUS_SHARED_INFO_INTERFACE_V5 SharedInfoInterfaceVersion5 = {
+    { sizeof (struct _XENBUS_SHARED_INFO_INTERFACE_V5), 5, NULL, NULL, NULL },
+    SharedInfoAcquire,
+    SharedInfoRelease,
+    SharedInfoUpcallPending,
+    SharedInfoEvtchnPoll,
+    SharedInfoEvtchnAck,
+    SharedInfoEvtchnMask,
+    SharedInfoEvtchnUnmask,
+    SharedInfoGetTime,
+    SharedInfoIsProcessorEnabled,
+    SharedInfoGetSystemTime
+};
                      
 NTSTATUS
 SharedInfoInitialize(
@@ -720,8 +1273,21 @@ SharedInfoInitialize(
     if (*Context == NULL)
         goto fail1;
 
+    (*Context)->VcpuBuffer = __SharedInfoAllocate(sizeof (XENBUS_SHARED_INFO_VCPU) *
+                                                  HVM_MAX_VCPUS +
+                                                  SYSTEM_CACHE_ALIGNMENT_SIZE);
+
+    status = STATUS_NO_MEMORY;
+    if ((*Context)->VcpuBuffer == NULL)
+        goto fail2;
+
+    (*Context)->Vcpu = (PVOID)P2ROUNDUP((ULONG_PTR)(*Context)->VcpuBuffer,
+                                        SYSTEM_CACHE_ALIGNMENT_SIZE);
+
     KeInitializeSpinLock(&(*Context)->Lock);
 
+    SharedInfoAllocateVcpuInfo(*Context);
+
     status = SuspendGetInterface(FdoGetSuspendContext(Fdo),
                                  XENBUS_SUSPEND_INTERFACE_VERSION_MAX,
                                  (PINTERFACE)&(*Context)->SuspendInterface,
@@ -742,6 +1308,12 @@ SharedInfoInitialize(
 
     return STATUS_SUCCESS;
 
+fail2:
+    Error("fail2\n");
+
+    ASSERT(IsZeroMemory(*Context, sizeof (XENBUS_SHARED_INFO_CONTEXT)));
+    __SharedInfoFree(*Context);
+
 fail1:
     Error("fail1 (%08x)\n", status);
 
@@ -795,6 +1367,40 @@ SharedInfoGetInterface(
         status = STATUS_SUCCESS;
         break;
     }
+    case 4: {
+        struct _XENBUS_SHARED_INFO_INTERFACE_V4 *SharedInfoInterface;
+
+        SharedInfoInterface = (struct _XENBUS_SHARED_INFO_INTERFACE_V4 *)Interface;
+
+        status = STATUS_BUFFER_OVERFLOW;
+        if (Size < sizeof (struct _XENBUS_SHARED_INFO_INTERFACE_V4))
+            break;
+
+        *SharedInfoInterface = SharedInfoInterfaceVersion4;
+
+        ASSERT3U(Interface->Version, ==, Version);
+        Interface->Context = Context;
+
+        status = STATUS_SUCCESS;
+        break;
+    }
+    case 5: {
+        struct _XENBUS_SHARED_INFO_INTERFACE_V5 *SharedInfoInterface;
+
+        SharedInfoInterface = (struct _XENBUS_SHARED_INFO_INTERFACE_V5 *)Interface;
+
+        status = STATUS_BUFFER_OVERFLOW;
+        if (Size < sizeof (struct _XENBUS_SHARED_INFO_INTERFACE_V5))
+            break;
+
+        *SharedInfoInterface = SharedInfoInterfaceVersion5;
+
+        ASSERT3U(Interface->Version, ==, Version);
+        Interface->Context = Context;
+
+        status = STATUS_SUCCESS;
+        break;
+    }
     default:
         status = STATUS_NOT_SUPPORTED;
         break;
@@ -826,6 +1432,14 @@ SharedInfoTeardown(
     RtlZeroMemory(&Context->SuspendInterface,
                   sizeof (XENBUS_SUSPEND_INTERFACE));
 
+    Context->SuspendCount = 0;
+
+    SharedInfoFreeVcpuInfo(Context);
+
+    Context->Vcpu = NULL;
+    __SharedInfoFree(Context->VcpuBuffer);
+    Context->VcpuBuffer = NULL;
+
     RtlZeroMemory(&Context->Lock, sizeof (KSPIN_LOCK));
 
     ASSERT(IsZeroMemory(Context, sizeof (XENBUS_SHARED_INFO_CONTEXT)));
@@ -145,6 +145,7 @@ struct _XENBUS_STORE_CONTEXT {
     PXENBUS_SUSPEND_CALLBACK            SuspendCallbackEarly;
     PXENBUS_SUSPEND_CALLBACK            SuspendCallbackLate;
     PXENBUS_DEBUG_CALLBACK              DebugCallback;
+    PXENBUS_DEBUG_STATISTIC             RoundTripStatistic;
     PXENBUS_THREAD                      WatchdogThread;
     BOOLEAN                             Enabled;
 };
@@ -920,6 +921,8 @@ StoreSubmitRequest(
     ULONG                       Count;
     XENBUS_STORE_REQUEST_STATE  State;
     LARGE_INTEGER               Timeout;
+    ULONGLONG                   Start;
+    ULONGLONG                   End;
 
     ASSERT3U(Request->State, ==, XENBUS_STORE_REQUEST_PREPARED);
 
@@ -927,6 +930,8 @@ StoreSubmitRequest(
     ASSERT3U(KeGetCurrentIrql(), <=, DISPATCH_LEVEL);
     KeRaiseIrql(DISPATCH_LEVEL, &Irql);
 
+    Start = __rdtsc();
+
     KeAcquireSpinLockAtDpcLevel(&Context->Lock);
 
     InsertTailList(&Context->SubmittedList, &Request->ListEntry);
@@ -959,6 +964,13 @@ StoreSubmitRequest(
 
     KeReleaseSpinLockFromDpcLevel(&Context->Lock);
 
+    End = __rdtsc();
+
+    XENBUS_DEBUG(StatisticRecord,
+                 &Context->DebugInterface,
+                 Context->RoundTripStatistic,
+                 End - Start);
+
     Response = Request->Response;
     ASSERT(Response == NULL ||
            Response->Header.type == XS_ERROR ||
@@ -2499,6 +2511,12 @@ StoreAcquire(
     if (!NT_SUCCESS(status))
         goto fail9;
 
+    (VOID) XENBUS_DEBUG(StatisticCreate,
+                        &Context->DebugInterface,
+                        "STORE|ROUND_TRIP",
+                        XENBUS_DEBUG_STATISTIC_TYPE_CYCLES,
+                        &Context->RoundTripStatistic);
+
     Trace("<====\n");
 
 done:
@@ -2592,6 +2610,11 @@ StoreRelease(
     if (!IsListEmpty(&Context->BufferList))
         BUG("OUTSTANDING BUFFER");
 
+    XENBUS_DEBUG(StatisticDestroy,
+                 &Context->DebugInterface,
+                 Context->RoundTripStatistic);
+    Context->RoundTripStatistic = NULL;
+
     XENBUS_DEBUG(Deregister,
                  &Context->DebugInterface,
                  Context->DebugCallback);
@@ -30,6 +30,7 @@
  */
 
 #include <ntddk.h>
+#include <ntstrsafe.h>
 #include <stdarg.h>
 #include <xen.h>
 
@@ -37,6 +38,7 @@
 #include "thread.h"
 #include "fdo.h"
 #include "sync.h"
+#include "registry.h"
 #include "dbg_print.h"
 #include "assert.h"
 #include "util.h"
@@ -47,15 +49,48 @@ struct _XENBUS_SUSPEND_CALLBACK {
     PVOID       Argument;
 };
 
+#define XENBUS_SUSPEND_TIMELINE_COUNT       8
+#define XENBUS_SUSPEND_TIMELINE_EVENT_COUNT 64
+
+// Times are in performance counter ticks. Event start times are
+// relative to the start of the timeline.
+typedef struct _XENBUS_SUSPEND_EVENT {
+    const CHAR  *Phase;
+    ULONG_PTR   Function;
+    PVOID       Argument;
+    LONGLONG    Start;
+    LONGLONG    Duration;
+} XENBUS_SUSPEND_EVENT, *PXENBUS_SUSPEND_EVENT;
+
+typedef struct _XENBUS_SUSPEND_TIMELINE {
+    ULONG                   Sequence;
+    NTSTATUS                Status;
+    LARGE_INTEGER           SystemTime;
+    LONGLONG                Start;
+    LONGLONG                Duration;
+    ULONG                   Count;
+    ULONG                   Dropped;
+    XENBUS_SUSPEND_EVENT    Event[XENBUS_SUSPEND_TIMELINE_EVENT_COUNT];
+} XENBUS_SUSPEND_TIMELINE, *PXENBUS_SUSPEND_TIMELINE;
+
 struct _XENBUS_SUSPEND_CONTEXT {
     PXENBUS_FDO                 Fdo;
     KSPIN_LOCK                  Lock;
     LONG                        References;
     ULONG                       Count;
+    ULONG                       CancelCount;
     LIST_ENTRY                  EarlyList;
     LIST_ENTRY                  LateList;
     XENBUS_DEBUG_INTERFACE      DebugInterface;
     PXENBUS_DEBUG_CALLBACK      DebugCallback;
+    PXENBUS_DEBUG_STATISTIC     ShutdownStatistic;
+    PXENBUS_DEBUG_STATISTIC     CancelStatistic;
+    PXENBUS_DEBUG_STATISTIC     EarlyStatistic;
+    PXENBUS_DEBUG_STATISTIC     LateStatistic;
+    LARGE_INTEGER               Frequency;
+    ULONG                       Sequence;
+    XENBUS_SUSPEND_TIMELINE     Timeline[XENBUS_SUSPEND_TIMELINE_COUNT];
+    PXENBUS_THREAD              SnapshotThread;
 };
 
 #define XENBUS_SUSPEND_TAG  'PSUS'
@@ -140,44 +175,128 @@ SuspendDeregister(
     __SuspendFree(Callback);
 }
 
-static FORCEINLINE VOID
-__SuspendLogTimers(
-    IN  const CHAR  *Prefix
-    )
-{
+typedef struct _XENBUS_SUSPEND_TIMERS {
     LARGE_INTEGER   SystemTime;
     LARGE_INTEGER   TickCount;
     ULONG           TimeIncrement;
     LARGE_INTEGER   PerformanceCounter;
     LARGE_INTEGER   PerformanceFrequency;
+} XENBUS_SUSPEND_TIMERS, *PXENBUS_SUSPEND_TIMERS;
 
-    KeQuerySystemTime(&SystemTime);
+static FORCEINLINE VOID
+__SuspendQueryTimers(
+    OUT PXENBUS_SUSPEND_TIMERS  Timers
+    )
+{
+    KeQuerySystemTime(&Timers->SystemTime);
 
-    TimeIncrement = KeQueryTimeIncrement();
-    KeQueryTickCount(&TickCount);
+    Timers->TimeIncrement = KeQueryTimeIncrement();
+    KeQueryTickCount(&Timers->TickCount);
 
-    PerformanceCounter = KeQueryPerformanceCounter(&PerformanceFrequency);
+    Timers->PerformanceCounter = KeQueryPerformanceCounter(&Timers->PerformanceFrequency);
+}
 
+static FORCEINLINE VOID
+__SuspendLogTimers(
+    IN  const CHAR              *Prefix,
+    IN  PXENBUS_SUSPEND_TIMERS  Timers
+    )
+{
     LogPrintf(LOG_LEVEL_INFO,
               "%s: SystemTime = %08x.%08x\n",
               Prefix,
-              SystemTime.HighPart,
-              SystemTime.LowPart);
+              Timers->SystemTime.HighPart,
+              Timers->SystemTime.LowPart);
 
     LogPrintf(LOG_LEVEL_INFO,
               "%s: TickCount = %08x.%08x (TimeIncrement = %08x)\n",
               Prefix,
-              TickCount.HighPart,
-              TickCount.LowPart,
-              TimeIncrement);
+              Timers->TickCount.HighPart,
+              Timers->TickCount.LowPart,
+              Timers->TimeIncrement);
 
     LogPrintf(LOG_LEVEL_INFO,
               "%s: PerformanceCounter = %08x.%08x (Frequency = %08x.%08x)\n",
               Prefix,
-              PerformanceCounter.HighPart,
-              PerformanceCounter.LowPart,
-              PerformanceFrequency.HighPart,
-              PerformanceFrequency.LowPart);
+              Timers->PerformanceCounter.HighPart,
+              Timers->PerformanceCounter.LowPart,
+              Timers->PerformanceFrequency.HighPart,
+              Timers->PerformanceFrequency.LowPart);
+}
+
+// The timeline is only written by SuspendTrigger(), which runs with
+// all other CPUs captured, so no locking is needed. A slot is not
+// considered valid until its sequence number is set at the end.
+static FORCEINLINE PXENBUS_SUSPEND_TIMELINE
+__SuspendTimelineStart(
+    IN  PXENBUS_SUSPEND_CONTEXT Context
+    )
+{
+    PXENBUS_SUSPEND_TIMELINE    Timeline;
+
+    Timeline = &Context->Timeline[++Context->Sequence %
+                                  XENBUS_SUSPEND_TIMELINE_COUNT];
+
+    Timeline->Sequence = 0;
+    KeMemoryBarrier();
+
+    Timeline->Status = STATUS_PENDING;
+    Timeline->Duration = 0;
+    Timeline->Count = 0;
+    Timeline->Dropped = 0;
+
+    KeQuerySystemTime(&Timeline->SystemTime);
+    Timeline->Start = KeQueryPerformanceCounter(NULL).QuadPart;
+
+    return Timeline;
+}
+
+static FORCEINLINE LONGLONG
+__SuspendTimelineNow(
+    VOID
+    )
+{
+    return KeQueryPerformanceCounter(NULL).QuadPart;
+}
+
+static FORCEINLINE VOID
+__SuspendTimelineRecord(
+    IN  PXENBUS_SUSPEND_TIMELINE    Timeline,
+    IN  const CHAR                  *Phase,
+    IN  ULONG_PTR                   Function OPTIONAL,
+    IN  PVOID                       Argument OPTIONAL,
+    IN  LONGLONG                    Start
+    )
+{
+    LONGLONG                        End = __SuspendTimelineNow();
+    PXENBUS_SUSPEND_EVENT           Event;
+
+    if (Timeline->Count == XENBUS_SUSPEND_TIMELINE_EVENT_COUNT) {
+        Timeline->Dropped++;
+        return;
+    }
+
+    Event = &Timeline->Event[Timeline->Count++];
+
+    Event->Phase = Phase;
+    Event->Function = Function;
+    Event->Argument = Argument;
+    Event->Start = Start - Timeline->Start;
+    Event->Duration = End - Start;
+}
+
+static FORCEINLINE VOID
+__SuspendTimelineFinish(
+    IN  PXENBUS_SUSPEND_CONTEXT     Context,
+    IN  PXENBUS_SUSPEND_TIMELINE    Timeline,
+    IN  NTSTATUS                    status
+    )
+{
+    Timeline->Status = status;
+    Timeline->Duration = __SuspendTimelineNow() - Timeline->Start;
+
+    KeMemoryBarrier();
+    Timeline->Sequence = Context->Sequence;
 }
 
 NTSTATUS
@@ -186,37 +305,77 @@ SuspendTrigger(
     IN  PINTERFACE          Interface
     )
 {
-    PXENBUS_SUSPEND_CONTEXT Context = Interface->Context;
-    KIRQL                   Irql;
-    NTSTATUS                status;
+    PXENBUS_SUSPEND_CONTEXT     Context = Interface->Context;
+    PXENBUS_SUSPEND_TIMELINE    Timeline;
+    XENBUS_SUSPEND_TIMERS       Pre;
+    XENBUS_SUSPEND_TIMERS       Post;
+    LARGE_INTEGER               Start;
+    LARGE_INTEGER               End;
+    LONGLONG                    Now;
+    KIRQL                       Irql;
+    NTSTATUS                    status;
 
     KeRaiseIrql(DISPATCH_LEVEL, &Irql);
 
-    LogPrintf(LOG_LEVEL_INFO,
-              "SUSPEND: ====>\n");
+    Timeline = __SuspendTimelineStart(Context);
 
+    Now = __SuspendTimelineNow();
     SyncCapture();
+    __SuspendTimelineRecord(Timeline, "SyncCapture", 0, NULL, Now);
+
+    Now = __SuspendTimelineNow();
     SyncDisableInterrupts();
+    __SuspendTimelineRecord(Timeline, "SyncDisableInterrupts", 0, NULL, Now);
 
-    __SuspendLogTimers("PRE-SUSPEND");
+    // Logging is slow, so nothing is logged until we know whether
+    // the suspend was cancelled. A cancelled suspend (e.g. a Remus or
+    // COLO checkpoint) leaves us running in the same domain with all
+    // state intact, so none of the resume work below is needed and
+    // the whole sequence should complete as quickly as possible.
 
-    LogPrintf(LOG_LEVEL_INFO,
-              "SUSPEND: SCHEDOP_shutdown:SHUTDOWN_suspend ====>\n");
+    __SuspendQueryTimers(&Pre);
+
+    Start = KeQueryPerformanceCounter(NULL);
     status = SchedShutdown(SHUTDOWN_suspend);
-    LogPrintf(LOG_LEVEL_INFO,
-              "SUSPEND: SCHEDOP_shutdown:SHUTDOWN_suspend <==== (%08x)\n",
-              status);
+    End = KeQueryPerformanceCounter(NULL);
+    __SuspendTimelineRecord(Timeline, "SCHEDOP_shutdown", 0, NULL, Start.QuadPart);
+
+    if (status == STATUS_CANCELLED) {
+        Context->CancelCount++;
+    } else {
+        __SuspendQueryTimers(&Post);
+
+        LogPrintf(LOG_LEVEL_INFO,
+                  "SUSPEND: ====>\n");
+
+        __SuspendLogTimers("PRE-SUSPEND", &Pre);
 
-    __SuspendLogTimers("POST-SUSPEND");
+        LogPrintf(LOG_LEVEL_INFO,
+                  "SUSPEND: SCHEDOP_shutdown:SHUTDOWN_suspend (%08x)\n",
+                  status);
+
+        __SuspendLogTimers("POST-SUSPEND", &Post);
+
+        XENBUS_DEBUG(StatisticRecord,
+                     &Context->DebugInterface,
+                     Context->ShutdownStatistic,
+                     End.QuadPart - Start.QuadPart);
+    }
 
     if (NT_SUCCESS(status)) {
         PLIST_ENTRY ListEntry;
 
         Context->Count++;
 
+        Start = KeQueryPerformanceCounter(NULL);
+
+        Now = __SuspendTimelineNow();
         HypercallPopulate();
+        __SuspendTimelineRecord(Timeline, "HypercallPopulate", 0, NULL, Now);
 
+        Now = __SuspendTimelineNow();
         UnplugDevices();
+        __SuspendTimelineRecord(Timeline, "UnplugDevices", 0, NULL, Now);
 
         for (ListEntry = Context->EarlyList.Flink;
              ListEntry != &Context->EarlyList;
@@ -224,11 +383,27 @@ SuspendTrigger(
             PXENBUS_SUSPEND_CALLBACK  Callback;
 
             Callback = CONTAINING_RECORD(ListEntry, XENBUS_SUSPEND_CALLBACK, ListEntry);
+
+            Now = __SuspendTimelineNow();
             Callback->Function(Callback->Argument);
+            __SuspendTimelineRecord(Timeline,
+                                    "EARLY",
+                                    (ULONG_PTR)Callback->Function,
+                                    Callback->Argument,
+                                    Now);
         }
+
+        End = KeQueryPerformanceCounter(NULL);
+
+        XENBUS_DEBUG(StatisticRecord,
+                     &Context->DebugInterface,
+                     Context->EarlyStatistic,
+                     End.QuadPart - Start.QuadPart);
     }
 
+    Now = __SuspendTimelineNow();
     SyncEnableInterrupts();
+    __SuspendTimelineRecord(Timeline, "SyncEnableInterrupts", 0, NULL, Now);
 
     // No lock is required here as the VM is single-threaded until
     // SyncRelease() is called.
@@ -236,22 +411,59 @@ SuspendTrigger(
     if (NT_SUCCESS(status)) {
         PLIST_ENTRY ListEntry;
 
+        Start = KeQueryPerformanceCounter(NULL);
+
         for (ListEntry = Context->LateList.Flink;
              ListEntry != &Context->LateList;
              ListEntry = ListEntry->Flink) {
             PXENBUS_SUSPEND_CALLBACK  Callback;
 
             Callback = CONTAINING_RECORD(ListEntry, XENBUS_SUSPEND_CALLBACK, ListEntry);
+
+            Now = __SuspendTimelineNow();
             Callback->Function(Callback->Argument);
+            __SuspendTimelineRecord(Timeline,
+                                    "LATE",
+                                    (ULONG_PTR)Callback->Function,
+                                    Callback->Argument,
+                                    Now);
         }
+
+        End = KeQueryPerformanceCounter(NULL);
+
+        XENBUS_DEBUG(StatisticRecord,
+                     &Context->DebugInterface,
+                     Context->LateStatistic,
+                     End.QuadPart - Start.QuadPart);
     }
 
+    Now = __SuspendTimelineNow();
     SyncRelease();
+    __SuspendTimelineRecord(Timeline, "SyncRelease", 0, NULL, Now);
+
+    __SuspendTimelineFinish(Context, Timeline, status);
+
+    if (status == STATUS_CANCELLED) {
+        XENBUS_DEBUG(StatisticRecord,
+                     &Context->DebugInterface,
+                     Context->CancelStatistic,
+                     Timeline->Duration);
+
+        KeLowerIrql(Irql);
+
+        // Checkpoints may be taken many times a second so don't
+        // bother snapshotting their timelines into the registry.
+        Trace("cancelled\n");
+        return STATUS_SUCCESS;
+    }
 
     LogPrintf(LOG_LEVEL_INFO, "SUSPEND: <====\n");
 
     KeLowerIrql(Irql);
 
+    // The registry snapshot can only be written at PASSIVE_LEVEL
+    ThreadWake(Context->SnapshotThread);
+
     return STATUS_SUCCESS;
 }
 
@@ -270,6 +482,90 @@ SuspendGetCount(
     return Context->Count;
 }
 
+#define XENBUS_SUSPEND_LINE_LENGTH  128
+
+static FORCEINLINE ULONGLONG
+__SuspendTicksToMicroseconds(
+    IN  PXENBUS_SUSPEND_CONTEXT Context,
+    IN  LONGLONG                Ticks
+    )
+{
+    return ((ULONGLONG)Ticks * 1000000ull) /
+           (ULONGLONG)Context->Frequency.QuadPart;
+}
+
+static VOID
+SuspendFormatEvent(
+    IN  PXENBUS_SUSPEND_CONTEXT Context,
+    IN  PXENBUS_SUSPEND_EVENT   Event,
+    IN  PCHAR                   Buffer,
+    IN  ULONG                   Length
+    )
+{
+    PCHAR                       Name;
+    ULONG_PTR                   Offset;
+    NTSTATUS                    status;
+
+    Name = NULL;
+    Offset = 0;
+
+    // Callbacks are attributed to the module that registered them
+    if (Event->Function != 0)
+        ModuleLookup(Event->Function, &Name, &Offset);
+
+    if (Event->Function == 0)
+        status = RtlStringCbPrintfA(Buffer,
+                                    Length,
+                                    "+%lluus: %s %lluus",
+                                    __SuspendTicksToMicroseconds(Context, Event->Start),
+                                    Event->Phase,
+                                    __SuspendTicksToMicroseconds(Context, Event->Duration));
+    else if (Name == NULL)
+        status = RtlStringCbPrintfA(Buffer,
+                                    Length,
+                                    "+%lluus: %s %p (%p) %lluus",
+                                    __SuspendTicksToMicroseconds(Context, Event->Start),
+                                    Event->Phase,
+                                    (PVOID)Event->Function,
+                                    Event->Argument,
+                                    __SuspendTicksToMicroseconds(Context, Event->Duration));
+    else
+        status = RtlStringCbPrintfA(Buffer,
+                                    Length,
+                                    "+%lluus: %s %s + %p (%p) %lluus",
+                                    __SuspendTicksToMicroseconds(Context, Event->Start),
+                                    Event->Phase,
+                                    Name,
+                                    (PVOID)Offset,
+                                    Event->Argument,
+                                    __SuspendTicksToMicroseconds(Context, Event->Duration));
+
+    ASSERT(NT_SUCCESS(status) || status == STATUS_BUFFER_OVERFLOW);
+}
+
+static VOID
+SuspendFormatTimeline(
+    IN  PXENBUS_SUSPEND_CONTEXT     Context,
+    IN  PXENBUS_SUSPEND_TIMELINE    Timeline,
+    IN  PCHAR                       Buffer,
+    IN  ULONG                       Length
+    )
+{
+    NTSTATUS                        status;
+
+    status = RtlStringCbPrintfA(Buffer,
+                                Length,
+                                "%u: %08x.%08x %08x %lluus (%u event(s), %u dropped)",
+                                Timeline->Sequence,
+                                Timeline->SystemTime.HighPart,
+                                Timeline->SystemTime.LowPart,
+                                Timeline->Status,
+                                __SuspendTicksToMicroseconds(Context, Timeline->Duration),
+                                Timeline->Count,
+                                Timeline->Dropped);
+    ASSERT(NT_SUCCESS(status) || status == STATUS_BUFFER_OVERFLOW);
+}
+
 static VOID
 SuspendDebugCallback(
     IN  PVOID               Argument,
@@ -278,6 +574,7 @@ SuspendDebugCallback(
 {
     PXENBUS_SUSPEND_CONTEXT Context = Argument;
     PLIST_ENTRY             ListEntry;
+    ULONG                   Sequence;
 
     UNREFERENCED_PARAMETER(Crashing);
 
@@ -286,6 +583,44 @@ SuspendDebugCallback(
                  "Count = %u\n",
                  Context->Count);
 
+    XENBUS_DEBUG(Printf,
+                 &Context->DebugInterface,
+                 "CancelCount = %u\n",
+                 Context->CancelCount);
+
+    // Most recent first
+    for (Sequence = Context->Sequence;
+         Sequence != 0 &&
+         Sequence + XENBUS_SUSPEND_TIMELINE_COUNT > Context->Sequence;
+         --Sequence) {
+        PXENBUS_SUSPEND_TIMELINE    Timeline;
+        CHAR                        Buffer[XENBUS_SUSPEND_LINE_LENGTH];
+        ULONG                       Index;
+
+        Timeline = &Context->Timeline[Sequence % XENBUS_SUSPEND_TIMELINE_COUNT];
+        if (Timeline->Sequence != Sequence)
+            continue;
+
+        SuspendFormatTimeline(Context, Timeline, Buffer, sizeof (Buffer));
+
+        XENBUS_DEBUG(Printf,
+                     &Context->DebugInterface,
+                     "TIMELINE %s\n",
+                     Buffer);
+
+        for (Index = 0; Index < Timeline->Count; Index++) {
+            SuspendFormatEvent(Context,
+                               &Timeline->Event[Index],
+                               Buffer,
+                               sizeof (Buffer));
+
+            XENBUS_DEBUG(Printf,
+                         &Context->DebugInterface,
+                         "- %s\n",
+                         Buffer);
+        }
+    }
+
     for (ListEntry = Context->EarlyList.Flink;
          ListEntry != &Context->EarlyList;
          ListEntry = ListEntry->Flink) {
@@ -370,6 +705,30 @@ SuspendAcquire(
     if (!NT_SUCCESS(status))
         goto fail2;
 
+    (VOID) XENBUS_DEBUG(StatisticCreate,
+                        &Context->DebugInterface,
+                        "SUSPEND|SHUTDOWN",
+                        XENBUS_DEBUG_STATISTIC_TYPE_TIME,
+                        &Context->ShutdownStatistic);
+
+    (VOID) XENBUS_DEBUG(StatisticCreate,
+                        &Context->DebugInterface,
+                        "SUSPEND|CANCEL",
+                        XENBUS_DEBUG_STATISTIC_TYPE_TIME,
+                        &Context->CancelStatistic);
+
+    (VOID) XENBUS_DEBUG(StatisticCreate,
+                        &Context->DebugInterface,
+                        "SUSPEND|EARLY",
+                        XENBUS_DEBUG_STATISTIC_TYPE_TIME,
+                        &Context->EarlyStatistic);
+
+    (VOID) XENBUS_DEBUG(StatisticCreate,
+                        &Context->DebugInterface,
+                        "SUSPEND|LATE",
+                        XENBUS_DEBUG_STATISTIC_TYPE_TIME,
+                        &Context->LateStatistic);
+
     Trace("<====\n");
 
 done:
@@ -411,8 +770,29 @@ SuspendRelease(
         !IsListEmpty(&Context->EarlyList))
         BUG("OUTSTANDING CALLBACKS");
 
+    Context->CancelCount = 0;
     Context->Count = 0;
 
+    XENBUS_DEBUG(StatisticDestroy,
+                 &Context->DebugInterface,
+                 Context->LateStatistic);
+    Context->LateStatistic = NULL;
+
+    XENBUS_DEBUG(StatisticDestroy,
+                 &Context->DebugInterface,
+                 Context->EarlyStatistic);
+    Context->EarlyStatistic = NULL;
+
+    XENBUS_DEBUG(StatisticDestroy,
+                 &Context->DebugInterface,
+                 Context->CancelStatistic);
+    Context->CancelStatistic = NULL;
+
+    XENBUS_DEBUG(StatisticDestroy,
+                 &Context->DebugInterface,
+                 Context->ShutdownStatistic);
+    Context->ShutdownStatistic = NULL;
+
     XENBUS_DEBUG(Deregister,
                  &Context->DebugInterface,
                  Context->DebugCallback);
@@ -426,8 +806,181 @@ done:
     KeReleaseSpinLock(&Context->Lock, Irql);
 }
 
+static NTSTATUS
+SuspendSnapshotTimeline(
+    IN  PXENBUS_SUSPEND_CONTEXT Context,
+    IN  HANDLE                  Key,
+    IN  ULONG                   Slot
+    )
+{
+    PXENBUS_SUSPEND_TIMELINE    Timeline;
+    PANSI_STRING                Array;
+    PCHAR                       Buffer;
+    CHAR                        Name[16];
+    ULONG                       Sequence;
+    ULONG                       Index;
+    NTSTATUS                    status;
+
+    Timeline = __SuspendAllocate(sizeof (XENBUS_SUSPEND_TIMELINE));
+
+    status = STATUS_NO_MEMORY;
+    if (Timeline == NULL)
+        goto fail1;
+
+    // Take a copy and make sure the slot was not re-used while we
+    // were doing so
+    Sequence = Context->Timeline[Slot].Sequence;
+    KeMemoryBarrier();
+
+    RtlCopyMemory(Timeline,
+                  &Context->Timeline[Slot],
+                  sizeof (XENBUS_SUSPEND_TIMELINE));
+
+    KeMemoryBarrier();
+
+    status = STATUS_RETRY;
+    if (Context->Timeline[Slot].Sequence != Sequence ||
+        Timeline->Sequence != Sequence)
+        goto fail2;
+
+    // One line for the timeline, one per event and a terminator
+    Array = __SuspendAllocate(sizeof (ANSI_STRING) * (Timeline->Count + 2));
+
+    status = STATUS_NO_MEMORY;
+    if (Array == NULL)
+        goto fail3;
+
+    Buffer = __SuspendAllocate(XENBUS_SUSPEND_LINE_LENGTH * (Timeline->Count + 1));
+
+    status = STATUS_NO_MEMORY;
+    if (Buffer == NULL)
+        goto fail4;
+
+    SuspendFormatTimeline(Context,
+                          Timeline,
+                          Buffer,
+                          XENBUS_SUSPEND_LINE_LENGTH);
+    RtlInitAnsiString(&Array[0], Buffer);
+
+    for (Index = 0; Index < Timeline->Count; Index++) {
+        PCHAR   Line = Buffer + ((Index + 1) * XENBUS_SUSPEND_LINE_LENGTH);
+
+        SuspendFormatEvent(Context,
+                           &Timeline->Event[Index],
+                           Line,
+                           XENBUS_SUSPEND_LINE_LENGTH);
+        RtlInitAnsiString(&Array[Index + 1], Line);
+    }
+
+    status = RtlStringCbPrintfA(Name, sizeof (Name), "Timeline%u", Slot);
+    ASSERT(NT_SUCCESS(status));
+
+    status = RegistryUpdateSzValue(Key,
+                                   Name,
+                                   REG_MULTI_SZ,
+                                   Array);
+    if (!NT_SUCCESS(status))
+        goto fail5;
+
+    __SuspendFree(Buffer);
+    __SuspendFree(Array);
+    __SuspendFree(Timeline);
+
+    return STATUS_SUCCESS;
+
+fail5:
+    Error("fail5\n");
+
+    __SuspendFree(Buffer);
+
+fail4:
+    Error("fail4\n");
+
+    __SuspendFree(Array);
+
+fail3:
+    Error("fail3\n");
+
+fail2:
+    Error("fail2\n");
+
+    __SuspendFree(Timeline);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static NTSTATUS
+SuspendSnapshot(
+    IN  PXENBUS_THREAD      Self,
+    IN  PVOID               _Context
+    )
+{
+    PXENBUS_SUSPEND_CONTEXT Context = _Context;
+    HANDLE                  ServiceKey;
+    HANDLE                  SuspendKey;
+    NTSTATUS                status;
+
+    Trace("====>\n");
+
+    status = RegistryOpenServiceKey(KEY_ALL_ACCESS, &ServiceKey);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    status = RegistryCreateSubKey(ServiceKey,
+                                  "Suspend",
+                                  REG_OPTION_VOLATILE,
+                                  &SuspendKey);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    RegistryCloseKey(ServiceKey);
+
+    for (;;) {
+        PKEVENT Event;
+        ULONG   Slot;
+
+        Event = ThreadGetEvent(Self);
+
+        (VOID) KeWaitForSingleObject(Event,
+                                     Executive,
+                                     KernelMode,
+                                     FALSE,
+                                     NULL);
+        KeClearEvent(Event);
+
+        if (ThreadIsAlerted(Self))
+            break;
+
+        for (Slot = 0; Slot < XENBUS_SUSPEND_TIMELINE_COUNT; Slot++) {
+            if (Context->Timeline[Slot].Sequence == 0)
+                continue;
+
+            (VOID) SuspendSnapshotTimeline(Context, SuspendKey, Slot);
+        }
+    }
+
+    RegistryCloseKey(SuspendKey);
+
+    Trace("<====\n");
+
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+    RegistryCloseKey(ServiceKey);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
 static struct _XENBUS_SUSPEND_INTERFACE_V1 SuspendInterfaceVersion1 = {
-    { sizeof (struct _XENBUS_SUSPEND_INTERFACE_V1), 1, NULL, NULL, NULL },
+    { sizeof (struct _XENBUS_SUSPEND_INTERFACE_V1), 1, 0, NULL, NULL },
     SuspendAcquire,
     SuspendRelease,
     SuspendRegister,
@@ -462,12 +1015,35 @@ SuspendInitialize(
     InitializeListHead(&(*Context)->LateList);
     KeInitializeSpinLock(&(*Context)->Lock);
 
+    (VOID) KeQueryPerformanceCounter(&(*Context)->Frequency);
+
+    status = ThreadCreate(SuspendSnapshot,
+                          *Context,
+                          &(*Context)->SnapshotThread);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
     (*Context)->Fdo = Fdo;
 
     Trace("<====\n");
 
     return STATUS_SUCCESS;
 
+fail2:
+    Error("fail2\n");
+
+    (*Context)->Frequency.QuadPart = 0;
+
+    RtlZeroMemory(&(*Context)->Lock, sizeof (KSPIN_LOCK));
+    RtlZeroMemory(&(*Context)->LateList, sizeof (LIST_ENTRY));
+    RtlZeroMemory(&(*Context)->EarlyList, sizeof (LIST_ENTRY));
+
+    RtlZeroMemory(&(*Context)->DebugInterface,
+                  sizeof (XENBUS_DEBUG_INTERFACE));
+
+    ASSERT(IsZeroMemory(*Context, sizeof (XENBUS_SUSPEND_CONTEXT)));
+    __SuspendFree(*Context);
+
 fail1:
     Error("fail1 (%08x)\n", status);
 
@@ -529,6 +1105,15 @@ SuspendTeardown(
 
     Context->Fdo = NULL;
 
+    ThreadAlert(Context->SnapshotThread);
+    ThreadJoin(Context->SnapshotThread);
+    Context->SnapshotThread = NULL;
+
+    Context->Sequence = 0;
+    RtlZeroMemory(Context->Timeline, sizeof (Context->Timeline));
+
+    Context->Frequency.QuadPart = 0;
+
     RtlZeroMemory(&Context->DebugInterface,
                   sizeof (XENBUS_DEBUG_INTERFACE));
 
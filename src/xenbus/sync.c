@@ -62,10 +62,10 @@
 //         complete, but CPU B is spinning with interrupts disabled.
 //         Thus the DPC on CPU A will never make it to HIGH_LEVEL and
 //         hence never get to disable interrupts. Thus if, while
-//         spinning with interrupts disabled, one DPC notices that
-//         another DPC has not made it, it briefly enables interrupts
-//         and drops back down to DISPATCH_LEVEL before trying again.
-//         This should allow any pending IPI to complete.
+//         spinning at HIGH_LEVEL, the calling CPU notices that
+//         another DPC has not made it, it aborts the attempt and all
+//         CPUs briefly drop back down to DISPATCH_LEVEL before trying
+//         again. This should allow any pending IPI to complete.
 //
 // - SyncEnableInterrupts() instructs the DPC routines to all enable
 //   interrupts and drop back to DISPATCH_LEVEL before enabling
@@ -74,21 +74,58 @@
 // - SyncRelease() instructs the DPC routines to exit, thus allowing
 //   the scheduler to run on the other CPUs again. It spins until all
 //   DPCs have completed and then returns.
+//
+// Each step ends in a rendezvous of all CPUs. To avoid all CPUs
+// hammering a single shared counter, CPUs are grouped into clusters
+// (by NUMA node, with a bounded number of CPUs per cluster). A CPU
+// arriving at the rendezvous decrements its cluster's counter and only
+// the last CPU to arrive in each cluster decrements the global counter.
+// The last cluster to arrive resets the global counter and flips its
+// sense bit in a single atomic operation, which is what all CPUs spin
+// on, so no counter needs to be reset by the calling CPU between steps.
+// Per-CPU state is cache line aligned so that the calling CPU writing
+// instructions for one CPU does not disturb any other.
+
+#define SYNC_SECTION_SIZE       (PAGE_SIZE * 16)
 
 #pragma data_seg("sync")
 __declspec(allocate("sync"))
-static UCHAR        __Section[PAGE_SIZE];
+static UCHAR        __Section[SYNC_SECTION_SIZE];
+
+#define SYNC_CLUSTER_SIZE       16
+#define SYNC_MAXIMUM_CLUSTERS   64
+#define SYNC_MAXIMUM_NODES      64
+
+#define SYNC_BARRIER_SENSE      0x80000000
+#define SYNC_BARRIER_ABORT      0x40000000
+#define SYNC_BARRIER_REMAINING  0x3FFFFFFF
 
-typedef struct  _SYNC_PROCESSOR {
+#define SYNC_ATTEMPT_LIMIT      1000
+
+typedef struct  DECLSPEC_CACHEALIGN _SYNC_PROCESSOR {
     KDPC                Dpc;
+    LONG                Cluster;
+    ULONG               Sense;
     BOOLEAN             DisableInterrupts;
     BOOLEAN             Exit;
 } SYNC_PROCESSOR, *PSYNC_PROCESSOR;
 
+typedef struct  DECLSPEC_CACHEALIGN _SYNC_CLUSTER {
+    LONG                Remaining;
+    LONG                Size;
+} SYNC_CLUSTER, *PSYNC_CLUSTER;
+
+typedef struct  DECLSPEC_CACHEALIGN _SYNC_BARRIER {
+    LONG                Value;
+} SYNC_BARRIER, *PSYNC_BARRIER;
+
 typedef struct  _SYNC_CONTEXT {
-    ULONG               Sequence;
+    SYNC_BARRIER        Barrier;
     LONG                ProcessorCount;
-    LONG                CompletionCount;
+    LONG                ClusterCount;
+    LONG                Attempt;
+    LONG                AbortCount;
+    SYNC_CLUSTER        Cluster[SYNC_MAXIMUM_CLUSTERS];
     SYNC_PROCESSOR      Processor[1];
 } SYNC_CONTEXT, *PSYNC_CONTEXT;
 
@@ -117,6 +154,182 @@ __SyncRelease(
     ASSERT3U(Old, ==, Index);
 }
 
+static FORCEINLINE VOID
+__SyncArrive(
+    IN  PSYNC_CONTEXT   Context,
+    IN  PSYNC_PROCESSOR Processor
+    )
+{
+    PSYNC_CLUSTER       Cluster = &Context->Cluster[Processor->Cluster];
+    LONG                Old;
+    LONG                New;
+
+    if (InterlockedDecrement(&Cluster->Remaining) != 0)
+        return;
+
+    // No other CPU in the cluster can arrive again until the barrier
+    // completes, so it is safe to reset the counter here.
+    Cluster->Remaining = Cluster->Size;
+
+    do {
+        Old = Context->Barrier.Value;
+
+        if (Old & SYNC_BARRIER_ABORT)
+            return;
+
+        ASSERT3U((ULONG)Old & SYNC_BARRIER_SENSE, ==, Processor->Sense);
+        ASSERT((Old & SYNC_BARRIER_REMAINING) != 0);
+
+        if ((Old & SYNC_BARRIER_REMAINING) == 1)
+            New = (LONG)(((ULONG)Old & SYNC_BARRIER_SENSE) ^ SYNC_BARRIER_SENSE) |
+                  Context->ClusterCount;
+        else
+            New = Old - 1;
+    } while (InterlockedCompareExchange(&Context->Barrier.Value, New, Old) != Old);
+}
+
+// Spin until the barrier completes (STATUS_SUCCESS), is aborted
+// (STATUS_CANCELLED) or, if Limit is non-zero, Limit iterations have
+// passed (STATUS_TIMEOUT).
+static FORCEINLINE NTSTATUS
+__SyncWait(
+    IN  PSYNC_CONTEXT   Context,
+    IN  PSYNC_PROCESSOR Processor,
+    IN  ULONG           Limit
+    )
+{
+    ULONG               Attempts;
+
+    for (Attempts = 0; Limit == 0 || Attempts < Limit; Attempts++) {
+        LONG    Value = Context->Barrier.Value;
+
+        if (((ULONG)Value & SYNC_BARRIER_SENSE) != Processor->Sense) {
+            Processor->Sense ^= SYNC_BARRIER_SENSE;
+            return STATUS_SUCCESS;
+        }
+
+        if (Value & SYNC_BARRIER_ABORT)
+            return STATUS_CANCELLED;
+
+        _mm_pause();
+        KeMemoryBarrier();
+    }
+
+    return STATUS_TIMEOUT;
+}
+
+// Returns FALSE if the barrier completed before it could be aborted
+static FORCEINLINE BOOLEAN
+__SyncAbort(
+    IN  PSYNC_CONTEXT   Context,
+    IN  PSYNC_PROCESSOR Processor
+    )
+{
+    LONG                Old;
+    LONG                New;
+
+    do {
+        Old = Context->Barrier.Value;
+
+        if (((ULONG)Old & SYNC_BARRIER_SENSE) != Processor->Sense)
+            return FALSE;
+
+        New = Old | SYNC_BARRIER_ABORT;
+    } while (InterlockedCompareExchange(&Context->Barrier.Value, New, Old) != Old);
+
+    return TRUE;
+}
+
+// Only safe once all other CPUs have acknowledged an abort
+static FORCEINLINE VOID
+__SyncReset(
+    IN  PSYNC_CONTEXT   Context,
+    IN  PSYNC_PROCESSOR Processor
+    )
+{
+    LONG                Index;
+
+    for (Index = 0; Index < Context->ClusterCount; Index++) {
+        PSYNC_CLUSTER   Cluster = &Context->Cluster[Index];
+
+        Cluster->Remaining = Cluster->Size;
+    }
+
+    Context->Barrier.Value = (LONG)Processor->Sense | Context->ClusterCount;
+    Context->AbortCount = 0;
+}
+
+static USHORT
+SyncGetNode(
+    IN  PPROCESSOR_NUMBER   ProcNumber
+    )
+{
+    USHORT                  Node;
+
+    for (Node = 0; Node <= KeQueryHighestNodeNumber(); Node++) {
+        GROUP_AFFINITY  Affinity;
+
+        KeQueryNodeActiveAffinity(Node, &Affinity, NULL);
+
+        if (Affinity.Group == ProcNumber->Group &&
+            (Affinity.Mask & ((KAFFINITY)1 << ProcNumber->Number)) != 0)
+            return Node;
+    }
+
+    return 0;
+}
+
+static VOID
+SyncBuildClusters(
+    IN  PSYNC_CONTEXT   Context
+    )
+{
+    LONG                NodeCluster[SYNC_MAXIMUM_NODES];
+    LONG                Index;
+
+    for (Index = 0; Index < SYNC_MAXIMUM_NODES; Index++)
+        NodeCluster[Index] = -1;
+
+    Context->ClusterCount = 0;
+
+    for (Index = 0; Index < Context->ProcessorCount; Index++) {
+        PSYNC_PROCESSOR     Processor = &Context->Processor[Index];
+        PROCESSOR_NUMBER    ProcNumber;
+        USHORT              Node;
+        LONG                Cluster;
+        NTSTATUS            status;
+
+        ASSERT3U((ULONG_PTR)(Processor + 1), <=, (ULONG_PTR)__Section + SYNC_SECTION_SIZE);
+
+        status = KeGetProcessorNumberFromIndex(Index, &ProcNumber);
+        ASSERT(NT_SUCCESS(status));
+
+        Node = SyncGetNode(&ProcNumber) % SYNC_MAXIMUM_NODES;
+        Cluster = NodeCluster[Node];
+
+        if ((Cluster < 0 ||
+             Context->Cluster[Cluster].Size == SYNC_CLUSTER_SIZE) &&
+            Context->ClusterCount < SYNC_MAXIMUM_CLUSTERS) {
+            Cluster = Context->ClusterCount++;
+            NodeCluster[Node] = Cluster;
+        }
+
+        // If we have run out of clusters then just overfill the last
+        if (Cluster < 0)
+            Cluster = Context->ClusterCount - 1;
+
+        Processor->Cluster = Cluster;
+        Context->Cluster[Cluster].Size++;
+    }
+
+    for (Index = 0; Index < Context->ClusterCount; Index++) {
+        PSYNC_CLUSTER   Cluster = &Context->Cluster[Index];
+
+        Cluster->Remaining = Cluster->Size;
+    }
+
+    Context->Barrier.Value = Context->ClusterCount;
+}
 
 KDEFERRED_ROUTINE   SyncWorker;
 
@@ -148,11 +361,11 @@ SyncWorker(
     Processor = &Context->Processor[Index];
 
     Trace("====> (%u:%u)\n", ProcNumber.Group, ProcNumber.Number);
-    InterlockedIncrement(&Context->CompletionCount);
 
-    for (;;) {
-        ULONG   Sequence;
+    __SyncArrive(Context, Processor);
+    (VOID) __SyncWait(Context, Processor, 0);
 
+    for (;;) {
         if (Processor->Exit)
             break;
 
@@ -163,46 +376,30 @@ SyncWorker(
             continue;
         }
 
-        Sequence = Context->Sequence;
-
         if (Processor->DisableInterrupts) {
-            ULONG       Attempts;
+            LONG        Attempt = Context->Attempt;
             NTSTATUS    status;
 
             (VOID) KfRaiseIrql(HIGH_LEVEL);
-            status = STATUS_SUCCESS;
 
-            InterlockedIncrement(&Context->CompletionCount);
+            __SyncArrive(Context, Processor);
 
-            Attempts = 0;
-            while (Context->Sequence == Sequence &&
-                   Context->CompletionCount < Context->ProcessorCount) {
-                _mm_pause();
-                KeMemoryBarrier();
-
-                if (++Attempts > 1000) {
-                    LONG    Old;
-                    LONG    New;
+            status = __SyncWait(Context, Processor, 0);
+            if (!NT_SUCCESS(status)) {
+                ASSERT3U(status, ==, STATUS_CANCELLED);
 
-                    do {
-                        Old = Context->CompletionCount;
-                        New = Old - 1;
+#pragma prefast(suppress:28138) // Use constant rather than variable
+                KeLowerIrql(DISPATCH_LEVEL);
 
-                        if (Old == Context->ProcessorCount)
-                            break;
-                    } while (InterlockedCompareExchange(&Context->CompletionCount, New, Old) != Old);
+                InterlockedIncrement(&Context->AbortCount);
 
-                    if (Old < Context->ProcessorCount) {
-#pragma prefast(suppress:28138) // Use constant rather than variable
-                        KeLowerIrql(DISPATCH_LEVEL);
-                        status = STATUS_UNSUCCESSFUL;
-                        break;
-                    }
+                while (Context->Attempt == Attempt) {
+                    _mm_pause();
+                    KeMemoryBarrier();
                 }
-            }
-                    
-            if (!NT_SUCCESS(status))
+
                 continue;
+            }
 
             _disable();
 
@@ -215,21 +412,18 @@ SyncWorker(
 #pragma prefast(suppress:28138) // Use constant rather than variable
             KeLowerIrql(DISPATCH_LEVEL);
 
-            InterlockedIncrement(&Context->CompletionCount);
-
-            while (Context->Sequence == Sequence &&
-                   Context->CompletionCount < Context->ProcessorCount) {
-                _mm_pause();
-                KeMemoryBarrier();
-            }
-
+            __SyncArrive(Context, Processor);
+            (VOID) __SyncWait(Context, Processor, 0);
         }
     }
 
     Trace("<==== (%u:%u)\n", ProcNumber.Group, ProcNumber.Number);
-    InterlockedIncrement(&Context->CompletionCount);
 
     ASSERT(!InterruptsDisabled);
+
+    // The context may be zeroed as soon as the last CPU arrives so it
+    // must not be touched after this point
+    __SyncArrive(Context, Processor);
 }
 
 __drv_maxIRQL(DISPATCH_LEVEL)
@@ -255,19 +449,16 @@ SyncCapture(
 
     Trace("====> (%u:%u)\n", Group, Number);
 
-    ASSERT(IsZeroMemory(Context, PAGE_SIZE));
-
-    Context->Sequence++;
-    Context->CompletionCount = 0;
+    ASSERT(IsZeroMemory(Context, SYNC_SECTION_SIZE));
 
     Context->ProcessorCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
 
+    SyncBuildClusters(Context);
+
     for (Index = 0; Index < Context->ProcessorCount; Index++) {
         PSYNC_PROCESSOR Processor = &Context->Processor[Index];
         NTSTATUS        status;
 
-        ASSERT3U((ULONG_PTR)(Processor + 1), <, (ULONG_PTR)__Section + PAGE_SIZE);
-
         status = KeGetProcessorNumberFromIndex(Index, &ProcNumber);
         ASSERT(NT_SUCCESS(status));
 
@@ -280,12 +471,8 @@ SyncCapture(
         KeInsertQueueDpc(&Processor->Dpc, NULL, NULL);
     }
 
-    InterlockedIncrement(&Context->CompletionCount);
-
-    while (Context->CompletionCount < Context->ProcessorCount) {
-        _mm_pause();
-        KeMemoryBarrier();
-    }
+    __SyncArrive(Context, &Context->Processor[SyncOwner]);
+    (VOID) __SyncWait(Context, &Context->Processor[SyncOwner], 0);
 
     Trace("<==== (%u:%u)\n", Group, Number);
 }
@@ -298,62 +485,52 @@ SyncDisableInterrupts(
     )
 {
     PSYNC_CONTEXT   Context = SyncContext;
+    PSYNC_PROCESSOR Processor = &Context->Processor[SyncOwner];
     LONG            Index;
-    ULONG           Attempts;
     NTSTATUS        status;
 
     Trace("====>\n");
 
-    Context->Sequence++;
-    Context->CompletionCount = 0;
-
-    for (Index = 0; Index < Context->ProcessorCount; Index++) {
-        PSYNC_PROCESSOR Processor = &Context->Processor[Index];
-
-        Processor->DisableInterrupts = TRUE;
-    }
+    for (Index = 0; Index < Context->ProcessorCount; Index++)
+        Context->Processor[Index].DisableInterrupts = TRUE;
 
     KeMemoryBarrier();
 
 again:
     (VOID) KfRaiseIrql(HIGH_LEVEL);
-    status = STATUS_SUCCESS;
 
-    InterlockedIncrement(&Context->CompletionCount);
+    __SyncArrive(Context, Processor);
 
-    Attempts = 0;
-    while (Context->CompletionCount < Context->ProcessorCount) {
-        _mm_pause();
-        KeMemoryBarrier();
+    status = __SyncWait(Context, Processor, SYNC_ATTEMPT_LIMIT);
+    if (status == STATUS_TIMEOUT) {
+        LONG    Value = Context->Barrier.Value;
 
-        if (++Attempts > 1000) {
-            LONG    Old;
-            LONG    New;
+        if (__SyncAbort(Context, Processor)) {
+            LogPrintf(LOG_LEVEL_WARNING,
+                      "SYNC: %d/%d clusters outstanding (attempt %d)\n",
+                      Value & SYNC_BARRIER_REMAINING,
+                      Context->ClusterCount,
+                      Context->Attempt);
 
-            do {
-                Old = Context->CompletionCount;
-                New = Old - 1;
+#pragma prefast(suppress:28138) // Use constant rather than variable
+            KeLowerIrql(DISPATCH_LEVEL);
 
-                if (Old == Context->ProcessorCount)
-                    break;
-            } while (InterlockedCompareExchange(&Context->CompletionCount, New, Old) != Old);
+            while (Context->AbortCount < Context->ProcessorCount - 1) {
+                _mm_pause();
+                KeMemoryBarrier();
+            }
 
-            if (Old < Context->ProcessorCount) {
-                LogPrintf(LOG_LEVEL_WARNING,
-                          "SYNC: %d < %d\n",
-                          Old,
-                          Context->ProcessorCount);
+            __SyncReset(Context, Processor);
 
-#pragma prefast(suppress:28138) // Use constant rather than variable
-                KeLowerIrql(DISPATCH_LEVEL);
-                status = STATUS_UNSUCCESSFUL;
-                break;
-            }
+            KeMemoryBarrier();
+            Context->Attempt++;
+
+            goto again;
         }
+
+        status = __SyncWait(Context, Processor, 0);
     }
-            
-    if (!NT_SUCCESS(status))
-        goto again;
+    ASSERT(NT_SUCCESS(status));
 
     _disable();
 }
@@ -373,9 +550,6 @@ SyncEnableInterrupts(
     Irql = KeGetCurrentIrql();
     ASSERT3U(Irql, ==, HIGH_LEVEL);
 
-    Context->Sequence++;
-    Context->CompletionCount = 0;
-
     for (Index = 0; Index < Context->ProcessorCount; Index++) {
         PSYNC_PROCESSOR Processor = &Context->Processor[Index];
 
@@ -384,12 +558,8 @@ SyncEnableInterrupts(
 
     KeMemoryBarrier();
 
-    InterlockedIncrement(&Context->CompletionCount);
-
-    while (Context->CompletionCount < Context->ProcessorCount) {
-        _mm_pause();
-        KeMemoryBarrier();
-    }
+    __SyncArrive(Context, &Context->Processor[SyncOwner]);
+    (VOID) __SyncWait(Context, &Context->Processor[SyncOwner], 0);
 
 #pragma prefast(suppress:28138) // Use constant rather than variable
     KeLowerIrql(DISPATCH_LEVEL);
@@ -409,9 +579,6 @@ SyncRelease(
 
     Trace("====>\n");
 
-    Context->Sequence++;
-    Context->CompletionCount = 0;
-
     for (Index = 0; Index < Context->ProcessorCount; Index++) {
         PSYNC_PROCESSOR Processor = &Context->Processor[Index];
 
@@ -420,14 +587,10 @@ SyncRelease(
 
     KeMemoryBarrier();
 
-    InterlockedIncrement(&Context->CompletionCount);
-
-    while (Context->CompletionCount < Context->ProcessorCount) {
-        _mm_pause();
-        KeMemoryBarrier();
-    }
+    __SyncArrive(Context, &Context->Processor[SyncOwner]);
+    (VOID) __SyncWait(Context, &Context->Processor[SyncOwner], 0);
 
-    RtlZeroMemory(Context, PAGE_SIZE);
+    RtlZeroMemory(Context, SYNC_SECTION_SIZE);
 
     Index = KeGetCurrentProcessorNumberEx(NULL);
     __SyncRelease(Index);
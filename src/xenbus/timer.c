@@ -0,0 +1,999 @@
+/* Copyright (c) Citrix Systems Inc.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms,
+ * with or without modification, are permitted provided
+ * that the following conditions are met:
+ *
+ * *   Redistributions of source code must retain the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer.
+ * *   Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the
+ *     following disclaimer in the documentation and/or other
+ *     materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND
+ * CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <ntddk.h>
+#include <procgrp.h>
+#include <xen.h>
+
+#include "timer.h"
+#include "fdo.h"
+#include "dbg_print.h"
+#include "assert.h"
+#include "util.h"
+
+#define XENBUS_TIMER_MAGIC  'RMIT'
+
+#define XENBUS_TIMER_INDEX_INVALID  ((ULONG)-1)
+
+#define XENBUS_TIMER_MINIMUM_HEAP_SIZE  16
+
+struct _XENBUS_TIMER {
+    ULONG                   Magic;
+    ULONG                   Cpu;
+    XENBUS_TIMER_FUNCTION   Function;
+    PVOID                   Argument;
+    LONGLONG                Deadline;
+    ULONG                   Index;
+};
+
+// Each vCPU has a single one-shot hypervisor timer, which can only be
+// programmed by the vCPU itself. The pending client timers for each CPU
+// are therefore kept in a binary min-heap, ordered by deadline, and the
+// earliest deadline is programmed from a DPC targeted at that CPU. The
+// resulting VIRQ_TIMER is delivered via the FDO's existing binding.
+//
+// Deadlines are in hypervisor system time, which restarts on resume, so
+// all pending deadlines are shifted by the suspend callbacks such that
+// their remaining time is preserved (see TimerSuspendCallbackLate()).
+typedef struct _XENBUS_TIMER_PROCESSOR {
+    PXENBUS_TIMER_CONTEXT   Context;
+    ULONG                   Index;
+    KSPIN_LOCK              Lock;
+    KDPC                    Dpc;
+    PXENBUS_TIMER           *Heap;
+    ULONG                   Count;
+    ULONG                   Size;
+    ULONG                   Timers;
+    LONGLONG                Now;
+    ULONGLONG               InterruptTime;
+    LONGLONG                Programmed;
+    LONG                    Fired;
+    ULONG                   Interrupts;
+    ULONG                   Expiries;
+    ULONG                   Errors;
+} XENBUS_TIMER_PROCESSOR, *PXENBUS_TIMER_PROCESSOR;
+
+struct _XENBUS_TIMER_CONTEXT {
+    PXENBUS_FDO                     Fdo;
+    KSPIN_LOCK                      Lock;
+    LONG                            References;
+    PXENBUS_TIMER_PROCESSOR         Processor;
+    ULONG                           ProcessorCount;
+    XENBUS_SHARED_INFO_INTERFACE    SharedInfoInterface;
+    XENBUS_SUSPEND_INTERFACE        SuspendInterface;
+    PXENBUS_SUSPEND_CALLBACK        SuspendCallbackEarly;
+    PXENBUS_SUSPEND_CALLBACK        SuspendCallbackLate;
+    ULONGLONG                       SuspendInterruptTime;
+    XENBUS_DEBUG_INTERFACE          DebugInterface;
+    PXENBUS_DEBUG_CALLBACK          DebugCallback;
+};
+
+#define XENBUS_TIMER_TAG    'RMIT'
+
+static FORCEINLINE PVOID
+__TimerAllocate(
+    IN  ULONG   Length
+    )
+{
+    return __AllocatePoolWithTag(NonPagedPool, Length, XENBUS_TIMER_TAG);
+}
+
+static FORCEINLINE VOID
+__TimerFree(
+    IN  PVOID   Buffer
+    )
+{
+    __FreePoolWithTag(Buffer, XENBUS_TIMER_TAG);
+}
+
+static FORCEINLINE VOID
+__TimerHeapSet(
+    IN  PXENBUS_TIMER_PROCESSOR Processor,
+    IN  ULONG                   Index,
+    IN  PXENBUS_TIMER           Timer
+    )
+{
+    Processor->Heap[Index] = Timer;
+    Timer->Index = Index;
+}
+
+static VOID
+TimerHeapUp(
+    IN  PXENBUS_TIMER_PROCESSOR Processor,
+    IN  ULONG                   Index
+    )
+{
+    PXENBUS_TIMER               Timer = Processor->Heap[Index];
+
+    while (Index != 0) {
+        ULONG           Parent = (Index - 1) / 2;
+        PXENBUS_TIMER   Other = Processor->Heap[Parent];
+
+        if (Other->Deadline <= Timer->Deadline)
+            break;
+
+        __TimerHeapSet(Processor, Index, Other);
+        Index = Parent;
+    }
+
+    __TimerHeapSet(Processor, Index, Timer);
+}
+
+static VOID
+TimerHeapDown(
+    IN  PXENBUS_TIMER_PROCESSOR Processor,
+    IN  ULONG                   Index
+    )
+{
+    PXENBUS_TIMER               Timer = Processor->Heap[Index];
+
+    for (;;) {
+        ULONG           Child = (Index * 2) + 1;
+        PXENBUS_TIMER   Other;
+
+        if (Child >= Processor->Count)
+            break;
+
+        if (Child + 1 < Processor->Count &&
+            Processor->Heap[Child + 1]->Deadline < Processor->Heap[Child]->Deadline)
+            Child++;
+
+        Other = Processor->Heap[Child];
+
+        if (Timer->Deadline <= Other->Deadline)
+            break;
+
+        __TimerHeapSet(Processor, Index, Other);
+        Index = Child;
+    }
+
+    __TimerHeapSet(Processor, Index, Timer);
+}
+
+static VOID
+TimerHeapInsert(
+    IN  PXENBUS_TIMER_PROCESSOR Processor,
+    IN  PXENBUS_TIMER           Timer
+    )
+{
+    ULONG                       Index;
+
+    ASSERT3U(Timer->Index, ==, XENBUS_TIMER_INDEX_INVALID);
+    ASSERT3U(Processor->Count, <, Processor->Size);
+
+    Index = Processor->Count++;
+    __TimerHeapSet(Processor, Index, Timer);
+
+    TimerHeapUp(Processor, Index);
+}
+
+static VOID
+TimerHeapRemove(
+    IN  PXENBUS_TIMER_PROCESSOR Processor,
+    IN  PXENBUS_TIMER           Timer
+    )
+{
+    ULONG                       Index = Timer->Index;
+    ULONG                       Last;
+
+    ASSERT3U(Index, <, Processor->Count);
+    ASSERT3P(Processor->Heap[Index], ==, Timer);
+
+    Last = --Processor->Count;
+
+    if (Index != Last) {
+        PXENBUS_TIMER   Moved = Processor->Heap[Last];
+
+        __TimerHeapSet(Processor, Index, Moved);
+
+        TimerHeapUp(Processor, Index);
+        TimerHeapDown(Processor, Moved->Index);
+    }
+
+    Processor->Heap[Last] = NULL;
+    Timer->Index = XENBUS_TIMER_INDEX_INVALID;
+}
+
+// Must be called with the processor lock held. Returns the current time.
+static LONGLONG
+TimerProcessorUpdate(
+    IN  PXENBUS_TIMER_PROCESSOR Processor
+    )
+{
+    PXENBUS_TIMER_CONTEXT       Context = Processor->Context;
+    LONGLONG                    Now;
+
+    Now = XENBUS_SHARED_INFO(GetSystemTime, &Context->SharedInfoInterface);
+
+    Processor->Now = Now;
+    Processor->InterruptTime = KeQueryInterruptTime();
+
+    return Now;
+}
+
+// Must be called with the processor lock held, on the processor itself.
+static VOID
+TimerProcessorProgram(
+    IN  PXENBUS_TIMER_PROCESSOR Processor
+    )
+{
+    LONGLONG                    Deadline;
+    unsigned int                vcpu_id;
+    NTSTATUS                    status;
+
+    if (Processor->Count == 0)
+        return;
+
+    Deadline = Processor->Heap[0]->Deadline;
+    if (Deadline == Processor->Programmed)
+        return;
+
+    status = SystemVirtualCpuIndex(Processor->Index, &vcpu_id);
+
+    // A deadline in the past will fire immediately
+    if (NT_SUCCESS(status))
+        status = VcpuSetSingleshotTimer(vcpu_id, (ULONGLONG)Deadline);
+
+    if (!NT_SUCCESS(status)) {
+        Processor->Programmed = 0;
+        Processor->Errors++;
+        return;
+    }
+
+    Processor->Programmed = Deadline;
+}
+
+static
+_Function_class_(KDEFERRED_ROUTINE)
+_IRQL_requires_max_(DISPATCH_LEVEL)
+_IRQL_requires_min_(DISPATCH_LEVEL)
+_IRQL_requires_(DISPATCH_LEVEL)
+_IRQL_requires_same_
+VOID
+TimerDpc(
+    IN  PKDPC               Dpc,
+    IN  PVOID               _Context,
+    IN  PVOID               Argument1,
+    IN  PVOID               Argument2
+    )
+{
+    PXENBUS_TIMER_PROCESSOR Processor = _Context;
+
+    UNREFERENCED_PARAMETER(Dpc);
+    UNREFERENCED_PARAMETER(Argument1);
+    UNREFERENCED_PARAMETER(Argument2);
+
+    ASSERT(Processor != NULL);
+
+    KeAcquireSpinLockAtDpcLevel(&Processor->Lock);
+
+    // The one-shot timer has been consumed (or may have been, if the
+    // VIRQ was raised by the periodic timer) so make sure it is
+    // re-programmed.
+    if (InterlockedExchange(&Processor->Fired, 0) != 0)
+        Processor->Programmed = 0;
+
+    // Nothing can be pending unless the interface is acquired
+    while (Processor->Count != 0) {
+        LONGLONG                Now;
+        PXENBUS_TIMER           Timer;
+        XENBUS_TIMER_FUNCTION   Function;
+        PVOID                   Argument;
+
+        Now = TimerProcessorUpdate(Processor);
+
+        Timer = Processor->Heap[0];
+        if (Timer->Deadline > Now)
+            break;
+
+        TimerHeapRemove(Processor, Timer);
+        Processor->Expiries++;
+
+        Function = Timer->Function;
+        Argument = Timer->Argument;
+
+        KeReleaseSpinLockFromDpcLevel(&Processor->Lock);
+
+        Function(Argument);
+
+        KeAcquireSpinLockAtDpcLevel(&Processor->Lock);
+    }
+
+    TimerProcessorProgram(Processor);
+
+    KeReleaseSpinLockFromDpcLevel(&Processor->Lock);
+}
+
+// Called by the FDO from the VIRQ_TIMER callback (or when the VIRQ is
+// bound) so this runs at HIGH_LEVEL.
+VOID
+TimerInterrupt(
+    IN  PXENBUS_TIMER_CONTEXT   Context,
+    IN  ULONG                   Cpu
+    )
+{
+    PXENBUS_TIMER_PROCESSOR     Processor;
+
+    if (Cpu >= Context->ProcessorCount)
+        return;
+
+    Processor = &Context->Processor[Cpu];
+
+    Processor->Interrupts++;
+    (VOID) InterlockedExchange(&Processor->Fired, 1);
+
+    (VOID) KeInsertQueueDpc(&Processor->Dpc, NULL, NULL);
+}
+
+static NTSTATUS
+TimerCreate(
+    IN  PINTERFACE              Interface,
+    IN  ULONG                   Cpu,
+    IN  XENBUS_TIMER_FUNCTION   Function,
+    IN  PVOID                   Argument,
+    OUT PXENBUS_TIMER           *Timer
+    )
+{
+    PXENBUS_TIMER_CONTEXT       Context = Interface->Context;
+    PXENBUS_TIMER_PROCESSOR     Processor;
+    PXENBUS_TIMER               *Heap;
+    ULONG                       Size;
+    KIRQL                       Irql;
+    NTSTATUS                    status;
+
+    status = STATUS_INVALID_PARAMETER;
+    if (Cpu >= Context->ProcessorCount)
+        goto fail1;
+
+    *Timer = __TimerAllocate(sizeof (XENBUS_TIMER));
+
+    status = STATUS_NO_MEMORY;
+    if (*Timer == NULL)
+        goto fail2;
+
+    (*Timer)->Magic = XENBUS_TIMER_MAGIC;
+    (*Timer)->Cpu = Cpu;
+    (*Timer)->Function = Function;
+    (*Timer)->Argument = Argument;
+    (*Timer)->Index = XENBUS_TIMER_INDEX_INVALID;
+
+    Processor = &Context->Processor[Cpu];
+
+    // Make sure there is a heap slot for every timer so that arming a
+    // timer never needs to allocate.
+    KeAcquireSpinLock(&Processor->Lock, &Irql);
+
+    while (Processor->Timers == Processor->Size) {
+        PXENBUS_TIMER   *Old;
+
+        Size = __max(Processor->Size * 2, XENBUS_TIMER_MINIMUM_HEAP_SIZE);
+
+        KeReleaseSpinLock(&Processor->Lock, Irql);
+
+        Heap = __TimerAllocate(sizeof (PXENBUS_TIMER) * Size);
+
+        status = STATUS_NO_MEMORY;
+        if (Heap == NULL)
+            goto fail3;
+
+        KeAcquireSpinLock(&Processor->Lock, &Irql);
+
+        if (Processor->Size >= Size) {
+            Old = Heap;
+        } else {
+            if (Processor->Count != 0)
+                RtlCopyMemory(Heap,
+                              Processor->Heap,
+                              sizeof (PXENBUS_TIMER) * Processor->Count);
+
+            Old = Processor->Heap;
+
+            Processor->Heap = Heap;
+            Processor->Size = Size;
+        }
+
+        if (Old != NULL) {
+            KeReleaseSpinLock(&Processor->Lock, Irql);
+            __TimerFree(Old);
+            KeAcquireSpinLock(&Processor->Lock, &Irql);
+        }
+    }
+
+    Processor->Timers++;
+
+    KeReleaseSpinLock(&Processor->Lock, Irql);
+
+    return STATUS_SUCCESS;
+
+fail3:
+    Error("fail3\n");
+
+    (*Timer)->Index = 0;
+    (*Timer)->Argument = NULL;
+    (*Timer)->Function = NULL;
+    (*Timer)->Cpu = 0;
+    (*Timer)->Magic = 0;
+
+    ASSERT(IsZeroMemory(*Timer, sizeof (XENBUS_TIMER)));
+    __TimerFree(*Timer);
+
+fail2:
+    Error("fail2\n");
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static BOOLEAN
+TimerSet(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_TIMER           Timer,
+    IN  ULONGLONG               Delay
+    )
+{
+    PXENBUS_TIMER_CONTEXT       Context = Interface->Context;
+    PXENBUS_TIMER_PROCESSOR     Processor;
+    LONGLONG                    Now;
+    BOOLEAN                     Pending;
+    BOOLEAN                     Kick;
+    KIRQL                       Irql;
+
+    ASSERT3U(Timer->Magic, ==, XENBUS_TIMER_MAGIC);
+
+    Processor = &Context->Processor[Timer->Cpu];
+
+    KeAcquireSpinLock(&Processor->Lock, &Irql);
+
+    Now = TimerProcessorUpdate(Processor);
+
+    Pending = (Timer->Index != XENBUS_TIMER_INDEX_INVALID) ? TRUE : FALSE;
+    if (Pending)
+        TimerHeapRemove(Processor, Timer);
+
+    if (Delay > (ULONGLONG)(MAXLONGLONG - Now))
+        Delay = (ULONGLONG)(MAXLONGLONG - Now);
+
+    Timer->Deadline = Now + (LONGLONG)Delay;
+    TimerHeapInsert(Processor, Timer);
+
+    // Only the processor itself can program its one-shot timer so, if
+    // this is now the earliest deadline, get its DPC to do it.
+    Kick = (Timer->Index == 0 &&
+            (Processor->Programmed == 0 ||
+             Timer->Deadline < Processor->Programmed)) ? TRUE : FALSE;
+
+    KeReleaseSpinLock(&Processor->Lock, Irql);
+
+    if (Kick)
+        (VOID) KeInsertQueueDpc(&Processor->Dpc, NULL, NULL);
+
+    return Pending;
+}
+
+static BOOLEAN
+TimerCancel(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_TIMER           Timer
+    )
+{
+    PXENBUS_TIMER_CONTEXT       Context = Interface->Context;
+    PXENBUS_TIMER_PROCESSOR     Processor;
+    BOOLEAN                     Pending;
+    KIRQL                       Irql;
+
+    ASSERT3U(Timer->Magic, ==, XENBUS_TIMER_MAGIC);
+
+    Processor = &Context->Processor[Timer->Cpu];
+
+    KeAcquireSpinLock(&Processor->Lock, &Irql);
+
+    // If this leaves an earlier one-shot programmed then it will just
+    // result in a spurious DPC.
+    Pending = (Timer->Index != XENBUS_TIMER_INDEX_INVALID) ? TRUE : FALSE;
+    if (Pending)
+        TimerHeapRemove(Processor, Timer);
+
+    KeReleaseSpinLock(&Processor->Lock, Irql);
+
+    return Pending;
+}
+
+static VOID
+TimerDestroy(
+    IN  PINTERFACE              Interface,
+    IN  PXENBUS_TIMER           Timer
+    )
+{
+    PXENBUS_TIMER_CONTEXT       Context = Interface->Context;
+    PXENBUS_TIMER_PROCESSOR     Processor;
+    KIRQL                       Irql;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+    ASSERT3U(Timer->Magic, ==, XENBUS_TIMER_MAGIC);
+
+    // A callback in progress may re-arm the timer so keep going until
+    // it is neither pending nor running.
+    do {
+        (VOID) TimerCancel(Interface, Timer);
+        KeFlushQueuedDpcs();
+
+        KeMemoryBarrier();
+    } while (Timer->Index != XENBUS_TIMER_INDEX_INVALID);
+
+    Processor = &Context->Processor[Timer->Cpu];
+
+    KeAcquireSpinLock(&Processor->Lock, &Irql);
+    ASSERT(Processor->Timers != 0);
+    --Processor->Timers;
+    KeReleaseSpinLock(&Processor->Lock, Irql);
+
+    Timer->Index = 0;
+    Timer->Deadline = 0;
+    Timer->Argument = NULL;
+    Timer->Function = NULL;
+    Timer->Cpu = 0;
+    Timer->Magic = 0;
+
+    ASSERT(IsZeroMemory(Timer, sizeof (XENBUS_TIMER)));
+    __TimerFree(Timer);
+}
+
+// Interrupts are disabled on every vCPU from before the suspend hypercall
+// until after the early callbacks have run, so the interrupt time has not
+// moved since the suspend. Recording it here tells us how long before the
+// suspend each CPU's heap was last looked at.
+static VOID
+TimerSuspendCallbackEarly(
+    IN  PVOID               Argument
+    )
+{
+    PXENBUS_TIMER_CONTEXT   Context = Argument;
+
+    Context->SuspendInterruptTime = KeQueryInterruptTime();
+}
+
+// The system time cannot be trusted until the SHARED_INFO late callback
+// has re-registered the vcpu_info, which it does before this runs. The
+// VM is still single-threaded, so no processor lock can be held.
+static VOID
+TimerSuspendCallbackLate(
+    IN  PVOID               Argument
+    )
+{
+    PXENBUS_TIMER_CONTEXT   Context = Argument;
+    LONGLONG                Now;
+    ULONG                   Cpu;
+
+    Now = XENBUS_SHARED_INFO(GetSystemTime, &Context->SharedInfoInterface);
+
+    for (Cpu = 0; Cpu < Context->ProcessorCount; Cpu++) {
+        PXENBUS_TIMER_PROCESSOR Processor = &Context->Processor[Cpu];
+        LONGLONG                Then;
+        LONGLONG                Delta;
+        ULONG                   Index;
+
+        // Anything programmed before the suspend is gone
+        Processor->Programmed = 0;
+
+        if (Processor->Count == 0)
+            continue;
+
+        // System time (in the old domain) at the point of suspend
+        Then = Processor->Now +
+               (LONGLONG)(Context->SuspendInterruptTime -
+                          Processor->InterruptTime) * 100;
+        Delta = Now - Then;
+
+        // A uniform shift keeps the heap ordered
+        for (Index = 0; Index < Processor->Count; Index++)
+            Processor->Heap[Index]->Deadline += Delta;
+
+        Processor->Now = Now;
+        Processor->InterruptTime = Context->SuspendInterruptTime;
+
+        (VOID) KeInsertQueueDpc(&Processor->Dpc, NULL, NULL);
+    }
+}
+
+static VOID
+TimerDebugCallback(
+    IN  PVOID               Argument,
+    IN  BOOLEAN             Crashing
+    )
+{
+    PXENBUS_TIMER_CONTEXT   Context = Argument;
+    ULONG                   Index;
+
+    UNREFERENCED_PARAMETER(Crashing);
+
+    for (Index = 0; Index < Context->ProcessorCount; Index++) {
+        PXENBUS_TIMER_PROCESSOR Processor = &Context->Processor[Index];
+
+        if (Processor->Timers == 0 && Processor->Interrupts == 0)
+            continue;
+
+        XENBUS_DEBUG(Printf,
+                     &Context->DebugInterface,
+                     "CPU %u: Timers = %lu Pending = %lu Interrupts = %lu Expiries = %lu Errors = %lu Programmed = %lld\n",
+                     Index,
+                     Processor->Timers,
+                     Processor->Count,
+                     Processor->Interrupts,
+                     Processor->Expiries,
+                     Processor->Errors,
+                     Processor->Programmed);
+    }
+}
+
+static NTSTATUS
+TimerAcquire(
+    IN  PINTERFACE          Interface
+    )
+{
+    PXENBUS_TIMER_CONTEXT   Context = Interface->Context;
+    KIRQL                   Irql;
+    NTSTATUS                status;
+
+    KeAcquireSpinLock(&Context->Lock, &Irql);
+
+    if (Context->References++ != 0)
+        goto done;
+
+    Trace("====>\n");
+
+    status = XENBUS_SHARED_INFO(Acquire, &Context->SharedInfoInterface);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    status = XENBUS_SUSPEND(Acquire, &Context->SuspendInterface);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    status = XENBUS_SUSPEND(Register,
+                            &Context->SuspendInterface,
+                            SUSPEND_CALLBACK_EARLY,
+                            TimerSuspendCallbackEarly,
+                            Context,
+                            &Context->SuspendCallbackEarly);
+    if (!NT_SUCCESS(status))
+        goto fail3;
+
+    status = XENBUS_SUSPEND(Register,
+                            &Context->SuspendInterface,
+                            SUSPEND_CALLBACK_LATE,
+                            TimerSuspendCallbackLate,
+                            Context,
+                            &Context->SuspendCallbackLate);
+    if (!NT_SUCCESS(status))
+        goto fail4;
+
+    status = XENBUS_DEBUG(Acquire, &Context->DebugInterface);
+    if (!NT_SUCCESS(status))
+        goto fail5;
+
+    status = XENBUS_DEBUG(Register,
+                          &Context->DebugInterface,
+                          __MODULE__ "|TIMER",
+                          TimerDebugCallback,
+                          Context,
+                          &Context->DebugCallback);
+    if (!NT_SUCCESS(status))
+        goto fail6;
+
+    Trace("<====\n");
+
+done:
+    KeReleaseSpinLock(&Context->Lock, Irql);
+
+    return STATUS_SUCCESS;
+
+fail6:
+    Error("fail6\n");
+
+    XENBUS_DEBUG(Release, &Context->DebugInterface);
+
+fail5:
+    Error("fail5\n");
+
+    XENBUS_SUSPEND(Deregister,
+                   &Context->SuspendInterface,
+                   Context->SuspendCallbackLate);
+    Context->SuspendCallbackLate = NULL;
+
+fail4:
+    Error("fail4\n");
+
+    XENBUS_SUSPEND(Deregister,
+                   &Context->SuspendInterface,
+                   Context->SuspendCallbackEarly);
+    Context->SuspendCallbackEarly = NULL;
+
+fail3:
+    Error("fail3\n");
+
+    XENBUS_SUSPEND(Release, &Context->SuspendInterface);
+
+fail2:
+    Error("fail2\n");
+
+    XENBUS_SHARED_INFO(Release, &Context->SharedInfoInterface);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    --Context->References;
+    ASSERT3U(Context->References, ==, 0);
+    KeReleaseSpinLock(&Context->Lock, Irql);
+
+    return status;
+}
+
+static VOID
+TimerRelease(
+    IN  PINTERFACE          Interface
+    )
+{
+    PXENBUS_TIMER_CONTEXT   Context = Interface->Context;
+    KIRQL                   Irql;
+    ULONG                   Index;
+
+    KeAcquireSpinLock(&Context->Lock, &Irql);
+
+    if (--Context->References > 0)
+        goto done;
+
+    Trace("====>\n");
+
+    for (Index = 0; Index < Context->ProcessorCount; Index++) {
+        if (Context->Processor[Index].Timers != 0)
+            BUG("OUTSTANDING TIMERS");
+    }
+
+    XENBUS_DEBUG(Deregister,
+                 &Context->DebugInterface,
+                 Context->DebugCallback);
+    Context->DebugCallback = NULL;
+
+    XENBUS_DEBUG(Release, &Context->DebugInterface);
+
+    XENBUS_SUSPEND(Deregister,
+                   &Context->SuspendInterface,
+                   Context->SuspendCallbackLate);
+    Context->SuspendCallbackLate = NULL;
+
+    XENBUS_SUSPEND(Deregister,
+                   &Context->SuspendInterface,
+                   Context->SuspendCallbackEarly);
+    Context->SuspendCallbackEarly = NULL;
+
+    Context->SuspendInterruptTime = 0;
+
+    XENBUS_SUSPEND(Release, &Context->SuspendInterface);
+
+    XENBUS_SHARED_INFO(Release, &Context->SharedInfoInterface);
+
+    Trace("<====\n");
+
+done:
+    KeReleaseSpinLock(&Context->Lock, Irql);
+}
+
+static struct _XENBUS_TIMER_INTERFACE_V1 TimerInterfaceVersion1 = {
+    { sizeof (struct _XENBUS_TIMER_INTERFACE_V1), 1, NULL, NULL, NULL },
+    TimerAcquire,
+    TimerRelease,
+    TimerCreate,
+    TimerSet,
+    TimerCancel,
+    TimerDestroy
+};
+
+NTSTATUS
+TimerInitialize(
+    IN  PXENBUS_FDO             Fdo,
+    OUT PXENBUS_TIMER_CONTEXT   *Context
+    )
+{
+    ULONG                       Index;
+    NTSTATUS                    status;
+
+    Trace("====>\n");
+
+    *Context = __TimerAllocate(sizeof (XENBUS_TIMER_CONTEXT));
+
+    status = STATUS_NO_MEMORY;
+    if (*Context == NULL)
+        goto fail1;
+
+    (*Context)->ProcessorCount = KeQueryActiveProcessorCountEx(ALL_PROCESSOR_GROUPS);
+    (*Context)->Processor = __TimerAllocate(sizeof (XENBUS_TIMER_PROCESSOR) *
+                                            (*Context)->ProcessorCount);
+
+    status = STATUS_NO_MEMORY;
+    if ((*Context)->Processor == NULL)
+        goto fail2;
+
+    for (Index = 0; Index < (*Context)->ProcessorCount; Index++) {
+        PXENBUS_TIMER_PROCESSOR Processor = &(*Context)->Processor[Index];
+        PROCESSOR_NUMBER        ProcNumber;
+
+        status = KeGetProcessorNumberFromIndex(Index, &ProcNumber);
+        ASSERT(NT_SUCCESS(status));
+
+        Processor->Context = *Context;
+        Processor->Index = Index;
+
+        KeInitializeSpinLock(&Processor->Lock);
+
+        KeInitializeDpc(&Processor->Dpc, TimerDpc, Processor);
+        KeSetImportanceDpc(&Processor->Dpc, HighImportance);
+
+        status = KeSetTargetProcessorDpcEx(&Processor->Dpc, &ProcNumber);
+        ASSERT(NT_SUCCESS(status));
+    }
+
+    status = SharedInfoGetInterface(FdoGetSharedInfoContext(Fdo),
+                                    XENBUS_SHARED_INFO_INTERFACE_VERSION_MAX,
+                                    (PINTERFACE)&(*Context)->SharedInfoInterface,
+                                    sizeof ((*Context)->SharedInfoInterface));
+    ASSERT(NT_SUCCESS(status));
+    ASSERT((*Context)->SharedInfoInterface.Interface.Context != NULL);
+
+    status = SuspendGetInterface(FdoGetSuspendContext(Fdo),
+                                 XENBUS_SUSPEND_INTERFACE_VERSION_MAX,
+                                 (PINTERFACE)&(*Context)->SuspendInterface,
+                                 sizeof ((*Context)->SuspendInterface));
+    ASSERT(NT_SUCCESS(status));
+    ASSERT((*Context)->SuspendInterface.Interface.Context != NULL);
+
+    status = DebugGetInterface(FdoGetDebugContext(Fdo),
+                               XENBUS_DEBUG_INTERFACE_VERSION_MAX,
+                               (PINTERFACE)&(*Context)->DebugInterface,
+                               sizeof ((*Context)->DebugInterface));
+    ASSERT(NT_SUCCESS(status));
+    ASSERT((*Context)->DebugInterface.Interface.Context != NULL);
+
+    KeInitializeSpinLock(&(*Context)->Lock);
+
+    (*Context)->Fdo = Fdo;
+
+    Trace("<====\n");
+
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+    (*Context)->ProcessorCount = 0;
+
+    ASSERT(IsZeroMemory(*Context, sizeof (XENBUS_TIMER_CONTEXT)));
+    __TimerFree(*Context);
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+NTSTATUS
+TimerGetInterface(
+    IN      PXENBUS_TIMER_CONTEXT   Context,
+    IN      ULONG                   Version,
+    IN OUT  PINTERFACE              Interface,
+    IN      ULONG                   Size
+    )
+{
+    NTSTATUS                        status;
+
+    ASSERT(Context != NULL);
+
+    switch (Version) {
+    case 1: {
+        struct _XENBUS_TIMER_INTERFACE_V1   *TimerInterface;
+
+        TimerInterface = (struct _XENBUS_TIMER_INTERFACE_V1 *)Interface;
+
+        status = STATUS_BUFFER_OVERFLOW;
+        if (Size < sizeof (struct _XENBUS_TIMER_INTERFACE_V1))
+            break;
+
+        *TimerInterface = TimerInterfaceVersion1;
+
+        ASSERT3U(Interface->Version, ==, Version);
+        Interface->Context = Context;
+
+        status = STATUS_SUCCESS;
+        break;
+    }
+    default:
+        status = STATUS_NOT_SUPPORTED;
+        break;
+    }
+
+    return status;
+}
+
+ULONG
+TimerGetReferences(
+    IN  PXENBUS_TIMER_CONTEXT   Context
+    )
+{
+    return Context->References;
+}
+
+VOID
+TimerTeardown(
+    IN  PXENBUS_TIMER_CONTEXT   Context
+    )
+{
+    ULONG                       Index;
+
+    Trace("====>\n");
+
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+    KeFlushQueuedDpcs();
+
+    Context->Fdo = NULL;
+
+    RtlZeroMemory(&Context->Lock, sizeof (KSPIN_LOCK));
+
+    RtlZeroMemory(&Context->DebugInterface,
+                  sizeof (XENBUS_DEBUG_INTERFACE));
+
+    RtlZeroMemory(&Context->SuspendInterface,
+                  sizeof (XENBUS_SUSPEND_INTERFACE));
+
+    RtlZeroMemory(&Context->SharedInfoInterface,
+                  sizeof (XENBUS_SHARED_INFO_INTERFACE));
+
+    for (Index = 0; Index < Context->ProcessorCount; Index++) {
+        PXENBUS_TIMER_PROCESSOR Processor = &Context->Processor[Index];
+
+        ASSERT3U(Processor->Timers, ==, 0);
+        ASSERT3U(Processor->Count, ==, 0);
+
+        if (Processor->Heap != NULL) {
+            __TimerFree(Processor->Heap);
+            Processor->Heap = NULL;
+        }
+    }
+
+    __TimerFree(Context->Processor);
+    Context->Processor = NULL;
+    Context->ProcessorCount = 0;
+
+    ASSERT(IsZeroMemory(Context, sizeof (XENBUS_TIMER_CONTEXT)));
+    __TimerFree(Context);
+
+    Trace("<====\n");
+}
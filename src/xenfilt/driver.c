@@ -57,6 +57,9 @@ typedef struct _XENFILT_DRIVER {
 
     PXENFILT_EMULATED_CONTEXT   EmulatedContext;
     XENFILT_EMULATED_INTERFACE  EmulatedInterface;
+
+    LIST_ENTRY                  EmulatedIdList;
+    LARGE_INTEGER               EmulatedIdTime;
 } XENFILT_DRIVER, *PXENFILT_DRIVER;
 
 static XENFILT_DRIVER   Driver;
@@ -402,6 +405,210 @@ DriverGetFilterState(
     return State;
 }
 
+static FORCEINLINE XENFILT_EMULATED_OBJECT_TYPE
+__DriverParseEmulatedType(
+    IN  PANSI_STRING    Ansi
+    )
+{
+    if (_strnicmp(Ansi->Buffer, "PCI", Ansi->Length) == 0)
+        return XENFILT_EMULATED_OBJECT_TYPE_PCI;
+
+    if (_strnicmp(Ansi->Buffer, "IDE", Ansi->Length) == 0)
+        return XENFILT_EMULATED_OBJECT_TYPE_IDE;
+
+    return XENFILT_EMULATED_OBJECT_TYPE_UNKNOWN;
+}
+
+//
+// The mapping of hardware/compatible ID to emulated type in the
+// Parameters key is cached so that AddDevice does not have to go to the
+// registry for every ID string. The cache is rebuilt whenever the last
+// write time of the key changes.
+//
+typedef struct _XENFILT_DRIVER_EMULATED_ID {
+    LIST_ENTRY                      ListEntry;
+    XENFILT_EMULATED_OBJECT_TYPE    Type;
+    CHAR                            Id[1];
+} XENFILT_DRIVER_EMULATED_ID, *PXENFILT_DRIVER_EMULATED_ID;
+
+static NTSTATUS
+DriverEmulatedIdAdd(
+    IN  PVOID                       Context,
+    IN  HANDLE                      Key,
+    IN  PANSI_STRING                Name,
+    IN  ULONG                       Type
+    )
+{
+    PLIST_ENTRY                     List = Context;
+    PANSI_STRING                    Ansi;
+    XENFILT_EMULATED_OBJECT_TYPE    EmulatedType;
+    PXENFILT_DRIVER_EMULATED_ID     EmulatedId;
+    ULONG                           Length;
+    NTSTATUS                        status;
+
+    if (Type != REG_SZ)
+        goto done;
+
+    status = RegistryQuerySzValue(Key,
+                                  Name->Buffer,
+                                  NULL,
+                                  &Ansi);
+    if (!NT_SUCCESS(status))
+        goto done;
+
+    EmulatedType = __DriverParseEmulatedType(&Ansi[0]);
+    if (EmulatedType == XENFILT_EMULATED_OBJECT_TYPE_UNKNOWN)
+        goto ignore;
+
+    Length = Name->Length + sizeof (CHAR);
+    EmulatedId = __DriverAllocate(FIELD_OFFSET(XENFILT_DRIVER_EMULATED_ID,
+                                               Id) +
+                                  Length);
+
+    status = STATUS_NO_MEMORY;
+    if (EmulatedId == NULL)
+        goto fail1;
+
+    EmulatedId->Type = EmulatedType;
+
+    status = RtlStringCbPrintfA(EmulatedId->Id,
+                                Length,
+                                "%Z",
+                                Name);
+    ASSERT(NT_SUCCESS(status));
+
+    InsertTailList(List, &EmulatedId->ListEntry);
+
+    Trace("%s -> %Z\n", EmulatedId->Id, Ansi);
+
+ignore:
+    RegistryFreeSzValue(Ansi);
+
+done:
+    return STATUS_SUCCESS;
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    RegistryFreeSzValue(Ansi);
+
+    return status;
+}
+
+static VOID
+DriverEmulatedIdFlush(
+    VOID
+    )
+{
+    while (!IsListEmpty(&Driver.EmulatedIdList)) {
+        PLIST_ENTRY                 ListEntry;
+        PXENFILT_DRIVER_EMULATED_ID EmulatedId;
+
+        ListEntry = RemoveHeadList(&Driver.EmulatedIdList);
+        ASSERT3P(ListEntry, !=, &Driver.EmulatedIdList);
+
+        EmulatedId = CONTAINING_RECORD(ListEntry,
+                                       XENFILT_DRIVER_EMULATED_ID,
+                                       ListEntry);
+
+        __DriverFree(EmulatedId);
+    }
+
+    Driver.EmulatedIdTime.QuadPart = 0;
+}
+
+static NTSTATUS
+DriverEmulatedIdRefresh(
+    VOID
+    )
+{
+    HANDLE          ParametersKey;
+    LARGE_INTEGER   Time;
+    NTSTATUS        status;
+
+    ASSERT3U(KeGetCurrentIrql(), ==, PASSIVE_LEVEL);
+
+    ParametersKey = __DriverGetParametersKey();
+
+    status = RegistryQueryKeyLastWriteTime(ParametersKey, &Time);
+    if (!NT_SUCCESS(status))
+        goto fail1;
+
+    if (Time.QuadPart == Driver.EmulatedIdTime.QuadPart)
+        goto done;
+
+    DriverEmulatedIdFlush();
+
+    status = RegistryEnumerateValues(ParametersKey,
+                                     DriverEmulatedIdAdd,
+                                     &Driver.EmulatedIdList);
+    if (!NT_SUCCESS(status))
+        goto fail2;
+
+    Driver.EmulatedIdTime = Time;
+
+    Info("refreshed\n");
+
+done:
+    return STATUS_SUCCESS;
+
+fail2:
+    Error("fail2\n");
+
+    DriverEmulatedIdFlush();
+
+fail1:
+    Error("fail1 (%08x)\n", status);
+
+    return status;
+}
+
+static XENFILT_EMULATED_OBJECT_TYPE
+DriverLookupEmulatedType(
+    IN  PCHAR                       Id
+    )
+{
+    PLIST_ENTRY                     ListEntry;
+
+    for (ListEntry = Driver.EmulatedIdList.Flink;
+         ListEntry != &Driver.EmulatedIdList;
+         ListEntry = ListEntry->Flink) {
+        PXENFILT_DRIVER_EMULATED_ID EmulatedId;
+
+        EmulatedId = CONTAINING_RECORD(ListEntry,
+                                       XENFILT_DRIVER_EMULATED_ID,
+                                       ListEntry);
+
+        if (_stricmp(Id, EmulatedId->Id) == 0)
+            return EmulatedId->Type;
+    }
+
+    return XENFILT_EMULATED_OBJECT_TYPE_UNKNOWN;
+}
+
+static XENFILT_EMULATED_OBJECT_TYPE
+DriverQueryEmulatedType(
+    IN  PCHAR                       Id
+    )
+{
+    PANSI_STRING                    Ansi;
+    XENFILT_EMULATED_OBJECT_TYPE    Type;
+    NTSTATUS                        status;
+
+    status = RegistryQuerySzValue(__DriverGetParametersKey(),
+                                  Id,
+                                  NULL,
+                                  &Ansi);
+    if (!NT_SUCCESS(status))
+        return XENFILT_EMULATED_OBJECT_TYPE_UNKNOWN;
+
+    Type = __DriverParseEmulatedType(&Ansi[0]);
+
+    RegistryFreeSzValue(Ansi);
+
+    return Type;
+}
+
 DRIVER_UNLOAD   DriverUnload;
 
 VOID
@@ -419,6 +626,9 @@ DriverUnload(
     ASSERT3U(Driver.References, ==, 1);
     --Driver.References;
 
+    DriverEmulatedIdFlush();
+    RtlZeroMemory(&Driver.EmulatedIdList, sizeof (LIST_ENTRY));
+
     RtlZeroMemory(&Driver.List, sizeof (LIST_ENTRY));
     RtlZeroMemory(&Driver.Mutex, sizeof (MUTEX));
 
@@ -729,44 +939,41 @@ DriverGetEmulatedType(
     IN  PCHAR                       Id
     )
 {
-    HANDLE                          ParametersKey;
     XENFILT_EMULATED_OBJECT_TYPE    Type;
+    BOOLEAN                         Cached;
     ULONG                           Index;
+    NTSTATUS                        status;
 
-    ParametersKey = __DriverGetParametersKey();
+    __DriverAcquireMutex();
+
+    status = DriverEmulatedIdRefresh();
+    Cached = NT_SUCCESS(status) ? TRUE : FALSE;
 
     Type = XENFILT_EMULATED_OBJECT_TYPE_UNKNOWN;
     Index = 0;
 
     do {
-        ULONG           Length;
-        PANSI_STRING    Ansi;
-        NTSTATUS        status;
+        ULONG   Length;
 
         Length = (ULONG)strlen(&Id[Index]);
         if (Length == 0)
             break;
 
-        status = RegistryQuerySzValue(ParametersKey,
-                                      &Id[Index],
-                                      NULL,
-                                      &Ansi);
-        if (NT_SUCCESS(status)) {
-            Info("MATCH: %s -> %Z\n", &Id[Index], Ansi);
-
-            if (_strnicmp(Ansi->Buffer, "PCI", Ansi->Length) == 0)
-                Type = XENFILT_EMULATED_OBJECT_TYPE_PCI;
-            else if (_strnicmp(Ansi->Buffer, "IDE", Ansi->Length) == 0)
-                Type = XENFILT_EMULATED_OBJECT_TYPE_IDE;
+        Type = (Cached) ?
+               DriverLookupEmulatedType(&Id[Index]) :
+               DriverQueryEmulatedType(&Id[Index]);
 
-            RegistryFreeSzValue(Ansi);
-        } else {
+        if (Type != XENFILT_EMULATED_OBJECT_TYPE_UNKNOWN)
+            Info("MATCH: %s -> %s\n", &Id[Index],
+                 (Type == XENFILT_EMULATED_OBJECT_TYPE_PCI) ? "PCI" : "IDE");
+        else
             Trace("NO MATCH: %s\n", &Id[Index]);
-        }
 
         Index += Length + 1;
     } while (Type == XENFILT_EMULATED_OBJECT_TYPE_UNKNOWN);
 
+    __DriverReleaseMutex();
+
     return Type;
 }
 
@@ -944,6 +1151,7 @@ DriverEntry(
 
     InitializeMutex(&Driver.Mutex);
     InitializeListHead(&Driver.List);
+    InitializeListHead(&Driver.EmulatedIdList);
     Driver.References = 1;
 
 done:
@@ -59,14 +59,27 @@ typedef union _XENFILT_EMULATED_OBJECT_DATA {
 
 struct _XENFILT_EMULATED_OBJECT {
     LIST_ENTRY                      ListEntry;
+    LIST_ENTRY                      BucketListEntry;
+    ULONG                           Hash;
     XENFILT_EMULATED_OBJECT_TYPE    Type;
     XENFILT_EMULATED_OBJECT_DATA    Data;
 };
 
+//
+// PCI objects are hashed on DeviceID alone, so that a lookup without an
+// InstanceID only has to walk a single bucket. IDE objects can only have
+// an index of (Controller << 1 | Target) with both values <= 1, so a
+// simple count per index is sufficient.
+//
+#define XENFILT_EMULATED_DEVICE_BUCKETS 64
+#define XENFILT_EMULATED_DISK_INDICES   4
+
 struct _XENFILT_EMULATED_CONTEXT {
     KSPIN_LOCK          Lock;
     LONG                References;
     LIST_ENTRY          List;
+    LIST_ENTRY          DeviceBucket[XENFILT_EMULATED_DEVICE_BUCKETS];
+    ULONG               DiskCount[XENFILT_EMULATED_DISK_INDICES];
 };
 
 #define XENFILT_EMULATED_TAG    'LUME'
@@ -87,6 +100,37 @@ __EmulatedFree(
     __FreePoolWithTag(Buffer, XENFILT_EMULATED_TAG);
 }
 
+static FORCEINLINE ULONG
+__EmulatedHash(
+    IN  PCHAR   DeviceID
+    )
+{
+    ULONG       Hash;
+    PCHAR       Cursor;
+
+    //
+    // FNV-1a over the upper-cased string, to match the case-insensitive
+    // comparison used for lookup.
+    //
+    Hash = 2166136261u;
+
+    for (Cursor = DeviceID; *Cursor != '\0'; Cursor++) {
+        Hash ^= (UCHAR)__toupper(*Cursor);
+        Hash *= 16777619u;
+    }
+
+    return Hash;
+}
+
+static FORCEINLINE PLIST_ENTRY
+__EmulatedDeviceBucket(
+    IN  PXENFILT_EMULATED_CONTEXT   Context,
+    IN  ULONG                       Hash
+    )
+{
+    return &Context->DeviceBucket[Hash % XENFILT_EMULATED_DEVICE_BUCKETS];
+}
+
 static NTSTATUS
 EmulatedSetObjectDeviceData(
     IN  PXENFILT_EMULATED_OBJECT        EmulatedObject,
@@ -113,6 +157,8 @@ EmulatedSetObjectDeviceData(
                                 InstanceID);
     ASSERT(NT_SUCCESS(status));
 
+    EmulatedObject->Hash = __EmulatedHash(EmulatedObject->Data.Device.DeviceID);
+
     return STATUS_SUCCESS;
 
 fail1:
@@ -168,6 +214,7 @@ EmulatedSetObjectDiskData(
         goto fail5;
 
     EmulatedObject->Data.Disk.Index = Controller << 1 | Target;
+    ASSERT3U(EmulatedObject->Data.Disk.Index, <, XENFILT_EMULATED_DISK_INDICES);
 
     return STATUS_SUCCESS;
 
@@ -235,7 +282,25 @@ EmulatedAddObject(
     (*EmulatedObject)->Type = Type;
 
     KeAcquireSpinLock(&Context->Lock, &Irql);
+
     InsertTailList(&Context->List, &(*EmulatedObject)->ListEntry);
+
+    switch (Type) {
+    case XENFILT_EMULATED_OBJECT_TYPE_PCI:
+        InsertTailList(__EmulatedDeviceBucket(Context,
+                                              (*EmulatedObject)->Hash),
+                       &(*EmulatedObject)->BucketListEntry);
+        break;
+
+    case XENFILT_EMULATED_OBJECT_TYPE_IDE:
+        Context->DiskCount[(*EmulatedObject)->Data.Disk.Index]++;
+        break;
+
+    default:
+        ASSERT(FALSE);
+        break;
+    }
+
     KeReleaseSpinLock(&Context->Lock, Irql);
 
     Trace("<====\n");
@@ -262,7 +327,24 @@ EmulatedRemoveObject(
     KIRQL                           Irql;
 
     KeAcquireSpinLock(&Context->Lock, &Irql);
+
+    switch (EmulatedObject->Type) {
+    case XENFILT_EMULATED_OBJECT_TYPE_PCI:
+        RemoveEntryList(&EmulatedObject->BucketListEntry);
+        break;
+
+    case XENFILT_EMULATED_OBJECT_TYPE_IDE:
+        ASSERT(Context->DiskCount[EmulatedObject->Data.Disk.Index] != 0);
+        --Context->DiskCount[EmulatedObject->Data.Disk.Index];
+        break;
+
+    default:
+        ASSERT(FALSE);
+        break;
+    }
+
     RemoveEntryList(&EmulatedObject->ListEntry);
+
     KeReleaseSpinLock(&Context->Lock, Irql);
 
     __EmulatedFree(EmulatedObject);
@@ -276,6 +358,8 @@ EmulatedIsDevicePresent(
     )
 {
     PXENFILT_EMULATED_CONTEXT   Context = Interface->Context;
+    ULONG                       Hash;
+    PLIST_ENTRY                 Bucket;
     KIRQL                       Irql;
     PLIST_ENTRY                 ListEntry;
 
@@ -283,17 +367,22 @@ EmulatedIsDevicePresent(
           DeviceID,
           (InstanceID != NULL) ? InstanceID : "ANY");
 
+    Hash = __EmulatedHash(DeviceID);
+    Bucket = __EmulatedDeviceBucket(Context, Hash);
+
     KeAcquireSpinLock(&Context->Lock, &Irql);
 
-    ListEntry = Context->List.Flink;
-    while (ListEntry != &Context->List) {
+    ListEntry = Bucket->Flink;
+    while (ListEntry != Bucket) {
         PXENFILT_EMULATED_OBJECT    EmulatedObject;
 
         EmulatedObject = CONTAINING_RECORD(ListEntry,
                                            XENFILT_EMULATED_OBJECT,
-                                           ListEntry);
+                                           BucketListEntry);
 
-        if (EmulatedObject->Type == XENFILT_EMULATED_OBJECT_TYPE_PCI &&
+        ASSERT3U(EmulatedObject->Type, ==, XENFILT_EMULATED_OBJECT_TYPE_PCI);
+
+        if (EmulatedObject->Hash == Hash &&
             _stricmp(DeviceID, EmulatedObject->Data.Device.DeviceID) == 0 &&
             (InstanceID == NULL ||
              _stricmp(InstanceID, EmulatedObject->Data.Device.InstanceID) == 0)) {
@@ -308,7 +397,7 @@ EmulatedIsDevicePresent(
 
     Trace("<====\n");
 
-    return (ListEntry != &Context->List) ? TRUE : FALSE;
+    return (ListEntry != Bucket) ? TRUE : FALSE;
 }
 
 static BOOLEAN
@@ -319,34 +408,24 @@ EmulatedIsDiskPresent(
 {
     PXENFILT_EMULATED_CONTEXT   Context = Interface->Context;
     KIRQL                       Irql;
-    PLIST_ENTRY                 ListEntry;
+    BOOLEAN                     Present;
 
     Trace("====> (%02X)\n", Index);
 
-    KeAcquireSpinLock(&Context->Lock, &Irql);
+    Present = FALSE;
 
-    ListEntry = Context->List.Flink;
-    while (ListEntry != &Context->List) {
-        PXENFILT_EMULATED_OBJECT    EmulatedObject;
-
-        EmulatedObject = CONTAINING_RECORD(ListEntry,
-                                           XENFILT_EMULATED_OBJECT,
-                                           ListEntry);
-
-        if (EmulatedObject->Type == XENFILT_EMULATED_OBJECT_TYPE_IDE &&
-            Index == EmulatedObject->Data.Disk.Index) {
-            Trace("FOUND\n");
-            break;
-        }
-
-        ListEntry = ListEntry->Flink;
+    if (Index < XENFILT_EMULATED_DISK_INDICES) {
+        KeAcquireSpinLock(&Context->Lock, &Irql);
+        Present = (Context->DiskCount[Index] != 0) ? TRUE : FALSE;
+        KeReleaseSpinLock(&Context->Lock, Irql);
     }
 
-    KeReleaseSpinLock(&Context->Lock, Irql);
+    if (Present)
+        Trace("FOUND\n");
 
     Trace("<====\n");
 
-    return (ListEntry != &Context->List) ? TRUE : FALSE;
+    return Present;
 }
 
 static BOOLEAN
@@ -430,6 +509,7 @@ EmulatedInitialize(
     OUT PXENFILT_EMULATED_CONTEXT   *Context
     )
 {
+    ULONG                           Index;
     NTSTATUS                        status;
 
     Trace("====>\n");
@@ -441,6 +521,10 @@ EmulatedInitialize(
         goto fail1;
 
     InitializeListHead(&(*Context)->List);
+
+    for (Index = 0; Index < XENFILT_EMULATED_DEVICE_BUCKETS; Index++)
+        InitializeListHead(&(*Context)->DeviceBucket[Index]);
+
     KeInitializeSpinLock(&(*Context)->Lock);
 
     Trace("<====\n");
@@ -513,11 +597,18 @@ EmulatedTeardown(
     IN  PXENFILT_EMULATED_CONTEXT   Context
     )
 {
+    ULONG                           Index;
+
     Trace("====>\n");
 
     if (!IsListEmpty(&Context->List))
         BUG("OUTSTANDING OBJECTS");
 
+    for (Index = 0; Index < XENFILT_EMULATED_DEVICE_BUCKETS; Index++) {
+        ASSERT(IsListEmpty(&Context->DeviceBucket[Index]));
+        RtlZeroMemory(&Context->DeviceBucket[Index], sizeof (LIST_ENTRY));
+    }
+
     RtlZeroMemory(&Context->Lock, sizeof (KSPIN_LOCK));
     RtlZeroMemory(&Context->List, sizeof (LIST_ENTRY));
 
@@ -398,6 +398,144 @@ FdoHasEnumerated(
     return Fdo->Enumerated;
 }
 
+typedef struct _XENFILT_FDO_RELATION {
+    PDEVICE_OBJECT  PhysicalDeviceObject;
+    ULONG           Index;
+    BOOLEAN         Claimed;
+} XENFILT_FDO_RELATION, *PXENFILT_FDO_RELATION;
+
+static FORCEINLINE LONG
+__FdoCompareRelation(
+    IN  PXENFILT_FDO_RELATION   Relation,
+    IN  PDEVICE_OBJECT          PhysicalDeviceObject
+    )
+{
+    if ((ULONG_PTR)Relation->PhysicalDeviceObject <
+        (ULONG_PTR)PhysicalDeviceObject)
+        return -1;
+
+    if ((ULONG_PTR)Relation->PhysicalDeviceObject >
+        (ULONG_PTR)PhysicalDeviceObject)
+        return 1;
+
+    return 0;
+}
+
+// Entries for the same device object are ordered by their position in
+// the original relations so that, should the bus report a device more
+// than once, they are claimed in the same order as a linear scan would.
+static FORCEINLINE LONG
+__FdoCompareRelations(
+    IN  PXENFILT_FDO_RELATION   First,
+    IN  PXENFILT_FDO_RELATION   Second
+    )
+{
+    LONG                        Result;
+
+    Result = __FdoCompareRelation(First, Second->PhysicalDeviceObject);
+    if (Result != 0)
+        return Result;
+
+    if (First->Index < Second->Index)
+        return -1;
+
+    if (First->Index > Second->Index)
+        return 1;
+
+    return 0;
+}
+
+static VOID
+FdoSiftRelation(
+    IN  PXENFILT_FDO_RELATION   Relation,
+    IN  ULONG                   Root,
+    IN  ULONG                   Count
+    )
+{
+    for (;;) {
+        ULONG                   Child;
+        XENFILT_FDO_RELATION    Temp;
+
+        Child = (Root * 2) + 1;
+        if (Child >= Count)
+            break;
+
+        if (Child + 1 < Count &&
+            __FdoCompareRelations(&Relation[Child],
+                                  &Relation[Child + 1]) < 0)
+            Child++;
+
+        if (__FdoCompareRelations(&Relation[Root],
+                                  &Relation[Child]) >= 0)
+            break;
+
+        Temp = Relation[Root];
+        Relation[Root] = Relation[Child];
+        Relation[Child] = Temp;
+
+        Root = Child;
+    }
+}
+
+static VOID
+FdoSortRelations(
+    IN  PXENFILT_FDO_RELATION   Relation,
+    IN  ULONG                   Count
+    )
+{
+    ULONG                       Index;
+
+    // Heap sort: in-place and O(n log n) without recursion
+    for (Index = Count / 2; Index != 0; --Index)
+        FdoSiftRelation(Relation, Index - 1, Count);
+
+    for (Index = Count; Index > 1; --Index) {
+        XENFILT_FDO_RELATION    Temp;
+
+        Temp = Relation[0];
+        Relation[0] = Relation[Index - 1];
+        Relation[Index - 1] = Temp;
+
+        FdoSiftRelation(Relation, 0, Index - 1);
+    }
+}
+
+// Find the first unclaimed entry for PhysicalDeviceObject
+static PXENFILT_FDO_RELATION
+FdoFindRelation(
+    IN  PXENFILT_FDO_RELATION   Relation,
+    IN  ULONG                   Count,
+    IN  PDEVICE_OBJECT          PhysicalDeviceObject
+    )
+{
+    ULONG                       Low;
+    ULONG                       High;
+
+    Low = 0;
+    High = Count;
+
+    while (Low < High) {
+        ULONG   Middle = Low + ((High - Low) / 2);
+
+        if (__FdoCompareRelation(&Relation[Middle],
+                                 PhysicalDeviceObject) < 0)
+            Low = Middle + 1;
+        else
+            High = Middle;
+    }
+
+    for (; Low < Count; Low++) {
+        if (__FdoCompareRelation(&Relation[Low],
+                                 PhysicalDeviceObject) != 0)
+            break;
+
+        if (!Relation[Low].Claimed)
+            return &Relation[Low];
+    }
+
+    return NULL;
+}
+
 static VOID
 FdoEnumerate(
     IN  PXENFILT_FDO        Fdo,
@@ -405,6 +543,7 @@ FdoEnumerate(
     )
 {
     PDEVICE_OBJECT          *PhysicalDeviceObject;
+    PXENFILT_FDO_RELATION   Relation;
     ULONG                   Count;
     PLIST_ENTRY             ListEntry;
     ULONG                   Index;
@@ -423,6 +562,24 @@ FdoEnumerate(
                   Relations->Objects,
                   sizeof (PDEVICE_OBJECT) * Count);
 
+    // Sort a copy of the relations so each existing PDO can be
+    // matched by binary search rather than a scan of the whole list.
+    // New devices are still created in the order the bus reported them.
+    // If there is no memory for the copy then fall back to the scan.
+    Relation = __FdoAllocate(sizeof (XENFILT_FDO_RELATION) * Count);
+
+    if (Relation != NULL) {
+        for (Index = 0; Index < Count; Index++) {
+            Relation[Index].PhysicalDeviceObject = PhysicalDeviceObject[Index];
+            Relation[Index].Index = Index;
+            Relation[Index].Claimed = FALSE;
+        }
+
+        FdoSortRelations(Relation, Count);
+    } else {
+        Warning("failed to allocate relations: scanning\n");
+    }
+
     // Remove any PDOs that do not appear in the device list
     ListEntry = Fdo->List.Flink;
     while (ListEntry != &Fdo->List) {
@@ -435,16 +592,33 @@ FdoEnumerate(
 
             Missing = TRUE;
 
-            for (Index = 0; Index < Count; Index++) {
-                if (PdoGetPhysicalDeviceObject(Pdo) == PhysicalDeviceObject[Index]) {
+            if (Relation != NULL) {
+                PXENFILT_FDO_RELATION   Found;
+
+                Found = FdoFindRelation(Relation,
+                                        Count,
+                                        PdoGetPhysicalDeviceObject(Pdo));
+                if (Found != NULL) {
+                    Found->Claimed = TRUE;
+                    Index = Found->Index;
+
                     Missing = FALSE;
-#pragma prefast(suppress:6387)  // PhysicalDeviceObject[Index] could be NULL
-                    ObDereferenceObject(PhysicalDeviceObject[Index]);
-                    PhysicalDeviceObject[Index] = NULL; // avoid duplication
-                    break;
+                }
+            } else {
+                for (Index = 0; Index < Count; Index++) {
+                    if (PdoGetPhysicalDeviceObject(Pdo) == PhysicalDeviceObject[Index]) {
+                        Missing = FALSE;
+                        break;
+                    }
                 }
             }
 
+            if (!Missing) {
+#pragma prefast(suppress:6387)  // PhysicalDeviceObject[Index] could be NULL
+                ObDereferenceObject(PhysicalDeviceObject[Index]);
+                PhysicalDeviceObject[Index] = NULL; // avoid duplication
+            }
+
             if (Missing) {
                 PdoSetMissing(Pdo, "device disappeared");
 
@@ -473,6 +647,9 @@ FdoEnumerate(
     
     __FdoSetEnumerated(Fdo);
 
+    if (Relation != NULL)
+        __FdoFree(Relation);
+
     __FdoFree(PhysicalDeviceObject);
     return;
 